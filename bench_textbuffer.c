@@ -0,0 +1,787 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/resource.h>
+
+#include "textbuffer.h"
+
+#define TRUE 1
+#define FALSE 0
+
+/* Times every textbuffer operation over synthetic corpora and prints one
+ * JSON object per result, so that runs can be diffed for regressions:
+ *
+ *   ./bench_textbuffer [max_lines] [corpus] [allocator]
+ *
+ * Corpora are built with 1000 lines, then ten times as many, up to
+ * max_lines (100000 by default, 10000000 at most). 'corpus' limits the run
+ * to one of short, long or duplicates, or is "all". 'allocator' is malloc
+ * (the default) or bump, an arena that is reset once all its memory is
+ * given back. peak_rss_kb is the peak of the whole process so far, so it
+ * only grows over a run.
+ */
+
+#define MAX_LINES 10000000
+
+//Every run of an operation together should take about this many lines
+#define LINES_PER_RESULT 1000000
+
+//feedTB is given text in pieces of this size, as a socket read might be
+#define STREAM_CHUNK 65536
+
+//newTBParallel and dumpParallelTB are timed with 1, 2, 4, ... up to this
+//many threads
+#define PARALLEL_THREADS 8
+
+//Each mix of readers and a writer sharing a buffer runs for this long
+#define CONTENTION_SECONDS 0.1
+
+//Arena memory is taken from the system in chunks of this size
+#define BUMP_CHUNK (64 << 20)
+
+typedef struct _bumpChunk {
+	struct _bumpChunk *next;
+	size_t size;
+	size_t used;
+	_Alignas(16) char memory[];
+} bumpChunk;
+
+typedef struct _bumpArena {
+	bumpChunk *chunks;
+	long live;
+} bumpArena;
+
+//A buffer read by several threads while another edits it
+typedef struct _contention {
+	TB tb;
+	//Readers call searchTB, or else dumpTB
+	int search;
+	int stop;
+	long reads;
+} contention;
+
+typedef struct _corpus {
+	const char *name;
+	char *text;
+	long bytes;
+	int nlines;
+} corpus;
+
+static double now(void);
+static long peak_rss(void);
+static void make_corpus(corpus *c, const char *name, int nlines);
+static void report(corpus *c, const char *op, int reps, double seconds);
+static void bench_corpus(corpus *c);
+static void bench_contention(corpus *c, int snapshot);
+static void *contended_reader(void *arg);
+static void *run(void *arg);
+static void *bump_allocate(size_t size, void *ctx);
+static void *bump_reallocate(void *ptr, size_t size, void *ctx);
+static void bump_deallocate(void *ptr, void *ctx);
+static void end_repetition(void);
+
+typedef struct _benchArgs {
+	int max_lines;
+	const char *only;
+} benchArgs;
+
+static const char *allocator_name = "malloc";
+static bumpArena arena;
+
+int main(int argc, char *argv[]) {
+
+	benchArgs args = {100000, NULL};
+	if (argc > 1) {
+		args.max_lines = atoi(argv[1]);
+	}
+	if (argc > 2 && strcmp(argv[2], "all") != 0) {
+		args.only = argv[2];
+	}
+	if (argc > 3) {
+		allocator_name = argv[3];
+	}
+	int bump = strcmp(allocator_name, "bump") == 0;
+	if (args.max_lines < 1000 || args.max_lines > MAX_LINES || (!bump && strcmp(allocator_name, "malloc") != 0)) {
+		fprintf(stderr, "usage: %s [max_lines 1000..%d] [all|short|long|duplicates] [malloc|bump]\n",
+			argv[0], MAX_LINES);
+		return EXIT_FAILURE;
+	}
+	if (bump) {
+		setAllocatorTB(bump_allocate, bump_reallocate, bump_deallocate, &arena);
+	}
+
+	//formRichText copies each line onto the stack, so run on a stack big
+	//enough for the largest corpus
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, (size_t) args.max_lines * 256 + (64 << 20));
+	pthread_t thread;
+	if (pthread_create(&thread, &attr, run, &args) != 0) {
+		fprintf(stderr, "could not start benchmark thread\n");
+		return EXIT_FAILURE;
+	}
+	pthread_join(thread, NULL);
+	pthread_attr_destroy(&attr);
+	return EXIT_SUCCESS;
+}
+
+static void *run(void *arg) {
+
+	benchArgs *args = arg;
+	const char *names[] = {"short", "long", "duplicates"};
+	for (int i = 0; i < 3; i++) {
+		if (args->only != NULL && strcmp(args->only, names[i]) != 0) {
+			continue;
+		}
+		for (int nlines = 1000; nlines <= args->max_lines; nlines = nlines * 10) {
+			corpus c;
+			make_corpus(&c, names[i], nlines);
+			bench_corpus(&c);
+			free(c.text);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Times each operation on 'c', rebuilding the buffer outside the timed part
+ * for operations that change it
+ */
+static void bench_corpus(corpus *c) {
+
+	int reps = LINES_PER_RESULT / c->nlines;
+	if (reps < 1) {
+		reps = 1;
+	}
+	int middle = c->nlines / 2;
+	double elapsed;
+	double start;
+
+	//newTB
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		start = now();
+		TB tb = newTB(c->text);
+		elapsed = elapsed + now() - start;
+		releaseTB(tb);
+		end_repetition();
+	}
+	report(c, "newTB", reps, elapsed);
+
+	//newStreamTB, fed in chunks the size of a socket read
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		start = now();
+		TB tb = newStreamTB();
+		for (long at = 0; at < c->bytes; at = at + STREAM_CHUNK) {
+			feedTB(tb, c->text + at, c->bytes - at < STREAM_CHUNK ? c->bytes - at : STREAM_CHUNK);
+		}
+		finishTB(tb);
+		elapsed = elapsed + now() - start;
+		releaseTB(tb);
+		end_repetition();
+	}
+	report(c, "feedTB", reps, elapsed);
+
+	//newTBParallel, to show how it scales with threads
+	for (int threads = 1; threads <= PARALLEL_THREADS; threads = threads * 2) {
+		elapsed = 0;
+		for (int i = 0; i < reps; i++) {
+			start = now();
+			TB tb = newTBParallel(c->text, c->bytes, threads);
+			elapsed = elapsed + now() - start;
+			releaseTB(tb);
+			end_repetition();
+		}
+		char op[32];
+		sprintf(op, "newTBParallel_%d", threads);
+		report(c, op, reps, elapsed);
+	}
+
+	TB tb = newTB(c->text);
+	memoryUsage usage;
+	memoryUsageTB(tb, &usage);
+	printf("{\"op\": \"memoryUsageTB\", \"corpus\": \"%s\", \"lines\": %d, \"bytes\": %ld, "
+		"\"allocator\": \"%s\", \"node_bytes\": %ld, \"payload_bytes\": %ld, \"slack_bytes\": %ld}\n",
+		c->name, c->nlines, c->bytes, allocator_name, usage.nodeBytes, usage.payloadBytes, usage.slackBytes);
+
+	//dumpTB
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		start = now();
+		char *dump = dumpTB(tb, FALSE);
+		elapsed = elapsed + now() - start;
+		free(dump);
+	}
+	report(c, "dumpTB", reps, elapsed);
+
+	//dumpParallelTB, to show how it scales with threads
+	for (int threads = 1; threads <= PARALLEL_THREADS; threads = threads * 2) {
+		elapsed = 0;
+		for (int i = 0; i < reps; i++) {
+			start = now();
+			char *dump = dumpParallelTB(tb, FALSE, threads);
+			elapsed = elapsed + now() - start;
+			free(dump);
+		}
+		char op[32];
+		sprintf(op, "dumpParallelTB_%d", threads);
+		report(c, op, reps, elapsed);
+	}
+
+	//searchTB
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		start = now();
+		Match matches = searchTB(tb, "ipsum");
+		elapsed = elapsed + now() - start;
+		while (matches != NULL) {
+			Match next = matches->next;
+			free(matches);
+			matches = next;
+		}
+	}
+	report(c, "searchTB", reps, elapsed);
+
+	//searchFlagsTB with code point columns, then without case, then
+	//validateUtf8TB
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		start = now();
+		Match matches = searchFlagsTB(tb, "ipsum", TB_SEARCH_CODEPOINTS);
+		elapsed = elapsed + now() - start;
+		while (matches != NULL) {
+			Match next = matches->next;
+			free(matches);
+			matches = next;
+		}
+	}
+	report(c, "searchFlagsTB_codepoints", reps, elapsed);
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		start = now();
+		Match matches = searchFlagsTB(tb, "IPSUM", TB_SEARCH_IGNORE_CASE);
+		elapsed = elapsed + now() - start;
+		while (matches != NULL) {
+			Match next = matches->next;
+			free(matches);
+			matches = next;
+		}
+	}
+	report(c, "searchFlagsTB_ignore_case", reps, elapsed);
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		start = now();
+		Match invalid = validateUtf8TB(tb, 0);
+		elapsed = elapsed + now() - start;
+		while (invalid != NULL) {
+			Match next = invalid->next;
+			free(invalid);
+			invalid = next;
+		}
+	}
+	report(c, "validateUtf8TB", reps, elapsed);
+
+	//offsetOfLineTB, whose first call builds the index, then lineAtOffsetTB
+	//at as many offsets as there are lines, spread over the text
+	start = now();
+	offsetOfLineTB(tb, middle);
+	report(c, "offsetOfLineTB_first", 1, now() - start);
+	start = now();
+	for (int i = 0; i < c->nlines; i++) {
+		lineAtOffsetTB(tb, c->bytes / c->nlines * i);
+	}
+	report(c, "lineAtOffsetTB", c->nlines, now() - start);
+
+	//equalTB against a copy, whose first call builds the hash blocks, then
+	//diffTB after each edit to a line of the copy
+	TB copy = newTB(c->text);
+	start = now();
+	equalTB(tb, copy);
+	report(c, "equalTB_first", 1, now() - start);
+	start = now();
+	for (int i = 0; i < reps; i++) {
+		equalTB(tb, copy);
+	}
+	report(c, "equalTB", reps, now() - start);
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		addPrefixTB(copy, middle, middle, "> ");
+		start = now();
+		char *diff = diffTB(tb, copy);
+		elapsed = elapsed + now() - start;
+		free(diff);
+	}
+	report(c, "diffTB_edit", reps, elapsed);
+	releaseTB(copy);
+
+	//watchMatchesTB after each edit to a line, to set against searchTB
+	TBWatch watch = watchSearchTB(tb, "ipsum");
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		start = now();
+		addPrefixTB(tb, middle, middle, "> ");
+		Match matches = watchMatchesTB(watch);
+		elapsed = elapsed + now() - start;
+		while (matches != NULL) {
+			Match next = matches->next;
+			free(matches);
+			matches = next;
+		}
+	}
+	report(c, "watchMatchesTB_edit", reps, elapsed);
+	releaseWatchTB(watch);
+
+	//searchWorkspaceTB over the buffer and a few small ones, to show how it
+	//scales with threads when one buffer holds nearly all the lines
+	TBWorkspace ws = newWorkspaceTB();
+	TB small[4];
+	for (int i = 0; i < 4; i++) {
+		small[i] = newTB("lorem ipsum dolor\nsit amet\n");
+		addWorkspaceTB(ws, small[i]);
+	}
+	addWorkspaceTB(ws, tb);
+	for (int threads = 1; threads <= PARALLEL_THREADS; threads = threads * 2) {
+		elapsed = 0;
+		for (int i = 0; i < reps; i++) {
+			start = now();
+			WorkspaceMatch matches = searchWorkspaceTB(ws, "ipsum", threads);
+			elapsed = elapsed + now() - start;
+			while (matches != NULL) {
+				WorkspaceMatch next = matches->next;
+				free(matches);
+				matches = next;
+			}
+		}
+		char op[32];
+		sprintf(op, "searchWorkspaceTB_%d", threads);
+		report(c, op, reps, elapsed);
+	}
+	releaseWorkspaceTB(ws);
+	for (int i = 0; i < 4; i++) {
+		releaseTB(small[i]);
+	}
+	//Every buffer below lasts one repetition, so that the bump arena is
+	//reset between them
+	releaseTB(tb);
+	end_repetition();
+
+	//addPrefixTB over every line
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		TB copy = newTB(c->text);
+		start = now();
+		addPrefixTB(copy, 0, c->nlines - 1, "> ");
+		elapsed = elapsed + now() - start;
+		releaseTB(copy);
+		end_repetition();
+	}
+	report(c, "addPrefixTB", reps, elapsed);
+
+	//mergeTB of a whole copy into the middle
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		TB copy = newTB(c->text);
+		TB other = newTB(c->text);
+		start = now();
+		mergeTB(copy, middle, other);
+		elapsed = elapsed + now() - start;
+		releaseTB(copy);
+		end_repetition();
+	}
+	report(c, "mergeTB", reps, elapsed);
+
+	//pasteTB of a whole copy into the middle
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		TB copy = newTB(c->text);
+		TB other = newTB(c->text);
+		start = now();
+		pasteTB(copy, middle, other);
+		elapsed = elapsed + now() - start;
+		releaseTB(other);
+		releaseTB(copy);
+		end_repetition();
+	}
+	report(c, "pasteTB", reps, elapsed);
+
+	//cutTB of the middle half
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		TB copy = newTB(c->text);
+		start = now();
+		TB cut = cutTB(copy, c->nlines / 4, middle + c->nlines / 4);
+		elapsed = elapsed + now() - start;
+		releaseTB(cut);
+		releaseTB(copy);
+		end_repetition();
+	}
+	report(c, "cutTB", reps, elapsed);
+
+	//deleteTB of the middle half
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		TB copy = newTB(c->text);
+		start = now();
+		deleteTB(copy, c->nlines / 4, middle + c->nlines / 4);
+		elapsed = elapsed + now() - start;
+		releaseTB(copy);
+		end_repetition();
+	}
+	report(c, "deleteTB", reps, elapsed);
+
+	//releaseTB, then it and deleteTB with frees left to the background
+	//thread, then readers contending with a writer, none of which the bump
+	//arena can be shared with
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		TB copy = newTB(c->text);
+		start = now();
+		releaseTB(copy);
+		elapsed = elapsed + now() - start;
+		end_repetition();
+	}
+	report(c, "releaseTB", reps, elapsed);
+	if (strcmp(allocator_name, "malloc") == 0) {
+		setDeferredFreesTB(TRUE);
+		elapsed = 0;
+		for (int i = 0; i < reps; i++) {
+			TB copy = newTB(c->text);
+			start = now();
+			releaseTB(copy);
+			elapsed = elapsed + now() - start;
+			drainFreesTB();
+		}
+		report(c, "releaseTB_deferred", reps, elapsed);
+		elapsed = 0;
+		for (int i = 0; i < reps; i++) {
+			TB copy = newTB(c->text);
+			start = now();
+			deleteTB(copy, c->nlines / 4, middle + c->nlines / 4);
+			elapsed = elapsed + now() - start;
+			releaseTB(copy);
+			drainFreesTB();
+		}
+		report(c, "deleteTB_deferred", reps, elapsed);
+		setDeferredFreesTB(FALSE);
+		bench_contention(c, FALSE);
+		bench_contention(c, TRUE);
+	}
+
+	//searchTB and dumpTB with the nodes scattered by being built one line
+	//at a time alongside another buffer's, then walking them through
+	//setUnrolledTB's chunks, then after compactTB
+	TB scattered = newTB("");
+	TB other = newTB("");
+	const char *line = c->text;
+	for (int i = 0; i < c->nlines; i++) {
+		const char *end = strchr(line, '\n') + 1;
+		char *text = malloc(end - line + 1);
+		memcpy(text, line, end - line);
+		text[end - line] = '\0';
+		mergeTB(scattered, i, newTB(text));
+		mergeTB(other, i, newTB(text));
+		free(text);
+		line = end;
+	}
+	releaseTB(other);
+	const char *layouts[] = {"scattered", "unrolled", "compacted"};
+	for (int layout = 0; layout < 3; layout++) {
+		char op[48];
+		elapsed = 0;
+		for (int i = 0; i < reps; i++) {
+			start = now();
+			Match matches = searchTB(scattered, "ipsum");
+			elapsed = elapsed + now() - start;
+			while (matches != NULL) {
+				Match next = matches->next;
+				free(matches);
+				matches = next;
+			}
+		}
+		sprintf(op, "searchTB_%s", layouts[layout]);
+		report(c, op, reps, elapsed);
+		elapsed = 0;
+		for (int i = 0; i < reps; i++) {
+			start = now();
+			char *dump = dumpTB(scattered, FALSE);
+			elapsed = elapsed + now() - start;
+			free(dump);
+		}
+		sprintf(op, "dumpTB_%s", layouts[layout]);
+		report(c, op, reps, elapsed);
+		if (layout == 0) {
+			start = now();
+			setUnrolledTB(scattered, TRUE);
+			report(c, "setUnrolledTB", 1, now() - start);
+		} else if (layout == 1) {
+			setUnrolledTB(scattered, FALSE);
+			start = now();
+			compactTB(scattered);
+			report(c, "compactTB", 1, now() - start);
+		}
+	}
+	releaseTB(scattered);
+	end_repetition();
+
+	//formRichText
+	elapsed = 0;
+	for (int i = 0; i < reps; i++) {
+		TB copy = newTB(c->text);
+		start = now();
+		formRichText(copy);
+		elapsed = elapsed + now() - start;
+		releaseTB(copy);
+		end_repetition();
+	}
+	report(c, "formRichText", reps, elapsed);
+}
+
+/*
+ * Times searchTB and dumpTB readers on 1, 2, 4, ... threads sharing a
+ * thread-safe buffer with one writer, which keeps inserting and deleting a
+ * line in the middle, with the readers taking the lock or, if 'snapshot',
+ * reading snapshots. Reports the readers' combined throughput, and the
+ * writer's mean and worst time per edit, starting with no readers at all.
+ */
+static void bench_contention(corpus *c, int snapshot) {
+
+	int middle = c->nlines / 2;
+	const char *mode = snapshot ? "snapshot" : "locked";
+	for (int search = TRUE; search >= FALSE; search--) {
+		const char *reader = search ? "searchTB" : "dumpTB";
+		for (int threads = 0; threads <= PARALLEL_THREADS; threads = threads == 0 ? 1 : threads * 2) {
+			TB tb = newTB(c->text);
+			setThreadSafeTB(tb, TRUE);
+			setSnapshotReadsTB(tb, snapshot);
+			contention shared = {tb, search, FALSE, 0};
+			pthread_t readers[PARALLEL_THREADS];
+			for (int i = 0; i < threads; i++) {
+				if (pthread_create(&readers[i], NULL, contended_reader, &shared) != 0) {
+					fprintf(stderr, "could not start reader thread\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			long edits = 0;
+			double editing = 0;
+			double worst = 0;
+			double start = now();
+			while (now() - start < CONTENTION_SECONDS) {
+				TB line = newTB("edited line\n");
+				for (int i = 0; i < 2; i++) {
+					double at = now();
+					if (i == 0) {
+						mergeTB(tb, middle, line);
+					} else {
+						deleteTB(tb, middle, middle);
+					}
+					double took = now() - at;
+					editing = editing + took;
+					worst = took > worst ? took : worst;
+					edits++;
+				}
+			}
+			double elapsed = now() - start;
+			__atomic_store_n(&shared.stop, TRUE, __ATOMIC_RELAXED);
+			for (int i = 0; i < threads; i++) {
+				pthread_join(readers[i], NULL);
+			}
+			releaseTB(tb);
+			char op[48];
+			if (threads > 0) {
+				sprintf(op, "%s_%s_%d", reader, mode, threads);
+				report(c, op, shared.reads, elapsed);
+			}
+			printf("{\"op\": \"edit_contended\", \"corpus\": \"%s\", \"lines\": %d, \"mode\": \"%s\", "
+				"\"readers\": \"%s\", \"threads\": %d, \"edits\": %ld, \"ns_per_edit\": %.0f, \"worst_ns\": %.0f}\n",
+				c->name, c->nlines, mode, reader, threads, edits, editing / edits * 1e9, worst * 1e9);
+			fflush(stdout);
+		}
+	}
+}
+
+static void *contended_reader(void *arg) {
+
+	contention *shared = arg;
+	long reads = 0;
+	while (!__atomic_load_n(&shared->stop, __ATOMIC_RELAXED)) {
+		if (shared->search) {
+			Match matches = searchTB(shared->tb, "ipsum");
+			while (matches != NULL) {
+				Match next = matches->next;
+				free(matches);
+				matches = next;
+			}
+		} else {
+			free(dumpTB(shared->tb, FALSE));
+		}
+		reads++;
+	}
+	__atomic_add_fetch(&shared->reads, reads, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * Builds 'nlines' lines of the named kind. Some lines carry rich text
+ * markers and the word searched for.
+ */
+static void make_corpus(corpus *c, const char *name, int nlines) {
+
+	static const char *words[] = {
+		"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+		"elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore"
+	};
+	int nwords = sizeof(words) / sizeof(words[0]);
+	int line_words = strcmp(name, "long") == 0 ? 30 : 2;
+	//Duplicates repeat a handful of distinct lines
+	int distinct = strcmp(name, "duplicates") == 0 ? 16 : nlines;
+
+	long capacity = (long) nlines * (line_words * 14 + 16) + 1;
+	c->text = malloc(capacity);
+	if (c->text == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	c->name = name;
+	c->nlines = nlines;
+
+	long out = 0;
+	for (int i = 0; i < nlines; i++) {
+		int line = i % distinct;
+		unsigned int seed = (unsigned int) line * 2654435761u + 12345;
+		if (line % 8 == 0) {
+			out = out + sprintf(c->text + out, "#");
+		}
+		for (int w = 0; w < line_words; w++) {
+			seed = seed * 1103515245 + 12345;
+			const char *word = words[(seed >> 16) % nwords];
+			if (w == 1 && line % 4 == 1) {
+				out = out + sprintf(c->text + out, "*%s* ", word);
+			} else if (w == 1 && line % 4 == 2) {
+				out = out + sprintf(c->text + out, "_%s_ ", word);
+			} else {
+				out = out + sprintf(c->text + out, "%s ", word);
+			}
+		}
+		out = out + sprintf(c->text + out, "%d\n", line);
+	}
+	c->text[out] = '\0';
+	c->bytes = out;
+}
+
+static void report(corpus *c, const char *op, int reps, double seconds) {
+
+	double per_op = seconds / reps;
+	printf("{\"op\": \"%s\", \"corpus\": \"%s\", \"lines\": %d, \"bytes\": %ld, \"allocator\": \"%s\", "
+		"\"reps\": %d, \"ns_per_op\": %.0f, \"bytes_per_sec\": %.0f, \"peak_rss_kb\": %ld}\n",
+		op, c->name, c->nlines, c->bytes, allocator_name, reps, per_op * 1e9,
+		per_op > 0 ? c->bytes / per_op : 0, peak_rss());
+	fflush(stdout);
+}
+
+static double now(void) {
+
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Largest resident set the process has had so far, in kilobytes
+ */
+static long peak_rss(void) {
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/*
+ * Called once nothing from a repetition is left. Setting the bump allocator
+ * again makes the textbuffer give back the memory it keeps for reuse, which
+ * resets the arena, as a per-request arena would be.
+ */
+static void end_repetition(void) {
+
+	if (strcmp(allocator_name, "bump") == 0) {
+		setAllocatorTB(bump_allocate, bump_reallocate, bump_deallocate, &arena);
+	}
+}
+
+/*
+ * Hands out memory from the current chunk, behind a header holding its
+ * size. Power of two sizes of a page or more are aligned to their size, as
+ * the textbuffer's node blocks want.
+ */
+static void *bump_allocate(size_t size, void *ctx) {
+
+	bumpArena *a = ctx;
+	size_t align = 16;
+	if (size >= 4096 && (size & (size - 1)) == 0) {
+		align = size;
+	}
+	bumpChunk *chunk = a->chunks;
+	size_t start = 0;
+	if (chunk != NULL) {
+		start = (chunk->used + 16 + align - 1) & ~(align - 1);
+	}
+	if (chunk == NULL || start + size > chunk->size) {
+		size_t chunk_size = BUMP_CHUNK;
+		if (size + align + 16 > chunk_size) {
+			chunk_size = size + align + 16;
+		}
+		chunk = malloc(sizeof(bumpChunk) + chunk_size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = a->chunks;
+		a->chunks = chunk;
+		uintptr_t base = (uintptr_t) chunk->memory;
+		start = ((base + 16 + align - 1) & ~(uintptr_t) (align - 1)) - base;
+	}
+	char *ptr = chunk->memory + start;
+	((size_t *) ptr)[-1] = size;
+	chunk->used = start + size;
+	a->live++;
+	return ptr;
+}
+
+static void *bump_reallocate(void *ptr, size_t size, void *ctx) {
+
+	void *moved = bump_allocate(size, ctx);
+	if (moved != NULL) {
+		size_t old = ((size_t *) ptr)[-1];
+		memcpy(moved, ptr, old < size ? old : size);
+		bump_deallocate(ptr, ctx);
+	}
+	return moved;
+}
+
+/*
+ * Memory is only given back to the arena all at once, when nothing handed
+ * out is still in use
+ */
+static void bump_deallocate(void *ptr, void *ctx) {
+
+	(void) ptr;
+	bumpArena *a = ctx;
+	a->live--;
+	if (a->live > 0) {
+		return;
+	}
+	bumpChunk *chunk = a->chunks;
+	while (chunk != NULL && chunk->next != NULL) {
+		bumpChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	a->chunks = chunk;
+	if (chunk != NULL) {
+		chunk->used = 0;
+	}
+}
@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "textbuffer.h"
+#include "tbtrace.h"
+
+#define TRUE 1
+#define FALSE 0
+
+/* Plays back a trace written by startTraceTB() against the library, one
+ * call at a time in the order they were recorded, and prints the latency
+ * percentiles of each operation as replayed and as recorded:
+ *
+ *   ./tbreplay trace.bin
+ *
+ * Calls that handed back a line count, match count, checkpoint, offset or
+ * equalTB result are checked against the trace, and differences are
+ * counted as mismatches. Traces recorded from several threads replay in the
+ * order the calls finished, so their results may differ.
+ */
+
+#define MAX_ARGS 4
+
+typedef struct _traceValue {
+	unsigned long long number;
+	char *text;
+} traceValue;
+
+typedef struct _latencies {
+	long long *replayed;
+	long long *recorded;
+	int count;
+	int capacity;
+} latencies;
+
+typedef struct _replay {
+	TB *buffers;
+	int nbuffers;
+	TBBatch *batches;
+	int nbatches;
+	TBWatch *watches;
+	int nwatches;
+	TBWorkspace *workspaces;
+	int nworkspaces;
+	latencies ops[TRACE_OPS];
+	long mismatches;
+	long skipped;
+} replay;
+
+static int read_number(FILE *file, unsigned long long *n);
+static char *read_string(FILE *file);
+static int to_int(unsigned long long n);
+static int free_matches(Match matches);
+static TB *buffer_slot(replay *r, unsigned long long id);
+static TBBatch *batch_slot(replay *r, unsigned long long id);
+static TBWatch *watch_slot(replay *r, unsigned long long id);
+static TBWorkspace *workspace_slot(replay *r, unsigned long long id);
+static int run_call(replay *r, int op, traceValue args[]);
+static void add_latency(latencies *l, long long replayed, long long recorded);
+static int compare_times(const void *a, const void *b);
+static long long percentile(long long *times, int count, double p);
+static long long now(void);
+
+int main(int argc, char *argv[]) {
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s trace\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	FILE *file = fopen(argv[1], "rb");
+	if (file == NULL) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	char magic[TRACE_MAGIC_LENGTH];
+	if (fread(magic, 1, TRACE_MAGIC_LENGTH, file) != TRACE_MAGIC_LENGTH
+			|| memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LENGTH) != 0) {
+		fprintf(stderr, "%s: not a textbuffer trace\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	replay r;
+	memset(&r, 0, sizeof(r));
+	int op;
+	while ((op = fgetc(file)) != EOF) {
+		unsigned long long start;
+		unsigned long long duration;
+		if (op >= TRACE_OPS || !read_number(file, &start) || !read_number(file, &duration)) {
+			fprintf(stderr, "%s: corrupt record\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+		traceValue args[MAX_ARGS];
+		int nargs = 0;
+		for (const char *arg = traceArgs[op]; *arg != '\0'; arg++) {
+			args[nargs].text = NULL;
+			int ok = *arg == 's' || *arg == 't' ? (args[nargs].text = read_string(file)) != NULL
+				: read_number(file, &args[nargs].number);
+			if (!ok) {
+				fprintf(stderr, "%s: truncated record\n", argv[1]);
+				return EXIT_FAILURE;
+			}
+			nargs++;
+		}
+
+		long long begin = now();
+		int ran = run_call(&r, op, args);
+		long long elapsed = now() - begin;
+		if (ran && op != TRACE_ADOPT) {
+			add_latency(&r.ops[op], elapsed, duration);
+		} else if (!ran) {
+			r.skipped++;
+		}
+		for (int i = 0; i < nargs; i++) {
+			free(args[i].text);
+		}
+	}
+	fclose(file);
+
+	printf("%-20s %10s %12s %12s %12s %12s %14s %14s\n", "op", "calls", "p50_ns", "p90_ns",
+		"p99_ns", "max_ns", "recorded_p50", "recorded_p99");
+	for (int i = 0; i < TRACE_OPS; i++) {
+		latencies *l = &r.ops[i];
+		if (l->count == 0) {
+			continue;
+		}
+		qsort(l->replayed, l->count, sizeof(long long), compare_times);
+		qsort(l->recorded, l->count, sizeof(long long), compare_times);
+		printf("%-20s %10d %12lld %12lld %12lld %12lld %14lld %14lld\n", traceNames[i], l->count,
+			percentile(l->replayed, l->count, 0.5), percentile(l->replayed, l->count, 0.9),
+			percentile(l->replayed, l->count, 0.99), l->replayed[l->count - 1],
+			percentile(l->recorded, l->count, 0.5), percentile(l->recorded, l->count, 0.99));
+		free(l->replayed);
+		free(l->recorded);
+	}
+	printf("mismatches %ld\nskipped %ld\n", r.mismatches, r.skipped);
+
+	for (int i = 0; i < r.nworkspaces; i++) {
+		if (r.workspaces[i] != NULL) {
+			releaseWorkspaceTB(r.workspaces[i]);
+		}
+	}
+	for (int i = 0; i < r.nwatches; i++) {
+		if (r.watches[i] != NULL) {
+			releaseWatchTB(r.watches[i]);
+		}
+	}
+	for (int i = 0; i < r.nbuffers; i++) {
+		if (r.buffers[i] != NULL) {
+			releaseTB(r.buffers[i]);
+		}
+	}
+	for (int i = 0; i < r.nbatches; i++) {
+		if (r.batches[i] != NULL) {
+			releaseBatchTB(r.batches[i]);
+		}
+	}
+	free(r.buffers);
+	free(r.batches);
+	free(r.watches);
+	free(r.workspaces);
+	return r.mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Makes one recorded call. Returns FALSE if it names a buffer, batch or
+ * watch the replay doesn't have, in which case nothing is called.
+ */
+static int run_call(replay *r, int op, traceValue args[]) {
+
+	//Buffers, batches, watches and workspaces named by the arguments, looked
+	//up up front
+	TB tbs[MAX_ARGS];
+	TBBatch batch = NULL;
+	TBWatch watch = NULL;
+	TBWorkspace ws = NULL;
+	int ntbs = 0;
+	for (int i = 0; traceArgs[op][i] != '\0'; i++) {
+		char kind = traceArgs[op][i];
+		if (kind == 'b') {
+			TB *slot = buffer_slot(r, args[i].number);
+			if (slot == NULL || *slot == NULL) {
+				return FALSE;
+			}
+			tbs[ntbs++] = *slot;
+		} else if (kind == 'h' && op != TRACE_BATCH_NEW) {
+			TBBatch *slot = batch_slot(r, args[i].number);
+			if (slot == NULL || *slot == NULL) {
+				return FALSE;
+			}
+			batch = *slot;
+		} else if (kind == 'w' && op != TRACE_WATCH) {
+			TBWatch *slot = watch_slot(r, args[i].number);
+			if (slot == NULL || *slot == NULL) {
+				return FALSE;
+			}
+			watch = *slot;
+		} else if (kind == 'k' && op != TRACE_WORKSPACE_NEW) {
+			TBWorkspace *slot = workspace_slot(r, args[i].number);
+			if (slot == NULL || *slot == NULL) {
+				return FALSE;
+			}
+			ws = *slot;
+		}
+	}
+
+	switch (op) {
+	case TRACE_NEW:
+	case TRACE_ADOPT: {
+		TB *slot = buffer_slot(r, args[0].number);
+		if (slot == NULL) {
+			return FALSE;
+		}
+		*slot = newTB(args[1].text);
+		break;
+	}
+	case TRACE_RELEASE:
+		releaseTB(tbs[0]);
+		*buffer_slot(r, args[0].number) = NULL;
+		break;
+	case TRACE_DUMP:
+		free(dumpTB(tbs[0], to_int(args[1].number)));
+		break;
+	case TRACE_LINES:
+		r->mismatches += linesTB(tbs[0]) != to_int(args[1].number);
+		break;
+	case TRACE_PREFIX:
+		addPrefixTB(tbs[0], to_int(args[1].number), to_int(args[2].number), args[3].text);
+		break;
+	case TRACE_MERGE:
+		mergeTB(tbs[0], to_int(args[1].number), tbs[1]);
+		if (tbs[0] != tbs[1]) {
+			*buffer_slot(r, args[2].number) = NULL;
+		}
+		break;
+	case TRACE_PASTE:
+		pasteTB(tbs[0], to_int(args[1].number), tbs[1]);
+		break;
+	case TRACE_CUT: {
+		TB cut = cutTB(tbs[0], to_int(args[1].number), to_int(args[2].number));
+		TB *slot = buffer_slot(r, args[3].number);
+		if (slot != NULL) {
+			*slot = cut;
+		} else if (cut != NULL) {
+			releaseTB(cut);
+		}
+		break;
+	}
+	case TRACE_SEARCH:
+		r->mismatches += free_matches(searchTB(tbs[0], args[1].text)) != to_int(args[2].number);
+		break;
+	case TRACE_DELETE:
+		deleteTB(tbs[0], to_int(args[1].number), to_int(args[2].number));
+		break;
+	case TRACE_RICH:
+		formRichText(tbs[0]);
+		break;
+	case TRACE_DIFF:
+		free(diffTB(tbs[0], tbs[1]));
+		break;
+	case TRACE_EQUAL:
+		r->mismatches += equalTB(tbs[0], tbs[1]) != to_int(args[2].number);
+		break;
+	case TRACE_CHECKPOINT:
+		r->mismatches += (unsigned long long) checkpointTB(tbs[0]) != args[1].number;
+		break;
+	case TRACE_DIFF_SINCE:
+		free(diffSinceTB(tbs[0], args[1].number));
+		break;
+	case TRACE_CHECKPOINT_RELEASE:
+		releaseCheckpointTB(tbs[0], args[1].number);
+		break;
+	case TRACE_INTERN:
+		setInternTB(tbs[0], to_int(args[1].number));
+		break;
+	case TRACE_COMPACT:
+		compactTB(tbs[0]);
+		break;
+	case TRACE_UNROLLED:
+		setUnrolledTB(tbs[0], to_int(args[1].number));
+		break;
+	case TRACE_THREAD_SAFE:
+		setThreadSafeTB(tbs[0], to_int(args[1].number));
+		break;
+	case TRACE_SNAPSHOT:
+		setSnapshotReadsTB(tbs[0], to_int(args[1].number));
+		break;
+	case TRACE_BATCH_NEW: {
+		TBBatch *slot = batch_slot(r, args[0].number);
+		if (slot == NULL) {
+			return FALSE;
+		}
+		*slot = newBatchTB();
+		break;
+	}
+	case TRACE_BATCH_RELEASE:
+		releaseBatchTB(batch);
+		*batch_slot(r, args[0].number) = NULL;
+		break;
+	case TRACE_BATCH_DELETE:
+		batchDeleteTB(batch, to_int(args[1].number), to_int(args[2].number));
+		break;
+	case TRACE_BATCH_PREFIX:
+		batchPrefixTB(batch, to_int(args[1].number), to_int(args[2].number), args[3].text);
+		break;
+	case TRACE_BATCH_PASTE:
+		batchPasteTB(batch, to_int(args[1].number), tbs[0]);
+		break;
+	case TRACE_BATCH_APPLY:
+		applyBatchTB(tbs[0], batch);
+		break;
+	case TRACE_LINE:
+		free(lineTB(tbs[0], to_int(args[1].number)));
+		break;
+	case TRACE_SAVE:
+		//Saves aren't repeated, so that a replay never writes files
+		break;
+	case TRACE_LOAD: {
+		TB *slot = buffer_slot(r, args[0].number);
+		if (slot == NULL) {
+			return FALSE;
+		}
+		*slot = loadSnapshotTB(args[1].text);
+		break;
+	}
+	case TRACE_JOURNAL:
+	case TRACE_SYNC:
+		//Buffers aren't journaled in a replay, for the same reason
+		break;
+	case TRACE_RECOVER: {
+		TB *slot = buffer_slot(r, args[0].number);
+		if (slot == NULL) {
+			return FALSE;
+		}
+		//Later calls need the buffer, but not its journal
+		*slot = recoverTB(args[1].text);
+		if (*slot != NULL) {
+			journalTB(*slot, NULL);
+		}
+		break;
+	}
+	case TRACE_STREAM: {
+		TB *slot = buffer_slot(r, args[0].number);
+		if (slot == NULL) {
+			return FALSE;
+		}
+		*slot = newStreamTB();
+		break;
+	}
+	case TRACE_FEED:
+		feedTB(tbs[0], args[1].text, strlen(args[1].text));
+		break;
+	case TRACE_FINISH:
+		finishTB(tbs[0]);
+		break;
+	case TRACE_NEW_PARALLEL: {
+		TB *slot = buffer_slot(r, args[0].number);
+		if (slot == NULL) {
+			return FALSE;
+		}
+		*slot = newTBParallel(args[1].text, strlen(args[1].text), to_int(args[2].number));
+		break;
+	}
+	case TRACE_DUMP_PARALLEL:
+		free(dumpParallelTB(tbs[0], to_int(args[1].number), to_int(args[2].number)));
+		break;
+	case TRACE_LINES64:
+		r->mismatches += linesTB64(tbs[0]) != args[1].number;
+		break;
+	case TRACE_PREFIX64:
+		addPrefixTB64(tbs[0], args[1].number, args[2].number, args[3].text);
+		break;
+	case TRACE_MERGE64:
+		mergeTB64(tbs[0], args[1].number, tbs[1]);
+		if (tbs[0] != tbs[1]) {
+			*buffer_slot(r, args[2].number) = NULL;
+		}
+		break;
+	case TRACE_PASTE64:
+		pasteTB64(tbs[0], args[1].number, tbs[1]);
+		break;
+	case TRACE_CUT64: {
+		TB cut = cutTB64(tbs[0], args[1].number, args[2].number);
+		TB *slot = buffer_slot(r, args[3].number);
+		if (slot != NULL) {
+			*slot = cut;
+		} else if (cut != NULL) {
+			releaseTB(cut);
+		}
+		break;
+	}
+	case TRACE_SEARCH64: {
+		Match64 matches = searchTB64(tbs[0], args[1].text);
+		unsigned long long nmatches = 0;
+		while (matches != NULL) {
+			Match64 next = matches->next;
+			free(matches);
+			matches = next;
+			nmatches++;
+		}
+		r->mismatches += nmatches != args[2].number;
+		break;
+	}
+	case TRACE_DELETE64:
+		deleteTB64(tbs[0], args[1].number, args[2].number);
+		break;
+	case TRACE_LINE64:
+		free(lineTB64(tbs[0], args[1].number));
+		break;
+	case TRACE_LINE_AT_OFFSET:
+		r->mismatches += lineAtOffsetTB(tbs[0], args[1].number) != args[2].number;
+		break;
+	case TRACE_OFFSET_OF_LINE:
+		r->mismatches += offsetOfLineTB(tbs[0], args[1].number) != args[2].number;
+		break;
+	case TRACE_SEARCH_FLAGS: {
+		Match matches = searchFlagsTB(tbs[0], args[1].text, to_int(args[2].number));
+		r->mismatches += free_matches(matches) != to_int(args[3].number);
+		break;
+	}
+	case TRACE_WATCH: {
+		TBWatch *slot = watch_slot(r, args[2].number);
+		if (slot == NULL) {
+			return FALSE;
+		}
+		*slot = watchSearchTB(tbs[0], args[1].text);
+		break;
+	}
+	case TRACE_WATCH_MATCHES:
+		r->mismatches += free_matches(watchMatchesTB(watch)) != to_int(args[1].number);
+		break;
+	case TRACE_WATCH_RELEASE:
+		releaseWatchTB(watch);
+		*watch_slot(r, args[0].number) = NULL;
+		break;
+	case TRACE_VALIDATE_UTF8: {
+		Match invalid = validateUtf8TB(tbs[0], to_int(args[1].number));
+		r->mismatches += free_matches(invalid) != to_int(args[2].number);
+		break;
+	}
+	case TRACE_WORKSPACE_NEW: {
+		TBWorkspace *slot = workspace_slot(r, args[0].number);
+		if (slot == NULL) {
+			return FALSE;
+		}
+		*slot = newWorkspaceTB();
+		break;
+	}
+	case TRACE_WORKSPACE_RELEASE:
+		releaseWorkspaceTB(ws);
+		*workspace_slot(r, args[0].number) = NULL;
+		break;
+	case TRACE_WORKSPACE_ADD:
+		addWorkspaceTB(ws, tbs[0]);
+		break;
+	case TRACE_WORKSPACE_REMOVE:
+		removeWorkspaceTB(ws, tbs[0]);
+		break;
+	case TRACE_WORKSPACE_SEARCH: {
+		WorkspaceMatch matches = searchWorkspaceTB(ws, args[1].text, to_int(args[2].number));
+		int nmatches = 0;
+		while (matches != NULL) {
+			WorkspaceMatch next = matches->next;
+			free(matches);
+			matches = next;
+			nmatches++;
+		}
+		r->mismatches += nmatches != to_int(args[3].number);
+		break;
+	}
+	}
+	return TRUE;
+}
+
+/*
+ * Returns where the buffer with trace id 'id' is kept, growing the table
+ * as needed, or NULL for id 0
+ */
+static TB *buffer_slot(replay *r, unsigned long long id) {
+
+	if (id == 0 || id > 100000000) {
+		return NULL;
+	}
+	if (id > (unsigned long long) r->nbuffers) {
+		int nbuffers = r->nbuffers == 0 ? 64 : r->nbuffers;
+		while ((unsigned long long) nbuffers < id) {
+			nbuffers = nbuffers * 2;
+		}
+		r->buffers = realloc(r->buffers, sizeof(TB) * nbuffers);
+		memset(r->buffers + r->nbuffers, 0, sizeof(TB) * (nbuffers - r->nbuffers));
+		r->nbuffers = nbuffers;
+	}
+	return &r->buffers[id - 1];
+}
+
+static TBBatch *batch_slot(replay *r, unsigned long long id) {
+
+	if (id == 0 || id > 100000000) {
+		return NULL;
+	}
+	if (id > (unsigned long long) r->nbatches) {
+		int nbatches = r->nbatches == 0 ? 16 : r->nbatches;
+		while ((unsigned long long) nbatches < id) {
+			nbatches = nbatches * 2;
+		}
+		r->batches = realloc(r->batches, sizeof(TBBatch) * nbatches);
+		memset(r->batches + r->nbatches, 0, sizeof(TBBatch) * (nbatches - r->nbatches));
+		r->nbatches = nbatches;
+	}
+	return &r->batches[id - 1];
+}
+
+static TBWatch *watch_slot(replay *r, unsigned long long id) {
+
+	if (id == 0 || id > 100000000) {
+		return NULL;
+	}
+	if (id > (unsigned long long) r->nwatches) {
+		int nwatches = r->nwatches == 0 ? 16 : r->nwatches;
+		while ((unsigned long long) nwatches < id) {
+			nwatches = nwatches * 2;
+		}
+		r->watches = realloc(r->watches, sizeof(TBWatch) * nwatches);
+		memset(r->watches + r->nwatches, 0, sizeof(TBWatch) * (nwatches - r->nwatches));
+		r->nwatches = nwatches;
+	}
+	return &r->watches[id - 1];
+}
+
+static TBWorkspace *workspace_slot(replay *r, unsigned long long id) {
+
+	if (id == 0 || id > 100000000) {
+		return NULL;
+	}
+	if (id > (unsigned long long) r->nworkspaces) {
+		int nworkspaces = r->nworkspaces == 0 ? 16 : r->nworkspaces;
+		while ((unsigned long long) nworkspaces < id) {
+			nworkspaces = nworkspaces * 2;
+		}
+		r->workspaces = realloc(r->workspaces, sizeof(TBWorkspace) * nworkspaces);
+		memset(r->workspaces + r->nworkspaces, 0, sizeof(TBWorkspace) * (nworkspaces - r->nworkspaces));
+		r->nworkspaces = nworkspaces;
+	}
+	return &r->workspaces[id - 1];
+}
+
+/*
+ * Reads a varint. Returns FALSE at the end of the file.
+ */
+static int read_number(FILE *file, unsigned long long *n) {
+
+	*n = 0;
+	for (int shift = 0; shift < 64; shift = shift + 7) {
+		int c = fgetc(file);
+		if (c == EOF) {
+			return FALSE;
+		}
+		*n = *n | (unsigned long long) (c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static char *read_string(FILE *file) {
+
+	unsigned long long length;
+	if (!read_number(file, &length) || length > 1UL << 31) {
+		return NULL;
+	}
+	char *s = malloc(length + 1);
+	if (s == NULL || fread(s, 1, length, file) != length) {
+		free(s);
+		return NULL;
+	}
+	s[length] = '\0';
+	return s;
+}
+
+/*
+ * Undoes the zigzag encoding of a signed number
+ */
+static int to_int(unsigned long long n) {
+	return (int) ((n >> 1) ^ -(n & 1));
+}
+
+/*
+ * Frees a list of matches, returning how many there were
+ */
+static int free_matches(Match matches) {
+
+	int nmatches = 0;
+	while (matches != NULL) {
+		Match next = matches->next;
+		free(matches);
+		matches = next;
+		nmatches++;
+	}
+	return nmatches;
+}
+
+static void add_latency(latencies *l, long long replayed, long long recorded) {
+
+	if (l->count == l->capacity) {
+		l->capacity = l->capacity == 0 ? 256 : l->capacity * 2;
+		l->replayed = realloc(l->replayed, sizeof(long long) * l->capacity);
+		l->recorded = realloc(l->recorded, sizeof(long long) * l->capacity);
+	}
+	l->replayed[l->count] = replayed;
+	l->recorded[l->count] = recorded;
+	l->count++;
+}
+
+static int compare_times(const void *a, const void *b) {
+
+	long long t1 = *(const long long *) a;
+	long long t2 = *(const long long *) b;
+	return t1 < t2 ? -1 : (t1 > t2);
+}
+
+/*
+ * The time at or below which a fraction 'p' of the sorted times fall
+ */
+static long long percentile(long long *times, int count, double p) {
+
+	int index = (int) (p * count + 0.999999) - 1;
+	if (index < 0) {
+		index = 0;
+	}
+	return times[index];
+}
+
+static long long now(void) {
+
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
@@ -0,0 +1,217 @@
+#ifndef TBTRACE_H
+#define TBTRACE_H
+
+/* Layout of the traces written by startTraceTB() and read by tbreplay.
+ *
+ * A trace is TRACE_MAGIC followed by one record per call, in the order the
+ * calls finished. Each record is the operation code as one byte, then the
+ * start of the call and its duration in nanoseconds, then its arguments.
+ * Numbers are stored as LEB128 varints, with signed ones zigzag encoded
+ * first, and strings as their length followed by their bytes.
+ *
+ * Buffers, batches, watches and workspaces are named by ids, numbered from
+ * 1 in the order the trace first sees them; 0 stands for NULL. A buffer
+ * made before tracing started is brought in by a TRACE_ADOPT record holding
+ * its text.
+ */
+
+#define TRACE_MAGIC "TBTRACE1"
+#define TRACE_MAGIC_LENGTH 8
+
+enum {
+	TRACE_NEW,
+	TRACE_ADOPT,
+	TRACE_RELEASE,
+	TRACE_DUMP,
+	TRACE_LINES,
+	TRACE_PREFIX,
+	TRACE_MERGE,
+	TRACE_PASTE,
+	TRACE_CUT,
+	TRACE_SEARCH,
+	TRACE_DELETE,
+	TRACE_RICH,
+	TRACE_DIFF,
+	TRACE_EQUAL,
+	TRACE_CHECKPOINT,
+	TRACE_DIFF_SINCE,
+	TRACE_INTERN,
+	TRACE_COMPACT,
+	TRACE_THREAD_SAFE,
+	TRACE_SNAPSHOT,
+	TRACE_BATCH_NEW,
+	TRACE_BATCH_RELEASE,
+	TRACE_BATCH_DELETE,
+	TRACE_BATCH_PREFIX,
+	TRACE_BATCH_PASTE,
+	TRACE_BATCH_APPLY,
+	TRACE_LINE,
+	TRACE_SAVE,
+	TRACE_LOAD,
+	TRACE_JOURNAL,
+	TRACE_SYNC,
+	TRACE_RECOVER,
+	TRACE_STREAM,
+	TRACE_FEED,
+	TRACE_FINISH,
+	TRACE_NEW_PARALLEL,
+	TRACE_DUMP_PARALLEL,
+	TRACE_LINES64,
+	TRACE_PREFIX64,
+	TRACE_MERGE64,
+	TRACE_PASTE64,
+	TRACE_CUT64,
+	TRACE_SEARCH64,
+	TRACE_DELETE64,
+	TRACE_LINE64,
+	TRACE_LINE_AT_OFFSET,
+	TRACE_OFFSET_OF_LINE,
+	TRACE_SEARCH_FLAGS,
+	TRACE_VALIDATE_UTF8,
+	TRACE_WATCH,
+	TRACE_WATCH_MATCHES,
+	TRACE_WATCH_RELEASE,
+	TRACE_WORKSPACE_NEW,
+	TRACE_WORKSPACE_RELEASE,
+	TRACE_WORKSPACE_ADD,
+	TRACE_WORKSPACE_REMOVE,
+	TRACE_WORKSPACE_SEARCH,
+	TRACE_CHECKPOINT_RELEASE,
+	TRACE_UNROLLED,
+	TRACE_OPS
+};
+
+/* Arguments of each operation, in order:
+ *
+ *   b  a buffer passed in        n  a buffer handed back
+ *   h  a batch                   i  an int
+ *   s  a string                  r  an int handed back, to check replays by
+ *   t  text passed with its length, stored as a string
+ *   z  a size_t, passed in or handed back, stored unsigned
+ *   w  a watch                   k  a workspace
+ */
+static const char *const traceArgs[TRACE_OPS] = {
+	[TRACE_NEW] = "ns",
+	[TRACE_ADOPT] = "ns",
+	[TRACE_RELEASE] = "b",
+	[TRACE_DUMP] = "bi",
+	[TRACE_LINES] = "br",
+	[TRACE_PREFIX] = "biis",
+	[TRACE_MERGE] = "bib",
+	[TRACE_PASTE] = "bib",
+	[TRACE_CUT] = "biin",
+	[TRACE_SEARCH] = "bsr",
+	[TRACE_DELETE] = "bii",
+	[TRACE_RICH] = "b",
+	[TRACE_DIFF] = "bb",
+	[TRACE_EQUAL] = "bbr",
+	[TRACE_CHECKPOINT] = "bz",
+	[TRACE_DIFF_SINCE] = "bz",
+	[TRACE_INTERN] = "bi",
+	[TRACE_COMPACT] = "b",
+	[TRACE_THREAD_SAFE] = "bi",
+	[TRACE_SNAPSHOT] = "bi",
+	[TRACE_BATCH_NEW] = "h",
+	[TRACE_BATCH_RELEASE] = "h",
+	[TRACE_BATCH_DELETE] = "hii",
+	[TRACE_BATCH_PREFIX] = "hiis",
+	[TRACE_BATCH_PASTE] = "hib",
+	[TRACE_BATCH_APPLY] = "bh",
+	[TRACE_LINE] = "bi",
+	[TRACE_SAVE] = "bsr",
+	[TRACE_LOAD] = "ns",
+	[TRACE_JOURNAL] = "bsr",
+	[TRACE_SYNC] = "br",
+	[TRACE_RECOVER] = "ns",
+	[TRACE_STREAM] = "n",
+	[TRACE_FEED] = "bt",
+	[TRACE_FINISH] = "b",
+	[TRACE_NEW_PARALLEL] = "nti",
+	[TRACE_DUMP_PARALLEL] = "bii",
+	[TRACE_LINES64] = "bz",
+	[TRACE_PREFIX64] = "bzzs",
+	[TRACE_MERGE64] = "bzb",
+	[TRACE_PASTE64] = "bzb",
+	[TRACE_CUT64] = "bzzn",
+	[TRACE_SEARCH64] = "bsz",
+	[TRACE_DELETE64] = "bzz",
+	[TRACE_LINE64] = "bz",
+	[TRACE_LINE_AT_OFFSET] = "bzz",
+	[TRACE_OFFSET_OF_LINE] = "bzz",
+	[TRACE_SEARCH_FLAGS] = "bsir",
+	[TRACE_VALIDATE_UTF8] = "bir",
+	[TRACE_WATCH] = "bsw",
+	[TRACE_WATCH_MATCHES] = "wr",
+	[TRACE_WATCH_RELEASE] = "w",
+	[TRACE_WORKSPACE_NEW] = "k",
+	[TRACE_WORKSPACE_RELEASE] = "k",
+	[TRACE_WORKSPACE_ADD] = "kb",
+	[TRACE_WORKSPACE_REMOVE] = "kb",
+	[TRACE_WORKSPACE_SEARCH] = "ksir",
+	[TRACE_CHECKPOINT_RELEASE] = "bz",
+	[TRACE_UNROLLED] = "bi",
+};
+
+static const char *const traceNames[TRACE_OPS] = {
+	[TRACE_NEW] = "newTB",
+	[TRACE_ADOPT] = "adopt",
+	[TRACE_RELEASE] = "releaseTB",
+	[TRACE_DUMP] = "dumpTB",
+	[TRACE_LINES] = "linesTB",
+	[TRACE_PREFIX] = "addPrefixTB",
+	[TRACE_MERGE] = "mergeTB",
+	[TRACE_PASTE] = "pasteTB",
+	[TRACE_CUT] = "cutTB",
+	[TRACE_SEARCH] = "searchTB",
+	[TRACE_DELETE] = "deleteTB",
+	[TRACE_RICH] = "formRichText",
+	[TRACE_DIFF] = "diffTB",
+	[TRACE_EQUAL] = "equalTB",
+	[TRACE_CHECKPOINT] = "checkpointTB",
+	[TRACE_DIFF_SINCE] = "diffSinceTB",
+	[TRACE_INTERN] = "setInternTB",
+	[TRACE_COMPACT] = "compactTB",
+	[TRACE_THREAD_SAFE] = "setThreadSafeTB",
+	[TRACE_SNAPSHOT] = "setSnapshotReadsTB",
+	[TRACE_BATCH_NEW] = "newBatchTB",
+	[TRACE_BATCH_RELEASE] = "releaseBatchTB",
+	[TRACE_BATCH_DELETE] = "batchDeleteTB",
+	[TRACE_BATCH_PREFIX] = "batchPrefixTB",
+	[TRACE_BATCH_PASTE] = "batchPasteTB",
+	[TRACE_BATCH_APPLY] = "applyBatchTB",
+	[TRACE_LINE] = "lineTB",
+	[TRACE_SAVE] = "saveSnapshotTB",
+	[TRACE_LOAD] = "loadSnapshotTB",
+	[TRACE_JOURNAL] = "journalTB",
+	[TRACE_SYNC] = "syncJournalTB",
+	[TRACE_RECOVER] = "recoverTB",
+	[TRACE_STREAM] = "newStreamTB",
+	[TRACE_FEED] = "feedTB",
+	[TRACE_FINISH] = "finishTB",
+	[TRACE_NEW_PARALLEL] = "newTBParallel",
+	[TRACE_DUMP_PARALLEL] = "dumpParallelTB",
+	[TRACE_LINES64] = "linesTB64",
+	[TRACE_PREFIX64] = "addPrefixTB64",
+	[TRACE_MERGE64] = "mergeTB64",
+	[TRACE_PASTE64] = "pasteTB64",
+	[TRACE_CUT64] = "cutTB64",
+	[TRACE_SEARCH64] = "searchTB64",
+	[TRACE_DELETE64] = "deleteTB64",
+	[TRACE_LINE64] = "lineTB64",
+	[TRACE_LINE_AT_OFFSET] = "lineAtOffsetTB",
+	[TRACE_OFFSET_OF_LINE] = "offsetOfLineTB",
+	[TRACE_SEARCH_FLAGS] = "searchFlagsTB",
+	[TRACE_VALIDATE_UTF8] = "validateUtf8TB",
+	[TRACE_WATCH] = "watchSearchTB",
+	[TRACE_WATCH_MATCHES] = "watchMatchesTB",
+	[TRACE_WATCH_RELEASE] = "releaseWatchTB",
+	[TRACE_WORKSPACE_NEW] = "newWorkspaceTB",
+	[TRACE_WORKSPACE_RELEASE] = "releaseWorkspaceTB",
+	[TRACE_WORKSPACE_ADD] = "addWorkspaceTB",
+	[TRACE_WORKSPACE_REMOVE] = "removeWorkspaceTB",
+	[TRACE_WORKSPACE_SEARCH] = "searchWorkspaceTB",
+	[TRACE_CHECKPOINT_RELEASE] = "releaseCheckpointTB",
+	[TRACE_UNROLLED] = "setUnrolledTB",
+};
+
+#endif
@@ -8,6 +8,8 @@
 #define FALSE 0
 
 int main(int argc, char *argv[]) {
+	(void) argc;
+	(void) argv;
  //   char str[] = "line 01\n"
    //              "line 02\n"
      //            "line 03\n"
@@ -1,945 +1,8335 @@
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "textbuffer.h"
+#include "tbtrace.h"
 
 
 #define TRUE 1
 #define FALSE 0
 
+//Lines shorter than this are kept inside their node
+#define INLINE_LINE 24
+
 struct textbufferNode {
 	struct textbufferNode *next;
 	struct textbufferNode *prev;
+	//Points at small for short lines, otherwise at the heap or intern table
 	char *line;
+	unsigned long long hash;
+	int length;
+	//TRUE if line is a shared payload from the intern table
+	int interned;
+	char small[INLINE_LINE];
 }textbufferNode;
 
 typedef struct textbufferNode *TBNode;
 
+//Nodes are carved out of aligned blocks, so that lines built together sit
+//together in memory and a node can find its block by masking its address.
+//This only changes where nodes live: the buffer is still a list with one
+//node per line, not an unrolled list, so a scan follows one pointer per
+//line and blocks are never split or merged as lines come and go.
+#define NODE_BLOCK_BYTES 16384
+
+typedef struct _nodeBlock {
+	//Links blocks that have at least a quarter of their nodes free
+	struct _nodeBlock *next;
+	struct _nodeBlock *prev;
+	int partial;
+	//Nodes given back, then nodes never handed out
+	TBNode free;
+	int fresh;
+	int used;
+	//What the allocator handed out, which the block may sit a little past
+	void *raw;
+	_Alignas(64) struct textbufferNode nodes[];
+} nodeBlock;
+
+#define NODE_BLOCK ((int) ((NODE_BLOCK_BYTES - offsetof(nodeBlock, nodes)) / sizeof(struct textbufferNode)))
+
+static struct {
+	nodeBlock *current;
+	nodeBlock *partial;
+} blocks;
+
+//Allocator set by setAllocatorTB, or NULLs for malloc. Memory handed back
+//to the caller always comes from malloc, so that it can be free()d.
+static struct {
+	void *(*allocate)(size_t size, void *ctx);
+	void *(*reallocate)(void *ptr, size_t size, void *ctx);
+	void (*deallocate)(void *ptr, void *ctx);
+	void *ctx;
+	//Allocations made and not yet freed
+	long live;
+} allocator;
+
+//Guards the node blocks and the intern table, which every buffer shares
+static pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct textbuffer{
-	int nlines;
+	long nlines;
 	struct textbufferNode* first;
 	struct textbufferNode* last;
+	//Sum of the hashes of every line, kept up to date by each edit
+	unsigned long long digest;
+	//Edits recorded since the oldest checkpoint still held, or NULL
+	struct _editHistory *history;
+	//TRUE if lines written to this buffer are interned
+	int intern;
+	//Taken by every operation once the buffer is made thread safe
+	pthread_rwlock_t lock;
+	int threadSafe;
+	//TRUE if linesTB, dumpTB and searchTB read without the lock
+	int snapshot;
+	//Odd while a writer holds a snapshot buffer, bumped on every edit so a
+	//read that overlaps one can tell
+	unsigned long version;
+	//Id in the trace being recorded, if traceGeneration is current
+	int traceId;
+	int traceGeneration;
+#ifdef TB_STATS
+	//Counts of the calls made on this buffer, or NULL before the first
+	struct _statCounters *stats;
+#endif
+	//File the lines are read from in place, if loaded by loadSnapshotTB and
+	//not yet turned into nodes
+	struct _mappedLines *mapped;
+	//Log every edit is appended to, if journalTB is on
+	struct _journal *journal;
+	//For a buffer from newStreamTB until finishTB, the start of a line that
+	//a later chunk ends
+	struct _textBuilder *stream;
+	//Unrolled list of the lines, with the byte offset of each, built by
+	//setUnrolledTB or the first lineAtOffsetTB or offsetOfLineTB, or NULL
+	struct _lineIndex *index;
+	//Hashes over runs of lines, built by the first equalTB or diffTB, or NULL
+	struct _hashIndex *hashes;
+	//Searches kept up to date by each edit, from watchSearchTB
+	struct textbufferWatch *watches;
 }textbuffer;
 
-static TBNode newTBNode(char *line);
-static int extract_line(char text[], int index, int length, char line[length]);
-static char *addrich(int length, int array[length], char type[length], char *line, int index);
+/* Layout of the files written by saveSnapshotTB(), which loadSnapshotTB()
+ * maps and reads in place:
+ *
+ *   snapshotHeader
+ *   uint64_t offsets[nlines + 1]   where each line starts in the payload,
+ *                                  then the payload's length
+ *   char payload[]                 every line followed by a '\0'
+ *
+ * Numbers are in the byte order of the machine that wrote the file, which
+ * byteOrder lets a reader check. generation is 0, except in the base of a
+ * journal.
+ */
+#define SNAPSHOT_MAGIC "TBSNAP01"
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct _snapshotHeader {
+	char magic[8];
+	uint32_t byteOrder;
+	uint32_t generation;
+	uint64_t nlines;
+	uint64_t payloadBytes;
+} snapshotHeader;
+
+typedef struct _mappedLines {
+	void *base;
+	size_t size;
+	const uint64_t *offsets;
+	const char *payload;
+	uint64_t payloadBytes;
+} mappedLines;
+
+/* Layout of the log journalTB() appends to, at the path of its base snapshot
+ * with ".log" added:
+ *
+ *   journalHeader                  generation matches the base's
+ *   records[]                      each a uint32_t length and a uint32_t
+ *                                  checksum of its body, then the body
+ *
+ * A body is the operation as one byte, then zigzag varints 'a' and 'b', then
+ * a string, in the encoding of the traces in tbtrace.h. A batch instead has
+ * its number of edits, then the kind, lines and string of each edit. Pasted
+ * lines are stored as their text, each line followed by a newline.
+ */
+#define JOURNAL_MAGIC "TBJRNL01"
+
+#define JOURNAL_PREFIX 0
+#define JOURNAL_DELETE 1
+#define JOURNAL_RICH 2
+#define JOURNAL_INSERT 3
+#define JOURNAL_BATCH 4
+
+//Records are synced together once this many are waiting, or the oldest has
+//waited JOURNAL_DELAY_NS
+#define JOURNAL_GROUP 32
+#define JOURNAL_DELAY_NS 10000000LL
+//The log is folded into a new base once it is bigger than this and the base
+#define JOURNAL_COMPACT (1 << 20)
+
+typedef struct _journalHeader {
+	char magic[8];
+	uint32_t byteOrder;
+	uint32_t generation;
+} journalHeader;
+
+typedef struct _journal {
+	int fd;
+	char *path;
+	uint32_t generation;
+	//Records written since the last sync, and when the first of them was
+	int unsynced;
+	long long unsyncedSince;
+	long long logBytes;
+	long long baseBytes;
+	//TRUE once a write has failed, after which the log is no longer trusted
+	int failed;
+	//Guards the fields above against the thread that syncs the log once
+	//its oldest record is due, which 'wake' rouses and 'stopping' ends
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t flusher;
+	int stopping;
+} journal;
+
+//Each read of a snapshot buffer takes a slot to announce itself in, for as
+//long as it lasts
+typedef struct _readerSlot {
+	struct _readerSlot *next;
+	struct _readerSlot *prev;
+	//Epoch the read started in
+	unsigned long epoch;
+} readerSlot;
+
+//Kinds of memory an edit can retire while readers may still see it
+#define RETIRED_NODES 0
+#define RETIRED_SHELLS 1
+#define RETIRED_LINE 2
+#define RETIRED_TB 3
+
+typedef struct _retiredItem {
+	struct _retiredItem *next;
+	//Epoch the item was taken out in
+	unsigned long epoch;
+	int kind;
+	void *item;
+	//Number of nodes, or TRUE for an interned line
+	long count;
+} retiredItem;
+
+//Retired items wait here, oldest first, until every read that could see
+//them has finished
+static struct {
+	unsigned long epoch;
+	readerSlot *readers;
+	retiredItem *first;
+	retiredItem *last;
+} snapshots = {1, NULL, NULL, NULL};
+
+//Times a read of a snapshot buffer is started over after an edit overlaps
+//it, before it takes the lock instead
+#define SNAPSHOT_TRIES 4
+
+//Chains of nodes that releaseTB, deleteTB and the like have let go of,
+//once setDeferredFreesTB() is on, waiting for the background thread to
+//free them. Items are pushed onto 'queue' with a CAS and taken off all at
+//once, so that callers never wait on a lock.
+static struct {
+	int enabled;
+	int started;
+	retiredItem *queue;
+	//Items pushed so far, and how many of them have been freed
+	unsigned long queued;
+	unsigned long freed;
+	//Lines queued and not yet freed, and lines freed since the last
+	//drainFreesTB()
+	long pending;
+	long lines;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+} deferred = {FALSE, FALSE, NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER};
+
+//The background thread frees this many nodes at a time between taking
+//and letting go of storage_lock, so that allocations needn't wait long
+#define DEFERRED_SLICE 1024
+
+//Callers free their own lines rather than queue them once this many wait
+#define DEFERRED_LIMIT (1L << 20)
+
+//Guards the retired items and the list of reader slots
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Refcounted payload shared by every interned copy of a line
+typedef struct _internedLine {
+	struct _internedLine *next;
+	unsigned long long hash;
+	long refs;
+	int length;
+	char text[];
+} internedLine;
+
+//Intern table shared by every textbuffer
+static struct {
+	internedLine **buckets;
+	int size;
+	internStats stats;
+} interned;
+
+//Growing string used to build up diffTB's edit script
+typedef struct _textBuilder {
+	char *text;
+	long length;
+	long capacity;
+} textBuilder;
+
+//Edit script that diffSinceTB() takes the part after a checkpoint of.
+//Checkpoints are offsets into every edit recorded since the first was
+//taken; the script only keeps what follows the oldest still held.
+typedef struct _editHistory {
+	textBuilder script;
+	//Offset of the start of 'script'
+	long base;
+	//Checkpoints held, in the order they were taken and so in order
+	long *checkpoints;
+	long ncheckpoints;
+	long capacity;
+} editHistory;
+
+//Line index, an unrolled list of the lines: the node of each line and the
+//length of it and its newline, in chunks of up to twice INDEX_CHUNK lines.
+//The chunks are linked in order, for scans to walk arrays of nodes rather
+//than follow one pointer per line, and kept in a treap ordered by position.
+//Each chunk also holds the lines and bytes of its subtree, so that a line or
+//an offset is found on the way down, and lines are inserted or removed by
+//splitting the treap at them and joining it up again, each in O(log n).
+//Chunks left small either side of a join are merged. Lines appended past
+//'valid' are added by sync_index.
+#define INDEX_CHUNK 128
+
+//Scans through the line index fetch the node this many lines ahead
+#define SCAN_AHEAD 8
+
+typedef struct _indexChunk {
+	struct _indexChunk *left;
+	struct _indexChunk *right;
+	//The chunk holding the lines after this one's
+	struct _indexChunk *next;
+	unsigned int priority;
+	int count;
+	//Bytes of this chunk's lines, then lines and bytes of its subtree
+	long own;
+	long lines;
+	long bytes;
+	long lengths[2 * INDEX_CHUNK];
+	TBNode nodes[2 * INDEX_CHUNK];
+} indexChunk;
+
+typedef struct _lineIndex {
+	indexChunk *root;
+	long nchunks;
+	//Number of leading lines the index holds
+	long valid;
+	unsigned int seed;
+} lineIndex;
+
+//Blocks of consecutive lines, each with a hash over the hashes of its lines,
+//so that equalTB can reject buffers that differ, and diffTB can find the runs
+//two buffers likely share, without visiting their lines. Either compares the
+//lines of runs whose hashes match before relying on them. A block is hashed as a polynomial modulo HASH_PRIME, so the
+//hash of two blocks together follows from theirs. Edits only change the
+//counts of the blocks they touch and mark them dirty, and the next equalTB
+//or diffTB rehashes the dirty blocks, splitting or joining them to keep
+//them near HASH_BLOCK lines.
+#define HASH_BLOCK 256
+#define HASH_PRIME ((1ULL << 61) - 1)
+#define HASH_BASE 0x0f3d5b79a2c4e687ULL
+
+typedef struct _hashBlock {
+	//First node of the block, except for the first block, which starts at
+	//the buffer's first node
+	TBNode first;
+	long count;
+	//Hash of the block and HASH_BASE to the power of 'count', unless dirty
+	unsigned long long hash;
+	unsigned long long power;
+	int dirty;
+} hashBlock;
+
+typedef struct _hashIndex {
+	hashBlock *blocks;
+	long nblocks;
+	long capacity;
+	//TRUE if some block is dirty
+	int stale;
+	//The block last found, and its first line, where the next search starts
+	long cursor;
+	long cursorLine;
+} hashIndex;
+
+//Maps each distinct line to a small integer id for diffTB
+typedef struct _lineSlot {
+	char *line;
+	unsigned long long hash;
+	long id;
+} lineSlot;
+
+typedef struct _lineTable {
+	lineSlot *slots;
+	long size;
+	long nids;
+} lineTable;
+
+//Working state for the Myers diff
+typedef struct _diffContext {
+	long *xv;
+	long *yv;
+	char *xchanged;
+	char *ychanged;
+	long *vbuf;
+	long *fdiag;
+	long *bdiag;
+} diffContext;
+
+//A stretch of lines two buffers share, which diffTB passes over
+typedef struct _diffAnchor {
+	//First line of the stretch in each buffer, and its length
+	long xline;
+	long yline;
+	long count;
+	//First node of the stretch in each buffer, then the node after it,
+	//either NULL at the end
+	TBNode xfirst;
+	TBNode yfirst;
+	TBNode xnext;
+	TBNode ynext;
+} diffAnchor;
+
+//A hash block of one of the buffers diffTB compares, 'side' 0 for tb1
+typedef struct _blockKey {
+	unsigned long long hash;
+	unsigned long long power;
+	long block;
+	int side;
+} blockKey;
+
+//A block of tb1 and a block of tb2 with the same lines
+typedef struct _blockPair {
+	long xblock;
+	long yblock;
+} blockPair;
+
+//Kinds of edit a batch can hold, in the order they apply at the same line
+#define BATCH_PASTE 0
+#define BATCH_DELETE 1
+#define BATCH_PREFIX 2
+
+typedef struct _batchEdit {
+	int kind;
+	int from;
+	int to;
+	//Order the edit was queued in
+	int seq;
+	char *prefix;
+	//Copied lines waiting to be pasted
+	TBNode first;
+	TBNode last;
+	long count;
+} batchEdit;
+
+struct textbufferBatch {
+	batchEdit *edits;
+	int nedits;
+	int capacity;
+	int traceId;
+	int traceGeneration;
+};
+
+//Matches found by search_tb so far, kept as a list of matchNode64s if wide,
+//otherwise of matchNodes
+typedef struct _matchList {
+	int wide;
+	void *first;
+	Match last;
+	Match64 last64;
+	long count;
+} matchList;
+
+//A match kept by a watch, by line from 0 and byte within the line
+typedef struct _watchMatch {
+	long line;
+	long charIndex;
+} watchMatch;
+
+typedef struct _watchMatches {
+	watchMatch *items;
+	long count;
+	long capacity;
+} watchMatches;
+
+//A run of lines of a watched buffer as it is now: lines kept from when the
+//watch last caught up, or lines written since, searched as they were
+typedef struct _watchPiece {
+	//First line of a kept run in the old numbering, or -1 for written lines
+	long from;
+	long count;
+	//Matches on written lines, numbered from the start of the run
+	watchMatches found;
+} watchPiece;
+
+//Watches catch up once edits have cut them into this many pieces
+#define WATCH_PIECES 256
+
+struct textbufferWatch {
+	//NULL once the buffer is released
+	TB tb;
+	char *search;
+	long length;
+	//Matches as of the last catch up, in order
+	watchMatches matches;
+	//The buffer's lines since then, in order, none of them empty
+	watchPiece *pieces;
+	long npieces;
+	long capacity;
+	//Other watches on the same buffer
+	struct textbufferWatch *next;
+	int traceId;
+	int traceGeneration;
+};
+
+//Part of the text given to newTBParallel, which one thread turns into nodes
+typedef struct _buildSlice {
+	const char *start;
+	const char *end;
+	pthread_t thread;
+	int started;
+	//The nodes built, and the block the last of them came from
+	TBNode first;
+	TBNode last;
+	long nlines;
+	unsigned long long digest;
+	nodeBlock *block;
+} buildSlice;
+
+//Part of the text dumpParallelTB writes, which one thread fills in
+typedef struct _dumpSlice {
+	TBNode first;
+	long count;
+	//Number of the first line, and where it goes in the text
+	long number;
+	char *out;
+	int showLineNumbers;
+	pthread_t thread;
+	int started;
+} dumpSlice;
+
+//newTBParallel and dumpParallelTB give each thread at least this much text
+#define PARALLEL_SLICE (1 << 20)
+//dumpParallelTB notes where every this many lines start in its output, and
+//cuts the output between threads only there
+#define DUMP_STRIDE 1024
+
+//Buffers registered with a workspace, searched together
+struct textbufferWorkspace {
+	TB *buffers;
+	int nbuffers;
+	int capacity;
+	int traceId;
+	int traceGeneration;
+};
+
+//Lines of one buffer that searchWorkspaceTB hands a thread at a time, and
+//the matches found on them
+typedef struct _searchTask {
+	TB tb;
+	TBNode first;
+	//Number of the first line, from 1
+	long number;
+	long count;
+	WorkspaceMatch matches;
+	WorkspaceMatch last;
+} searchTask;
+
+//searchWorkspaceTB cuts buffers into tasks of at most this many lines
+#define SEARCH_TASK_LINES 1024
+
+//Shared by searchWorkspaceTB's threads. Each owns a range of tasks, packed
+//as the next in the low half of a word and the end in the high half. It
+//takes tasks from the front of its own, and once that is empty steals the
+//back half of another's.
+typedef struct _searchPool {
+	searchTask *tasks;
+	const char *search;
+	long length;
+	int nthreads;
+	uint64_t *ranges;
+} searchPool;
+
+typedef struct _searchWorker {
+	searchPool *pool;
+	int id;
+	pthread_t thread;
+	int started;
+} searchWorker;
+
+//Trace being recorded by startTraceTB, shared by every thread
+static struct {
+	FILE *file;
+	long long start;
+	//Bumped by every trace, so that ids handed out by older ones are stale
+	int generation;
+	int buffers;
+	int batches;
+	int watches;
+	int workspaces;
+} trace;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef TB_STATS
+//Latencies are counted in four buckets per power of two nanoseconds
+#define STAT_BUCKETS 164
+
+typedef struct _opCounters {
+	unsigned long calls;
+	unsigned long long totalNs;
+	unsigned int buckets[STAT_BUCKETS];
+} opCounters;
+
+//Work done by calls, as counted by the COUNT() sites
+typedef struct _workCounts {
+	unsigned long nodes;
+	unsigned long bytes;
+	unsigned long allocations;
+} workCounts;
+
+//Counts of the calls made on one buffer, or by one thread
+typedef struct _statCounters {
+	struct _statCounters *next;
+	//Each allocated the first time its operation is counted
+	opCounters *ops[TRACE_OPS];
+	workCounts work;
+} statCounters;
+
+_Static_assert(TRACE_OPS <= TB_STATS_OPS, "tbStats has no room for every operation");
+
+//Every thread's counters, which globalStatsTB adds up. A thread's counters
+//outlive it, so that its calls stay counted.
+static statCounters *thread_stats;
+static __thread statCounters *my_stats;
+
+//Work done by this thread so far; each call takes the part done while it ran
+static __thread workCounts work;
+
+#define COUNT(field, n) (work.field += (n))
+#else
+#define COUNT(field, n) ((void) 0)
+#endif
+
+//A call being traced or counted, with the ids of the buffers it was passed
+typedef struct _traceCall {
+	long long start;
+	int ids[2];
+#ifdef TB_STATS
+	TB tb;
+	long long began;
+	workCounts work;
+#endif
+} traceCall;
+
+static TBNode copyTBNode(TBNode node);
+static TBNode alloc_node(int contiguous);
+static nodeBlock *alloc_block(void);
+static void *tb_alloc(size_t size);
+static void *tb_realloc(void *ptr, size_t size);
+static void tb_free(void *ptr);
+static void *result_alloc(size_t size);
+static void out_of_memory(void);
+static void free_node(TBNode node);
+static void retire_block(nodeBlock *block);
+static void shelve_block(nodeBlock *block);
+static void unlink_block(nodeBlock *block);
+static unsigned long long chain_digest(TBNode start);
+static void free_tb(TB tb);
+static void append_line(TB tb, const char *line, long length);
+static TB new_tb_parallel(const char *text, long length, int nthreads);
+static void *build_slice(void *arg);
+static void feed_tb(TB tb, const char *chunk, int length);
+static void finish_tb(TB tb);
+static char *dump_tb(TB tb, int showLineNumbers);
+static void run_prefix(TB tb, long pos1, long pos2, char *prefix);
+static void add_prefix(TB tb, long pos1, long pos2, char* prefix);
+static void run_merge(TB tb1, long pos, TB tb2);
+static void merge_tb(TB tb1, long pos, TB tb2);
+static void run_paste(TB tb1, long pos, TB tb2);
+static void paste_tb(TB tb1, long pos, TB tb2);
+static TB run_cut(TB tb, long from, long to);
+static TB cut_tb(TB tb, long from, long to);
+static void run_search(TB tb, char *search, int flags, matchList *list);
+static void search_tb(TB tb, char* search, int flags, matchList *list);
+static char *find_ignore_case(char *floor, char *text, char *end, const char *folded, long length);
+#ifdef __SSE2__
+static __m128i lower_block(__m128i bytes);
+#endif
+static int equal_ignore_case(const char *text, const char *folded, long length);
+static long count_codepoints(const char *text, long length);
+static void run_validate(TB tb, int flags, matchList *list);
+static void validate_utf8_tb(TB tb, int flags, matchList *list);
+static long skip_ascii(const char *text, long from, long length);
+static int utf8_sequence(const unsigned char *text, long length);
+static void clear_matches(matchList *list);
+static void add_match(matchList *list, long lineNumber, long charIndex);
+static void watch_scan(TBWatch watch, watchMatches *found, TBNode first, long count);
+static void add_watch_match(watchMatches *found, long line, long charIndex);
+static long split_piece(TBWatch watch, long pos);
+static void insert_piece(TBWatch watch, long at);
+static void join_pieces(TBWatch watch, long at);
+static void watch_insert(TB tb, long pos, TBNode first, long count);
+static void watch_remove(TB tb, long pos, long count);
+static void catch_up(TBWatch watch);
+static void end_watches(TB tb);
+static WorkspaceMatch search_workspace(TBWorkspace ws, char *search, int nthreads);
+static void *search_worker(void *arg);
+static int steal_tasks(searchPool *pool, int thief);
+static void search_task(searchPool *pool, searchTask *task);
+static int compare_buffers(const void *a, const void *b);
+static void run_delete(TB tb, long from, long to);
+static void delete_tb(TB tb, long from, long to);
+static void form_rich_text(TB tb);
+static char *diff_tb(TB tb1, TB tb2);
+static diffAnchor *match_blocks(TB tb1, TB tb2, long *nanchors);
+static int compare_block_keys(const void *a, const void *b);
+static int compare_block_pairs(const void *a, const void *b);
+static long diff_lines(textBuilder *script, TBNode xfirst, TBNode xlast, long n, TBNode yfirst, TBNode ylast, long m, long pos);
+static int equal_tb(TB tb1, TB tb2);
+static void read_lock(TB tb);
+static void write_lock(TB tb);
+static void unlock_tb(TB tb);
+static void lock_pair(TB tb1, int write1, TB tb2, int write2);
+static void unlock_pair(TB tb1, TB tb2);
+static void publish(TBNode *link, TBNode node);
+static TBNode first_node(TB tb);
+static TBNode next_node(TBNode node);
+static readerSlot *enter_epoch(void);
+static void exit_epoch(readerSlot *slot);
+static int begin_snapshot(TB tb, unsigned long *version);
+static int end_snapshot(TB tb, unsigned long version);
+static void retire(int kind, void *item, long count);
+static void retire_line(TBNode node);
+static void reclaim_retired(void);
+static int defer_nodes(TBNode first, long count);
+static void *reclaim_deferred(void *arg);
+static void free_deferred(retiredItem *items);
+static void drain_frees(void);
+static void discard_nodes(TB tb, TBNode first, long count);
+static void drop_tb(TB tb);
+static TB copy_range(TB tb, long from, long to);
+static char *try_dump_snapshot(TB tb, int showLineNumbers);
+static char *dump_snapshot(TB tb, int showLineNumbers);
+static char *dump_parallel(TB tb, int showLineNumbers, int nthreads);
+static void *dump_slice(void *arg);
+static TB new_tb(char text[]);
+static void load_mapped(TB tb);
+static const char *mapped_line(mappedLines *mapped, long pos, int *length);
+static char *dump_mapped(TB tb, int showLineNumbers);
+static void unmap_lines(mappedLines *mapped);
+static int write_snapshot(TB tb, FILE *file, uint32_t generation);
+static int save_snapshot(TB tb, const char *path, uint32_t generation);
+static TB load_snapshot(const char *path);
+static int start_journal(TB tb, const char *path, uint32_t generation, int fd);
+static int start_log(journal *log);
+static void close_journal(TB tb);
+static int sync_journal(journal *log);
+static void *flush_journal(void *arg);
+static void journal_begin(textBuilder *record, int op);
+static void journal_edit(TB tb, int op, long a, long b, const char *text);
+static void journal_insert(textBuilder *record, long pos, TB tb2);
+static void journal_batch(textBuilder *record, TBBatch batch);
+static void journal_number(textBuilder *record, long n);
+static void journal_lines(textBuilder *record, TBNode first, long count);
+static void journal_append(TB tb, textBuilder *record);
+static unsigned int journal_checksum(const char *body, uint32_t length);
+static int replay_record(TB tb, const char *body, uint32_t length);
+static int read_varint(const char **at, const char *end, unsigned long long *n);
+static int read_number(const char **at, const char *end, long long *n);
+static char *read_string(const char **at, const char *end);
+static void set_thread_safe(TB tb, int threadSafe);
+static void release_tb(TB tb);
+static long long trace_clock(void);
+static void trace_begin(traceCall *call, TB tb1, TB tb2);
+static void trace_end(traceCall *call, int op, ...);
+static int trace_buffer(TB tb);
+static int trace_batch(TBBatch batch, int adopt);
+static int trace_watch(TBWatch watch);
+static int trace_workspace(TBWorkspace ws);
+static void trace_header(textBuilder *record, int op, long long start, long long end);
+static void trace_number(textBuilder *record, unsigned long long n);
+static void trace_string(textBuilder *record, const char *s);
+#ifdef TB_STATS
+static void count_call(traceCall *call, int op);
+static void *stat_counters(void **counters, size_t size);
+static void add_counts(statCounters *counters, int op, long long ns, workCounts *done);
+static void sum_counts(statCounters *counters, opCounters sums[TRACE_OPS], tbStats *stats);
+static void report_counts(opCounters sums[TRACE_OPS], tbStats *stats);
+static int stat_bucket(long long ns);
+static long long stat_percentile(opCounters *counts, int percent);
+#endif
+static char *node_line(TBNode node);
+static void store_line(TBNode node, const char *line, long length);
+static void replace_line(TB tb, TBNode node, char *line);
+static void release_line(TBNode node);
+static char *intern_line(const char *line, unsigned long long hash);
+static void unintern_line(char *line);
+static void record_insert(TB tb, long pos, TBNode first, long count);
+static void record_remove(TB tb, long pos, long count);
+static void record_change(TB tb, long pos, TBNode node);
+static batchEdit *queue_edit(TBBatch batch, int kind, int from, int to);
+static void apply_batch(TB tb, TBBatch batch);
+static void free_batch(TBBatch batch);
+static int compare_edits(const void *a, const void *b);
+static void link_before(TB tb, TBNode node, TBNode first, TBNode last);
+static void unlink_node(TB tb, TBNode node);
+static unsigned long long chain_digest_count(TBNode start, long count);
+static char *addrich(int length, int *array, char *type, char *line, int index);
 static int search_closer(int charIndex, int *new_start, char *line, int type);
-static void free_nodes(TBNode start);
-static int text_length(TB tb);
-static int num_places(int n);
+static void free_nodes(TBNode start, long count);
+static long text_length(TB tb);
+static int num_places(long n);
+static long lines_tb(TB tb);
+static void set_lines(TB tb, long nlines);
+static char *line_tb(TB tb, long pos);
+static TBNode node_at(TB tb, long pos);
+static long line_at_offset(TB tb, size_t offset);
+static size_t offset_of_line(TB tb, long pos);
+static lineIndex *sync_index(TB tb);
+static void index_resize(TB tb, long pos, long delta);
+static void index_insert(TB tb, long pos, TBNode first, long count);
+static void index_remove(TB tb, long pos, long count);
+static indexChunk *split_chunks(lineIndex *index, indexChunk *chunk, long pos, indexChunk **right);
+static indexChunk *join_chunks(indexChunk *left, indexChunk *right);
+static indexChunk *splice_chunks(indexChunk *left, indexChunk *right);
+static indexChunk *first_chunk(indexChunk *chunk);
+static TBNode next_indexed(indexChunk **chunk, int *at);
+static indexChunk *indexed_scan(TB tb);
+static indexChunk *build_chunks(lineIndex *index, TBNode first, long count);
+static indexChunk *new_chunk(lineIndex *index);
+static void mend_chunks(lineIndex *index, long pos);
+static void mend_seam(lineIndex *index, long pos, long *before, long *after);
+static void sum_chunk(indexChunk *chunk);
+static void free_chunks(lineIndex *index, indexChunk *chunk);
+static hashIndex *sync_hashes(TB tb);
+static void rehash_block(TB tb, long block);
+static int hashes_ready(TB tb);
+static void lock_hashes(TB tb1, TB tb2);
+static long find_block(hashIndex *hashes, long pos, int atEnd);
+static TBNode block_first(TB tb, long block);
+static void add_blocks(hashIndex *hashes, long at, long count);
+static void drop_blocks(hashIndex *hashes, long at, long count);
+static void hashes_insert(TB tb, long pos, long count);
+static void hashes_remove(TB tb, long pos, long count);
+static void hashes_change(TB tb, long pos);
+static void free_hashes(TB tb);
+static unsigned long long mul_mod(unsigned long long a, unsigned long long b);
+static unsigned long long join_hash(unsigned long long hash, unsigned long long power, unsigned long long next);
+static void append_text(textBuilder *b, const char *s, long n);
+static long find_checkpoint(editHistory *history, long checkpoint);
+static void free_history(editHistory *history);
+static unsigned long long hash_line(const char *line);
+static void new_line_table(lineTable *table, long nlines);
+static void free_line_table(lineTable *table);
+static long line_id(lineTable *table, char *line, unsigned long long hash);
+static int same_line(TBNode a, TBNode b);
+static int same_lines(TBNode a, TBNode b, long count);
+static void compare_seq(diffContext *ctx, long xoff, long xlim, long yoff, long ylim);
+static void middle_snake(diffContext *ctx, long xoff, long xlim, long yoff, long ylim, long *xmid, long *ymid);
 
 /* Allocate a new textbuffer whose contents is initialised with the text given
  * in the array.
  */
 TB newTB (char text[]) {
 
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	TB tb = new_tb(text);
+	trace_end(&call, TRACE_NEW, tb, text);
+	return tb;
+}
+
+/* 
+ * Does the work of newTB
+ */
+static TB new_tb(char text[]) {
+
 	//Initialization
-	TB newTB = malloc(sizeof(textbuffer));
-	assert(newTB != NULL);
+	TB newTB = tb_alloc(sizeof(textbuffer));
 	newTB->nlines = 0;
 	newTB->first = NULL;
 	newTB->last = NULL;
+	newTB->digest = 0;
+	newTB->history = NULL;
+	newTB->intern = FALSE;
+	newTB->threadSafe = FALSE;
+	newTB->snapshot = FALSE;
+	newTB->version = 0;
+	newTB->traceGeneration = 0;
+	newTB->mapped = NULL;
+	newTB->journal = NULL;
+	newTB->stream = NULL;
+	newTB->index = NULL;
+	newTB->hashes = NULL;
+	newTB->watches = NULL;
+#ifdef TB_STATS
+	newTB->stats = NULL;
+#endif
 
 	//Case 1: Empty String
 	if (text[0] == '\0') {
 		return newTB;
 	}	
 
-	//Case 2: Normal String
-	int length = strlen(text) + 1;
-	char line[length];
-	int new_start = 0;
-
-	//First node
-	new_start = extract_line(text, new_start, length, line);
-	if (new_start != -1) {
-		newTB->nlines = 1;
-		newTB->first = newTBNode(line);
-		newTB->last = newTB->first;
-		newTB->first->next = NULL;
-		newTB->first->prev = NULL;
-	}
-
-	//Middle and End Node
-	new_start = extract_line(text, new_start,length, line);
-	while(new_start != -1) {
+	//Case 2: Normal String, whose last line may lack its newline
+	pthread_mutex_lock(&storage_lock);
+	const char *start = text;
+	while (*start != '\0') {
+		const char *newline = strchr(start, '\n');
+		long length = newline != NULL ? newline - start : (long) strlen(start);
+		append_line(newTB, start, length);
 		newTB->nlines++;
-		newTB->last->next = newTBNode(line);
-		newTB->last->next->prev = newTB->last;
-		newTB->last = newTB->last->next;
-		new_start = extract_line(text, new_start, length, line);
+		start = newline != NULL ? newline + 1 : start + length;
 	}
-	newTB->last->next = NULL;
+	pthread_mutex_unlock(&storage_lock);
 	return newTB;
 }
 
-/* Allocates a new textbufferNode whose contents is initialized with the string given
- * in the array.
+/* 
+ * Adds a node holding the first 'length' bytes of 'line' after the last
+ * line of 'tb', with storage_lock held. The caller counts it in nlines.
  */
-static TBNode newTBNode(char *line) {
-
-	TBNode newL = malloc(sizeof(textbufferNode));
-	assert(newL != NULL);
-	newL->line = strdup(line);
-	newL->next = NULL;
-	newL->prev = NULL;
-	return newL;
+static void append_line(TB tb, const char *line, long length) {
+
+	TBNode node = alloc_node(FALSE);
+	store_line(node, line, length);
+	node->hash = hash_line(node_line(node));
+	node->next = NULL;
+	node->prev = tb->last;
+	if (tb->last == NULL) {
+		tb->first = node;
+	} else {
+		tb->last->next = node;
+	}
+	tb->last = node;
+	tb->digest = tb->digest + node->hash;
 }
 
-/* Given an initial starting value, increments through a given array, until it reaches 
- * a new line character, where it returns the index of the new line character. '\0' is
- * returned if the inital starting value never increments
+/* Build the same textbuffer newTB() would from the first 'length' bytes of
+ * 'text', using 'nthreads' threads.
+ *
+ * - The text is cut at line boundaries into a slice for each thread, which
+ *   turns it into nodes from blocks of its own. The lists of nodes are then
+ *   joined in order, in time proportional to the number of threads.
+ * - 'text' need not end in a '\0'. 0 threads means one per processor.
+ * - Each thread is given at least PARALLEL_SLICE bytes. While an allocator
+ *   set by setAllocatorTB() is in use, which need not be thread safe, the
+ *   work is done on one thread.
+ * - The program is to abort() with an error message if 'text' holds a '\0'.
  */
-static int extract_line(char text[], int index, int length, char line[length]) {
+TB newTBParallel (const char *text, long length, int nthreads) {
 
-	char curr_char = text[index];
-	line[0] = text[index];
-	int i = 0;
-	while ((curr_char != '\n') && (curr_char != '\0')) {
-		index++;
-		i++;
-		curr_char = text[index];
-		line[i] = text[index];
-	}
-	if ((i == 0) && (curr_char == '\n')) {
-		line[0] = '\0';
-		index++;
-		return index;
-	}
-	if ((i == 0) && (curr_char == '\0')) {
-		return -1;
-	}
-	line[i++] = '\0';
-	index++;
-	return index;	
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	TB tb = new_tb_parallel(text, length, nthreads);
+	trace_end(&call, TRACE_NEW_PARALLEL, tb, length, text, nthreads);
+	return tb;
 }
 
-/* Free the memory occupied by the given textbuffer.  It is an error to access
- * the buffer afterwards.
+/* 
+ * Does the work of newTBParallel
  */
-void releaseTB (TB tb) {
+static TB new_tb_parallel(const char *text, long length, int nthreads) {
 
-	//Case 1: Only one line
-	if (tb->nlines == 1) {
-		free(tb->first->line);
-		free(tb->first);
+	if (length < 0) {
+		printf("Invalid text");
+		abort();
+	}
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nthreads > length / PARALLEL_SLICE) {
+		nthreads = length / PARALLEL_SLICE;
+	}
+	if (nthreads < 1 || allocator.allocate != NULL) {
+		nthreads = 1;
 	}
 
-	//Case 2: Two or more lines
-	if (tb->nlines > 1) {
-		TBNode curr = tb->first->next;
-		while (curr->next!= NULL) {
-			free(curr->prev->line);
-			free(curr->prev);
-			curr = curr->next;
+	//Case 1: Cut the text just after the first newline at or past each
+	//thread's even share
+	buildSlice *slices = tb_alloc(sizeof(buildSlice) * nthreads);
+	const char *end = text + length;
+	const char *start = text;
+	for (int i = 0; i < nthreads; i++) {
+		const char *cut = end;
+		const char *share = text + length / nthreads * (i + 1);
+		if (i < nthreads - 1 && share <= start) {
+			//The slice before ran on past this one's share
+			cut = start;
+		} else if (i < nthreads - 1) {
+			const char *newline = memchr(share - 1, '\n', end - share + 1);
+			cut = newline != NULL ? newline + 1 : end;
 		}
-		free(curr->prev->line);
-		free(curr->prev);
-		free(curr->line);
-		free(curr);
+		slices[i].start = start;
+		slices[i].end = cut;
+		start = cut;
 	}
-	free(tb);
-}
 
-/* Allocate and return an array containing the text in the given textbuffer.
- * add a prefix corrosponding to line number iff showLineNumbers == TRUE
- */
-char *dumpTB (TB tb, int showLineNumbers){
-
-	// Case 1: TB is empty
-	if (tb->nlines == 0) {
-		char *dump = malloc(sizeof(char) * 2);
-		return strcpy(dump, "");
+	//Case 2: Build the slices, the first on this thread
+	for (int i = 1; i < nthreads; i++) {
+		slices[i].started = pthread_create(&slices[i].thread, NULL, build_slice, &slices[i]) == 0;
+		if (!slices[i].started) {
+			build_slice(&slices[i]);
+		}
 	}
-
-	//Case 2: Normal String
-
-	//Initialization
-	int length = text_length(tb);
-	if (showLineNumbers == TRUE) {
-		length = length + (tb->nlines) * num_places(tb->nlines);
-		//Ensures that there will always be space for line numbers
+	build_slice(&slices[0]);
+	for (int i = 1; i < nthreads; i++) {
+		if (slices[i].started) {
+			pthread_join(slices[i].thread, NULL);
+		}
 	}
-	char *dump = malloc(sizeof(char) * length);
-	dump[0] = '\0';
-
-	//For first line;
-	int num = 1;
-	TBNode curr = tb->first;
 
-	while (curr != NULL) {
-		if (showLineNumbers == TRUE) {
-			char line_num[10];
-			snprintf(line_num, 10, "%d", num);
-			num++;
-			strcat(dump, line_num);
-			strcat(dump, ". ");
+	//Case 3: Join the slices' nodes, and keep their last blocks for reuse
+	TB tb = new_tb("");
+	pthread_mutex_lock(&storage_lock);
+	for (int i = 0; i < nthreads; i++) {
+		buildSlice *slice = &slices[i];
+		if (slice->nlines == 0) {
+			continue;
 		}
-		strcat(dump, curr->line);
-		strcat(dump, "\n");
-		curr = curr->next;
+		if (tb->last == NULL) {
+			tb->first = slice->first;
+		} else {
+			tb->last->next = slice->first;
+			slice->first->prev = tb->last;
+		}
+		tb->last = slice->last;
+		tb->nlines = tb->nlines + slice->nlines;
+		tb->digest = tb->digest + slice->digest;
+		shelve_block(slice->block);
 	}
-	return dump;
+	pthread_mutex_unlock(&storage_lock);
+	tb_free(slices);
+	return tb;
 }
 
 /* 
- * Determine length of whole string to 
- * Avoid reallocing
+ * Turns one slice of newTBParallel's text into a list of nodes, taking them
+ * from blocks no other thread is using
  */
-static int text_length(TB tb) {
-    
-    TBNode curr = tb->first;
-    int length = 0;
-    while (curr != NULL) {
-    	length = length + strlen(curr->line)+5;
-    	curr = curr->next;
-    }
-    return length;
+static void *build_slice(void *arg) {
+
+	buildSlice *slice = arg;
+	slice->first = NULL;
+	slice->last = NULL;
+	slice->nlines = 0;
+	slice->digest = 0;
+	slice->block = NULL;
+	if (memchr(slice->start, '\0', slice->end - slice->start) != NULL) {
+		printf("Invalid text");
+		abort();
+	}
+	const char *start = slice->start;
+	while (start < slice->end) {
+		const char *newline = memchr(start, '\n', slice->end - start);
+		const char *stop = newline != NULL ? newline : slice->end;
+		if (slice->block == NULL || slice->block->fresh == NODE_BLOCK) {
+			slice->block = alloc_block();
+		}
+		TBNode node = &slice->block->nodes[slice->block->fresh++];
+		slice->block->used++;
+		store_line(node, start, stop - start);
+		node->hash = hash_line(node_line(node));
+		node->next = NULL;
+		node->prev = slice->last;
+		if (slice->last == NULL) {
+			slice->first = node;
+		} else {
+			slice->last->next = node;
+		}
+		slice->last = node;
+		slice->nlines++;
+		slice->digest = slice->digest + node->hash;
+		start = stop + 1;
+	}
+	return NULL;
 }
 
-/* 
- * Fastest Way to get number of digits for highest line-number
+/* Allocate a new, empty textbuffer to be filled by feedTB() a chunk at a
+ * time, so that the whole text never has to be in memory at once.
  */
-static int num_places(int n) {
-
-    if (n < 10) {
-    	return 1;
-   	}
-    if (n < 100) {
-    	return 2;
-    }
-    if (n < 1000) {
-    	return 3;
-    }
-    if (n < 10000) {
-    	return 4;
-    }
-    if (n < 100000) {
-    	return 5;
-    }
-    if (n < 1000000) {
-    	return 6;
-    }
-    if (n < 10000000) {
-    	return 7;
-    }
-    if (n < 100000000) {
-    	return 8;
-    }
-    if (n < 1000000000) {
-    	return 9;
-    }
-    return 10;
+TB newStreamTB (void) {
+
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	TB tb = new_tb("");
+	tb->stream = tb_alloc(sizeof(textBuilder));
+	tb->stream->text = NULL;
+	tb->stream->length = 0;
+	tb->stream->capacity = 0;
+	trace_end(&call, TRACE_STREAM, tb);
+	return tb;
 }
 
-/* Return the number of lines of the given textbuffer.
+/* Add the 'length' bytes of text at 'chunk' to the end of a textbuffer from
+ * newStreamTB().
+ *
+ * - Lines may be split between chunks anywhere. Each whole line goes
+ *   straight from 'chunk' into a node, and only a line still waiting for
+ *   the rest of it is copied aside, so the memory used is that of the
+ *   buffer plus about one chunk.
+ * - The program is to abort() with an error message if 'tb' was finished,
+ *   or 'chunk' holds a '\0'.
  */
-int linesTB (TB tb){
-	return tb->nlines;
+void feedTB (TB tb, const char *chunk, int length) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	write_lock(tb);
+	feed_tb(tb, chunk, length);
+	unlock_tb(tb);
+	trace_end(&call, TRACE_FEED, (long) length, chunk);
 }
 
-/* Add a given prefix to all lines between pos1 and pos2
- *
- * - The program is to abort() with an error message if line 'pos1' or line
- *   'pos2' is out of range.  The first line of a textbuffer is at position 0.
+/* 
+ * Does the work of feedTB, with the buffer already locked
  */
-void addPrefixTB (TB tb, int pos1, int pos2, char* prefix){
+static void feed_tb(TB tb, const char *chunk, int length) {
 
-	//Case 1: Positions out of range
-	if (pos1 > pos2) {
-		printf("Invalid positions");
+	//Case 1: Not a stream, or a chunk newTB couldn't have been given
+	if (tb->stream == NULL) {
+		printf("Not a stream");
 		abort();
 	}
-
-	if (pos1 < 0 || pos2 < 0) {
-		printf("Positions out of range");
+	if (length < 0 || memchr(chunk, '\0', length) != NULL) {
+		printf("Invalid text");
 		abort();
 	}
 
-	if (pos1 > tb->nlines-1 || pos2 > tb->nlines-1) {
-		printf("Positions out of range");
-		abort();
+	const char *end = chunk + length;
+	const char *start = chunk;
+	const char *newline = memchr(start, '\n', end - start);
+	textBuilder *partial = tb->stream;
+	long nlines = tb->nlines;
+	pthread_mutex_lock(&storage_lock);
+
+	//Case 2: The chunk ends a line begun by earlier ones
+	if (newline != NULL && partial->length != 0) {
+		append_text(partial, start, newline - start);
+		append_line(tb, partial->text, partial->length);
+		set_lines(tb, tb->nlines + 1);
+		partial->length = 0;
+		start = newline + 1;
+		newline = memchr(start, '\n', end - start);
 	}
 
-	//Case 2: Empty/null prefix
-	if (strcmp(prefix, "") == 0) {
-		return;
+	//Case 3: Whole lines, straight from the chunk
+	while (newline != NULL) {
+		append_line(tb, start, newline - start);
+		set_lines(tb, tb->nlines + 1);
+		start = newline + 1;
+		newline = memchr(start, '\n', end - start);
 	}
-	if (prefix == NULL) {
-		printf("Invalid positions");
-		abort();
+	pthread_mutex_unlock(&storage_lock);
+	hashes_insert(tb, nlines, tb->nlines - nlines);
+	//A line index, once there, is what scans walk, so it takes the new
+	//lines straight away
+	if (tb->index != NULL) {
+		sync_index(tb);
 	}
 
-	//Case 3: Empty TB
-	if (tb->nlines == 0) {
-		return;
+	//Case 4: The start of a line for a later chunk to end
+	if (start != end) {
+		append_text(partial, start, end - start);
 	}
+}
 
-	//Case 4: Normal scenario
-	TBNode curr = tb->first;
-	int position = 0;
-	int prefix_length = strlen(prefix);
-	while (curr != NULL) {
-		if ((position >= pos1) && (position <= pos2)) {
-			int length = strlen(curr->line) + prefix_length + 2;
-			char *new_line = malloc(sizeof(char) * length);
-			new_line[0] = '\0';
-			new_line = strcat(new_line, prefix);
-			new_line = strcat(new_line, curr->line);
-			free(curr->line);
-			curr->line = new_line;
-		}
-		position++;
-		curr = curr->next;
-	}
+/* End the text fed to a textbuffer from newStreamTB(), whose last line need
+ * not end in a newline. 'tb' is then like one from newTB(), and can't be fed
+ * any more.
+ */
+void finishTB (TB tb) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	write_lock(tb);
+	finish_tb(tb);
+	unlock_tb(tb);
+	trace_end(&call, TRACE_FINISH);
 }
 
-/* Merge 'tb2' into 'tb1' at line 'pos'.
- *
- * - Afterwards line 0 of 'tb2' will be line 'pos' of 'tb1'.
- * - The old line 'pos' of 'tb1' will follow after the last line of 'tb2'.
- * - After this operation 'tb2' can not be used anymore (as if we had used
- *   releaseTB() on it).
- * - The program is to abort() with an error message if 'pos' is out of range.
+/* 
+ * Does the work of finishTB, with the buffer already locked
  */
-void mergeTB (TB tb1, int pos, TB tb2){
+static void finish_tb(TB tb) {
 
-	//Case 1: Merging with self
-	if (tb1 == tb2) {
-		return;
+	if (tb->stream == NULL) {
+		printf("Not a stream");
+		abort();
+	}
+	textBuilder *partial = tb->stream;
+	if (partial->length != 0) {
+		pthread_mutex_lock(&storage_lock);
+		append_line(tb, partial->text, partial->length);
+		set_lines(tb, tb->nlines + 1);
+		pthread_mutex_unlock(&storage_lock);
+		hashes_insert(tb, tb->nlines - 1, 1);
+		if (tb->index != NULL) {
+			sync_index(tb);
+		}
 	}
+	free(partial->text);
+	tb_free(partial);
+	tb->stream = NULL;
+}
 
-	//Case 2: Tb2 is empty
-	if (tb2->nlines == 0) {
-		free(tb2);
-		return;
+/* Allocates a copy of a textbufferNode, reusing its hash, and sharing its line
+ * if that line is interned
+ */
+static TBNode copyTBNode(TBNode node) {
+
+	TBNode newL = alloc_node(FALSE);
+	if (node->interned) {
+		newL->line = intern_line(node_line(node), node->hash);
+		newL->length = node->length;
+		newL->interned = TRUE;
+	} else {
+		store_line(newL, node_line(node), node->length);
 	}
+	newL->hash = node->hash;
+	newL->next = NULL;
+	newL->prev = NULL;
+	return newL;
+}
 
-	//Case 3: pos is out of range
-	if (pos > tb1->nlines||pos < 0) {
-		printf("Positions out of range");
-		abort();
+/* 
+ * Hands out a node from the current block. Once that is used up, a block with
+ * plenty of free nodes is reused, or a new block is started if 'contiguous'
+ * asks for nodes that follow one another in memory.
+ */
+static TBNode alloc_node(int contiguous) {
+
+	nodeBlock *block = blocks.current;
+	int used_up = TRUE;
+	if (block != NULL && contiguous) {
+		used_up = block->fresh == NODE_BLOCK;
+	} else if (block != NULL) {
+		used_up = block->free == NULL && block->fresh == NODE_BLOCK;
 	}
-	
-	//Case 4: Tb1 is empty
-	if (tb1->nlines == 0) {
-		//Only possible position is zero
-		//Replace first
-		tb1->first = tb2->first;
-		tb1->last = tb2->last;
-		tb1->nlines = tb2->nlines;
-		free(tb2);
-		return;
+	if (used_up) {
+		if (block != NULL) {
+			retire_block(block);
+		}
+		if (!contiguous && blocks.partial != NULL) {
+			block = blocks.partial;
+			unlink_block(block);
+		} else {
+			block = alloc_block();
+		}
+		blocks.current = block;
 	}
 
-	//Case 5: pos is zero
-	if (pos == 0) {
-		//First retain tb1->first;
-		TBNode tb1first = tb1->first;
-		//Then link the end of tb2 to tb1->first
-		tb2->last->next = tb1first;
-		tb1->first = tb2->first;
-		tb1first->prev = tb2->last;
-		tb1->nlines = tb1->nlines + tb2->nlines;
-		free(tb2);
-		return;
+	TBNode node;
+	if (block->free != NULL && !contiguous) {
+		node = block->free;
+		block->free = node->next;
+	} else {
+		node = &block->nodes[block->fresh++];
 	}
+	block->used++;
+	return node;
+}
 
-	//Case 6: pos is nlines
-	if (pos == tb1->nlines) {
-		tb1->last->next = tb2->first;
-		tb2->first->prev = tb1->last;
-		tb1->last = tb2->last;
-		tb1->nlines = tb1->nlines + tb2->nlines;
-		free(tb2);
-		return;
-	}
+/* 
+ * Allocates an empty block aligned to its own size. An allocator set by
+ * setAllocatorTB can't be asked for that, so unless what it hands out
+ * happens to be aligned, twice the room is taken and the block is placed
+ * inside it.
+ */
+static nodeBlock *alloc_block(void) {
 
-	//Case 7: pos is in middle
-	TBNode prev_link = tb1->first;
-	TBNode after_link = tb1->last;
-	TBNode curr = tb1->first;
-	int line_num = 0;
-	while(curr != NULL) {
-		if (line_num == pos) {
-			prev_link = curr->prev;
-			after_link = curr;
-		} 	
-		line_num++;
-		curr = curr->next;
+	nodeBlock *block;
+	if (allocator.allocate == NULL) {
+		block = aligned_alloc(NODE_BLOCK_BYTES, NODE_BLOCK_BYTES);
+		if (block == NULL) {
+			out_of_memory();
+		}
+		__atomic_fetch_add(&allocator.live, 1, __ATOMIC_RELAXED);
+		COUNT(allocations, 1);
+		block->raw = block;
+	} else {
+		void *raw = tb_alloc(NODE_BLOCK_BYTES);
+		if (((uintptr_t) raw & (NODE_BLOCK_BYTES - 1)) != 0) {
+			tb_free(raw);
+			raw = tb_alloc(2 * NODE_BLOCK_BYTES);
+		}
+		uintptr_t start = ((uintptr_t) raw + NODE_BLOCK_BYTES - 1) & ~(uintptr_t) (NODE_BLOCK_BYTES - 1);
+		block = (nodeBlock *) start;
+		block->raw = raw;
 	}
-	prev_link->next = tb2->first;
-	tb2->first->prev = prev_link;
-	tb2->last->next = after_link;
-	after_link->prev = tb2->last;
-	tb1->nlines = tb1->nlines + tb2->nlines;
-	free(tb2);
-	return;
+	block->partial = FALSE;
+	block->free = NULL;
+	block->fresh = 0;
+	block->used = 0;
+	return block;
 }
 
-/* Copy 'tb2' into 'tb1' at line 'pos'.
- *
- * - Afterwards line 0 of 'tb2' will be line 'pos' of 'tb1'.
- * - The old line 'pos' of 'tb1' will follow after the last line of 'tb2'.
- * - After this operation 'tb2' is unmodified and remains usable independent
- *   of 'tb1'.
- * - The program is to abort() with an error message if 'pos' is out of range.
+/* 
+ * Allocates memory the library frees itself, from the allocator set by
+ * setAllocatorTB
  */
-void pasteTB (TB tb1, int pos, TB tb2) {
+static void *tb_alloc(size_t size) {
 
-	//Case 1: Merging with self
-	if (tb1 == tb2) {
-		return;
+	void *ptr;
+	if (allocator.allocate == NULL) {
+		ptr = malloc(size);
+	} else {
+		ptr = allocator.allocate(size, allocator.ctx);
 	}
-
-	//Case 2: Tb2 is empty
-	if (tb2->nlines == 0) {
-		return;
+	if (ptr == NULL) {
+		out_of_memory();
 	}
+	__atomic_fetch_add(&allocator.live, 1, __ATOMIC_RELAXED);
+	COUNT(allocations, 1);
+	return ptr;
+}
 
-	//Case 3: pos is out of range
-	if ((pos > tb1->nlines) || (pos < 0)) {
-		printf("Positions out of range");
-		abort();
-	}
+static void *tb_realloc(void *ptr, size_t size) {
 
-	//Recreate TB2
-	TBNode first = newTBNode(tb2->first->line);
-	TBNode new_curr = first;
-	new_curr->prev = NULL;
-	new_curr->next = NULL;
-	TBNode tb2curr = tb2->first->next;
-	while(tb2curr != NULL) {
-		new_curr->next = newTBNode(tb2curr->line);
-		new_curr->next->prev = new_curr;
-		new_curr->next->next = NULL;
-		new_curr = new_curr->next;
-		tb2curr = tb2curr->next;
+	if (ptr == NULL) {
+		return tb_alloc(size);
+	}
+	void *moved;
+	if (allocator.reallocate == NULL) {
+		moved = realloc(ptr, size);
+	} else {
+		moved = allocator.reallocate(ptr, size, allocator.ctx);
 	}
+	if (moved == NULL) {
+		out_of_memory();
+	}
+	COUNT(allocations, 1);
+	return moved;
+}
 
-	//Case 4: Tb1 is empty
-	if (tb1->nlines == 0) {
-		tb1->first = tb2->first;
-		tb1->last = tb2->last;
-		tb1->nlines = tb2->nlines;
+static void tb_free(void *ptr) {
 
-		tb2->first = first;
-		tb2->last = new_curr;
+	if (ptr == NULL) {
 		return;
 	}
+	__atomic_fetch_sub(&allocator.live, 1, __ATOMIC_RELAXED);
+	if (allocator.deallocate == NULL) {
+		free(ptr);
+	} else {
+		allocator.deallocate(ptr, allocator.ctx);
+	}
+}
 
-	//Case 5: pos is zero
-	if (pos == 0) {
-		TBNode tb1first = tb1->first;
-		tb2->last->next = tb1first;
-		tb1->first = tb2->first;
-		tb1first->prev = tb2->last;
-		tb1->nlines = tb1->nlines + tb2->nlines;
-		tb2->first = first;
-		tb2->last = new_curr;
+/* 
+ * Allocates memory to hand back to the caller, who frees it with free()
+ */
+static void *result_alloc(size_t size) {
+
+	void *ptr = malloc(size);
+	if (ptr == NULL) {
+		out_of_memory();
+	}
+	COUNT(allocations, 1);
+	return ptr;
+}
+
+static void out_of_memory(void) {
+
+	printf("Out of memory");
+	abort();
+}
+
+/* 
+ * Gives a node back to its block, freeing the block once it is empty
+ */
+static void free_node(TBNode node) {
+
+	nodeBlock *block = (nodeBlock *) ((uintptr_t) node & ~(uintptr_t) (NODE_BLOCK_BYTES - 1));
+	node->next = block->free;
+	block->free = node;
+	block->used--;
+	if (block == blocks.current) {
 		return;
 	}
+	if (block->used == 0) {
+		if (block->partial) {
+			unlink_block(block);
+		}
+		tb_free(block->raw);
+	} else if (!block->partial && NODE_BLOCK - block->used >= NODE_BLOCK / 4) {
+		block->partial = TRUE;
+		block->prev = NULL;
+		block->next = blocks.partial;
+		if (blocks.partial != NULL) {
+			blocks.partial->prev = block;
+		}
+		blocks.partial = block;
+	}
+}
 
-	//Case 6: pos is nlines
-	if (pos == tb1->nlines) {
-		tb1->last->next = tb2->first;
-		tb2->first->prev = tb1->last;
-		tb1->last = tb2->last;
-		tb1->nlines = tb1->nlines + tb2->nlines;
+/* 
+ * Stops allocating from 'block', keeping it for reuse if it has room
+ */
+static void retire_block(nodeBlock *block) {
 
-		tb2->first = first;
-		tb2->last = new_curr;
+	blocks.current = NULL;
+	shelve_block(block);
+}
+
+/* 
+ * Frees a block no longer being allocated from if it is empty, or lists
+ * it for reuse if it has room
+ */
+static void shelve_block(nodeBlock *block) {
+
+	if (block->used == 0) {
+		tb_free(block->raw);
+	} else if (NODE_BLOCK - block->used >= NODE_BLOCK / 4) {
+		block->partial = TRUE;
+		block->prev = NULL;
+		block->next = blocks.partial;
+		if (blocks.partial != NULL) {
+			blocks.partial->prev = block;
+		}
+		blocks.partial = block;
+	}
+}
+
+/* 
+ * Takes a block off the list of blocks with room
+ */
+static void unlink_block(nodeBlock *block) {
+
+	if (block->prev != NULL) {
+		block->prev->next = block->next;
+	} else {
+		blocks.partial = block->next;
+	}
+	if (block->next != NULL) {
+		block->next->prev = block->prev;
+	}
+	block->partial = FALSE;
+}
+
+/* Move the lines of 'tb' into fresh, contiguous blocks of nodes, in order.
+ *
+ * - After many edits the nodes of a buffer end up scattered over many
+ *   blocks; compacting makes full scans walk memory sequentially again.
+ * - Nothing compacts a buffer on its own, and edits after this scatter it
+ *   again. bench_textbuffer times searchTB and dumpTB before and after.
+ */
+void compactTB (TB tb) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	load_mapped(tb);
+	write_lock(tb);
+	pthread_mutex_lock(&storage_lock);
+	//Start from an empty block
+	if (blocks.current != NULL) {
+		retire_block(blocks.current);
+	}
+	TBNode old = tb->first;
+	TBNode curr = tb->first;
+	TBNode first = NULL;
+	TBNode prev = NULL;
+	//Hash blocks keep their hashes, pointed at their new first nodes, and
+	//the line index its chunks, pointed at the new nodes
+	long line = 0;
+	long block = 0;
+	long boundary = 0;
+	indexChunk *chunk = tb->index == NULL ? NULL : first_chunk(tb->index->root);
+	int at = 0;
+	while (curr != NULL) {
+		TBNode next = curr->next;
+		TBNode node = alloc_node(TRUE);
+		*node = *curr;
+		COUNT(nodes, 1);
+		COUNT(bytes, sizeof(struct textbufferNode));
+		if (tb->hashes != NULL && line == boundary && block < tb->hashes->nblocks) {
+			tb->hashes->blocks[block].first = node;
+			boundary = boundary + tb->hashes->blocks[block].count;
+			block++;
+		}
+		if (chunk != NULL) {
+			chunk->nodes[at++] = node;
+			if (at == chunk->count) {
+				chunk = chunk->next;
+				at = 0;
+			}
+		}
+		line++;
+		if (curr->line == curr->small) {
+			node->line = node->small;
+		}
+		node->prev = prev;
+		node->next = NULL;
+		if (prev == NULL) {
+			first = node;
+		} else {
+			prev->next = node;
+		}
+		prev = node;
+		//Readers may still be walking the old nodes
+		if (!tb->snapshot) {
+			free_node(curr);
+		}
+		curr = next;
+	}
+	publish(&tb->first, first);
+	tb->last = prev;
+	pthread_mutex_unlock(&storage_lock);
+	if (tb->snapshot && old != NULL) {
+		retire(RETIRED_SHELLS, old, tb->nlines);
+	}
+	unlock_tb(tb);
+	trace_end(&call, TRACE_COMPACT);
+}
+
+/* Keep the lines of 'tb' in an unrolled list as well as the list of nodes:
+ * chunks of up to 256 nodes and line lengths, in arrays linked in order.
+ *
+ * - While on, dumpTB, searchTB, searchFlagsTB, validateUtf8TB and
+ *   formRichText walk the arrays, fetching nodes a few lines ahead, rather
+ *   than following one pointer per line through memory. Reads of a buffer
+ *   with snapshot reads on still walk the nodes.
+ * - Turning it on builds the chunks in O(n). Every edit then keeps them up
+ *   to date in O(log n), plus the lines it inserts or removes, splitting
+ *   chunks where lines go in or come out and merging chunks left small.
+ * - The chunks are the index lineAtOffsetTB and offsetOfLineTB look offsets
+ *   up in, so the first of those turns this on as well. Turning it off frees
+ *   the chunks, for the next lookup to build again.
+ */
+void setUnrolledTB (TB tb, int unrolled) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	load_mapped(tb);
+	write_lock(tb);
+	if (unrolled) {
+		sync_index(tb);
+	} else if (tb->index != NULL) {
+		free_chunks(tb->index, tb->index->root);
+		tb_free(tb->index);
+		tb->index = NULL;
+	}
+	unlock_tb(tb);
+	trace_end(&call, TRACE_UNROLLED, unrolled);
+}
+
+/* Free the memory occupied by the given textbuffer.  It is an error to access
+ * the buffer afterwards.
+ */
+void releaseTB (TB tb) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	release_tb(tb);
+	trace_end(&call, TRACE_RELEASE);
+}
+
+/* 
+ * Does the work of releaseTB
+ */
+static void release_tb(TB tb) {
+
+	if (tb->snapshot) {
+		if (tb->first != NULL) {
+			retire(RETIRED_NODES, tb->first, tb->nlines);
+		}
+		drop_tb(tb);
+		reclaim_retired();
 		return;
 	}
+	if (tb->first != NULL) {
+		discard_nodes(tb, tb->first, tb->nlines);
+	}
+	free_tb(tb);
+}
 
-	//Case 7: pos is in middle
-	TBNode prev_link = tb1->first;
-	TBNode after_link = tb1->last;
-	TBNode curr = tb1->first;
-	int line_num = 0;
-	while(curr != NULL) {
-		if (line_num == pos) {
-			prev_link = curr->prev;
-			after_link = curr;
-		} 	
-		line_num++;
-		curr = curr->next;
+/*
+ * Frees a textbuffer header, or retires it if it has snapshot readers
+ */
+static void drop_tb(TB tb) {
+
+	end_watches(tb);
+	if (tb->snapshot) {
+		retire(RETIRED_TB, tb, 0);
+	} else {
+		free_tb(tb);
 	}
-	prev_link->next = tb2->first;
-	tb2->first->prev = prev_link;
-	tb2->last->next = after_link;
-	after_link->prev = tb2->last;
-	tb1->nlines = tb1->nlines + tb2->nlines;
-	tb2->first = first;
-	tb2->last = new_curr;
-	return;
 }
 
-/* Cut the lines between and including 'from' and 'to' out of the textbuffer
- * 'tb'.
+/* 
+ * Frees a textbuffer header and anything attached to it, but not its lines
+ */
+static void free_tb(TB tb) {
+
+	if (tb->threadSafe) {
+		pthread_rwlock_destroy(&tb->lock);
+	}
+	if (tb->history != NULL) {
+		free_history(tb->history);
+	}
+	if (tb->mapped != NULL) {
+		unmap_lines(tb->mapped);
+	}
+	if (tb->journal != NULL) {
+		close_journal(tb);
+	}
+	if (tb->stream != NULL) {
+		free(tb->stream->text);
+		tb_free(tb->stream);
+	}
+	if (tb->index != NULL) {
+		free_chunks(tb->index, tb->index->root);
+		tb_free(tb->index);
+	}
+	free_hashes(tb);
+	end_watches(tb);
+#ifdef TB_STATS
+	if (tb->stats != NULL) {
+		for (int op = 0; op < TRACE_OPS; op++) {
+			free(tb->stats->ops[op]);
+		}
+		free(tb->stats);
+	}
+#endif
+	tb_free(tb);
+}
+
+/* Make every operation on 'tb' take its lock, or stop doing so.
  *
- * - The result is a new textbuffer (much as one created with newTB()).
- * - The cut lines will be deleted from 'tb'.
- * - The program is to abort() with an error message if 'from' or 'to' is out
- *   of range.
+ * - While on, operations that only read 'tb' (linesTB, dumpTB, searchTB,
+ *   diffTB, ...) may run at the same time from any number of threads, and
+ *   operations that change 'tb' run on their own.
+ * - This must be set before 'tb' is shared between threads.
  */
-TB cutTB (TB tb, int from, int to){
+void setThreadSafeTB (TB tb, int threadSafe) {
 
-	//Case 1: tb is empty
-	if (tb->nlines == 0) {
-		return NULL;
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	set_thread_safe(tb, threadSafe);
+	trace_end(&call, TRACE_THREAD_SAFE, threadSafe);
+}
+
+/* 
+ * Does the work of setThreadSafeTB
+ */
+static void set_thread_safe(TB tb, int threadSafe) {
+
+	if (threadSafe && !tb->threadSafe) {
+		pthread_rwlockattr_t attr;
+		pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+		//Don't let a steady stream of readers starve writers
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+		pthread_rwlock_init(&tb->lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+	} else if (!threadSafe && tb->threadSafe) {
+		pthread_rwlock_destroy(&tb->lock);
+		tb->snapshot = FALSE;
 	}
+	tb->threadSafe = threadSafe;
+}
 
-	//Case 2: to is larger than from
-	if (to < from) {
-		return NULL;
+/* Let linesTB, dumpTB and searchTB read 'tb' without taking its lock.
+ *
+ * - Each read sees the whole buffer as it was between two edits. Every edit
+ *   bumps a version number, and a read started during an edit, or overtaken
+ *   by one, is thrown away and started over.
+ * - Readers can still hold writers up. A read that starts while an edit is
+ *   under way, or has been overtaken SNAPSHOT_TRIES times, takes the lock to
+ *   finish, so heavy editing can't starve it, and the edits queued behind it
+ *   wait until it is done. Only reads that run between edits leave writers
+ *   alone.
+ * - Lines and nodes an edit takes out are retired, and only freed once every
+ *   read that started before the edit has finished.
+ * - Also makes 'tb' thread safe; edits and the other reads still take the
+ *   lock. This must be set before 'tb' is shared between threads.
+ */
+void setSnapshotReadsTB (TB tb, int snapshot) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	load_mapped(tb);
+	if (snapshot) {
+		set_thread_safe(tb, TRUE);
+	}
+	tb->snapshot = snapshot;
+	trace_end(&call, TRACE_SNAPSHOT, snapshot);
+}
+
+/* 
+ * Locks 'tb' for reading, if it is thread safe
+ */
+static void read_lock(TB tb) {
+
+	if (tb->threadSafe) {
+		pthread_rwlock_rdlock(&tb->lock);
 	}
+}
 
-	//Case 3: If to or from is out of range
-	if (from < 0 || to < 0) {
-		printf("Positions out of range");
-		abort();
+/* 
+ * Locks 'tb' for writing, if it is thread safe
+ */
+static void write_lock(TB tb) {
+
+	if (tb->threadSafe) {
+		pthread_rwlock_wrlock(&tb->lock);
 	}
-	if (from > tb->nlines-1 || to > tb->nlines-1) {
-		printf("Positions out of range");
-		abort();
+	if (tb->snapshot) {
+		//Readers without the lock must see this before any change
+		__atomic_store_n(&tb->version, tb->version + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
 	}
+}
 
-	TB tb2 = malloc(sizeof(textbuffer));
-	assert(tb2!= NULL);
-	tb2->first = NULL;
-	tb2->last = NULL;
-	tb2->nlines = to - from + 1;
+static void unlock_tb(TB tb) {
 
-	//Case 4: Deleting first node
-	if ((from == 0) && (to != tb->nlines - 1)) {
+	//Only the writer holding the lock can see the version odd
+	if (tb->snapshot && tb->version % 2 == 1) {
+		__atomic_store_n(&tb->version, tb->version + 1, __ATOMIC_RELEASE);
+	}
+	if (tb->threadSafe) {
+		pthread_rwlock_unlock(&tb->lock);
+	}
+	if (tb->snapshot) {
+		reclaim_retired();
+	}
+}
 
-		TBNode first = tb->first;
-		TBNode last = tb->first;
-		int line_num = 0; 
-		while (line_num != to) {
-			last = last->next;
-			line_num++;
+/* 
+ * Locks two buffers, always in the same order so that two threads locking
+ * the same pair can't deadlock. A buffer passed twice is locked once.
+ */
+static void lock_pair(TB tb1, int write1, TB tb2, int write2) {
+
+	if (tb1 == tb2) {
+		if (write1 || write2) {
+			write_lock(tb1);
+		} else {
+			read_lock(tb1);
 		}
-		tb->first = last->next;
-		last->next->prev = NULL;
-		tb2->first = first;
-		tb2->last = last;
-		last->next = NULL;
-		tb->nlines = tb->nlines - (tb2->nlines);
-		return tb2;
+		return;
+	}
+	if ((uintptr_t) tb1 > (uintptr_t) tb2) {
+		TB tb = tb1;
+		tb1 = tb2;
+		tb2 = tb;
+		int write = write1;
+		write1 = write2;
+		write2 = write;
+	}
+	if (write1) {
+		write_lock(tb1);
+	} else {
+		read_lock(tb1);
 	}
+	if (write2) {
+		write_lock(tb2);
+	} else {
+		read_lock(tb2);
+	}
+}
 
-	//Case 5: Deleting last node
-	if ((from != 0) && (to == tb->nlines - 1)) {
-		TBNode first = tb->first;
-		TBNode last = tb->last;
-		int line_num = 0; 
-		while (line_num!= from) {
-			first = first->next;
-			line_num++;
-		}
-		tb->last = first->prev;
-		first->prev->next = NULL;
-		tb2->first = first;
-		tb2->last = last;
-		first->prev = NULL;
-		tb->nlines = tb->nlines - (tb2->nlines);
-		return tb2;
+static void unlock_pair(TB tb1, TB tb2) {
 
+	unlock_tb(tb1);
+	if (tb1 != tb2) {
+		unlock_tb(tb2);
 	}
+}
 
-	//Case 6: moving whole text
-	if ((from == 0) && (to == tb->nlines - 1)) {
-		tb2->first = tb->first;
-		tb2->last = tb->last;
-		tb->last = NULL;
-		tb->first = NULL;
-		tb->nlines = tb->nlines - (tb2->nlines);
-		return tb2;
+/*
+ * Points 'link' at 'node' once everything written to 'node' so far is
+ * visible, for readers that don't take the lock
+ */
+static void publish(TBNode *link, TBNode node) {
+	__atomic_store_n(link, node, __ATOMIC_RELEASE);
+}
+
+/*
+ * Sets the line count of 'tb', which snapshot readers read without the lock
+ */
+static void set_lines(TB tb, long nlines) {
+	__atomic_store_n(&tb->nlines, nlines, __ATOMIC_RELAXED);
+}
+
+static TBNode first_node(TB tb) {
+	return __atomic_load_n(&tb->first, __ATOMIC_ACQUIRE);
+}
+
+static TBNode next_node(TBNode node) {
+	return __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Announces that this thread is starting a read of a snapshot buffer.
+ * Nothing retired from now on is freed until the matching exit_epoch().
+ */
+static readerSlot *enter_epoch(void) {
+
+	readerSlot *slot = tb_alloc(sizeof(readerSlot));
+	//Reclaiming reads the slots with retire_lock held, so the read is seen
+	//by every reclaim from here on, and the epoch is one no item already
+	//reclaimable was retired in
+	pthread_mutex_lock(&retire_lock);
+	slot->epoch = __atomic_load_n(&snapshots.epoch, __ATOMIC_RELAXED);
+	slot->prev = NULL;
+	slot->next = snapshots.readers;
+	if (snapshots.readers != NULL) {
+		snapshots.readers->prev = slot;
 	}
+	snapshots.readers = slot;
+	pthread_mutex_unlock(&retire_lock);
+	return slot;
+}
 
-	//Case 6: Deleting normally
-	TBNode first = tb->first;
-	TBNode last = tb->last;
-	TBNode curr = tb->first;
-	int line_num = 0; 
-	while (curr != NULL) {
-		if (line_num == from) {
-			first = curr;
-		} 
-		if (line_num == to) {
-			last = curr;
+/*
+ * Ends a read started by enter_epoch(), freeing whatever is no longer seen
+ */
+static void exit_epoch(readerSlot *slot) {
+
+	pthread_mutex_lock(&retire_lock);
+	if (slot->prev == NULL) {
+		snapshots.readers = slot->next;
+	} else {
+		slot->prev->next = slot->next;
+	}
+	if (slot->next != NULL) {
+		slot->next->prev = slot->prev;
+	}
+	pthread_mutex_unlock(&retire_lock);
+	tb_free(slot);
+	if (__atomic_load_n(&snapshots.first, __ATOMIC_RELAXED) != NULL) {
+		reclaim_retired();
+	}
+}
+
+/* 
+ * Starts a read of snapshot buffer 'tb' inside an epoch, noting its version.
+ * Returns FALSE if an edit is under way, so the read would be wasted.
+ */
+static int begin_snapshot(TB tb, unsigned long *version) {
+
+	*version = __atomic_load_n(&tb->version, __ATOMIC_ACQUIRE);
+	return *version % 2 == 0;
+}
+
+/* 
+ * TRUE if no edit has started on 'tb' since begin_snapshot() gave 'version',
+ * so everything read in between came from one version of the buffer
+ */
+static int end_snapshot(TB tb, unsigned long version) {
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&tb->version, __ATOMIC_RELAXED) == version;
+}
+
+/*
+ * Queues 'item' to be freed once no read that started before now is left
+ */
+static void retire(int kind, void *item, long count) {
+
+	retiredItem *retired = tb_alloc(sizeof(retiredItem));
+	retired->next = NULL;
+	retired->kind = kind;
+	retired->item = item;
+	retired->count = count;
+	pthread_mutex_lock(&retire_lock);
+	retired->epoch = __atomic_load_n(&snapshots.epoch, __ATOMIC_SEQ_CST);
+	if (snapshots.last == NULL) {
+		__atomic_store_n(&snapshots.first, retired, __ATOMIC_RELAXED);
+	} else {
+		snapshots.last->next = retired;
+	}
+	snapshots.last = retired;
+	pthread_mutex_unlock(&retire_lock);
+}
+
+/*
+ * Retires the line of 'node', unless it lives inside the node
+ */
+static void retire_line(TBNode node) {
+
+	if (node->line != node->small) {
+		retire(RETIRED_LINE, node->line, node->interned);
+	}
+}
+
+/*
+ * Frees every retired item that no running read can still see. Skipped if
+ * another thread is already doing so.
+ */
+static void reclaim_retired(void) {
+
+	if (pthread_mutex_trylock(&retire_lock) != 0) {
+		return;
+	}
+	//Reads that start from here on can't see anything retired so far
+	unsigned long epoch = __atomic_fetch_add(&snapshots.epoch, 1, __ATOMIC_SEQ_CST);
+	unsigned long oldest = epoch + 1;
+	for (readerSlot *slot = snapshots.readers; slot != NULL; slot = slot->next) {
+		if (slot->epoch < oldest) {
+			oldest = slot->epoch;
 		}
-		line_num++;
+	}
+	retiredItem *done = snapshots.first;
+	retiredItem *last = NULL;
+	retiredItem *curr = snapshots.first;
+	while (curr != NULL && curr->epoch < oldest) {
+		last = curr;
 		curr = curr->next;
 	}
-	first->prev->next = last->next;
-	last->next->prev = first->prev;
-	first->prev = NULL;
+	if (last == NULL) {
+		pthread_mutex_unlock(&retire_lock);
+		return;
+	}
 	last->next = NULL;
-	tb2->first = first;
+	__atomic_store_n(&snapshots.first, curr, __ATOMIC_RELAXED);
+	if (curr == NULL) {
+		snapshots.last = NULL;
+	}
+	pthread_mutex_unlock(&retire_lock);
+
+	while (done != NULL) {
+		retiredItem *next = done->next;
+		if (done->kind == RETIRED_TB) {
+			free_tb(done->item);
+		} else {
+			pthread_mutex_lock(&storage_lock);
+			if (done->kind == RETIRED_LINE && done->count) {
+				unintern_line(done->item);
+			} else if (done->kind == RETIRED_LINE) {
+				tb_free(done->item);
+			} else {
+				TBNode node = done->item;
+				for (long i = 0; i < done->count; i++) {
+					TBNode following = node->next;
+					if (done->kind == RETIRED_NODES) {
+						release_line(node);
+					}
+					free_node(node);
+					node = following;
+				}
+			}
+			pthread_mutex_unlock(&storage_lock);
+		}
+		tb_free(done);
+		done = next;
+	}
+}
+
+/*
+ * Hands 'count' nodes starting from 'first' to the background thread if
+ * frees are deferred. Returns FALSE, queueing nothing, if they aren't, or if
+ * the thread has fallen so far behind that the caller should free its own.
+ */
+static int defer_nodes(TBNode first, long count) {
+
+	if (!__atomic_load_n(&deferred.enabled, __ATOMIC_ACQUIRE)) {
+		return FALSE;
+	}
+	//Never more than the caller's own lines are freed in the call
+	if (__atomic_load_n(&deferred.pending, __ATOMIC_RELAXED) > DEFERRED_LIMIT) {
+		return FALSE;
+	}
+	retiredItem *item = tb_alloc(sizeof(retiredItem));
+	item->epoch = 0;
+	item->kind = RETIRED_NODES;
+	item->item = first;
+	item->count = count;
+	__atomic_fetch_add(&deferred.pending, count, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&deferred.queued, 1, __ATOMIC_SEQ_CST);
+	retiredItem *head = __atomic_load_n(&deferred.queue, __ATOMIC_RELAXED);
+	do {
+		item->next = head;
+	} while (!__atomic_compare_exchange_n(&deferred.queue, &head, item, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (head == NULL) {
+		//The background thread only sleeps once it has found the queue empty
+		pthread_mutex_lock(&deferred.lock);
+		pthread_cond_signal(&deferred.wake);
+		pthread_mutex_unlock(&deferred.lock);
+	}
+	return TRUE;
+}
+
+/*
+ * Body of the background thread, which frees whatever is queued and then
+ * sleeps until more is
+ */
+static void *reclaim_deferred(void *arg) {
+
+	(void) arg;
+	while (TRUE) {
+		pthread_mutex_lock(&deferred.lock);
+		while (__atomic_load_n(&deferred.queue, __ATOMIC_ACQUIRE) == NULL) {
+			pthread_cond_wait(&deferred.wake, &deferred.lock);
+		}
+		pthread_mutex_unlock(&deferred.lock);
+		free_deferred(__atomic_exchange_n(&deferred.queue, NULL, __ATOMIC_ACQUIRE));
+	}
+	return NULL;
+}
+
+/*
+ * Frees the nodes of every item in 'items', and the items, then tells any
+ * drainFreesTB() waiting how many are done
+ */
+static void free_deferred(retiredItem *items) {
+
+	unsigned long nitems = 0;
+	while (items != NULL) {
+		retiredItem *next = items->next;
+		TBNode node = items->item;
+		long count = items->count;
+		long nodes = 0;
+		while (node != NULL && nodes != count) {
+			pthread_mutex_lock(&storage_lock);
+			for (long i = 0; i < DEFERRED_SLICE && node != NULL && nodes != count; i++) {
+				TBNode following = node->next;
+				release_line(node);
+				free_node(node);
+				node = following;
+				nodes++;
+			}
+			pthread_mutex_unlock(&storage_lock);
+		}
+		__atomic_fetch_sub(&deferred.pending, count, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&deferred.lines, nodes, __ATOMIC_RELAXED);
+		tb_free(items);
+		items = next;
+		nitems++;
+	}
+	if (nitems > 0) {
+		pthread_mutex_lock(&deferred.lock);
+		__atomic_store_n(&deferred.freed, deferred.freed + nitems, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&deferred.done);
+		pthread_mutex_unlock(&deferred.lock);
+	}
+}
+
+/* Free the lines that releaseTB, deleteTB and every other call that drops
+ * lines let go of on a background thread, so that the call returns without
+ * waiting for them, or go back to freeing them in the call.
+ *
+ * - Once the thread has fallen more than DEFERRED_LIMIT lines behind, each
+ *   call frees its own lines rather than queueing them, so memory waiting to
+ *   be freed stays bounded however busy the processors are, and no call
+ *   frees more than it let go of.
+ * - The allocator given to setAllocatorTB() must be safe to call from more
+ *   than one thread while this is on.
+ * - Turning it off waits for the lines already queued to be freed.
+ * - Returns FALSE, changing nothing, if the thread can't be started.
+ */
+int setDeferredFreesTB (int defer) {
+
+	pthread_mutex_lock(&deferred.lock);
+	if (defer && !deferred.started) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, reclaim_deferred, NULL) != 0) {
+			pthread_mutex_unlock(&deferred.lock);
+			return FALSE;
+		}
+		pthread_detach(thread);
+		deferred.started = TRUE;
+	}
+	__atomic_store_n(&deferred.enabled, defer != FALSE, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&deferred.lock);
+	if (!defer) {
+		drain_frees();
+	}
+	return TRUE;
+}
+
+/* Wait until every line queued to be freed in the background so far has
+ * been, freeing what the background thread hasn't started on in this call.
+ * Returns how many lines were freed in the background and by this call
+ * since the last drainFreesTB().
+ */
+size_t drainFreesTB (void) {
+
+	drain_frees();
+	return __atomic_exchange_n(&deferred.lines, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Waits for every item queued so far to be freed, freeing those the
+ * background thread hasn't taken
+ */
+static void drain_frees(void) {
+
+	unsigned long queued = __atomic_load_n(&deferred.queued, __ATOMIC_SEQ_CST);
+	free_deferred(__atomic_exchange_n(&deferred.queue, NULL, __ATOMIC_ACQUIRE));
+	//Items already taken by the background thread, or still being pushed
+	pthread_mutex_lock(&deferred.lock);
+	while (deferred.freed < queued) {
+		pthread_cond_wait(&deferred.done, &deferred.lock);
+	}
+	pthread_mutex_unlock(&deferred.lock);
+}
+
+/*
+ * Frees 'count' nodes starting from first, or retires them if snapshot
+ * readers of 'tb' may still be walking them
+ */
+static void discard_nodes(TB tb, TBNode first, long count) {
+
+	if (tb->snapshot) {
+		retire(RETIRED_NODES, first, count);
+		return;
+	}
+	if (defer_nodes(first, count)) {
+		return;
+	}
+	pthread_mutex_lock(&storage_lock);
+	TBNode curr = first;
+	for (long i = 0; i < count; i++) {
+		TBNode next = curr->next;
+		release_line(curr);
+		free_node(curr);
+		COUNT(nodes, 1);
+		curr = next;
+	}
+	pthread_mutex_unlock(&storage_lock);
+}
+
+/* Allocate and return an array containing the text in the given textbuffer.
+ * add a prefix corrosponding to line number iff showLineNumbers == TRUE
+ */
+char *dumpTB (TB tb, int showLineNumbers){
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	char *dump = tb->snapshot ? try_dump_snapshot(tb, showLineNumbers) : NULL;
+	if (dump == NULL) {
+		read_lock(tb);
+		dump = dump_tb(tb, showLineNumbers);
+		unlock_tb(tb);
+	}
+	trace_end(&call, TRACE_DUMP, showLineNumbers);
+	return dump;
+}
+
+/* 
+ * Does the work of dumpTB, with the buffers already locked
+ */
+static char *dump_tb(TB tb, int showLineNumbers) {
+
+	if (tb->mapped != NULL) {
+		return dump_mapped(tb, showLineNumbers);
+	}
+
+	// Case 1: TB is empty
+	if (tb->nlines == 0) {
+		char *dump = result_alloc(sizeof(char) * 2);
+		return strcpy(dump, "");
+	}
+
+	//Case 2: Normal String
+
+	//Initialization
+	long length = text_length(tb) + 1;
+	if (showLineNumbers == TRUE) {
+		//Each line gets its number followed by ". "
+		for (long num = 1; num <= tb->nlines; num++) {
+			length = length + num_places(num) + 2;
+		}
+	}
+	char *dump = result_alloc(sizeof(char) * length);
+	COUNT(bytes, length);
+
+	//Copy each line after the last, rather than strcat'ing from the start
+	long num = 1;
+	long out = 0;
+	TBNode curr = tb->first;
+	indexChunk *chunk = indexed_scan(tb);
+	int at = 0;
+	if (chunk != NULL) {
+		curr = chunk->nodes[0];
+	}
+	while (curr != NULL) {
+		if (showLineNumbers == TRUE) {
+			out = out + sprintf(dump + out, "%ld. ", num);
+			num++;
+		}
+		memcpy(dump + out, node_line(curr), curr->length);
+		out = out + curr->length;
+		dump[out++] = '\n';
+		COUNT(nodes, 1);
+		curr = chunk != NULL ? next_indexed(&chunk, &at) : curr->next;
+	}
+	dump[out] = '\0';
+	return dump;
+}
+
+/* Return the same text as dumpTB(), copied into place by 'nthreads'
+ * threads, or one per processor if 'nthreads' is 0.
+ *
+ * - The lines are first walked once to size the output, noting where every
+ *   DUMP_STRIDE'th line starts in it. The output is then cut at those lines
+ *   into a slice of about the same size for each thread, and the threads
+ *   fill their own slices of it at once.
+ * - Each thread is given at least PARALLEL_SLICE bytes. A buffer with
+ *   snapshot reads on is dumped on one thread without the lock, unless
+ *   edits keep it from finishing.
+ */
+char *dumpParallelTB (TB tb, int showLineNumbers, int nthreads) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	char *dump = tb->snapshot ? try_dump_snapshot(tb, showLineNumbers) : NULL;
+	if (dump == NULL) {
+		read_lock(tb);
+		dump = dump_parallel(tb, showLineNumbers, nthreads);
+		unlock_tb(tb);
+	}
+	trace_end(&call, TRACE_DUMP_PARALLEL, showLineNumbers, nthreads);
+	return dump;
+}
+
+/* 
+ * Does the work of dumpParallelTB, with the buffer already locked
+ */
+static char *dump_parallel(TB tb, int showLineNumbers, int nthreads) {
+
+	//Case 1: Nothing to share out
+	if (tb->mapped != NULL || tb->nlines == 0) {
+		return dump_tb(tb, showLineNumbers);
+	}
+
+	//Case 2: Size the output, noting where every DUMP_STRIDE'th line starts
+	long nmarks = (tb->nlines + DUMP_STRIDE - 1) / DUMP_STRIDE;
+	TBNode *marks = tb_alloc(sizeof(TBNode) * nmarks);
+	long *offsets = tb_alloc(sizeof(long) * (nmarks + 1));
+	long length = 0;
+	TBNode curr = tb->first;
+	for (long i = 0; i < tb->nlines; i++) {
+		if (i % DUMP_STRIDE == 0) {
+			marks[i / DUMP_STRIDE] = curr;
+			offsets[i / DUMP_STRIDE] = length;
+		}
+		length = length + curr->length + 1;
+		if (showLineNumbers == TRUE) {
+			length = length + num_places(i + 1) + 2;
+		}
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+	offsets[nmarks] = length;
+	char *dump = result_alloc(length + 1);
+	dump[length] = '\0';
+	COUNT(bytes, length + 1);
+
+	//Case 3: Give each thread the marks closest to an even share of bytes
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nthreads > length / PARALLEL_SLICE) {
+		nthreads = length / PARALLEL_SLICE;
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	dumpSlice *slices = tb_alloc(sizeof(dumpSlice) * nthreads);
+	long mark = 0;
+	for (int i = 0; i < nthreads; i++) {
+		long next = mark;
+		while (next < nmarks && (i == nthreads - 1 || offsets[next] < length / nthreads * (i + 1))) {
+			next++;
+		}
+		long from = mark * DUMP_STRIDE;
+		long to = next == nmarks ? tb->nlines : next * DUMP_STRIDE;
+		slices[i].first = mark < nmarks ? marks[mark] : NULL;
+		slices[i].number = from + 1;
+		slices[i].count = to > from ? to - from : 0;
+		slices[i].out = dump + offsets[mark];
+		slices[i].showLineNumbers = showLineNumbers;
+		mark = next;
+	}
+
+	//Case 4: Fill the slices, the first on this thread
+	for (int i = 1; i < nthreads; i++) {
+		slices[i].started = pthread_create(&slices[i].thread, NULL, dump_slice, &slices[i]) == 0;
+		if (!slices[i].started) {
+			dump_slice(&slices[i]);
+		}
+	}
+	dump_slice(&slices[0]);
+	for (int i = 1; i < nthreads; i++) {
+		if (slices[i].started) {
+			pthread_join(slices[i].thread, NULL);
+		}
+	}
+	tb_free(slices);
+	tb_free(offsets);
+	tb_free(marks);
+	return dump;
+}
+
+/* 
+ * Copies one slice of dumpParallelTB's lines into place
+ */
+static void *dump_slice(void *arg) {
+
+	dumpSlice *slice = arg;
+	char *out = slice->out;
+	TBNode curr = slice->first;
+	for (long i = 0; i < slice->count; i++) {
+		if (slice->showLineNumbers == TRUE) {
+			out = out + sprintf(out, "%ld. ", slice->number + i);
+		}
+		memcpy(out, node_line(curr), curr->length);
+		out = out + curr->length;
+		*out++ = '\n';
+		curr = curr->next;
+	}
+	return NULL;
+}
+
+/* 
+ * Dumps snapshot buffer 'tb' without the lock, starting over each time an
+ * edit overlaps the dump. Returns NULL if an edit is under way or edits keep
+ * overlapping it, for the caller to take the lock instead.
+ */
+static char *try_dump_snapshot(TB tb, int showLineNumbers) {
+
+	char *dump = NULL;
+	for (int tries = 0; dump == NULL && tries < SNAPSHOT_TRIES; tries++) {
+		readerSlot *slot = enter_epoch();
+		unsigned long version;
+		int consistent = begin_snapshot(tb, &version);
+		if (consistent) {
+			dump = dump_snapshot(tb, showLineNumbers);
+			consistent = end_snapshot(tb, version);
+			if (!consistent) {
+				free(dump);
+				dump = NULL;
+			}
+		}
+		exit_epoch(slot);
+		if (!consistent && version % 2 == 1) {
+			break;
+		}
+	}
+	return dump;
+}
+
+/* 
+ * Does the work of dumpTB without the lock. Lines may change while it runs,
+ * so each one is measured as it is copied rather than sized up front.
+ */
+static char *dump_snapshot(TB tb, int showLineNumbers) {
+
+	textBuilder dump = {NULL, 0, 0};
+	append_text(&dump, "", 0);
+	long num = 1;
+	TBNode curr = first_node(tb);
+	while (curr != NULL) {
+		if (showLineNumbers == TRUE) {
+			char number[24];
+			append_text(&dump, number, sprintf(number, "%ld. ", num));
+			num++;
+		}
+		char *line = node_line(curr);
+		append_text(&dump, line, strlen(line));
+		append_text(&dump, "\n", 1);
+		COUNT(nodes, 1);
+		curr = next_node(curr);
+	}
+	return dump.text;
+}
+
+/* 
+ * Determine length of whole string, one newline per line,
+ * to avoid reallocing. The line index, if it holds every line, has it.
+ */
+static long text_length(TB tb) {
+    
+    if (indexed_scan(tb) != NULL) {
+    	return tb->index->root->bytes;
+    }
+    TBNode curr = tb->first;
+    long length = 0;
+    while (curr != NULL) {
+    	length = length + curr->length + 1;
+    	COUNT(nodes, 1);
+    	curr = curr->next;
+    }
+    return length;
+}
+
+/* 
+ * Fastest Way to get number of digits for highest line-number
+ */
+static int num_places(long n) {
+
+    if (n < 10) {
+    	return 1;
+   	}
+    if (n < 100) {
+    	return 2;
+    }
+    if (n < 1000) {
+    	return 3;
+    }
+    if (n < 10000) {
+    	return 4;
+    }
+    if (n < 100000) {
+    	return 5;
+    }
+    if (n < 1000000) {
+    	return 6;
+    }
+    if (n < 10000000) {
+    	return 7;
+    }
+    if (n < 100000000) {
+    	return 8;
+    }
+    if (n < 1000000000) {
+    	return 9;
+    }
+    //Past an int, a loop is fast enough
+    int places = 10;
+    for (n = n / 10000000000L; n > 0; n = n / 10) {
+    	places++;
+    }
+    return places;
+}
+
+/* Return the number of lines of the given textbuffer.
+ */
+int linesTB (TB tb){
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	long nlines = lines_tb(tb);
+	if (nlines > INT_MAX) {
+		printf("Too many lines");
+		abort();
+	}
+	trace_end(&call, TRACE_LINES, (int) nlines);
+	return nlines;
+}
+
+/* Return the number of lines of the given textbuffer, however many.
+ */
+size_t linesTB64 (TB tb) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	size_t nlines = lines_tb(tb);
+	trace_end(&call, TRACE_LINES64, nlines);
+	return nlines;
+}
+
+/* 
+ * Does the work of linesTB, taking the lock unless reads are snapshots
+ */
+static long lines_tb(TB tb) {
+
+	if (tb->snapshot) {
+		return __atomic_load_n(&tb->nlines, __ATOMIC_RELAXED);
+	}
+	read_lock(tb);
+	long nlines = tb->nlines;
+	unlock_tb(tb);
+	return nlines;
+}
+
+/* Add a given prefix to all lines between pos1 and pos2
+ *
+ * - The program is to abort() with an error message if line 'pos1' or line
+ *   'pos2' is out of range.  The first line of a textbuffer is at position 0.
+ */
+void addPrefixTB (TB tb, int pos1, int pos2, char* prefix){
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	run_prefix(tb, pos1, pos2, prefix);
+	trace_end(&call, TRACE_PREFIX, pos1, pos2, prefix);
+}
+
+/* The same, for lines at any position.
+ */
+void addPrefixTB64 (TB tb, size_t pos1, size_t pos2, char *prefix) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	run_prefix(tb, pos1, pos2, prefix);
+	trace_end(&call, TRACE_PREFIX64, pos1, pos2, prefix);
+}
+
+/* 
+ * Locks 'tb' for addPrefixTB and does its work, journaling it
+ */
+static void run_prefix(TB tb, long pos1, long pos2, char *prefix) {
+
+	load_mapped(tb);
+	write_lock(tb);
+	add_prefix(tb, pos1, pos2, prefix);
+	if (tb->journal != NULL) {
+		journal_edit(tb, JOURNAL_PREFIX, pos1, pos2, prefix);
+	}
+	unlock_tb(tb);
+}
+
+/* 
+ * Does the work of addPrefixTB, with the buffers already locked
+ */
+static void add_prefix(TB tb, long pos1, long pos2, char* prefix) {
+
+	//Case 1: Positions out of range
+	if (pos1 > pos2) {
+		printf("Invalid positions");
+		abort();
+	}
+
+	if (pos1 < 0 || pos2 < 0) {
+		printf("Positions out of range");
+		abort();
+	}
+
+	if (pos1 > tb->nlines-1 || pos2 > tb->nlines-1) {
+		printf("Positions out of range");
+		abort();
+	}
+
+	//Case 2: Empty/null prefix
+	if (strcmp(prefix, "") == 0) {
+		return;
+	}
+	if (prefix == NULL) {
+		printf("Invalid positions");
+		abort();
+	}
+
+	//Case 3: Empty TB
+	if (tb->nlines == 0) {
+		return;
+	}
+
+	//Case 4: Normal scenario
+	TBNode curr = tb->first;
+	long position = 0;
+	long prefix_length = strlen(prefix);
+	while (curr != NULL) {
+		if ((position >= pos1) && (position <= pos2)) {
+			long length = curr->length + prefix_length + 1L;
+			char *new_line = tb_alloc(sizeof(char) * length);
+			memcpy(new_line, prefix, prefix_length);
+			memcpy(new_line + prefix_length, node_line(curr), curr->length + 1);
+			COUNT(bytes, length);
+			replace_line(tb, curr, new_line);
+			record_change(tb, position, curr);
+			index_resize(tb, position, prefix_length);
+			hashes_change(tb, position);
+		}
+		position++;
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+}
+
+/* Merge 'tb2' into 'tb1' at line 'pos'.
+ *
+ * - Afterwards line 0 of 'tb2' will be line 'pos' of 'tb1'.
+ * - The old line 'pos' of 'tb1' will follow after the last line of 'tb2'.
+ * - After this operation 'tb2' can not be used anymore (as if we had used
+ *   releaseTB() on it).
+ * - The program is to abort() with an error message if 'pos' is out of range.
+ */
+void mergeTB (TB tb1, int pos, TB tb2){
+
+	traceCall call;
+	trace_begin(&call, tb1, tb2);
+	run_merge(tb1, pos, tb2);
+	trace_end(&call, TRACE_MERGE, pos);
+}
+
+/* The same, at any position.
+ */
+void mergeTB64 (TB tb1, size_t pos, TB tb2) {
+
+	traceCall call;
+	trace_begin(&call, tb1, tb2);
+	run_merge(tb1, pos, tb2);
+	trace_end(&call, TRACE_MERGE64, pos);
+}
+
+/* 
+ * Locks the buffers for mergeTB and does its work, journaling it
+ */
+static void run_merge(TB tb1, long pos, TB tb2) {
+
+	load_mapped(tb1);
+	load_mapped(tb2);
+	//Merging with self does nothing
+	if (tb1 != tb2) {
+		lock_pair(tb1, TRUE, tb2, TRUE);
+		textBuilder record = {NULL, 0, 0};
+		if (tb1->journal != NULL && tb2->nlines != 0) {
+			journal_insert(&record, pos, tb2);
+		}
+		merge_tb(tb1, pos, tb2);
+		if (record.text != NULL) {
+			journal_append(tb1, &record);
+		}
+		unlock_pair(tb1, tb2);
+		drop_tb(tb2);
+	}
+}
+
+/* 
+ * Does the work of mergeTB, with the buffers already locked
+ */
+static void merge_tb(TB tb1, long pos, TB tb2) {
+
+	//Case 1: Merging with self
+	if (tb1 == tb2) {
+		return;
+	}
+
+	//Case 2: Tb2 is empty
+	if (tb2->nlines == 0) {
+		return;
+	}
+
+	//Case 3: pos is out of range
+	if (pos > tb1->nlines||pos < 0) {
+		printf("Positions out of range");
+		abort();
+	}
+	record_insert(tb1, pos, tb2->first, tb2->nlines);
+	index_insert(tb1, pos, tb2->first, tb2->nlines);
+	hashes_insert(tb1, pos, tb2->nlines);
+	
+	//Case 4: Tb1 is empty
+	if (tb1->nlines == 0) {
+		//Only possible position is zero
+		//Replace first
+		tb1->last = tb2->last;
+		publish(&tb1->first, tb2->first);
+		set_lines(tb1, tb2->nlines);
+		tb1->digest = tb2->digest;
+		return;
+	}
+
+	//Case 5: pos is zero
+	if (pos == 0) {
+		//First retain tb1->first;
+		TBNode tb1first = tb1->first;
+		//Then link the end of tb2 to tb1->first
+		tb2->last->next = tb1first;
+		publish(&tb1->first, tb2->first);
+		tb1first->prev = tb2->last;
+		set_lines(tb1, tb1->nlines + tb2->nlines);
+		tb1->digest = tb1->digest + tb2->digest;
+		return;
+	}
+
+	//Case 6: pos is nlines
+	if (pos == tb1->nlines) {
+		tb2->first->prev = tb1->last;
+		publish(&tb1->last->next, tb2->first);
+		tb1->last = tb2->last;
+		set_lines(tb1, tb1->nlines + tb2->nlines);
+		tb1->digest = tb1->digest + tb2->digest;
+		return;
+	}
+
+	//Case 7: pos is in middle
+	TBNode prev_link = tb1->first;
+	TBNode after_link = tb1->last;
+	TBNode curr = tb1->first;
+	long line_num = 0;
+	while(curr != NULL) {
+		if (line_num == pos) {
+			prev_link = curr->prev;
+			after_link = curr;
+		} 	
+		line_num++;
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+	//Finish the new lines before they can be reached
+	tb2->first->prev = prev_link;
+	tb2->last->next = after_link;
+	publish(&prev_link->next, tb2->first);
+	after_link->prev = tb2->last;
+	set_lines(tb1, tb1->nlines + tb2->nlines);
+	tb1->digest = tb1->digest + tb2->digest;
+	return;
+}
+
+/* Copy 'tb2' into 'tb1' at line 'pos'.
+ *
+ * - Afterwards line 0 of 'tb2' will be line 'pos' of 'tb1'.
+ * - The old line 'pos' of 'tb1' will follow after the last line of 'tb2'.
+ * - After this operation 'tb2' is unmodified and remains usable independent
+ *   of 'tb1'.
+ * - The program is to abort() with an error message if 'pos' is out of range.
+ */
+void pasteTB (TB tb1, int pos, TB tb2) {
+
+	traceCall call;
+	trace_begin(&call, tb1, tb2);
+	run_paste(tb1, pos, tb2);
+	trace_end(&call, TRACE_PASTE, pos);
+}
+
+/* The same, at any position.
+ */
+void pasteTB64 (TB tb1, size_t pos, TB tb2) {
+
+	traceCall call;
+	trace_begin(&call, tb1, tb2);
+	run_paste(tb1, pos, tb2);
+	trace_end(&call, TRACE_PASTE64, pos);
+}
+
+/* 
+ * Locks the buffers for pasteTB and does its work, journaling it
+ */
+static void run_paste(TB tb1, long pos, TB tb2) {
+
+	load_mapped(tb1);
+	load_mapped(tb2);
+	lock_pair(tb1, TRUE, tb2, FALSE);
+	textBuilder record = {NULL, 0, 0};
+	if (tb1->journal != NULL && tb1 != tb2 && tb2->nlines != 0) {
+		journal_insert(&record, pos, tb2);
+	}
+	paste_tb(tb1, pos, tb2);
+	if (record.text != NULL) {
+		journal_append(tb1, &record);
+	}
+	unlock_pair(tb1, tb2);
+}
+
+/* 
+ * Does the work of pasteTB, with the buffers already locked
+ */
+static void paste_tb(TB tb1, long pos, TB tb2) {
+
+	//Case 1: Merging with self
+	if (tb1 == tb2) {
+		return;
+	}
+
+	//Case 2: Tb2 is empty
+	if (tb2->nlines == 0) {
+		return;
+	}
+
+	//Case 3: pos is out of range
+	if ((pos > tb1->nlines) || (pos < 0)) {
+		printf("Positions out of range");
+		abort();
+	}
+	record_insert(tb1, pos, tb2->first, tb2->nlines);
+	hashes_insert(tb1, pos, tb2->nlines);
+
+	//Copy TB2, leaving it as it was
+	pthread_mutex_lock(&storage_lock);
+	TBNode first = copyTBNode(tb2->first);
+	TBNode new_curr = first;
+	new_curr->prev = NULL;
+	new_curr->next = NULL;
+	TBNode tb2curr = tb2->first->next;
+	while(tb2curr != NULL) {
+		new_curr->next = copyTBNode(tb2curr);
+		new_curr->next->prev = new_curr;
+		new_curr->next->next = NULL;
+		new_curr = new_curr->next;
+		COUNT(nodes, 1);
+		tb2curr = tb2curr->next;
+	}
+	pthread_mutex_unlock(&storage_lock);
+	index_insert(tb1, pos, first, tb2->nlines);
+
+	//Case 4: Tb1 is empty
+	if (tb1->nlines == 0) {
+		tb1->last = new_curr;
+		publish(&tb1->first, first);
+		set_lines(tb1, tb2->nlines);
+		tb1->digest = tb2->digest;
+		return;
+	}
+
+	//Case 5: pos is zero
+	if (pos == 0) {
+		TBNode tb1first = tb1->first;
+		new_curr->next = tb1first;
+		publish(&tb1->first, first);
+		tb1first->prev = new_curr;
+		set_lines(tb1, tb1->nlines + tb2->nlines);
+		tb1->digest = tb1->digest + tb2->digest;
+		return;
+	}
+
+	//Case 6: pos is nlines
+	if (pos == tb1->nlines) {
+		first->prev = tb1->last;
+		publish(&tb1->last->next, first);
+		tb1->last = new_curr;
+		set_lines(tb1, tb1->nlines + tb2->nlines);
+		tb1->digest = tb1->digest + tb2->digest;
+		return;
+	}
+
+	//Case 7: pos is in middle
+	TBNode prev_link = tb1->first;
+	TBNode after_link = tb1->last;
+	TBNode curr = tb1->first;
+	long line_num = 0;
+	while(curr != NULL) {
+		if (line_num == pos) {
+			prev_link = curr->prev;
+			after_link = curr;
+		} 	
+		line_num++;
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+	first->prev = prev_link;
+	new_curr->next = after_link;
+	publish(&prev_link->next, first);
+	after_link->prev = new_curr;
+	set_lines(tb1, tb1->nlines + tb2->nlines);
+	tb1->digest = tb1->digest + tb2->digest;
+	return;
+}
+
+/* Cut the lines between and including 'from' and 'to' out of the textbuffer
+ * 'tb'.
+ *
+ * - The result is a new textbuffer (much as one created with newTB()).
+ * - The cut lines will be deleted from 'tb'.
+ * - The program is to abort() with an error message if 'from' or 'to' is out
+ *   of range.
+ */
+TB cutTB (TB tb, int from, int to){
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	TB tb2 = run_cut(tb, from, to);
+	trace_end(&call, TRACE_CUT, from, to, tb2);
+	return tb2;
+}
+
+/* The same, for lines at any position.
+ */
+TB cutTB64 (TB tb, size_t from, size_t to) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	TB tb2 = run_cut(tb, from, to);
+	trace_end(&call, TRACE_CUT64, from, to, tb2);
+	return tb2;
+}
+
+/* 
+ * Locks 'tb' for cutTB and does its work, journaling it
+ */
+static TB run_cut(TB tb, long from, long to) {
+
+	load_mapped(tb);
+	write_lock(tb);
+	TB tb2 = cut_tb(tb, from, to);
+	//Nothing is cut if 'from' is after 'to'
+	if (tb->journal != NULL && tb2 != NULL) {
+		journal_edit(tb, JOURNAL_DELETE, from, to, "");
+	}
+	unlock_tb(tb);
+	return tb2;
+}
+
+/* 
+ * Does the work of cutTB, with the buffers already locked
+ */
+static TB cut_tb(TB tb, long from, long to) {
+
+	//Case 1: tb is empty
+	if (tb->nlines == 0) {
+		return NULL;
+	}
+
+	//Case 2: to is larger than from
+	if (to < from) {
+		return NULL;
+	}
+
+	//Case 3: If to or from is out of range
+	if (from < 0 || to < 0) {
+		printf("Positions out of range");
+		abort();
+	}
+	if (from > tb->nlines-1 || to > tb->nlines-1) {
+		printf("Positions out of range");
+		abort();
+	}
+
+	//Readers may still be walking the cut lines, so hand back copies
+	if (tb->snapshot) {
+		TB tb2 = copy_range(tb, from, to);
+		delete_tb(tb, from, to);
+		return tb2;
+	}
+	record_remove(tb, from, to - from + 1);
+	index_remove(tb, from, to - from + 1);
+	hashes_remove(tb, from, to - from + 1);
+
+	TB tb2 = tb_alloc(sizeof(textbuffer));
+	tb2->first = NULL;
+	tb2->last = NULL;
+	tb2->nlines = to - from + 1;
+	tb2->digest = 0;
+	tb2->history = NULL;
+	tb2->intern = tb->intern;
+	tb2->threadSafe = FALSE;
+	tb2->snapshot = FALSE;
+	tb2->version = 0;
+	tb2->traceGeneration = 0;
+	tb2->mapped = NULL;
+	tb2->journal = NULL;
+	tb2->stream = NULL;
+	tb2->index = NULL;
+	tb2->hashes = NULL;
+	tb2->watches = NULL;
+#ifdef TB_STATS
+	tb2->stats = NULL;
+#endif
+
+	//Case 4: Deleting first node
+	if ((from == 0) && (to != tb->nlines - 1)) {
+
+		TBNode first = tb->first;
+		TBNode last = tb->first;
+		long line_num = 0; 
+		while (line_num != to) {
+			last = last->next;
+			line_num++;
+			COUNT(nodes, 1);
+		}
+		tb->first = last->next;
+		last->next->prev = NULL;
+		tb2->first = first;
+		tb2->last = last;
+		last->next = NULL;
+		set_lines(tb, tb->nlines - (tb2->nlines));
+		tb2->digest = chain_digest(first);
+		tb->digest = tb->digest - tb2->digest;
+		return tb2;
+	}
+
+	//Case 5: Deleting last node
+	if ((from != 0) && (to == tb->nlines - 1)) {
+		TBNode first = tb->first;
+		TBNode last = tb->last;
+		long line_num = 0; 
+		while (line_num!= from) {
+			first = first->next;
+			line_num++;
+			COUNT(nodes, 1);
+		}
+		tb->last = first->prev;
+		first->prev->next = NULL;
+		tb2->first = first;
+		tb2->last = last;
+		first->prev = NULL;
+		set_lines(tb, tb->nlines - (tb2->nlines));
+		tb2->digest = chain_digest(first);
+		tb->digest = tb->digest - tb2->digest;
+		return tb2;
+
+	}
+
+	//Case 6: moving whole text
+	if ((from == 0) && (to == tb->nlines - 1)) {
+		tb2->first = tb->first;
+		tb2->last = tb->last;
+		tb->last = NULL;
+		tb->first = NULL;
+		set_lines(tb, tb->nlines - (tb2->nlines));
+		tb2->digest = tb->digest;
+		tb->digest = 0;
+		return tb2;
+	}
+
+	//Case 6: Deleting normally
+	TBNode first = tb->first;
+	TBNode last = tb->last;
+	TBNode curr = tb->first;
+	long line_num = 0; 
+	while (curr != NULL) {
+		if (line_num == from) {
+			first = curr;
+		} 
+		if (line_num == to) {
+			last = curr;
+		}
+		line_num++;
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+	first->prev->next = last->next;
+	last->next->prev = first->prev;
+	first->prev = NULL;
+	last->next = NULL;
+	tb2->first = first;
 	tb2->last = last;
-	tb->nlines = tb->nlines - (tb2->nlines);
+	set_lines(tb, tb->nlines - (tb2->nlines));
+	tb2->digest = chain_digest(first);
+	tb->digest = tb->digest - tb2->digest;
+	return tb2;
+}
+
+/* 
+ * Returns a new textbuffer holding copies of lines 'from' to 'to' of 'tb'
+ */
+static TB copy_range(TB tb, long from, long to) {
+
+	TB tb2 = new_tb("");
+	tb2->intern = tb->intern;
+	TBNode curr = tb->first;
+	for (long i = 0; i < from; i++) {
+		curr = curr->next;
+	}
+	pthread_mutex_lock(&storage_lock);
+	for (long i = from; i <= to; i++) {
+		TBNode node = copyTBNode(curr);
+		node->prev = tb2->last;
+		if (tb2->last == NULL) {
+			tb2->first = node;
+		} else {
+			tb2->last->next = node;
+		}
+		tb2->last = node;
+		tb2->digest = tb2->digest + node->hash;
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+	pthread_mutex_unlock(&storage_lock);
+	tb2->nlines = to - from + 1;
 	return tb2;
 }
 
-/*  Return a linked list of Match nodes of all the matches of string search
- *  in tb
- *
- * - The textbuffer 'tb' will remain unmodified.
- * - The user is responsible of freeing the returned list
+/*  Return a linked list of Match nodes of all the matches of string search
+ *  in tb
+ *
+ * - The textbuffer 'tb' will remain unmodified.
+ * - The user is responsible of freeing the returned list
+ */
+Match searchTB (TB tb, char* search){
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	matchList list = {FALSE, NULL, NULL, NULL, 0};
+	run_search(tb, search, 0, &list);
+	trace_end(&call, TRACE_SEARCH, search, (int) list.count);
+	return list.first;
+}
+
+/* The same, with the options in 'flags'.
+ */
+Match searchFlagsTB (TB tb, char *search, int flags) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	matchList list = {FALSE, NULL, NULL, NULL, 0};
+	run_search(tb, search, flags, &list);
+	trace_end(&call, TRACE_SEARCH_FLAGS, search, flags, (int) list.count);
+	return list.first;
+}
+
+/* The same, for matches on lines at any position.
+ */
+Match64 searchTB64 (TB tb, char *search) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	matchList list = {TRUE, NULL, NULL, NULL, 0};
+	run_search(tb, search, 0, &list);
+	trace_end(&call, TRACE_SEARCH64, search, (size_t) list.count);
+	return list.first;
+}
+
+/* 
+ * Locks 'tb' for searchTB, unless reads are snapshots and no edit overlaps
+ * the search, and does its work
+ */
+static void run_search(TB tb, char *search, int flags, matchList *list) {
+
+	load_mapped(tb);
+	for (int tries = 0; tb->snapshot && tries < SNAPSHOT_TRIES; tries++) {
+		readerSlot *slot = enter_epoch();
+		unsigned long version;
+		int consistent = begin_snapshot(tb, &version);
+		if (consistent) {
+			search_tb(tb, search, flags, list);
+			consistent = end_snapshot(tb, version);
+		}
+		exit_epoch(slot);
+		if (consistent) {
+			return;
+		}
+		clear_matches(list);
+		if (version % 2 == 1) {
+			break;
+		}
+	}
+	read_lock(tb);
+	search_tb(tb, search, flags, list);
+	unlock_tb(tb);
+}
+
+/* 
+ * Does the work of searchTB, with the buffers already locked, adding each
+ * match to 'list'
+ */
+static void search_tb(TB tb, char* search, int flags, matchList *list) {
+
+	//Case 1: search for NULL;
+	if (search == NULL) {
+		printf("Invalid search");
+		abort();
+	}
+
+	//Case 2: search for nothing;
+	if (search[0] == '\0') {
+		return;
+	}
+
+	//Case 3: Normal search, resuming after each match
+	TBNode curr = first_node(tb);
+	indexChunk *chunk = indexed_scan(tb);
+	int at = 0;
+	if (chunk != NULL) {
+		curr = chunk->nodes[0];
+	}
+	long line_num = 1;
+	long search_length = strlen(search);
+	//Without case, lines are matched against a lower case copy of 'search'
+	char *folded = NULL;
+	if (flags & TB_SEARCH_IGNORE_CASE) {
+		folded = tb_alloc(search_length + 1);
+		for (long i = 0; i <= search_length; i++) {
+			folded[i] = search[i] >= 'A' && search[i] <= 'Z' ? search[i] + 'a' - 'A' : search[i];
+		}
+	}
+	while (curr!= NULL) {
+		char *line = node_line(curr);
+		char *charindex = NULL;
+		char *end = NULL;
+		char *floor = line == curr->small ? (char *) curr : line;
+		//Without the lock the length may belong to a newer line
+		if (tb->snapshot || curr->length >= search_length) {
+			if (folded == NULL) {
+				charindex = strstr(line,search);
+			} else {
+				end = line + (tb->snapshot ? (long) strlen(line) : curr->length);
+				charindex = find_ignore_case(floor, line, end, folded, search_length);
+			}
+		}
+		//Code points are counted on from the last match, so that each byte
+		//of a line is counted at most once
+		char *counted = line;
+		long column = 0;
+		while (charindex != NULL) {
+			if (flags & TB_SEARCH_CODEPOINTS) {
+				column = column + count_codepoints(counted, charindex - counted);
+				counted = charindex;
+				add_match(list, line_num, column);
+			} else {
+				add_match(list, line_num, charindex - line);
+			}
+			if (folded == NULL) {
+				charindex = strstr(charindex + search_length, search);
+			} else {
+				charindex = find_ignore_case(floor, charindex + search_length, end, folded, search_length);
+			}
+		}
+		line_num++;
+		COUNT(nodes, 1);
+		curr = chunk != NULL ? next_indexed(&chunk, &at) : next_node(curr);
+	}
+	tb_free(folded);
+}
+
+/* 
+ * Returns where 'folded', 'length' bytes already in lower case, first
+ * occurs between 'text' and 'end' with ASCII letters of either case, or
+ * NULL. 'floor' is the lowest address that may be read, which lies before
+ * the line where it sits inside its node.
+ *
+ * With SSE2, 16 places at a time are ruled out unless their first and last
+ * bytes both match, and only the rest are compared in full. The last few
+ * places are taken from a block reaching back as far as 'floor', so that
+ * short lines need no byte at a time loop.
+ */
+static char *find_ignore_case(char *floor, char *text, char *end, const char *folded, long length) {
+
+	char *last = end - length;
+#ifdef __SSE2__
+	const __m128i first = _mm_set1_epi8(folded[0]);
+	const __m128i final = _mm_set1_epi8(folded[length - 1]);
+	while (text <= last && last - 15 >= floor) {
+		//Places before 'text' in a block reaching back are ruled out
+		char *block = text + 15 <= last ? text : last - 15;
+		__m128i starts = lower_block(_mm_loadu_si128((const __m128i *) block));
+		__m128i ends = lower_block(_mm_loadu_si128((const __m128i *) (block + length - 1)));
+		int candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, final)));
+		candidates = candidates & (0xFFFF << (text - block));
+		while (candidates != 0) {
+			char *candidate = block + __builtin_ctz(candidates);
+			if (equal_ignore_case(candidate + 1, folded + 1, length - 2)) {
+				return candidate;
+			}
+			candidates = candidates & (candidates - 1);
+		}
+		text = block + 16;
+	}
+	//Otherwise, if a block fits after 'text', it holds every place left
+	if (text <= last && end - text >= 16) {
+		__m128i starts = lower_block(_mm_loadu_si128((const __m128i *) text));
+		int candidates = _mm_movemask_epi8(_mm_cmpeq_epi8(starts, first));
+		candidates = candidates & ((2 << (last - text)) - 1);
+		while (candidates != 0) {
+			char *candidate = text + __builtin_ctz(candidates);
+			if (equal_ignore_case(candidate + 1, folded + 1, length - 1)) {
+				return candidate;
+			}
+			candidates = candidates & (candidates - 1);
+		}
+		return NULL;
+	}
+#endif
+	//Setting the case bit of a byte lowers it if the letter it is matched
+	//against is one
+	char caseBit = folded[0] >= 'a' && folded[0] <= 'z' ? 'a' - 'A' : 0;
+	for (; text <= last; text++) {
+		if ((*text | caseBit) == folded[0] && equal_ignore_case(text + 1, folded + 1, length - 1)) {
+			return text;
+		}
+	}
+	return NULL;
+}
+
+#ifdef __SSE2__
+/* 
+ * Returns 'bytes' with the ASCII upper case letters among them in lower case
+ */
+static __m128i lower_block(__m128i bytes) {
+
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)),
+		_mm_cmplt_epi8(bytes, _mm_set1_epi8('Z' + 1)));
+	return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+}
+#endif
+
+/* 
+ * Returns TRUE if the first 'length' bytes of 'text' are those of 'folded'
+ * with ASCII letters of either case
+ */
+static int equal_ignore_case(const char *text, const char *folded, long length) {
+
+	for (long i = 0; i < length; i++) {
+		char c = text[i] >= 'A' && text[i] <= 'Z' ? text[i] + 'a' - 'A' : text[i];
+		if (c != folded[i]) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* 
+ * Frees every match in 'list', leaving it empty
+ */
+static void clear_matches(matchList *list) {
+
+	if (list->wide) {
+		Match64 match = list->first;
+		while (match != NULL) {
+			Match64 next = match->next;
+			free(match);
+			match = next;
+		}
+	} else {
+		Match match = list->first;
+		while (match != NULL) {
+			Match next = match->next;
+			free(match);
+			match = next;
+		}
+	}
+	list->first = NULL;
+	list->last = NULL;
+	list->last64 = NULL;
+	list->count = 0;
+}
+
+/* 
+ * Appends a match to the end of 'list'. A matchNode can't number lines
+ * past INT_MAX, so a list of them aborts there.
+ */
+static void add_match(matchList *list, long lineNumber, long charIndex) {
+
+	if (list->wide) {
+		Match64 match = result_alloc(sizeof(matchNode64));
+		match->lineNumber = lineNumber;
+		match->charIndex = charIndex;
+		match->next = NULL;
+		if (list->last64 == NULL) {
+			list->first = match;
+		} else {
+			list->last64->next = match;
+		}
+		list->last64 = match;
+	} else {
+		if (lineNumber > INT_MAX) {
+			printf("Too many lines");
+			abort();
+		}
+		Match match = result_alloc(sizeof(matchNode));
+		match->lineNumber = lineNumber;
+		match->charIndex = charIndex;
+		match->next = NULL;
+		if (list->last == NULL) {
+			list->first = match;
+		} else {
+			list->last->next = match;
+		}
+		list->last = match;
+	}
+	list->count++;
+}
+
+/* 
+ * Returns the number of UTF-8 characters in the first 'length' bytes of
+ * 'text', counting every byte that doesn't continue a character, 16 bytes
+ * at a time where SSE2 is available and 8 at a time otherwise
+ */
+static long count_codepoints(const char *text, long length) {
+
+	long count = 0;
+	long i = 0;
+#ifdef __SSE2__
+	//Continuation bytes, 0x80 to 0xBF, are those at or below -65 as signed
+	const __m128i continuation = _mm_set1_epi8(-65);
+	while (i + 16 <= length) {
+		//Each byte of 'lanes' counts for its position in up to 255 blocks,
+		//then they are summed
+		__m128i lanes = _mm_setzero_si128();
+		long end = length - i > 16 * 255 ? i + 16 * 255 : length;
+		for (; i + 16 <= end; i = i + 16) {
+			__m128i bytes = _mm_loadu_si128((const __m128i *) (text + i));
+			lanes = _mm_sub_epi8(lanes, _mm_cmpgt_epi8(bytes, continuation));
+		}
+		__m128i sums = _mm_sad_epu8(lanes, _mm_setzero_si128());
+		count = count + _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+	}
+	//The last few bytes are the top lanes of the block that ends with them
+	if (i < length && length >= 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *) (text + length - 16));
+		int leads = _mm_movemask_epi8(_mm_cmpgt_epi8(bytes, continuation));
+		return count + __builtin_popcount(leads >> (16 - (length - i)));
+	}
+#else
+	//A continuation byte has its top bit set and the next one clear
+	for (; i + 8 <= length; i = i + 8) {
+		uint64_t bytes;
+		memcpy(&bytes, text + i, 8);
+		count = count + 8 - __builtin_popcountll(bytes & ~(bytes << 1) & 0x8080808080808080ULL);
+	}
+#endif
+	for (; i < length; i++) {
+		count = count + ((signed char) text[i] > -65);
+	}
+	return count;
+}
+
+/* Return a list of every byte sequence in 'tb' that isn't valid UTF-8, or
+ * NULL if there are none, with the options in 'flags'.
+ *
+ * - The user is responsible of freeing the returned list
+ */
+Match validateUtf8TB (TB tb, int flags) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	matchList list = {FALSE, NULL, NULL, NULL, 0};
+	run_validate(tb, flags, &list);
+	trace_end(&call, TRACE_VALIDATE_UTF8, flags, (int) list.count);
+	return list.first;
+}
+
+/* 
+ * Locks 'tb' for validateUtf8TB, unless reads are snapshots and no edit
+ * overlaps the read, and does its work
+ */
+static void run_validate(TB tb, int flags, matchList *list) {
+
+	load_mapped(tb);
+	for (int tries = 0; tb->snapshot && tries < SNAPSHOT_TRIES; tries++) {
+		readerSlot *slot = enter_epoch();
+		unsigned long version;
+		int consistent = begin_snapshot(tb, &version);
+		if (consistent) {
+			validate_utf8_tb(tb, flags, list);
+			consistent = end_snapshot(tb, version);
+		}
+		exit_epoch(slot);
+		if (consistent) {
+			return;
+		}
+		clear_matches(list);
+		if (version % 2 == 1) {
+			break;
+		}
+	}
+	read_lock(tb);
+	validate_utf8_tb(tb, flags, list);
+	unlock_tb(tb);
+}
+
+/* 
+ * Does the work of validateUtf8TB, with the buffer already locked, adding
+ * where each invalid sequence starts to 'list'
+ */
+static void validate_utf8_tb(TB tb, int flags, matchList *list) {
+
+	TBNode curr = first_node(tb);
+	indexChunk *chunk = indexed_scan(tb);
+	int at = 0;
+	if (chunk != NULL) {
+		curr = chunk->nodes[0];
+	}
+	long line_num = 1;
+	while (curr != NULL) {
+		char *line = node_line(curr);
+		//Without the lock the length may belong to a newer line
+		long length = tb->snapshot ? (long) strlen(line) : curr->length;
+		long counted = 0;
+		long column = 0;
+		long i = skip_ascii(line, 0, length);
+		while (i < length) {
+			int sequence = utf8_sequence((const unsigned char *) line + i, length - i);
+			if (sequence < 0) {
+				if (flags & TB_SEARCH_CODEPOINTS) {
+					column = column + count_codepoints(line + counted, i - counted);
+					counted = i;
+					add_match(list, line_num, column);
+				} else {
+					add_match(list, line_num, i);
+				}
+				sequence = -sequence;
+			}
+			i = skip_ascii(line, i + sequence, length);
+		}
+		line_num++;
+		COUNT(nodes, 1);
+		curr = chunk != NULL ? next_indexed(&chunk, &at) : next_node(curr);
+	}
+}
+
+/* 
+ * Returns where the first byte at or after 'from' that isn't ASCII is in
+ * 'text', or 'length' if there is none
+ */
+static long skip_ascii(const char *text, long from, long length) {
+
+#ifdef __SSE2__
+	for (; from + 16 <= length; from = from + 16) {
+		int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (text + from)));
+		if (high != 0) {
+			return from + __builtin_ctz(high);
+		}
+	}
+#else
+	for (; from + 8 <= length; from = from + 8) {
+		uint64_t bytes;
+		memcpy(&bytes, text + from, 8);
+		if ((bytes & 0x8080808080808080ULL) != 0) {
+			break;
+		}
+	}
+#endif
+	while (from < length && (unsigned char) text[from] < 0x80) {
+		from++;
+	}
+	return from;
+}
+
+/* 
+ * Returns the length of the UTF-8 character 'text' starts with, or, if it
+ * isn't one, minus the length of the bytes that begin one without finishing
+ * it, at least 1. Overlong forms, surrogates and code points past U+10FFFF
+ * are not characters.
+ */
+static int utf8_sequence(const unsigned char *text, long length) {
+
+	int need;
+	//Range of the byte after the first, which rules out the forms above
+	unsigned char low = 0x80;
+	unsigned char high = 0xBF;
+	if (text[0] < 0x80) {
+		return 1;
+	} else if (text[0] >= 0xC2 && text[0] <= 0xDF) {
+		need = 1;
+	} else if (text[0] >= 0xE0 && text[0] <= 0xEF) {
+		need = 2;
+		if (text[0] == 0xE0) {
+			low = 0xA0;
+		} else if (text[0] == 0xED) {
+			high = 0x9F;
+		}
+	} else if (text[0] >= 0xF0 && text[0] <= 0xF4) {
+		need = 3;
+		if (text[0] == 0xF0) {
+			low = 0x90;
+		} else if (text[0] == 0xF4) {
+			high = 0x8F;
+		}
+	} else {
+		return -1;
+	}
+	for (int i = 1; i <= need; i++) {
+		if (i >= length || text[i] < low || text[i] > high) {
+			return -i;
+		}
+		low = 0x80;
+		high = 0xBF;
+	}
+	return need + 1;
+}
+
+/* Start a search for 'search' in 'tb' whose matches are kept up to date as
+ * 'tb' is edited.
+ *
+ * - Each edit searches only the lines it writes, and notes where lines were
+ *   removed. Matches on the lines in between are renumbered only when asked
+ *   for.
+ * - The watch outlives 'tb', after which it has no matches.
+ * - The program is to abort() with an error message if 'search' is NULL.
+ */
+TBWatch watchSearchTB (TB tb, char *search) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	if (search == NULL) {
+		printf("Invalid search");
+		abort();
+	}
+	load_mapped(tb);
+	write_lock(tb);
+	TBWatch watch = tb_alloc(sizeof(struct textbufferWatch));
+	watch->tb = tb;
+	watch->length = strlen(search);
+	watch->search = tb_alloc(watch->length + 1);
+	memcpy(watch->search, search, watch->length + 1);
+	watch->matches = (watchMatches) {NULL, 0, 0};
+	watch->pieces = NULL;
+	watch->npieces = 0;
+	watch->capacity = 0;
+	watch->traceGeneration = 0;
+	watch_scan(watch, &watch->matches, tb->first, tb->nlines);
+	if (tb->nlines > 0) {
+		insert_piece(watch, 0);
+		watch->pieces[0].from = 0;
+		watch->pieces[0].count = tb->nlines;
+	}
+	watch->next = tb->watches;
+	tb->watches = watch;
+	unlock_tb(tb);
+	trace_end(&call, TRACE_WATCH, search, watch);
+	return watch;
+}
+
+/* Return the matches of 'watch' in its buffer as it is now, as searchTB()
+ * would, in time proportional to their number and the edits since the last
+ * call.
+ *
+ * - The user is responsible of freeing the returned list
+ */
+Match watchMatchesTB (TBWatch watch) {
+
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	matchList list = {FALSE, NULL, NULL, NULL, 0};
+	TB tb = watch->tb;
+	if (tb != NULL) {
+		write_lock(tb);
+		catch_up(watch);
+		for (long i = 0; i < watch->matches.count; i++) {
+			add_match(&list, watch->matches.items[i].line + 1, watch->matches.items[i].charIndex);
+		}
+		unlock_tb(tb);
+	}
+	trace_end(&call, TRACE_WATCH_MATCHES, watch, (int) list.count);
+	return list.first;
+}
+
+/* Stop 'watch' and free it.
+ */
+void releaseWatchTB (TBWatch watch) {
+
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	TB tb = watch->tb;
+	if (tb != NULL) {
+		write_lock(tb);
+		TBWatch *link = &tb->watches;
+		while (*link != watch) {
+			link = &(*link)->next;
+		}
+		*link = watch->next;
+		unlock_tb(tb);
+	}
+	trace_end(&call, TRACE_WATCH_RELEASE, watch);
+	for (long i = 0; i < watch->npieces; i++) {
+		tb_free(watch->pieces[i].found.items);
+	}
+	tb_free(watch->pieces);
+	tb_free(watch->matches.items);
+	tb_free(watch->search);
+	tb_free(watch);
+}
+
+/* 
+ * Adds the matches of 'watch' on the 'count' lines from 'first' to 'found',
+ * numbering the lines from 0
+ */
+static void watch_scan(TBWatch watch, watchMatches *found, TBNode first, long count) {
+
+	if (watch->length == 0) {
+		return;
+	}
+	TBNode curr = first;
+	for (long i = 0; i < count; i++) {
+		if (curr->length >= watch->length) {
+			char *line = node_line(curr);
+			char *charindex = strstr(line, watch->search);
+			while (charindex != NULL) {
+				add_watch_match(found, i, charindex - line);
+				charindex = strstr(charindex + watch->length, watch->search);
+			}
+		}
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+}
+
+static void add_watch_match(watchMatches *found, long line, long charIndex) {
+
+	if (found->count == found->capacity) {
+		found->capacity = found->capacity == 0 ? 16 : found->capacity * 2;
+		found->items = tb_realloc(found->items, sizeof(watchMatch) * found->capacity);
+	}
+	found->items[found->count].line = line;
+	found->items[found->count].charIndex = charIndex;
+	found->count++;
+}
+
+/* 
+ * Returns the index of the piece of 'watch' that starts at line 'pos',
+ * first splitting the piece that holds it in two if need be, or the number
+ * of pieces if 'pos' is the end of the buffer
+ */
+static long split_piece(TBWatch watch, long pos) {
+
+	long start = 0;
+	long i = 0;
+	while (i < watch->npieces && start + watch->pieces[i].count <= pos) {
+		start = start + watch->pieces[i].count;
+		i++;
+	}
+	if (i == watch->npieces || start == pos) {
+		return i;
+	}
+	insert_piece(watch, i + 1);
+	watchPiece *piece = &watch->pieces[i];
+	watchPiece *rest = &watch->pieces[i + 1];
+	long offset = pos - start;
+	rest->count = piece->count - offset;
+	piece->count = offset;
+	if (piece->from >= 0) {
+		rest->from = piece->from + offset;
+		return i + 1;
+	}
+	//Matches on written lines past the split move to the new piece
+	rest->from = -1;
+	long keep = 0;
+	while (keep < piece->found.count && piece->found.items[keep].line < offset) {
+		keep++;
+	}
+	for (long j = keep; j < piece->found.count; j++) {
+		add_watch_match(&rest->found, piece->found.items[j].line - offset, piece->found.items[j].charIndex);
+	}
+	piece->found.count = keep;
+	return i + 1;
+}
+
+/* 
+ * Makes room for an empty piece at index 'at' of 'watch'
+ */
+static void insert_piece(TBWatch watch, long at) {
+
+	if (watch->npieces == watch->capacity) {
+		watch->capacity = watch->capacity == 0 ? 4 : watch->capacity * 2;
+		watch->pieces = tb_realloc(watch->pieces, sizeof(watchPiece) * watch->capacity);
+	}
+	memmove(&watch->pieces[at + 1], &watch->pieces[at], sizeof(watchPiece) * (watch->npieces - at));
+	watch->pieces[at] = (watchPiece) {-1, 0, {NULL, 0, 0}};
+	watch->npieces++;
+}
+
+/* 
+ * Folds the piece at index 'at' of 'watch' into the one before it, if both
+ * hold written lines, so that repeated edits in one place don't pile up
+ * pieces
+ */
+static void join_pieces(TBWatch watch, long at) {
+
+	if (at <= 0 || at >= watch->npieces || watch->pieces[at - 1].from >= 0 || watch->pieces[at].from >= 0) {
+		return;
+	}
+	watchPiece *before = &watch->pieces[at - 1];
+	watchPiece *piece = &watch->pieces[at];
+	for (long j = 0; j < piece->found.count; j++) {
+		add_watch_match(&before->found, piece->found.items[j].line + before->count, piece->found.items[j].charIndex);
+	}
+	before->count = before->count + piece->count;
+	tb_free(piece->found.items);
+	memmove(piece, piece + 1, sizeof(watchPiece) * (watch->npieces - at - 1));
+	watch->npieces--;
+}
+
+/* 
+ * Searches the 'count' lines from 'first' just inserted at 'pos' for every
+ * watch on 'tb'
+ */
+static void watch_insert(TB tb, long pos, TBNode first, long count) {
+
+	if (count == 0) {
+		return;
+	}
+	for (TBWatch watch = tb->watches; watch != NULL; watch = watch->next) {
+		long at = split_piece(watch, pos);
+		insert_piece(watch, at);
+		watch->pieces[at].count = count;
+		watch_scan(watch, &watch->pieces[at].found, first, count);
+		join_pieces(watch, at + 1);
+		join_pieces(watch, at);
+		if (watch->npieces > WATCH_PIECES) {
+			catch_up(watch);
+		}
+	}
+}
+
+/* 
+ * Drops the 'count' lines just removed from 'pos' from every watch on 'tb'
+ */
+static void watch_remove(TB tb, long pos, long count) {
+
+	if (count == 0) {
+		return;
+	}
+	for (TBWatch watch = tb->watches; watch != NULL; watch = watch->next) {
+		long from = split_piece(watch, pos);
+		long to = split_piece(watch, pos + count);
+		for (long i = from; i < to; i++) {
+			tb_free(watch->pieces[i].found.items);
+		}
+		memmove(&watch->pieces[from], &watch->pieces[to], sizeof(watchPiece) * (watch->npieces - to));
+		watch->npieces = watch->npieces - (to - from);
+		join_pieces(watch, from);
+		if (watch->npieces > WATCH_PIECES) {
+			catch_up(watch);
+		}
+	}
+}
+
+/* 
+ * Renumbers the matches of 'watch' for its buffer as it is now, in one pass
+ * over them and its pieces, leaving a single kept piece. Kept pieces are in
+ * the order of their old lines, as no edit moves lines, so the old matches
+ * are read front to back once.
+ */
+static void catch_up(TBWatch watch) {
+
+	//Nothing to do if the lines kept are all there were, which lines cut
+	//from the end would leave matches past
+	long nmatches = watch->matches.count;
+	if (watch->npieces == 1 && watch->pieces[0].from == 0
+			&& (nmatches == 0 || watch->matches.items[nmatches - 1].line < watch->pieces[0].count)) {
+		return;
+	}
+	watchMatches matches = {NULL, 0, 0};
+	long old = 0;
+	long start = 0;
+	for (long i = 0; i < watch->npieces; i++) {
+		watchPiece *piece = &watch->pieces[i];
+		if (piece->from >= 0) {
+			while (old < watch->matches.count && watch->matches.items[old].line < piece->from) {
+				old++;
+			}
+			for (; old < watch->matches.count && watch->matches.items[old].line < piece->from + piece->count; old++) {
+				add_watch_match(&matches, watch->matches.items[old].line - piece->from + start,
+					watch->matches.items[old].charIndex);
+			}
+		} else {
+			for (long j = 0; j < piece->found.count; j++) {
+				add_watch_match(&matches, piece->found.items[j].line + start, piece->found.items[j].charIndex);
+			}
+			tb_free(piece->found.items);
+		}
+		start = start + piece->count;
+	}
+	tb_free(watch->matches.items);
+	watch->matches = matches;
+	watch->npieces = 0;
+	if (start > 0) {
+		insert_piece(watch, 0);
+		watch->pieces[0].from = 0;
+		watch->pieces[0].count = start;
+	}
+}
+
+/* 
+ * Leaves every watch on 'tb' without a buffer, and so without matches
+ */
+static void end_watches(TB tb) {
+
+	for (TBWatch watch = tb->watches; watch != NULL; watch = watch->next) {
+		for (long i = 0; i < watch->npieces; i++) {
+			tb_free(watch->pieces[i].found.items);
+		}
+		watch->npieces = 0;
+		watch->matches.count = 0;
+		watch->tb = NULL;
+	}
+	tb->watches = NULL;
+}
+
+/* Allocate a new, empty workspace.
+ */
+TBWorkspace newWorkspaceTB (void) {
+
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	TBWorkspace ws = tb_alloc(sizeof(struct textbufferWorkspace));
+	ws->capacity = 16;
+	ws->buffers = tb_alloc(sizeof(TB) * ws->capacity);
+	ws->nbuffers = 0;
+	ws->traceGeneration = 0;
+	trace_end(&call, TRACE_WORKSPACE_NEW, ws);
+	return ws;
+}
+
+/* Free the given workspace, but not the buffers in it.
+ */
+void releaseWorkspaceTB (TBWorkspace ws) {
+
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	trace_end(&call, TRACE_WORKSPACE_RELEASE, ws);
+	tb_free(ws->buffers);
+	tb_free(ws);
+}
+
+/* Add 'tb' to the buffers 'ws' searches, unless it is there already.
+ */
+void addWorkspaceTB (TBWorkspace ws, TB tb) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	int i = 0;
+	while (i < ws->nbuffers && ws->buffers[i] != tb) {
+		i++;
+	}
+	if (i == ws->nbuffers) {
+		if (ws->nbuffers == ws->capacity) {
+			ws->capacity = ws->capacity * 2;
+			ws->buffers = tb_realloc(ws->buffers, sizeof(TB) * ws->capacity);
+		}
+		ws->buffers[ws->nbuffers++] = tb;
+	}
+	trace_end(&call, TRACE_WORKSPACE_ADD, ws);
+}
+
+/* Take 'tb' out of 'ws', as must be done before it is released.
+ */
+void removeWorkspaceTB (TBWorkspace ws, TB tb) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	for (int i = 0; i < ws->nbuffers; i++) {
+		if (ws->buffers[i] == tb) {
+			memmove(&ws->buffers[i], &ws->buffers[i + 1], sizeof(TB) * (ws->nbuffers - i - 1));
+			ws->nbuffers--;
+			break;
+		}
+	}
+	trace_end(&call, TRACE_WORKSPACE_REMOVE, ws);
+}
+
+/* Return a list of the matches of 'search' in every buffer of 'ws', each
+ * tagged with its buffer, in the order the buffers were added and then as
+ * searchTB() orders them.
+ *
+ * - Buffers are cut into tasks of at most SEARCH_TASK_LINES lines, shared
+ *   out between 'nthreads' threads, or one per processor if 0. A thread
+ *   that runs out steals half of the tasks another has left, so one large
+ *   buffer among many small ones doesn't hold up the rest.
+ * - Every buffer is locked for reading until the search ends.
+ * - The user is responsible of freeing the returned list
+ * - The program is to abort() with an error message if 'search' is NULL.
+ */
+WorkspaceMatch searchWorkspaceTB (TBWorkspace ws, char *search, int nthreads) {
+
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	if (search == NULL) {
+		printf("Invalid search");
+		abort();
+	}
+	for (int i = 0; i < ws->nbuffers; i++) {
+		load_mapped(ws->buffers[i]);
+	}
+	//Locked in address order, as lock_pair does, so as not to deadlock
+	TB *locked = tb_alloc(sizeof(TB) * (ws->nbuffers + 1));
+	memcpy(locked, ws->buffers, sizeof(TB) * ws->nbuffers);
+	qsort(locked, ws->nbuffers, sizeof(TB), compare_buffers);
+	for (int i = 0; i < ws->nbuffers; i++) {
+		read_lock(locked[i]);
+	}
+	WorkspaceMatch matches = search_workspace(ws, search, nthreads);
+	long nmatches = 0;
+	for (WorkspaceMatch match = matches; match != NULL; match = match->next) {
+		nmatches++;
+	}
+	for (int i = 0; i < ws->nbuffers; i++) {
+		unlock_tb(locked[i]);
+	}
+	tb_free(locked);
+	trace_end(&call, TRACE_WORKSPACE_SEARCH, ws, search, nthreads, (int) nmatches);
+	return matches;
+}
+
+/* 
+ * Does the work of searchWorkspaceTB, with the buffers already locked
+ */
+static WorkspaceMatch search_workspace(TBWorkspace ws, char *search, int nthreads) {
+
+	//Case 1: search for nothing;
+	long length = strlen(search);
+	if (length == 0) {
+		return NULL;
+	}
+
+	//Case 2: Find how many threads there is work for
+	long ntasks = 0;
+	for (int i = 0; i < ws->nbuffers; i++) {
+		if (ws->buffers[i]->nlines > INT_MAX) {
+			printf("Too many lines");
+			abort();
+		}
+		ntasks = ntasks + (ws->buffers[i]->nlines + SEARCH_TASK_LINES - 1) / SEARCH_TASK_LINES;
+	}
+	if (ntasks == 0) {
+		return NULL;
+	}
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nthreads > ntasks) {
+		nthreads = ntasks;
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+
+	//Case 3: Cut the buffers into tasks, walking only those that need
+	//cutting. One thread takes each buffer whole, with no walk at all.
+	long taskLines = nthreads == 1 ? INT_MAX : SEARCH_TASK_LINES;
+	if (nthreads == 1) {
+		ntasks = 0;
+		for (int i = 0; i < ws->nbuffers; i++) {
+			ntasks = ntasks + (ws->buffers[i]->nlines > 0);
+		}
+	}
+	searchTask *tasks = tb_alloc(sizeof(searchTask) * ntasks);
+	long ntask = 0;
+	for (int i = 0; i < ws->nbuffers; i++) {
+		TB tb = ws->buffers[i];
+		TBNode curr = tb->first;
+		for (long from = 0; from < tb->nlines; from = from + taskLines) {
+			searchTask *task = &tasks[ntask++];
+			task->tb = tb;
+			task->first = curr;
+			task->number = from + 1;
+			task->count = tb->nlines - from < taskLines ? tb->nlines - from : taskLines;
+			task->matches = NULL;
+			task->last = NULL;
+			if (from + task->count < tb->nlines) {
+				for (long j = 0; j < task->count; j++) {
+					COUNT(nodes, 1);
+					curr = curr->next;
+				}
+			}
+		}
+	}
+
+	//Case 4: Deal the tasks out evenly, the first share to this thread
+	searchPool pool = {tasks, search, length, nthreads, tb_alloc(sizeof(uint64_t) * nthreads)};
+	searchWorker *workers = tb_alloc(sizeof(searchWorker) * nthreads);
+	for (int i = 0; i < nthreads; i++) {
+		uint64_t from = ntasks * i / nthreads;
+		uint64_t to = ntasks * (i + 1) / nthreads;
+		pool.ranges[i] = to << 32 | from;
+		workers[i].pool = &pool;
+		workers[i].id = i;
+	}
+	for (int i = 1; i < nthreads; i++) {
+		workers[i].started = pthread_create(&workers[i].thread, NULL, search_worker, &workers[i]) == 0;
+	}
+	search_worker(&workers[0]);
+	for (int i = 1; i < nthreads; i++) {
+		if (workers[i].started) {
+			pthread_join(workers[i].thread, NULL);
+		}
+	}
+
+	//Case 5: Join the tasks' matches in order. A worker that couldn't be
+	//started had its tasks stolen by the others.
+	WorkspaceMatch first = NULL;
+	WorkspaceMatch last = NULL;
+	for (long i = 0; i < ntasks; i++) {
+		if (tasks[i].matches == NULL) {
+			continue;
+		}
+		if (last == NULL) {
+			first = tasks[i].matches;
+		} else {
+			last->next = tasks[i].matches;
+		}
+		last = tasks[i].last;
+	}
+	tb_free(workers);
+	tb_free(pool.ranges);
+	tb_free(tasks);
+	return first;
+}
+
+/* 
+ * Runs the tasks of one of searchWorkspaceTB's threads, then those it can
+ * steal, until none are left
+ */
+static void *search_worker(void *arg) {
+
+	searchWorker *worker = arg;
+	searchPool *pool = worker->pool;
+	uint64_t *own = &pool->ranges[worker->id];
+	while (TRUE) {
+		uint64_t range = __atomic_load_n(own, __ATOMIC_ACQUIRE);
+		uint32_t next = (uint32_t) range;
+		if (next < (uint32_t) (range >> 32)) {
+			if (__atomic_compare_exchange_n(own, &range, range + 1, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				search_task(pool, &pool->tasks[next]);
+			}
+		} else if (!steal_tasks(pool, worker->id)) {
+			return NULL;
+		}
+	}
+}
+
+/* 
+ * Moves the back half of the tasks another thread has left, rounded up, to
+ * the empty range of 'thief'. Returns FALSE if every other range is empty.
+ */
+static int steal_tasks(searchPool *pool, int thief) {
+
+	for (int i = 1; i < pool->nthreads; i++) {
+		uint64_t *victim = &pool->ranges[(thief + i) % pool->nthreads];
+		uint64_t range = __atomic_load_n(victim, __ATOMIC_ACQUIRE);
+		while ((uint32_t) range < (uint32_t) (range >> 32)) {
+			uint32_t next = (uint32_t) range;
+			uint32_t end = (uint32_t) (range >> 32);
+			uint32_t middle = next + (end - next) / 2;
+			//On failure 'range' is reloaded, and the steal tried again
+			if (__atomic_compare_exchange_n(victim, &range, (uint64_t) middle << 32 | next, FALSE,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_store_n(&pool->ranges[thief], (uint64_t) end << 32 | middle, __ATOMIC_RELEASE);
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
+/* 
+ * Searches the lines of 'task', keeping the matches found on it
+ */
+static void search_task(searchPool *pool, searchTask *task) {
+
+	TBNode curr = task->first;
+	for (long i = 0; i < task->count; i++) {
+		if (curr->length >= pool->length) {
+			char *line = node_line(curr);
+			char *charindex = strstr(line, pool->search);
+			while (charindex != NULL) {
+				WorkspaceMatch match = result_alloc(sizeof(workspaceMatchNode));
+				match->tb = task->tb;
+				match->lineNumber = task->number + i;
+				match->charIndex = charindex - line;
+				match->next = NULL;
+				if (task->last == NULL) {
+					task->matches = match;
+				} else {
+					task->last->next = match;
+				}
+				task->last = match;
+				charindex = strstr(charindex + pool->length, pool->search);
+			}
+		}
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+}
+
+static int compare_buffers(const void *a, const void *b) {
+
+	uintptr_t tb1 = (uintptr_t) *(const TB *) a;
+	uintptr_t tb2 = (uintptr_t) *(const TB *) b;
+	return (tb1 > tb2) - (tb1 < tb2);
+}
+
+/* Remove the lines between and including 'from' and 'to' from the textbuffer
+ * 'tb'.
+ *
+ * - The program is to abort() with an error message if 'from' or 'to' is out
+ *   of range.
+ */
+void deleteTB (TB tb, int from, int to){
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	run_delete(tb, from, to);
+	trace_end(&call, TRACE_DELETE, from, to);
+}
+
+/* The same, for lines at any position.
+ */
+void deleteTB64 (TB tb, size_t from, size_t to) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	run_delete(tb, from, to);
+	trace_end(&call, TRACE_DELETE64, from, to);
+}
+
+/* 
+ * Locks 'tb' for deleteTB and does its work, journaling it
+ */
+static void run_delete(TB tb, long from, long to) {
+
+	load_mapped(tb);
+	write_lock(tb);
+	delete_tb(tb, from, to);
+	if (tb->journal != NULL) {
+		journal_edit(tb, JOURNAL_DELETE, from, to, "");
+	}
+	unlock_tb(tb);
+}
+
+/* 
+ * Does the work of deleteTB, with the buffers already locked
+ */
+static void delete_tb(TB tb, long from, long to) {
+
+	//Case 1: tb is empty
+	if (tb->nlines == 0) {
+		return;
+	}
+
+	//Case 2: to is larger than from
+	if (to < from) {
+		printf("Invalid position");
+		abort();
+	}
+
+	//Case 3: If to or from is out of range
+	if (from < 0 || to < 0) {
+		printf("Positions out of range");
+		abort();	
+	}
+	if (from > tb->nlines-1 || to > tb->nlines-1) {
+		printf("Positions out of range");
+		abort();	
+	}
+	record_remove(tb, from, to - from + 1);
+	index_remove(tb, from, to - from + 1);
+	hashes_remove(tb, from, to - from + 1);
+
+	//Case 4: Deleting first node
+	if ((from == 0) && (to != tb->nlines - 1)) {
+		TBNode first = tb->first;
+		TBNode last = tb->first;
+		long line_num = 0; 
+		while (line_num != to) {
+			last = last->next;
+			line_num++;
+			COUNT(nodes, 1);
+		}
+		//adjust tb, leaving the deleted lines pointing back into it for
+		//any reader still on them
+		publish(&tb->first, last->next);
+		last->next->prev = NULL;
+		tb->digest = tb->digest - chain_digest_count(first, to - from + 1);
+		//free from first to last
+		discard_nodes(tb, first, to - from + 1);
+		set_lines(tb, tb->nlines - (to-from + 1));
+		return;
+	}
+ 
+	//Case 5: Deleting last node
+	if ((from != 0) && (to == tb->nlines - 1)) {
+		TBNode first = tb->first;
+		//TBNode last = tb->last;
+		long line_num = 0; 
+		while (line_num != from) {
+			first = first->next;
+			line_num++;
+			COUNT(nodes, 1);
+		}
+		tb->last = first->prev;
+		publish(&first->prev->next, NULL);
+		tb->digest = tb->digest - chain_digest(first);
+		discard_nodes(tb, first, to - from + 1);
+		set_lines(tb, tb->nlines - (to - from + 1));
+		return;
+
+	}
+
+	//Case 6: moving whole text
+	if ((from == 0) && (to == tb->nlines - 1)) {
+		TBNode first = tb->first;
+		publish(&tb->first, NULL);
+		discard_nodes(tb, first, tb->nlines);
+		tb->digest = 0;
+		tb->last = NULL;
+		set_lines(tb, tb->nlines - (to - from + 1));
+		return;
+	}
+
+	//Case 6: Deleting normally
+	TBNode first = tb->first;
+	TBNode last = tb->last;
+	TBNode curr = tb->first;
+	long line_num = 0; 
+	while (curr != NULL) {
+		if (line_num == from) {
+			first = curr;
+		} 
+		if (line_num == to) {
+
+			last = curr;
+		}
+		line_num++;
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+	publish(&first->prev->next, last->next);
+	last->next->prev = first->prev;
+	first->prev = NULL;
+	tb->digest = tb->digest - chain_digest_count(first, to - from + 1);
+	discard_nodes(tb, first, to - from + 1);
+	set_lines(tb, tb->nlines - (to - from + 1));
+	return;
+}
+
+/* 
+ * Frees nodes starting from a start up until it reaches NULL, 'count' of them
+ * Essentially releaseTB if we didn't have the free component
+ */ 
+static void free_nodes(TBNode start, long count) {
+
+	if (defer_nodes(start, count)) {
+		return;
+	}
+	pthread_mutex_lock(&storage_lock);
+	TBNode curr = start;
+	while (curr != NULL) {
+		TBNode next = curr->next;
+		release_line(curr);
+		free_node(curr);
+		COUNT(nodes, 1);
+		curr = next;
+	}
+	pthread_mutex_unlock(&storage_lock);
+}
+
+/* 
+ * Sums the hashes of the nodes from start up until it reaches NULL
+ */ 
+static unsigned long long chain_digest(TBNode start) {
+
+	unsigned long long digest = 0;
+	TBNode curr = start;
+	while (curr != NULL) {
+		digest = digest + curr->hash;
+		curr = curr->next;
+	}
+	return digest;
+}
+
+/* Search every line of tb for each occurrence of a set of specified subsitituions
+ * and alter them accordingly
+ *
+ * refer to spec for table.
+ */
+void formRichText (TB tb){
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	load_mapped(tb);
+	write_lock(tb);
+	form_rich_text(tb);
+	if (tb->journal != NULL) {
+		journal_edit(tb, JOURNAL_RICH, 0, 0, "");
+	}
+	unlock_tb(tb);
+	trace_end(&call, TRACE_RICH);
+}
+
+/* 
+ * Does the work of formRichText, with the buffers already locked
+ */
+static void form_rich_text(TB tb) {
+
+	//Case 1: Empty tb
+	if (tb->nlines == 0) {
+		return;
+	}
+
+	//Case 2: normal case;
+	//Scratch space for the markers of a line, on the heap as lines can be
+	//far bigger than the stack, and grown to fit the longest line so far
+	char *type = NULL;
+	int *array = NULL;
+	long scratch = 0;
+	TBNode curr = tb->first;
+	indexChunk *chunk = indexed_scan(tb);
+	int at = 0;
+	if (chunk != NULL) {
+		curr = chunk->nodes[0];
+	}
+	long position = 0;
+	while (curr != NULL) {
+		int index = 0;
+		char *line = node_line(curr);
+		int length = curr->length;
+		if (length >= scratch) {
+			scratch = length < scratch * 2 ? scratch * 2 : length + 1L;
+			tb_free(type);
+			tb_free(array);
+			type = tb_alloc(scratch);
+			array = tb_alloc(sizeof(int) * scratch);
+		}
+		//Tells you if it is '_' or '*'
+		type[0]= '\0';
+		//Tells you where to find these
+		int charIndex = 0;
+		char  letter = line[charIndex];
+		while (letter != '\0') {
+			int found = 0;
+			if (letter == '*') {
+				int prev = charIndex;
+				found = search_closer(charIndex, &charIndex, line, 1);
+				if (found == 1) {
+					type[index *2] = '1';
+					type[index *2 +1] = '1';
+					array[index *2] = prev;
+					array[index *2 +1] = charIndex;
+					index++;
+				}
+			} else if (letter == '_') {
+				int prev = charIndex;
+				found = search_closer(charIndex, &charIndex, line, 2);
+				if (found == 1) {
+					type[index *2] = '2';
+					type[index *2 +1] = '2';
+					array[index *2] = prev;
+					array[index *2 +1] = charIndex;
+					index++;
+				}
+			} else if ((letter == '#') && (charIndex == 0) && (length > 1)) {
+				type[index *2] = '3';
+				type[index *2 +1] = '3';
+				array[0] = 0;
+				array[1] = length;
+				index++;
+				charIndex = length-1;
+			}	
+			charIndex++;
+			letter = line[charIndex];
+		}
+		if (index > 0) {
+			replace_line(tb, curr, addrich(length, array, type, line, index * 2));
+			record_change(tb, position, curr);
+			index_resize(tb, position, curr->length - length);
+			hashes_change(tb, position);
+		}
+		position++;
+		COUNT(nodes, 1);
+		curr = chunk != NULL ? next_indexed(&chunk, &at) : curr->next;
+	}
+	tb_free(type);
+	tb_free(array);
+}
+
+/* Searches through a line to find the next valid '*' or '_'
+ * If none found, it returns FALSE
+ * If found, it returns TRUE and increments charIndex in the caller
+ */
+static int search_closer(int charIndex, int *new_start, char *line, int type) {
+
+	charIndex = charIndex + 1;
+	char letter = line[charIndex];
+
+	if ((type == 1) && (letter == '*')) {
+		return FALSE;
+	} 
+	if ((type == 2) && (letter == '_')) {
+		return FALSE;
+	} 
+
+	while (letter != '\0') {
+		if ((letter == '*') && (type == 1)) {
+			*new_start = charIndex;
+			return TRUE;
+		} else if ((letter == '_') && (type == 2)) {
+			*new_start = charIndex;
+			return TRUE;
+		}
+		charIndex++;
+		letter = line[charIndex];
+	}
+	return FALSE;
+}
+	
+
+
+/* 
+ * Copies the text between the markers found by formRichText into a new line,
+ * replacing each marker with its opening or closing tag. 'line' is left
+ * untouched, as it may be shared with other buffers.
+ */
+static char *addrich(int length, int *array, char *type, char *line, int index) {
+
+	//A heading of one character grows the most, to five times its length
+	char *new_line = tb_alloc((size_t) length * 5 + 1);
+	long out = 0;
+
+	//Text before the first marker
+	if (type[0] != '3') {
+		memcpy(new_line, line, array[0]);
+		out = array[0];
+	}
+
+	int i = 0;
+	int check = 0;
+	while(i<index) {
+		const char *tag = "";
+		if (type[i] == '1') {
+			tag = check == 0 ? "<b>" : "</b>";
+		} else if (type[i] == '2') {
+			tag = check == 0 ? "<i>" : "</i>";
+		} else if (type[i] == '3') {
+			tag = check == 0 ? "<h1>" : "</h1>";
+		}
+		int tag_length = strlen(tag);
+		memcpy(new_line + out, tag, tag_length);
+		out = out + tag_length;
+
+		//Text up to the next marker, or the end of the line
+		int start = array[i] + 1;
+		int end = (i + 1 < index) ? array[i + 1] : length;
+		if (start < end) {
+			memcpy(new_line + out, line + start, end - start);
+			out = out + end - start;
+		}
+		check = !check;
+		i++;
+	}
+	new_line[out] = '\0';
+	COUNT(bytes, out);
+	return new_line;
+}
+
+
+/* Allocate a new, empty batch of edits.
+ */
+TBBatch newBatchTB (void) {
+
+	TBBatch batch = tb_alloc(sizeof(struct textbufferBatch));
+	batch->edits = NULL;
+	batch->nedits = 0;
+	batch->capacity = 0;
+	batch->traceGeneration = 0;
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	trace_end(&call, TRACE_BATCH_NEW, batch);
+	return batch;
+}
+
+/* Free the memory occupied by the given batch, including any edits that
+ * were never applied.
+ */
+void releaseBatchTB (TBBatch batch) {
+
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	trace_end(&call, TRACE_BATCH_RELEASE, batch);
+	free_batch(batch);
+}
+
+/* 
+ * Does the work of releaseBatchTB
+ */
+static void free_batch(TBBatch batch) {
+
+	for (int i = 0; i < batch->nedits; i++) {
+		tb_free(batch->edits[i].prefix);
+		if (batch->edits[i].first != NULL) {
+			free_nodes(batch->edits[i].first, batch->edits[i].count);
+		}
+	}
+	tb_free(batch->edits);
+	tb_free(batch);
+}
+
+/* Queue the removal of the lines between and including 'from' and 'to'.
+ *
+ * - The program is to abort() with an error message if 'from' is after 'to'.
+ */
+void batchDeleteTB (TBBatch batch, int from, int to) {
+
+	if (from > to || from < 0) {
+		printf("Invalid positions");
+		abort();
+	}
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	queue_edit(batch, BATCH_DELETE, from, to);
+	trace_end(&call, TRACE_BATCH_DELETE, batch, from, to);
+}
+
+/* Queue adding 'prefix' to the lines between and including 'pos1' and 'pos2'.
+ *
+ * - The program is to abort() with an error message if 'pos1' is after 'pos2'.
+ */
+void batchPrefixTB (TBBatch batch, int pos1, int pos2, char *prefix) {
+
+	if (prefix == NULL || pos1 > pos2 || pos1 < 0) {
+		printf("Invalid positions");
+		abort();
+	}
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	if (strcmp(prefix, "") != 0) {
+		batchEdit *edit = queue_edit(batch, BATCH_PREFIX, pos1, pos2);
+		int length = strlen(prefix) + 1;
+		edit->prefix = tb_alloc(length);
+		memcpy(edit->prefix, prefix, length);
+	}
+	trace_end(&call, TRACE_BATCH_PREFIX, batch, pos1, pos2, prefix);
+}
+
+/* Queue a copy of 'tb2' to be inserted before line 'pos'.
+ *
+ * - The lines are copied straight away, so 'tb2' may change or be released
+ *   before the batch is applied.
+ */
+void batchPasteTB (TBBatch batch, int pos, TB tb2) {
+
+	if (pos < 0) {
+		printf("Positions out of range");
+		abort();
+	}
+	traceCall call;
+	trace_begin(&call, tb2, NULL);
+	load_mapped(tb2);
+	read_lock(tb2);
+	if (tb2->nlines != 0) {
+		batchEdit *edit = queue_edit(batch, BATCH_PASTE, pos, pos);
+		pthread_mutex_lock(&storage_lock);
+		TBNode curr = tb2->first;
+		while (curr != NULL) {
+			TBNode copy = copyTBNode(curr);
+			if (edit->first == NULL) {
+				edit->first = copy;
+			} else {
+				edit->last->next = copy;
+				copy->prev = edit->last;
+			}
+			edit->last = copy;
+			edit->count++;
+			curr = curr->next;
+		}
+		pthread_mutex_unlock(&storage_lock);
+	}
+	unlock_tb(tb2);
+	trace_end(&call, TRACE_BATCH_PASTE, batch, pos);
+}
+
+/* Apply every edit queued in 'batch' to 'tb' in a single pass, then empty
+ * the batch.
+ *
+ * - Positions refer to the lines of 'tb' before any of the batch is applied.
+ * - Pastes at the same position go in the order they were queued, before the
+ *   line at that position. A position equal to the number of lines appends.
+ * - Prefixes on the same line are added in the order they were queued, as
+ *   if addPrefixTB() had been called for each. Pasted lines get no prefixes.
+ * - Deleted lines lose any prefixes queued for them.
+ * - The program is to abort() with an error message if any edit is out of
+ *   range, in which case 'tb' is left unmodified.
+ */
+void applyBatchTB (TB tb, TBBatch batch) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	load_mapped(tb);
+	write_lock(tb);
+	textBuilder record = {NULL, 0, 0};
+	if (tb->journal != NULL && batch->nedits != 0) {
+		journal_batch(&record, batch);
+	}
+	apply_batch(tb, batch);
+	if (record.text != NULL) {
+		journal_append(tb, &record);
+	}
+	unlock_tb(tb);
+	trace_end(&call, TRACE_BATCH_APPLY, batch);
+}
+
+/* 
+ * Does the work of applyBatchTB, with the buffer already locked
+ */
+static void apply_batch(TB tb, TBBatch batch) {
+
+	//Case 1: Check every edit before changing anything
+	int nedits = batch->nedits;
+	for (int i = 0; i < nedits; i++) {
+		batchEdit *edit = &batch->edits[i];
+		long limit = edit->kind == BATCH_PASTE ? tb->nlines : tb->nlines - 1;
+		if (edit->to > limit) {
+			printf("Positions out of range");
+			abort();
+		}
+	}
+
+	//Case 2: Sort the edits by position, keeping the queued order
+	batchEdit **sorted = tb_alloc(sizeof(batchEdit *) * (nedits + 1));
+	for (int i = 0; i < nedits; i++) {
+		sorted[i] = &batch->edits[i];
+	}
+	qsort(sorted, nedits, sizeof(batchEdit *), compare_edits);
+	//Prefixes that cover the current line, oldest first
+	batchEdit **active = tb_alloc(sizeof(batchEdit *) * (nedits + 1));
+	int nactive = 0;
+	textBuilder prefix = {NULL, 0, 0};
+	append_text(&prefix, "", 0);
+
+	//Case 3: Walk the buffer once
+	TBNode curr = tb->first;
+	TBNode removed = NULL;
+	long nremoved = 0;
+	int next = 0;
+	long delete_until = -1;
+	int changed = FALSE;
+	long pos = 0;
+	//Lines removed at 'pos' not yet taken out of the hash blocks, which
+	//take a run at a time
+	long removing = 0;
+	for (long i = 0; i <= tb->nlines; i++) {
+		//Take on the edits that start at this line
+		while (next < nedits && sorted[next]->from == i) {
+			batchEdit *edit = sorted[next++];
+			if (edit->kind == BATCH_PASTE) {
+				link_before(tb, curr, edit->first, edit->last);
+				record_insert(tb, pos, edit->first, edit->count);
+				index_remove(tb, pos, removing);
+				hashes_remove(tb, pos, removing);
+				removing = 0;
+				index_insert(tb, pos, edit->first, edit->count);
+				hashes_insert(tb, pos, edit->count);
+				tb->digest = tb->digest + chain_digest_count(edit->first, edit->count);
+				pos = pos + edit->count;
+				edit->first = NULL;
+				edit->last = NULL;
+			} else if (edit->kind == BATCH_DELETE) {
+				if (edit->to > delete_until) {
+					delete_until = edit->to;
+				}
+			} else {
+				int j = nactive++;
+				while (j > 0 && active[j - 1]->seq > edit->seq) {
+					active[j] = active[j - 1];
+					j--;
+				}
+				active[j] = edit;
+				changed = TRUE;
+			}
+		}
+		if (curr == NULL) {
+			break;
+		}
+
+		//Drop the prefixes that ended before this line
+		int kept = 0;
+		for (int j = 0; j < nactive; j++) {
+			if (active[j]->to >= i) {
+				active[kept++] = active[j];
+			}
+		}
+		if (kept != nactive) {
+			nactive = kept;
+			changed = TRUE;
+		}
+		if (changed) {
+			//The newest prefix ends up outermost
+			prefix.length = 0;
+			prefix.text[0] = '\0';
+			for (int j = nactive - 1; j >= 0; j--) {
+				append_text(&prefix, active[j]->prefix, strlen(active[j]->prefix));
+			}
+			changed = FALSE;
+		}
+
+		TBNode following = curr->next;
+		if (i <= delete_until) {
+			unlink_node(tb, curr);
+			tb->digest = tb->digest - curr->hash;
+			record_remove(tb, pos, 1);
+			removing++;
+			if (tb->snapshot) {
+				discard_nodes(tb, curr, 1);
+			} else {
+				curr->next = removed;
+				removed = curr;
+				nremoved++;
+			}
+		} else {
+			index_remove(tb, pos, removing);
+			hashes_remove(tb, pos, removing);
+			removing = 0;
+			if (nactive > 0) {
+				char *new_line = tb_alloc(prefix.length + curr->length + 1);
+				memcpy(new_line, prefix.text, prefix.length);
+				memcpy(new_line + prefix.length, node_line(curr), curr->length + 1);
+				COUNT(bytes, prefix.length + curr->length + 1);
+				long length = curr->length;
+				replace_line(tb, curr, new_line);
+				record_change(tb, pos, curr);
+				index_resize(tb, pos, curr->length - length);
+				hashes_change(tb, pos);
+			}
+			pos++;
+		}
+		COUNT(nodes, 1);
+		curr = following;
+	}
+	index_remove(tb, pos, removing);
+	hashes_remove(tb, pos, removing);
+	set_lines(tb, pos);
+	if (removed != NULL) {
+		free_nodes(removed, nremoved);
+	}
+
+	free(prefix.text);
+	tb_free(active);
+	tb_free(sorted);
+	for (int i = 0; i < nedits; i++) {
+		tb_free(batch->edits[i].prefix);
+	}
+	batch->nedits = 0;
+}
+
+/* 
+ * Appends a blank edit of the given kind to 'batch'
+ */
+static batchEdit *queue_edit(TBBatch batch, int kind, int from, int to) {
+
+	if (batch->nedits == batch->capacity) {
+		batch->capacity = batch->capacity == 0 ? 16 : batch->capacity * 2;
+		batch->edits = tb_realloc(batch->edits, sizeof(batchEdit) * batch->capacity);
+	}
+	batchEdit *edit = &batch->edits[batch->nedits];
+	edit->kind = kind;
+	edit->from = from;
+	edit->to = to;
+	edit->seq = batch->nedits;
+	edit->prefix = NULL;
+	edit->first = NULL;
+	edit->last = NULL;
+	edit->count = 0;
+	batch->nedits++;
+	return edit;
+}
+
+/* 
+ * Orders edits by the line they start at, then by when they were queued
+ */
+static int compare_edits(const void *a, const void *b) {
+
+	const batchEdit *edit1 = *(batchEdit * const *) a;
+	const batchEdit *edit2 = *(batchEdit * const *) b;
+	if (edit1->from != edit2->from) {
+		return edit1->from < edit2->from ? -1 : 1;
+	}
+	return edit1->seq < edit2->seq ? -1 : (edit1->seq > edit2->seq);
+}
+
+/* 
+ * Links the chain first..last into 'tb' before 'node', or at the end if
+ * 'node' is NULL. Does not update nlines.
+ */
+static void link_before(TB tb, TBNode node, TBNode first, TBNode last) {
+
+	TBNode prev = node == NULL ? tb->last : node->prev;
+	first->prev = prev;
+	last->next = node;
+	if (prev == NULL) {
+		publish(&tb->first, first);
+	} else {
+		publish(&prev->next, first);
+	}
+	if (node == NULL) {
+		tb->last = last;
+	} else {
+		node->prev = last;
+	}
+}
+
+/* 
+ * Takes 'node' out of the list of 'tb'. Does not update nlines, and leaves
+ * the links of 'node' alone for any reader still on it.
+ */
+static void unlink_node(TB tb, TBNode node) {
+
+	if (node->prev == NULL) {
+		publish(&tb->first, node->next);
+	} else {
+		publish(&node->prev->next, node->next);
+	}
+	if (node->next == NULL) {
+		tb->last = node->prev;
+	} else {
+		node->next->prev = node->prev;
+	}
+}
+
+/* 
+ * Sums the hashes of 'count' nodes starting from start
+ */
+static unsigned long long chain_digest_count(TBNode start, long count) {
+
+	unsigned long long digest = 0;
+	TBNode curr = start;
+	for (long i = 0; i < count; i++) {
+		digest = digest + curr->hash;
+		curr = curr->next;
+	}
+	return digest;
+}
+
+/* Return a string of edit commands which, applied in order to 'tb1', turn it
+ * into 'tb2'. Each command is on its own line:
+ *
+ *   "+,POS,TEXT" - insert a line containing TEXT at position POS
+ *   "-,POS"      - delete the line at position POS
+ *
+ * POS refers to tb1 as it stands after the previous commands have been
+ * applied. Each buffer keeps a hash for every block of about HASH_BLOCK
+ * lines, built by the first call and rehashed only where later edits land.
+ * Runs of blocks both buffers share at the start and end, and blocks found
+ * exactly once in each buffer between them, are matched by hash, so that
+ * near-identical buffers are only diffed over the blocks that changed. The
+ * lines of matched blocks are compared before they are passed over, so a
+ * hash collision costs time but never gives a wrong script. The lines left
+ * between matched blocks get a minimal script, found with Myers' O(ND)
+ * algorithm using the linear space (middle snake) refinement over integer
+ * ids given to each distinct line.
+ */
+char* diffTB (TB tb1, TB tb2) {
+
+	traceCall call;
+	trace_begin(&call, tb1, tb2);
+	load_mapped(tb1);
+	load_mapped(tb2);
+	lock_hashes(tb1, tb2);
+	char *diff = diff_tb(tb1, tb2);
+	unlock_pair(tb1, tb2);
+	trace_end(&call, TRACE_DIFF);
+	return diff;
+}
+
+/* 
+ * Does the work of diffTB, with the buffers already locked
+ */
+static char *diff_tb(TB tb1, TB tb2) {
+
+	//Case 1: Same buffer, or both empty
+	textBuilder script = {NULL, 0, 0};
+	append_text(&script, "", 0);
+	if ((tb1 == tb2) || (tb1->nlines == 0 && tb2->nlines == 0)) {
+		return script.text;
+	}
+
+	//Case 2: Normal case
+	//Pass over the stretches of lines the hash blocks show both buffers
+	//share, and diff the lines between them. A stretch whose lines turn out
+	//not to match is diffed along with the lines either side of it.
+	long nanchors;
+	diffAnchor *anchors = match_blocks(tb1, tb2, &nanchors);
+	long x = 0;
+	long y = 0;
+	long pos = 0;
+	TBNode xnext = tb1->first;
+	TBNode ynext = tb2->first;
+	for (long i = 0; i < nanchors; i++) {
+		diffAnchor *anchor = &anchors[i];
+		if (!same_lines(anchor->xfirst, anchor->yfirst, anchor->count)) {
+			continue;
+		}
+		TBNode xlast = anchor->xfirst != NULL ? anchor->xfirst->prev : tb1->last;
+		TBNode ylast = anchor->yfirst != NULL ? anchor->yfirst->prev : tb2->last;
+		pos = diff_lines(&script, xnext, xlast, anchor->xline - x, ynext, ylast, anchor->yline - y, pos);
+		pos = pos + anchor->count;
+		x = anchor->xline + anchor->count;
+		y = anchor->yline + anchor->count;
+		xnext = anchor->xnext;
+		ynext = anchor->ynext;
+	}
+	tb_free(anchors);
+	return script.text;
+}
+
+/* 
+ * Finds stretches of lines that 'tb1' and 'tb2' share, in the same order,
+ * from their hash blocks: the runs of blocks at either end that match, then
+ * between them, the blocks found once in each buffer, as many of those as
+ * keep their order. The last stretch is an empty one at the end of both.
+ */
+static diffAnchor *match_blocks(TB tb1, TB tb2, long *nanchors) {
+
+	//Case 1: Runs of blocks ending on the same line in both, from the start
+	hashIndex *xhashes = sync_hashes(tb1);
+	hashIndex *yhashes = sync_hashes(tb2);
+	long prefix = 0;
+	long xfrom = 0;
+	long yfrom = 0;
+	long xend = 0;
+	long yend = 0;
+	unsigned long long xhash = 0;
+	unsigned long long yhash = 0;
+	long i = 0;
+	long j = 0;
+	while (xend <= yend ? i < xhashes->nblocks : j < yhashes->nblocks) {
+		if (xend <= yend) {
+			xhash = join_hash(xhash, xhashes->blocks[i].power, xhashes->blocks[i].hash);
+			xend = xend + xhashes->blocks[i++].count;
+		} else {
+			yhash = join_hash(yhash, yhashes->blocks[j].power, yhashes->blocks[j].hash);
+			yend = yend + yhashes->blocks[j++].count;
+		}
+		if (xend == yend) {
+			if (xhash != yhash) {
+				break;
+			}
+			prefix = xend;
+			xfrom = i;
+			yfrom = j;
+			xhash = 0;
+			yhash = 0;
+		}
+	}
+
+	//Case 2: The same from the end, short of the blocks already matched
+	long suffix = 0;
+	long xto = xhashes->nblocks;
+	long yto = yhashes->nblocks;
+	long xlength = 0;
+	long ylength = 0;
+	unsigned long long xpower = 1;
+	unsigned long long ypower = 1;
+	xhash = 0;
+	yhash = 0;
+	i = xto;
+	j = yto;
+	while (xlength <= ylength ? i > xfrom : j > yfrom) {
+		if (xlength <= ylength) {
+			i--;
+			xhash = join_hash(xhashes->blocks[i].hash, xpower, xhash);
+			xpower = mul_mod(xpower, xhashes->blocks[i].power);
+			xlength = xlength + xhashes->blocks[i].count;
+		} else {
+			j--;
+			yhash = join_hash(yhashes->blocks[j].hash, ypower, yhash);
+			ypower = mul_mod(ypower, yhashes->blocks[j].power);
+			ylength = ylength + yhashes->blocks[j].count;
+		}
+		if (xlength == ylength) {
+			if (xhash != yhash) {
+				break;
+			}
+			suffix = xlength;
+			xto = i;
+			yto = j;
+			xhash = 0;
+			yhash = 0;
+			xpower = 1;
+			ypower = 1;
+		}
+	}
+
+	//Case 3: In between, pair up the blocks found once in each buffer
+	long nx = xto - xfrom;
+	long ny = yto - yfrom;
+	blockKey *keys = tb_alloc(sizeof(blockKey) * (nx + ny + 1));
+	for (i = 0; i < nx; i++) {
+		hashBlock *block = &xhashes->blocks[xfrom + i];
+		keys[i] = (blockKey) {block->hash, block->power, xfrom + i, 0};
+	}
+	for (j = 0; j < ny; j++) {
+		hashBlock *block = &yhashes->blocks[yfrom + j];
+		keys[nx + j] = (blockKey) {block->hash, block->power, yfrom + j, 1};
+	}
+	qsort(keys, nx + ny, sizeof(blockKey), compare_block_keys);
+	blockPair *pairs = tb_alloc(sizeof(blockPair) * (nx + 1));
+	long npairs = 0;
+	for (long k = 0; k < nx + ny; ) {
+		long same = k + 1;
+		while (same < nx + ny && keys[same].hash == keys[k].hash && keys[same].power == keys[k].power) {
+			same++;
+		}
+		if (same == k + 2 && keys[k].side == 0 && keys[k + 1].side == 1) {
+			pairs[npairs].xblock = keys[k].block;
+			pairs[npairs].yblock = keys[k + 1].block;
+			npairs++;
+		}
+		k = same;
+	}
+	qsort(pairs, npairs, sizeof(blockPair), compare_block_pairs);
+
+	//Keep the longest run of pairs whose blocks of tb2 are in order too,
+	//found as patience sorting does: 'tails' holds the last pair of the
+	//best run of each length so far, and 'links' the pair before each
+	long *tails = tb_alloc(sizeof(long) * (npairs + 1));
+	long *links = tb_alloc(sizeof(long) * (npairs + 1));
+	long longest = 0;
+	for (long k = 0; k < npairs; k++) {
+		long low = 0;
+		long high = longest;
+		while (low < high) {
+			long mid = (low + high) / 2;
+			if (pairs[tails[mid]].yblock < pairs[k].yblock) {
+				low = mid + 1;
+			} else {
+				high = mid;
+			}
+		}
+		links[k] = low > 0 ? tails[low - 1] : -1;
+		tails[low] = k;
+		if (low == longest) {
+			longest++;
+		}
+	}
+	//The run is followed back from its end, so it is listed back to front
+	long k = longest > 0 ? tails[longest - 1] : -1;
+	for (long at = longest - 1; at >= 0; at--) {
+		tails[at] = k;
+		k = links[k];
+	}
+
+	//Case 4: List the stretches in order, counting lines up to each block
+	diffAnchor *anchors = tb_alloc(sizeof(diffAnchor) * (longest + 3));
+	long n = 0;
+	if (prefix > 0) {
+		anchors[n++] = (diffAnchor) {0, 0, prefix, tb1->first, tb2->first, block_first(tb1, xfrom), block_first(tb2, yfrom)};
+	}
+	long xline = prefix;
+	long yline = prefix;
+	i = xfrom;
+	j = yfrom;
+	for (long at = 0; at < longest; at++) {
+		blockPair *pair = &pairs[tails[at]];
+		while (i < pair->xblock) {
+			xline = xline + xhashes->blocks[i++].count;
+		}
+		while (j < pair->yblock) {
+			yline = yline + yhashes->blocks[j++].count;
+		}
+		anchors[n++] = (diffAnchor) {xline, yline, xhashes->blocks[i].count, block_first(tb1, i), block_first(tb2, j),
+			block_first(tb1, i + 1), block_first(tb2, j + 1)};
+	}
+	if (suffix > 0) {
+		anchors[n++] = (diffAnchor) {tb1->nlines - suffix, tb2->nlines - suffix, suffix,
+			block_first(tb1, xto), block_first(tb2, yto), NULL, NULL};
+	}
+	anchors[n++] = (diffAnchor) {tb1->nlines, tb2->nlines, 0, NULL, NULL, NULL, NULL};
+	tb_free(links);
+	tb_free(tails);
+	tb_free(pairs);
+	tb_free(keys);
+	*nanchors = n;
+	return anchors;
+}
+
+/* 
+ * Orders block keys by hash, then by buffer, so that a block found once in
+ * each buffer sorts as the one of tb1 then the one of tb2
+ */
+static int compare_block_keys(const void *a, const void *b) {
+
+	const blockKey *x = a;
+	const blockKey *y = b;
+	if (x->hash != y->hash) {
+		return x->hash < y->hash ? -1 : 1;
+	}
+	if (x->power != y->power) {
+		return x->power < y->power ? -1 : 1;
+	}
+	return x->side - y->side;
+}
+
+/* 
+ * Orders pairs of blocks by their block of tb1
+ */
+static int compare_block_pairs(const void *a, const void *b) {
+
+	const blockPair *x = a;
+	const blockPair *y = b;
+	return (x->xblock > y->xblock) - (x->xblock < y->xblock);
+}
+
+/* 
+ * Appends to 'script' the commands that turn the 'n' lines of tb1 from
+ * 'xfirst' to 'xlast' into the 'm' lines of tb2 from 'yfirst' to 'ylast',
+ * the first of them at line 'pos' of tb1 as edited so far. Returns the line
+ * of tb1 after them once edited.
+ */
+static long diff_lines(textBuilder *script, TBNode xfirst, TBNode xlast, long n, TBNode yfirst, TBNode ylast, long m, long pos) {
+
+	//Skip the lines both share at either end
+	while (n > 0 && m > 0 && same_line(xfirst, yfirst)) {
+		xfirst = xfirst->next;
+		yfirst = yfirst->next;
+		n--;
+		m--;
+		pos++;
+		COUNT(nodes, 2);
+	}
+	long suffix = 0;
+	while (n > 0 && m > 0 && same_line(xlast, ylast)) {
+		xlast = xlast->prev;
+		ylast = ylast->prev;
+		n--;
+		m--;
+		suffix++;
+		COUNT(nodes, 2);
+	}
+	if (n == 0 && m == 0) {
+		return pos + suffix;
+	}
+
+	//Give every distinct line in between an integer id
+	lineTable table;
+	new_line_table(&table, n + m);
+	long *xv = tb_alloc(sizeof(long) * (n + m));
+	char **ylines = tb_alloc(sizeof(char *) * (m + 1));
+	long *yv = xv + n;
+	TBNode curr = xfirst;
+	for (long i = 0; i < n; i++) {
+		xv[i] = line_id(&table, node_line(curr), curr->hash);
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+	curr = yfirst;
+	for (long i = 0; i < m; i++) {
+		ylines[i] = node_line(curr);
+		yv[i] = line_id(&table, ylines[i], curr->hash);
+		COUNT(nodes, 1);
+		curr = curr->next;
+	}
+	free_line_table(&table);
+
+	//Mark which lines of tb1 are deleted, and which lines of tb2 inserted
+	diffContext ctx;
+	ctx.xv = xv;
+	ctx.yv = yv;
+	ctx.xchanged = tb_alloc(sizeof(char) * (n + m));
+	memset(ctx.xchanged, 0, sizeof(char) * (n + m));
+	ctx.vbuf = tb_alloc(sizeof(long) * 2 * (n + m + 3));
+	ctx.ychanged = ctx.xchanged + n;
+	ctx.fdiag = ctx.vbuf + m + 1;
+	ctx.bdiag = ctx.fdiag + n + m + 3;
+	compare_seq(&ctx, 0, n, 0, m);
+
+	//Walk both together, emitting commands against tb1
+	long x = 0;
+	long y = 0;
+	while (x < n || y < m) {
+		char command[32];
+		if (x < n && ctx.xchanged[x]) {
+			int len = snprintf(command, sizeof(command), "-,%ld\n", pos);
+			append_text(script, command, len);
+			x++;
+		} else if (y < m && ctx.ychanged[y]) {
+			int len = snprintf(command, sizeof(command), "+,%ld,", pos);
+			append_text(script, command, len);
+			append_text(script, ylines[y], strlen(ylines[y]));
+			append_text(script, "\n", 1);
+			pos++;
+			y++;
+		} else {
+			pos++;
+			x++;
+			y++;
+		}
+	}
+	tb_free(ctx.vbuf);
+	tb_free(ctx.xchanged);
+	tb_free(ylines);
+	tb_free(xv);
+	return pos + suffix;
+}
+
+/* Turn interning of the lines of 'tb' on or off.
+ *
+ * - While on, every line written to 'tb' is stored once in an intern table
+ *   shared by all textbuffers, and identical lines share a single refcounted
+ *   payload. The lines already in 'tb' are interned straight away.
+ * - Turning it off gives every line of 'tb' its own private copy again.
+ * - Lines moved in from other buffers keep the storage they already had.
+ */
+void setInternTB (TB tb, int intern) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	load_mapped(tb);
+	write_lock(tb);
+	pthread_mutex_lock(&storage_lock);
+	tb->intern = intern;
+	TBNode curr = tb->first;
+	while (curr != NULL) {
+		if (intern && !curr->interned) {
+			char *line = intern_line(node_line(curr), curr->hash);
+			if (tb->snapshot) {
+				retire_line(curr);
+			} else {
+				release_line(curr);
+			}
+			__atomic_store_n(&curr->line, line, __ATOMIC_RELEASE);
+			curr->interned = TRUE;
+		} else if (!intern && curr->interned && tb->snapshot) {
+			char *line = tb_alloc(curr->length + 1);
+			memcpy(line, node_line(curr), curr->length + 1);
+			retire_line(curr);
+			__atomic_store_n(&curr->line, line, __ATOMIC_RELEASE);
+			curr->interned = FALSE;
+		} else if (!intern && curr->interned) {
+			char *line = node_line(curr);
+			store_line(curr, line, curr->length);
+			unintern_line(line);
+		}
+		curr = curr->next;
+	}
+	pthread_mutex_unlock(&storage_lock);
+	unlock_tb(tb);
+	trace_end(&call, TRACE_INTERN, intern);
+}
+
+/* Fill in 'stats' with the current state of the shared intern table,
+ * including how many bytes interning has saved.
+ */
+void internStatsTB (internStats *stats) {
+
+	pthread_mutex_lock(&storage_lock);
+	*stats = interned.stats;
+	pthread_mutex_unlock(&storage_lock);
+}
+
+/* Fill in 'usage' with the memory 'tb' holds.
+ *
+ * - nodeBytes covers the header, every node and the edit history.
+ * - payloadBytes covers lines too long to fit in their node. An interned
+ *   line is split evenly between the nodes sharing it. For a buffer still
+ *   read from its snapshot it is the size of the mapped file.
+ * - slackBytes is the part of both that holds nothing: the room left in
+ *   each node after any line kept there, and unused history.
+ */
+void memoryUsageTB (TB tb, memoryUsage *usage) {
+
+	read_lock(tb);
+	if (tb->mapped != NULL) {
+		usage->nodeBytes = sizeof(textbuffer) + sizeof(mappedLines);
+		usage->payloadBytes = tb->mapped->size;
+		usage->slackBytes = 0;
+		unlock_tb(tb);
+		return;
+	}
+	pthread_mutex_lock(&storage_lock);
+	usage->nodeBytes = sizeof(textbuffer) + (long) tb->nlines * sizeof(struct textbufferNode);
+	usage->payloadBytes = 0;
+	usage->slackBytes = 0;
+	TBNode curr = tb->first;
+	while (curr != NULL) {
+		if (curr->line == curr->small) {
+			usage->slackBytes = usage->slackBytes + INLINE_LINE - curr->length - 1;
+		} else if (curr->interned) {
+			internedLine *entry = (internedLine *) (curr->line - offsetof(internedLine, text));
+			usage->payloadBytes = usage->payloadBytes + (sizeof(internedLine) + entry->length + 1) / entry->refs;
+			usage->slackBytes = usage->slackBytes + INLINE_LINE;
+		} else {
+			usage->payloadBytes = usage->payloadBytes + curr->length + 1;
+			usage->slackBytes = usage->slackBytes + INLINE_LINE;
+		}
+		curr = curr->next;
+	}
+	if (tb->history != NULL) {
+		editHistory *history = tb->history;
+		usage->nodeBytes = usage->nodeBytes + sizeof(editHistory) + history->script.capacity
+			+ sizeof(long) * history->capacity;
+		usage->slackBytes = usage->slackBytes + history->script.capacity - history->script.length - 1
+			+ sizeof(long) * (history->capacity - history->ncheckpoints);
+	}
+	if (tb->index != NULL) {
+		usage->nodeBytes = usage->nodeBytes + sizeof(lineIndex) + sizeof(indexChunk) * tb->index->nchunks;
+		usage->slackBytes = usage->slackBytes
+			+ (sizeof(long) + sizeof(TBNode)) * (2 * INDEX_CHUNK * tb->index->nchunks - tb->index->valid);
+	}
+	if (tb->hashes != NULL) {
+		usage->nodeBytes = usage->nodeBytes + sizeof(hashIndex) + sizeof(hashBlock) * tb->hashes->capacity;
+		usage->slackBytes = usage->slackBytes + sizeof(hashBlock) * (tb->hashes->capacity - tb->hashes->nblocks);
+	}
+	pthread_mutex_unlock(&storage_lock);
+	unlock_tb(tb);
+}
+
+/* Take the memory of every textbuffer, batch and the intern table from
+ * 'allocate', 'reallocate' and 'deallocate', each passed 'ctx'. Passing
+ * NULLs goes back to malloc.
+ *
+ * - Anything handed back to the caller (dumps, matches, diffs) still comes
+ *   from malloc, so that it can be free()d as before.
+ * - Node blocks must be aligned to their size; if 'allocate' doesn't give
+ *   that, each block takes twice its size to be aligned within.
+ * - Each read of a snapshot buffer takes a few bytes from it while it runs,
+ *   so it must be safe to call from every thread reading one.
+ * - Returns FALSE, changing nothing, while any memory from the current
+ *   allocator has not been freed: set it before the first textbuffer is made
+ *   or after the last one is released.
+ */
+int setAllocatorTB (void *(*allocate)(size_t size, void *ctx),
+                    void *(*reallocate)(void *ptr, size_t size, void *ctx),
+                    void (*deallocate)(void *ptr, void *ctx), void *ctx) {
+
+	if ((allocate == NULL) != (reallocate == NULL) || (allocate == NULL) != (deallocate == NULL)) {
+		return FALSE;
+	}
+	//Lines released from snapshot buffers, or deferred, may still be waiting
+	//to be freed
+	reclaim_retired();
+	drain_frees();
+	pthread_mutex_lock(&storage_lock);
+	//Let go of memory only kept for reuse
+	if (blocks.current != NULL && blocks.current->used == 0) {
+		retire_block(blocks.current);
+	}
+	if (interned.stats.uniqueLines == 0 && interned.buckets != NULL) {
+		tb_free(interned.buckets);
+		interned.buckets = NULL;
+		interned.size = 0;
+	}
+	int idle = __atomic_load_n(&allocator.live, __ATOMIC_RELAXED) == 0;
+	if (idle) {
+		allocator.allocate = allocate;
+		allocator.reallocate = reallocate;
+		allocator.deallocate = deallocate;
+		allocator.ctx = ctx;
+	}
+	pthread_mutex_unlock(&storage_lock);
+	return idle;
+}
+
+/* 
+ * Returns the text of the line held by 'node'. Every read of a line goes
+ * through here, wherever the line is stored.
+ */
+static char *node_line(TBNode node) {
+	return __atomic_load_n(&node->line, __ATOMIC_ACQUIRE);
+}
+
+/* 
+ * Gives 'node' a private copy of 'line', inside the node if it is short
+ * enough, otherwise on the heap. Does not release the node's old line.
+ * Aborts if the line is too long for the node to hold its length.
+ */
+static void store_line(TBNode node, const char *line, long length) {
+
+	if (length > INT_MAX) {
+		printf("Line too long");
+		abort();
+	}
+	if (length < INLINE_LINE) {
+		node->line = node->small;
+	} else {
+		node->line = tb_alloc(length + 1);
+	}
+	memcpy(node->line, line, length);
+	node->line[length] = '\0';
+	COUNT(bytes, length + 1);
+	node->length = length;
+	node->interned = FALSE;
+}
+
+/* 
+ * Gives 'node' the malloc'd string 'line' in place of its current line,
+ * interning it if 'tb' interns its lines
+ */
+static void replace_line(TB tb, TBNode node, char *line) {
+
+	pthread_mutex_lock(&storage_lock);
+	//Snapshot readers may still be reading the old line, so it is retired,
+	//and the new one never overwrites the inline buffer
+	if (tb->snapshot) {
+		retire_line(node);
+	} else {
+		release_line(node);
+	}
+	tb->digest = tb->digest - node->hash;
+	node->hash = hash_line(line);
+	tb->digest = tb->digest + node->hash;
+	size_t length = strlen(line);
+	if (length > INT_MAX) {
+		printf("Line too long");
+		abort();
+	}
+	if (tb->intern) {
+		__atomic_store_n(&node->line, intern_line(line, node->hash), __ATOMIC_RELEASE);
+		node->length = length;
+		node->interned = TRUE;
+		tb_free(line);
+	} else if (length < INLINE_LINE && !tb->snapshot) {
+		store_line(node, line, length);
+		tb_free(line);
+	} else {
+		__atomic_store_n(&node->line, line, __ATOMIC_RELEASE);
+		node->length = length;
+		node->interned = FALSE;
+	}
+	pthread_mutex_unlock(&storage_lock);
+}
+
+/* 
+ * Frees the line of 'node', or drops its reference if it is interned
+ */
+static void release_line(TBNode node) {
+
+	if (node->interned) {
+		unintern_line(node->line);
+	} else if (node->line != node->small) {
+		tb_free(node->line);
+	}
+}
+
+/* 
+ * Returns the shared payload for 'line', adding it to the intern table if
+ * it is not there yet
+ */
+static char *intern_line(const char *line, unsigned long long hash) {
+
+	//Grow the table once it is as full as it has buckets
+	if (interned.stats.uniqueLines >= interned.size) {
+		int size = interned.size == 0 ? 1024 : interned.size * 2;
+		internedLine **buckets = tb_alloc(sizeof(internedLine *) * size);
+		memset(buckets, 0, sizeof(internedLine *) * size);
+		for (int i = 0; i < interned.size; i++) {
+			internedLine *curr = interned.buckets[i];
+			while (curr != NULL) {
+				internedLine *next = curr->next;
+				curr->next = buckets[curr->hash & (size - 1)];
+				buckets[curr->hash & (size - 1)] = curr;
+				curr = next;
+			}
+		}
+		tb_free(interned.buckets);
+		interned.buckets = buckets;
+		interned.size = size;
+	}
+
+	int length = strlen(line);
+	internedLine **bucket = &interned.buckets[hash & (interned.size - 1)];
+	internedLine *curr = *bucket;
+	while (curr != NULL) {
+		if (curr->hash == hash && curr->length == length && strcmp(curr->text, line) == 0) {
+			curr->refs++;
+			interned.stats.references++;
+			interned.stats.bytesSaved = interned.stats.bytesSaved + length + 1;
+			return curr->text;
+		}
+		curr = curr->next;
+	}
+
+	internedLine *entry = tb_alloc(sizeof(internedLine) + length + 1);
+	COUNT(bytes, length + 1);
+	memcpy(entry->text, line, length + 1);
+	entry->hash = hash;
+	entry->length = length;
+	entry->refs = 1;
+	entry->next = *bucket;
+	*bucket = entry;
+	interned.stats.uniqueLines++;
+	interned.stats.references++;
+	interned.stats.bytesStored = interned.stats.bytesStored + length + 1;
+	return entry->text;
+}
+
+/* 
+ * Drops a reference to an interned payload, freeing it with the last one
+ */
+static void unintern_line(char *line) {
+
+	internedLine *entry = (internedLine *) (line - offsetof(internedLine, text));
+	interned.stats.references--;
+	entry->refs--;
+	if (entry->refs > 0) {
+		interned.stats.bytesSaved = interned.stats.bytesSaved - entry->length - 1;
+		return;
+	}
+	internedLine **bucket = &interned.buckets[entry->hash & (interned.size - 1)];
+	while (*bucket != entry) {
+		bucket = &(*bucket)->next;
+	}
+	*bucket = entry->next;
+	interned.stats.uniqueLines--;
+	interned.stats.bytesStored = interned.stats.bytesStored - entry->length - 1;
+	tb_free(entry);
+}
+
+/* Start recording the edits made to 'tb' and return a checkpoint for the
+ * current state, to be passed to diffSinceTB().
+ *
+ * - Edits are only recorded while a checkpoint is held, so buffers that
+ *   don't use checkpoints, or have released them all, pay nothing for them.
+ * - The recorded edits are kept from the oldest checkpoint still held on.
+ */
+long checkpointTB (TB tb) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	write_lock(tb);
+	if (tb->history == NULL) {
+		tb->history = tb_alloc(sizeof(editHistory));
+		tb->history->script.text = NULL;
+		tb->history->script.length = 0;
+		tb->history->script.capacity = 0;
+		append_text(&tb->history->script, "", 0);
+		tb->history->base = 0;
+		tb->history->checkpoints = NULL;
+		tb->history->ncheckpoints = 0;
+		tb->history->capacity = 0;
+	}
+	editHistory *history = tb->history;
+	if (history->ncheckpoints == history->capacity) {
+		history->capacity = history->capacity == 0 ? 4 : history->capacity * 2;
+		history->checkpoints = tb_realloc(history->checkpoints, sizeof(long) * history->capacity);
+	}
+	long checkpoint = history->base + history->script.length;
+	history->checkpoints[history->ncheckpoints++] = checkpoint;
+	unlock_tb(tb);
+	trace_end(&call, TRACE_CHECKPOINT, (size_t) checkpoint);
+	return checkpoint;
+}
+
+/* Return an edit script, in the same format as diffTB(), which turns the
+ * buffer as it was at 'checkpoint' into the buffer as it is now.
+ *
+ * - The script is built from the edits recorded since the checkpoint, so it
+ *   costs time proportional to those edits and not to the size of 'tb'.
+ * - The program is to abort() with an error message if 'checkpoint' is not
+ *   held on 'tb'.
+ */
+char *diffSinceTB (TB tb, long checkpoint) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	read_lock(tb);
+	if (tb->history == NULL || find_checkpoint(tb->history, checkpoint) < 0) {
+		printf("Invalid checkpoint");
+		abort();
+	}
+	char *diff = strdup(tb->history->script.text + (checkpoint - tb->history->base));
+	unlock_tb(tb);
+	trace_end(&call, TRACE_DIFF_SINCE, (size_t) checkpoint);
+	return diff;
+}
+
+/* Let go of a checkpoint returned by checkpointTB(), so that the edits made
+ * before the oldest one still held can be forgotten.
+ *
+ * - Once no checkpoint is held, nothing more is recorded.
+ * - The program is to abort() with an error message if 'checkpoint' is not
+ *   held on 'tb'.
+ */
+void releaseCheckpointTB (TB tb, long checkpoint) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	write_lock(tb);
+	editHistory *history = tb->history;
+	long i = history == NULL ? -1 : find_checkpoint(history, checkpoint);
+	if (i < 0) {
+		printf("Invalid checkpoint");
+		abort();
+	}
+	memmove(&history->checkpoints[i], &history->checkpoints[i + 1],
+		sizeof(long) * (history->ncheckpoints - i - 1));
+	history->ncheckpoints--;
+	if (history->ncheckpoints == 0) {
+		free_history(history);
+		tb->history = NULL;
+	} else {
+		//Drop the edits before the oldest checkpoint once they are at least
+		//half the script, so that each byte is moved at most once on average
+		textBuilder *script = &history->script;
+		long drop = history->checkpoints[0] - history->base;
+		if (drop > 0 && drop >= script->length / 2) {
+			memmove(script->text, script->text + drop, script->length - drop + 1);
+			script->length = script->length - drop;
+			history->base = history->checkpoints[0];
+			long capacity = 64;
+			while (capacity < script->length + 1) {
+				capacity = capacity * 2;
+			}
+			if (capacity < script->capacity) {
+				char *text = realloc(script->text, capacity);
+				if (text != NULL) {
+					script->text = text;
+					script->capacity = capacity;
+				}
+			}
+		}
+	}
+	unlock_tb(tb);
+	trace_end(&call, TRACE_CHECKPOINT_RELEASE, (size_t) checkpoint);
+}
+
+/* 
+ * Returns where 'checkpoint' is among those held in 'history', or -1
+ */
+static long find_checkpoint(editHistory *history, long checkpoint) {
+
+	long low = 0;
+	long high = history->ncheckpoints;
+	while (low < high) {
+		long middle = low + (high - low) / 2;
+		if (history->checkpoints[middle] < checkpoint) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	if (low < history->ncheckpoints && history->checkpoints[low] == checkpoint) {
+		return low;
+	}
+	return -1;
+}
+
+static void free_history(editHistory *history) {
+
+	free(history->script.text);
+	tb_free(history->checkpoints);
+	tb_free(history);
+}
+
+/* 
+ * Records that 'count' lines starting at 'first' were inserted at 'pos', in
+ * the edit history and any watches
+ */
+static void record_insert(TB tb, long pos, TBNode first, long count) {
+
+	if (tb->watches != NULL) {
+		watch_insert(tb, pos, first, count);
+	}
+	if (tb->history == NULL) {
+		return;
+	}
+	TBNode curr = first;
+	for (long i = 0; i < count; i++) {
+		char command[32];
+		int len = snprintf(command, sizeof(command), "+,%ld,", pos + i);
+		append_text(&tb->history->script, command, len);
+		append_text(&tb->history->script, node_line(curr), curr->length);
+		append_text(&tb->history->script, "\n", 1);
+		curr = curr->next;
+	}
+}
+
+/* 
+ * Records that 'count' lines starting at 'pos' were removed
+ */
+static void record_remove(TB tb, long pos, long count) {
+
+	if (tb->watches != NULL) {
+		watch_remove(tb, pos, count);
+	}
+	if (tb->history == NULL) {
+		return;
+	}
+	char command[32];
+	int len = snprintf(command, sizeof(command), "-,%ld\n", pos);
+	for (long i = 0; i < count; i++) {
+		append_text(&tb->history->script, command, len);
+	}
+}
+
+/* 
+ * Records that the line at 'pos' was replaced by the line in 'node'
+ */
+static void record_change(TB tb, long pos, TBNode node) {
+
+	if (tb->history == NULL && tb->watches == NULL) {
+		return;
+	}
+	record_remove(tb, pos, 1);
+	record_insert(tb, pos, node, 1);
+}
+
+/* Return TRUE iff 'tb1' and 'tb2' hold exactly the same lines.
+ *
+ * - Buffers whose line counts or digests differ are rejected without
+ *   looking at any line.
+ * - Otherwise the hashes of runs of blocks ending on the same line in both
+ *   buffers are compared, so that most buffers that differ are rejected
+ *   without visiting their lines. Blocks are hashed by the first call and
+ *   rehashed only where later edits land.
+ * - Buffers whose hashes all agree then have their lines compared, as
+ *   diffTB's are, so that a collision can't make them equal.
+ */
+int equalTB (TB tb1, TB tb2) {
+
+	traceCall call;
+	trace_begin(&call, tb1, tb2);
+	load_mapped(tb1);
+	load_mapped(tb2);
+	lock_hashes(tb1, tb2);
+	int equal = equal_tb(tb1, tb2);
+	unlock_pair(tb1, tb2);
+	trace_end(&call, TRACE_EQUAL, equal);
+	return equal;
+}
+
+/* 
+ * Does the work of equalTB, with the buffers already locked
+ */
+static int equal_tb(TB tb1, TB tb2) {
+
+	//Case 1: Same buffer
+	if (tb1 == tb2) {
+		return TRUE;
+	}
+
+	//Case 2: Cheap rejection
+	if ((tb1->nlines != tb2->nlines) || (tb1->digest != tb2->digest)) {
+		return FALSE;
+	}
+
+	//Case 3: Compare the hashes of runs of blocks that end on the same line
+	//in both buffers, most often a block at a time
+	hashIndex *x = sync_hashes(tb1);
+	hashIndex *y = sync_hashes(tb2);
+	long i = 0;
+	long j = 0;
+	long xend = 0;
+	long yend = 0;
+	unsigned long long xhash = 0;
+	unsigned long long yhash = 0;
+	while (i < x->nblocks || j < y->nblocks) {
+		if (j == y->nblocks || (i < x->nblocks && xend <= yend)) {
+			xhash = join_hash(xhash, x->blocks[i].power, x->blocks[i].hash);
+			xend = xend + x->blocks[i].count;
+			i++;
+		} else {
+			yhash = join_hash(yhash, y->blocks[j].power, y->blocks[j].hash);
+			yend = yend + y->blocks[j].count;
+			j++;
+		}
+		if (xend == yend) {
+			if (xhash != yhash) {
+				return FALSE;
+			}
+			xhash = 0;
+			yhash = 0;
+		}
+	}
+
+	//Case 4: The hashes only say the lines are likely the same
+	return same_lines(tb1->first, tb2->first, tb1->nlines);
+}
+
+/* 
+ * Two nodes hold the same line if they share a payload, or their hashes and
+ * then their text agree
+ */
+static int same_line(TBNode a, TBNode b) {
+
+	if (node_line(a) == node_line(b)) {
+		return TRUE;
+	}
+	return (a->hash == b->hash) && (a->length == b->length) && (strcmp(node_line(a), node_line(b)) == 0);
+}
+
+/* 
+ * TRUE if the 'count' lines from 'a' are the same as those from 'b'
+ */
+static int same_lines(TBNode a, TBNode b, long count) {
+
+	for (long i = 0; i < count; i++) {
+		if (!same_line(a, b)) {
+			return FALSE;
+		}
+		COUNT(nodes, 2);
+		a = a->next;
+		b = b->next;
+	}
+	return TRUE;
+}
+
+/* Appends 'n' characters of 's' to a growing, NUL terminated string
+ */
+static void append_text(textBuilder *b, const char *s, long n) {
+
+	if (b->length + n + 1 > b->capacity) {
+		long capacity = b->capacity == 0 ? 64 : b->capacity;
+		while (b->length + n + 1 > capacity) {
+			capacity = capacity * 2;
+		}
+		b->text = realloc(b->text, capacity);
+		if (b->text == NULL) {
+			out_of_memory();
+		}
+		b->capacity = capacity;
+		COUNT(allocations, 1);
+	}
+	memcpy(b->text + b->length, s, n);
+	COUNT(bytes, n);
+	b->length = b->length + n;
+	b->text[b->length] = '\0';
+}
+
+/* 
+ * FNV-1a, used to give lines a cheap fingerprint before comparing them
+ */
+static unsigned long long hash_line(const char *line) {
+
+	unsigned long long hash = 14695981039346656037ULL;
+	while (*line != '\0') {
+		hash = (hash ^ (unsigned char) *line) * 1099511628211ULL;
+		line++;
+	}
+	return hash;
+}
+
+/* Creates an open addressing table big enough for 'nlines' distinct lines
+ */
+static void new_line_table(lineTable *table, long nlines) {
+
+	long size = 16;
+	while (size < nlines * 2) {
+		size = size * 2;
+	}
+	table->size = size;
+	table->nids = 0;
+	table->slots = tb_alloc(sizeof(lineSlot) * size);
+	memset(table->slots, 0, sizeof(lineSlot) * size);
+}
+
+static void free_line_table(lineTable *table) {
+	tb_free(table->slots);
+}
+
+/* Returns the id of 'line', giving it the next free id if it has not been
+ * seen before. Lines are only strcmp'd when their hashes are equal.
+ */
+static long line_id(lineTable *table, char *line, unsigned long long hash) {
+
+	long mask = table->size - 1;
+	long i = (long) (hash & mask);
+	while (table->slots[i].line != NULL) {
+		if (table->slots[i].line == line) {
+			return table->slots[i].id;
+		}
+		if (table->slots[i].hash == hash && strcmp(table->slots[i].line, line) == 0) {
+			return table->slots[i].id;
+		}
+		i = (i + 1) & mask;
+	}
+	table->slots[i].line = line;
+	table->slots[i].hash = hash;
+	table->slots[i].id = table->nids++;
+	return table->slots[i].id;
+}
+
+/* Marks the changed lines between xv[xoff, xlim) and yv[yoff, ylim), by
+ * trimming the common ends and then splitting around the middle snake.
+ */
+static void compare_seq(diffContext *ctx, long xoff, long xlim, long yoff, long ylim) {
+
+	//Skip common prefix and suffix
+	while (xoff < xlim && yoff < ylim && ctx->xv[xoff] == ctx->yv[yoff]) {
+		xoff++;
+		yoff++;
+	}
+	while (xoff < xlim && yoff < ylim && ctx->xv[xlim - 1] == ctx->yv[ylim - 1]) {
+		xlim--;
+		ylim--;
+	}
+
+	//Case 1: only insertions or deletions left
+	if (xoff == xlim) {
+		while (yoff < ylim) {
+			ctx->ychanged[yoff++] = TRUE;
+		}
+		return;
+	}
+	if (yoff == ylim) {
+		while (xoff < xlim) {
+			ctx->xchanged[xoff++] = TRUE;
+		}
+		return;
+	}
+
+	//Case 2: divide and conquer
+	long xmid = 0;
+	long ymid = 0;
+	middle_snake(ctx, xoff, xlim, yoff, ylim, &xmid, &ymid);
+	compare_seq(ctx, xoff, xmid, yoff, ymid);
+	compare_seq(ctx, xmid, xlim, ymid, ylim);
+}
+
+/* Finds the midpoint of a shortest edit script between xv[xoff, xlim) and
+ * yv[yoff, ylim) by running the forward and backward searches of Myers'
+ * algorithm until they overlap. Diagonal k holds lines where x - y == k.
+ */
+static void middle_snake(diffContext *ctx, long xoff, long xlim, long yoff, long ylim, long *xmid, long *ymid) {
+
+	long *fd = ctx->fdiag;
+	long *bd = ctx->bdiag;
+	long *xv = ctx->xv;
+	long *yv = ctx->yv;
+	long dmin = xoff - ylim;
+	long dmax = xlim - yoff;
+	long fmid = xoff - yoff;
+	long bmid = xlim - ylim;
+	long fmin = fmid;
+	long fmax = fmid;
+	long bmin = bmid;
+	long bmax = bmid;
+	int odd = (fmid - bmid) & 1;
+
+	fd[fmid] = xoff;
+	bd[bmid] = xlim;
+	while (TRUE) {
+		//Extend the forward search by one edit
+		if (fmin > dmin) {
+			fd[--fmin - 1] = -1;
+		} else {
+			fmin++;
+		}
+		if (fmax < dmax) {
+			fd[++fmax + 1] = -1;
+		} else {
+			fmax--;
+		}
+		for (long d = fmax; d >= fmin; d = d - 2) {
+			long tlo = fd[d - 1];
+			long thi = fd[d + 1];
+			long x = tlo >= thi ? tlo + 1 : thi;
+			long y = x - d;
+			while (x < xlim && y < ylim && xv[x] == yv[y]) {
+				x++;
+				y++;
+			}
+			fd[d] = x;
+			if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+				*xmid = x;
+				*ymid = y;
+				return;
+			}
+		}
+
+		//Extend the backward search by one edit
+		if (bmin > dmin) {
+			bd[--bmin - 1] = LONG_MAX;
+		} else {
+			bmin++;
+		}
+		if (bmax < dmax) {
+			bd[++bmax + 1] = LONG_MAX;
+		} else {
+			bmax--;
+		}
+		for (long d = bmax; d >= bmin; d = d - 2) {
+			long tlo = bd[d - 1];
+			long thi = bd[d + 1];
+			long x = tlo < thi ? tlo : thi - 1;
+			long y = x - d;
+			while (x > xoff && y > yoff && xv[x - 1] == yv[y - 1]) {
+				x--;
+				y--;
+			}
+			bd[d] = x;
+			if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+				*xmid = x;
+				*ymid = y;
+				return;
+			}
+		}
+	}
+}
+
+/* Return a copy of line 'pos' of 'tb', without its newline.
+ *
+ * - Takes constant time on a buffer just loaded by loadSnapshotTB().
+ *   Otherwise the line is found from whichever end of 'tb' is nearer.
+ * - The program is to abort() with an error message if 'pos' is out of range.
+ * - The user is responsible for freeing the returned string.
+ */
+char *lineTB (TB tb, int pos) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	char *copy = line_tb(tb, pos);
+	trace_end(&call, TRACE_LINE, pos);
+	return copy;
+}
+
+/* The same, for a line at any position.
+ */
+char *lineTB64 (TB tb, size_t pos) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	char *copy = line_tb(tb, pos);
+	trace_end(&call, TRACE_LINE64, pos);
+	return copy;
+}
+
+/* 
+ * Does the work of lineTB, taking the lock itself
+ */
+static char *line_tb(TB tb, long pos) {
+
+	read_lock(tb);
+	if (pos < 0 || pos > tb->nlines - 1) {
+		printf("Position out of range");
+		abort();
+	}
+	const char *line;
+	int length;
+	if (tb->mapped != NULL) {
+		line = mapped_line(tb->mapped, pos, &length);
+	} else {
+		TBNode curr = node_at(tb, pos);
+		line = node_line(curr);
+		length = curr->length;
+	}
+	char *copy = result_alloc(length + 1);
+	memcpy(copy, line, length + 1);
+	COUNT(bytes, length + 1);
+	unlock_tb(tb);
+	return copy;
+}
+
+/* 
+ * Returns the node of line 'pos', walking from whichever end is nearer
+ */
+static TBNode node_at(TB tb, long pos) {
+
+	TBNode curr;
+	if (pos < tb->nlines / 2) {
+		curr = tb->first;
+		for (long i = 0; i < pos; i++) {
+			COUNT(nodes, 1);
+			curr = curr->next;
+		}
+	} else {
+		curr = tb->last;
+		for (long i = tb->nlines - 1; i > pos; i--) {
+			COUNT(nodes, 1);
+			curr = curr->prev;
+		}
+	}
+	return curr;
+}
+
+/* Return the line holding byte 'offset' of the text dumpTB() returns
+ * without line numbers, each line owning its newline.
+ *
+ * - Offsets are looked up in the unrolled list of setUnrolledTB(), which
+ *   the first call builds in time proportional to the number of lines.
+ *   Every edit keeps it up to date in O(log n), plus the lines it inserts
+ *   or removes. Otherwise each call takes O(log n).
+ * - A buffer loaded by loadSnapshotTB() is looked up in the offsets of its
+ *   file instead.
+ * - The program is to abort() with an error message if 'offset' is past the
+ *   end of the text.
+ */
+size_t lineAtOffsetTB (TB tb, size_t offset) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	//Taken for writing, as the index may be brought up to date
+	write_lock(tb);
+	size_t line = line_at_offset(tb, offset);
+	unlock_tb(tb);
+	trace_end(&call, TRACE_LINE_AT_OFFSET, offset, line);
+	return line;
+}
+
+/* Return the offset of line 'pos' in the text dumpTB() returns without line
+ * numbers, from the same index.
+ *
+ * - 'pos' may be the number of lines, whose offset is the length of the text.
+ * - The program is to abort() with an error message if 'pos' is out of range.
+ */
+size_t offsetOfLineTB (TB tb, size_t pos) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	write_lock(tb);
+	size_t offset = offset_of_line(tb, pos);
+	unlock_tb(tb);
+	trace_end(&call, TRACE_OFFSET_OF_LINE, pos, offset);
+	return offset;
+}
+
+/* 
+ * Does the work of lineAtOffsetTB, with the buffer already locked
+ */
+static long line_at_offset(TB tb, size_t offset) {
+
+	//Case 1: A mapped snapshot, whose file has the offsets in order
+	if (tb->mapped != NULL) {
+		const uint64_t *offsets = tb->mapped->offsets;
+		if (offset >= offsets[tb->nlines]) {
+			printf("Offset out of range");
+			abort();
+		}
+		long low = 0;
+		long high = tb->nlines - 1;
+		while (low < high) {
+			long mid = low + (high - low + 1) / 2;
+			if (offsets[mid] <= offset) {
+				low = mid;
+			} else {
+				high = mid - 1;
+			}
+		}
+		return low;
+	}
+
+	//Case 2: Walk down the chunks, passing over those that end at or before
+	//'offset', to count the lines wholly before it
+	lineIndex *index = sync_index(tb);
+	indexChunk *chunk = index->root;
+	if (chunk == NULL || offset >= (size_t) chunk->bytes) {
+		printf("Offset out of range");
+		abort();
+	}
+	long line = 0;
+	while (TRUE) {
+		long left = chunk->left == NULL ? 0 : chunk->left->bytes;
+		if (offset < (size_t) left) {
+			chunk = chunk->left;
+		} else if (offset < (size_t) (left + chunk->own)) {
+			offset = offset - left;
+			line = line + (chunk->left == NULL ? 0 : chunk->left->lines);
+			int i = 0;
+			while (offset >= (size_t) chunk->lengths[i]) {
+				offset = offset - chunk->lengths[i];
+				i++;
+			}
+			return line + i;
+		} else {
+			offset = offset - left - chunk->own;
+			line = line + (chunk->left == NULL ? 0 : chunk->left->lines) + chunk->count;
+			chunk = chunk->right;
+		}
+	}
+}
+
+/* 
+ * Does the work of offsetOfLineTB, with the buffer already locked
+ */
+static size_t offset_of_line(TB tb, long pos) {
+
+	if (pos < 0 || pos > tb->nlines) {
+		printf("Position out of range");
+		abort();
+	}
+	if (tb->mapped != NULL) {
+		return tb->mapped->offsets[pos];
+	}
+	lineIndex *index = sync_index(tb);
+	indexChunk *chunk = index->root;
+	size_t offset = 0;
+	while (chunk != NULL) {
+		long left = chunk->left == NULL ? 0 : chunk->left->lines;
+		if (pos < left) {
+			chunk = chunk->left;
+		} else if (pos < left + chunk->count) {
+			offset = offset + (chunk->left == NULL ? 0 : chunk->left->bytes);
+			for (long i = 0; i < pos - left; i++) {
+				offset = offset + chunk->lengths[i];
+			}
+			return offset;
+		} else {
+			offset = offset + (chunk->left == NULL ? 0 : chunk->left->bytes) + chunk->own;
+			pos = pos - left - chunk->count;
+			chunk = chunk->right;
+		}
+	}
+	return offset;
+}
+
+/* 
+ * Returns the offset index of 'tb', first building it, or adding the lines
+ * appended since it last held them all
+ */
+static lineIndex *sync_index(TB tb) {
+
+	lineIndex *index = tb->index;
+	if (index == NULL) {
+		index = tb_alloc(sizeof(lineIndex));
+		index->root = NULL;
+		index->nchunks = 0;
+		index->valid = 0;
+		index->seed = 2463534242U;
+		tb->index = index;
+	}
+	long valid = index->valid;
+	if (valid == tb->nlines) {
+		return index;
+	}
+	index->root = splice_chunks(index->root, build_chunks(index, node_at(tb, valid), tb->nlines - valid));
+	index->valid = tb->nlines;
+	mend_chunks(index, valid);
+	return index;
+}
+
+/* 
+ * Adds 'delta' to the length of line 'pos' in the offset index of 'tb', if
+ * it has one that holds the line
+ */
+static void index_resize(TB tb, long pos, long delta) {
+
+	if (tb->index == NULL || pos >= tb->index->valid) {
+		return;
+	}
+	indexChunk *chunk = tb->index->root;
+	while (TRUE) {
+		chunk->bytes = chunk->bytes + delta;
+		long left = chunk->left == NULL ? 0 : chunk->left->lines;
+		if (pos < left) {
+			chunk = chunk->left;
+		} else if (pos < left + chunk->count) {
+			chunk->lengths[pos - left] = chunk->lengths[pos - left] + delta;
+			chunk->own = chunk->own + delta;
+			return;
+		} else {
+			pos = pos - left - chunk->count;
+			chunk = chunk->right;
+		}
+	}
+}
+
+/* 
+ * Adds the 'count' lines from 'first', which now start at line 'pos', to the
+ * offset index of 'tb', if it has one that reaches that far
+ */
+static void index_insert(TB tb, long pos, TBNode first, long count) {
+
+	lineIndex *index = tb->index;
+	if (index == NULL || pos > index->valid || count == 0) {
+		return;
+	}
+	indexChunk *right;
+	indexChunk *left = split_chunks(index, index->root, pos, &right);
+	left = splice_chunks(left, build_chunks(index, first, count));
+	index->root = splice_chunks(left, right);
+	index->valid = index->valid + count;
+	mend_chunks(index, pos + count);
+	mend_chunks(index, pos);
+}
+
+/* 
+ * Takes the 'count' lines from line 'pos' out of the offset index of 'tb',
+ * if it has one that holds them
+ */
+static void index_remove(TB tb, long pos, long count) {
+
+	lineIndex *index = tb->index;
+	if (index == NULL || pos >= index->valid || count == 0) {
+		return;
+	}
+	if (count > index->valid - pos) {
+		count = index->valid - pos;
+	}
+	indexChunk *right;
+	indexChunk *left = split_chunks(index, index->root, pos, &right);
+	indexChunk *after;
+	indexChunk *removed = split_chunks(index, right, count, &after);
+	free_chunks(index, removed);
+	index->root = splice_chunks(left, after);
+	index->valid = index->valid - count;
+	mend_chunks(index, pos);
+}
+
+/* 
+ * Splits the chunks under 'chunk' into those holding its first 'pos' lines,
+ * which it returns, and the rest, left in 'right'. A chunk the split falls
+ * inside is cut in two.
+ */
+static indexChunk *split_chunks(lineIndex *index, indexChunk *chunk, long pos, indexChunk **right) {
+
+	if (chunk == NULL) {
+		*right = NULL;
+		return NULL;
+	}
+	long left = chunk->left == NULL ? 0 : chunk->left->lines;
+	if (pos <= left) {
+		indexChunk *inner;
+		indexChunk *outer = split_chunks(index, chunk->left, pos, &inner);
+		chunk->left = inner;
+		sum_chunk(chunk);
+		*right = chunk;
+		return outer;
+	}
+	if (pos >= left + chunk->count) {
+		chunk->right = split_chunks(index, chunk->right, pos - left - chunk->count, right);
+		sum_chunk(chunk);
+		return chunk;
+	}
+	//The tail may end up under the chunks above this one, so it must not
+	//outrank it
+	indexChunk *tail = new_chunk(index);
+	tail->priority = ((unsigned long long) tail->priority * chunk->priority) >> 32;
+	int at = pos - left;
+	tail->count = chunk->count - at;
+	memcpy(tail->lengths, chunk->lengths + at, sizeof(long) * tail->count);
+	memcpy(tail->nodes, chunk->nodes + at, sizeof(TBNode) * tail->count);
+	tail->next = chunk->next;
+	chunk->next = tail;
+	chunk->count = at;
+	sum_chunk(tail);
+	*right = join_chunks(tail, chunk->right);
+	chunk->right = NULL;
+	sum_chunk(chunk);
+	return chunk;
+}
+
+/* 
+ * Joins two treaps of chunks, every line of 'left' coming before 'right'
+ */
+static indexChunk *join_chunks(indexChunk *left, indexChunk *right) {
+
+	if (left == NULL) {
+		return right;
+	}
+	if (right == NULL) {
+		return left;
+	}
+	if (left->priority > right->priority) {
+		left->right = join_chunks(left->right, right);
+		sum_chunk(left);
+		return left;
+	}
+	right->left = join_chunks(left, right->left);
+	sum_chunk(right);
+	return right;
+}
+
+/* 
+ * Joins two treaps of chunks as join_chunks does, first linking the last
+ * chunk of 'left' to the first of 'right'
+ */
+static indexChunk *splice_chunks(indexChunk *left, indexChunk *right) {
+
+	indexChunk *last = left;
+	while (last != NULL && last->right != NULL) {
+		last = last->right;
+	}
+	if (last != NULL) {
+		last->next = first_chunk(right);
+	}
+	return join_chunks(left, right);
+}
+
+/* 
+ * Returns the chunk holding the first lines under 'chunk', or NULL
+ */
+static indexChunk *first_chunk(indexChunk *chunk) {
+
+	while (chunk != NULL && chunk->left != NULL) {
+		chunk = chunk->left;
+	}
+	return chunk;
+}
+
+/* 
+ * Steps a scan through the line index on from line 'at' of 'chunk', and
+ * returns the node of the line after, or NULL after the last line. The node
+ * SCAN_AHEAD lines on is fetched now, and the line of the one half as far
+ * on, whose node should have arrived by then.
+ */
+static TBNode next_indexed(indexChunk **chunk, int *at) {
+
+	indexChunk *curr = *chunk;
+	int i = *at + 1;
+	if (i == curr->count) {
+		curr = curr->next;
+		i = 0;
+		*chunk = curr;
+		if (curr == NULL) {
+			return NULL;
+		}
+	}
+	*at = i;
+	if (i + SCAN_AHEAD < curr->count) {
+		__builtin_prefetch(curr->nodes[i + SCAN_AHEAD]);
+		__builtin_prefetch(curr->nodes[i + SCAN_AHEAD / 2]->line);
+	}
+	return curr->nodes[i];
+}
+
+/* 
+ * Returns the first chunk of the line index of 'tb' for a scan to walk, or
+ * NULL if it has none, or if reads are snapshots, which edits may change the
+ * chunks under
+ */
+static indexChunk *indexed_scan(TB tb) {
+
+	if (tb->index == NULL || tb->snapshot || tb->index->valid != tb->nlines) {
+		return NULL;
+	}
+	return first_chunk(tb->index->root);
+}
+
+/* 
+ * Returns a treap of full chunks holding the lengths of the 'count' lines
+ * from 'first'
+ */
+static indexChunk *build_chunks(lineIndex *index, TBNode first, long count) {
+
+	indexChunk *built = NULL;
+	indexChunk *last = NULL;
+	TBNode curr = first;
+	for (long done = 0; done < count; ) {
+		indexChunk *chunk = new_chunk(index);
+		while (chunk->count < INDEX_CHUNK && done < count) {
+			chunk->nodes[chunk->count] = curr;
+			chunk->lengths[chunk->count++] = curr->length + 1;
+			COUNT(nodes, 1);
+			curr = curr->next;
+			done++;
+		}
+		sum_chunk(chunk);
+		if (last != NULL) {
+			last->next = chunk;
+		}
+		last = chunk;
+		built = join_chunks(built, chunk);
+	}
+	return built;
+}
+
+static indexChunk *new_chunk(lineIndex *index) {
+
+	indexChunk *chunk = tb_alloc(sizeof(indexChunk));
+	//xorshift, seeded per index so that buffers edited on different threads
+	//share nothing
+	unsigned int seed = index->seed;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	index->seed = seed;
+	chunk->priority = seed;
+	chunk->left = NULL;
+	chunk->right = NULL;
+	chunk->next = NULL;
+	chunk->count = 0;
+	index->nchunks++;
+	return chunk;
+}
+
+/* 
+ * Merges the chunks that end and start at line 'pos', if they fit in one,
+ * then each of them with the chunk on its other side, so that no two chunks
+ * next to each other hold INDEX_CHUNK lines or fewer between them
+ */
+static void mend_chunks(lineIndex *index, long pos) {
+
+	long before;
+	long after;
+	mend_seam(index, pos, &before, &after);
+	if (before > 0) {
+		mend_seam(index, pos - before, &before, &before);
+	}
+	if (after > 0) {
+		mend_seam(index, pos + after, &after, &after);
+	}
+}
+
+/* 
+ * Merges the chunks that end and start at line 'pos', if they fit in one,
+ * leaving in 'before' and 'after' how many lines they held
+ */
+static void mend_seam(lineIndex *index, long pos, long *before, long *after) {
+
+	indexChunk *right;
+	indexChunk *left = split_chunks(index, index->root, pos, &right);
+	indexChunk *last = left;
+	while (last != NULL && last->right != NULL) {
+		last = last->right;
+	}
+	indexChunk *first = right;
+	while (first != NULL && first->left != NULL) {
+		first = first->left;
+	}
+	*before = last == NULL ? 0 : last->count;
+	*after = first == NULL ? 0 : first->count;
+	if (last == NULL || first == NULL || last->count + first->count > 2 * INDEX_CHUNK) {
+		index->root = join_chunks(left, right);
+		return;
+	}
+	//Move the first chunk of 'right' onto the end of the last of 'left',
+	//then add its lines to the chunks down the right edge of 'left'
+	indexChunk *rest;
+	indexChunk *moved = split_chunks(index, right, first->count, &rest);
+	memcpy(last->lengths + last->count, moved->lengths, sizeof(long) * moved->count);
+	memcpy(last->nodes + last->count, moved->nodes, sizeof(TBNode) * moved->count);
+	last->next = moved->next;
+	last->count = last->count + moved->count;
+	last->own = last->own + moved->own;
+	for (indexChunk *curr = left; curr != NULL; curr = curr->right) {
+		curr->lines = curr->lines + moved->count;
+		curr->bytes = curr->bytes + moved->own;
+	}
+	free_chunks(index, moved);
+	index->root = join_chunks(left, rest);
+}
+
+/* 
+ * Works out the totals of 'chunk' from its lines and those of its children
+ */
+static void sum_chunk(indexChunk *chunk) {
+
+	long own = 0;
+	for (int i = 0; i < chunk->count; i++) {
+		own = own + chunk->lengths[i];
+	}
+	chunk->own = own;
+	chunk->lines = chunk->count;
+	chunk->bytes = own;
+	if (chunk->left != NULL) {
+		chunk->lines = chunk->lines + chunk->left->lines;
+		chunk->bytes = chunk->bytes + chunk->left->bytes;
+	}
+	if (chunk->right != NULL) {
+		chunk->lines = chunk->lines + chunk->right->lines;
+		chunk->bytes = chunk->bytes + chunk->right->bytes;
+	}
+}
+
+static void free_chunks(lineIndex *index, indexChunk *chunk) {
+
+	if (chunk == NULL) {
+		return;
+	}
+	free_chunks(index, chunk->left);
+	free_chunks(index, chunk->right);
+	tb_free(chunk);
+	index->nchunks--;
+}
+
+/* 
+ * Returns the hash blocks of 'tb', first building them, or rehashing the
+ * blocks edits have marked dirty
+ */
+static hashIndex *sync_hashes(TB tb) {
+
+	hashIndex *hashes = tb->hashes;
+	if (hashes == NULL) {
+		hashes = tb_alloc(sizeof(hashIndex));
+		hashes->blocks = NULL;
+		hashes->nblocks = 0;
+		hashes->capacity = 0;
+		hashes->stale = FALSE;
+		hashes->cursor = 0;
+		hashes->cursorLine = 0;
+		tb->hashes = hashes;
+		//One dirty block for the whole buffer, which rehashing splits up
+		hashes_insert(tb, 0, tb->nlines);
+	}
+	if (!hashes->stale) {
+		return hashes;
+	}
+	for (long i = 0; i < hashes->nblocks; i++) {
+		if (hashes->blocks[i].dirty) {
+			rehash_block(tb, i);
+		}
+	}
+	hashes->stale = FALSE;
+	hashes->cursor = 0;
+	hashes->cursorLine = 0;
+	return hashes;
+}
+
+/* 
+ * Hashes block 'block' of 'tb' again. A block that has shrunk below a
+ * quarter of HASH_BLOCK lines first takes in the block after it, and one
+ * that has grown past twice HASH_BLOCK is split into blocks of HASH_BLOCK.
+ */
+static void rehash_block(TB tb, long block) {
+
+	hashIndex *hashes = tb->hashes;
+	if (hashes->blocks[block].count < HASH_BLOCK / 4 && block + 1 < hashes->nblocks) {
+		hashes->blocks[block].count = hashes->blocks[block].count + hashes->blocks[block + 1].count;
+		drop_blocks(hashes, block + 1, 1);
+	}
+	long count = hashes->blocks[block].count;
+	long pieces = count > 2 * HASH_BLOCK ? count / HASH_BLOCK : 1;
+	add_blocks(hashes, block + 1, pieces - 1);
+	TBNode curr = block_first(tb, block);
+	for (long piece = 0; piece < pieces; piece++) {
+		hashBlock *split = &hashes->blocks[block + piece];
+		split->first = curr;
+		split->count = piece < pieces - 1 ? HASH_BLOCK : count - HASH_BLOCK * (pieces - 1);
+		unsigned long long hash = 0;
+		unsigned long long power = 1;
+		for (long i = 0; i < split->count; i++) {
+			hash = join_hash(hash, HASH_BASE, curr->hash % HASH_PRIME);
+			power = mul_mod(power, HASH_BASE);
+			COUNT(nodes, 1);
+			curr = curr->next;
+		}
+		split->hash = hash;
+		split->power = power;
+		split->dirty = FALSE;
+	}
+}
+
+/* 
+ * TRUE if 'tb' has hash blocks and none of them is dirty
+ */
+static int hashes_ready(TB tb) {
+	return tb->hashes != NULL && !tb->hashes->stale;
+}
+
+/* 
+ * Locks 'tb1' and 'tb2' for equalTB or diffTB: for reading, unless the hash
+ * blocks of either have to be built or rehashed first
+ */
+static void lock_hashes(TB tb1, TB tb2) {
+
+	lock_pair(tb1, FALSE, tb2, FALSE);
+	if (!hashes_ready(tb1) || !hashes_ready(tb2)) {
+		unlock_pair(tb1, tb2);
+		lock_pair(tb1, TRUE, tb2, TRUE);
+	}
+}
+
+/* 
+ * Returns the block holding line 'pos', or if 'atEnd', the first block that
+ * holds it or ends just before it. The search starts from the block last
+ * found, as edits made together tend to be close to each other.
+ */
+static long find_block(hashIndex *hashes, long pos, int atEnd) {
+
+	long target = atEnd && pos > 0 ? pos - 1 : pos;
+	long block = hashes->cursor;
+	long line = hashes->cursorLine;
+	while (line > target) {
+		block--;
+		line = line - hashes->blocks[block].count;
+	}
+	while (line + hashes->blocks[block].count <= target) {
+		line = line + hashes->blocks[block].count;
+		block++;
+	}
+	hashes->cursor = block;
+	hashes->cursorLine = line;
+	return block;
+}
+
+/* 
+ * Returns the first node of 'block', or NULL past the last block
+ */
+static TBNode block_first(TB tb, long block) {
+
+	if (block == 0) {
+		return tb->first;
+	}
+	return block < tb->hashes->nblocks ? tb->hashes->blocks[block].first : NULL;
+}
+
+/* 
+ * Makes room for 'count' empty, dirty blocks before block 'at'
+ */
+static void add_blocks(hashIndex *hashes, long at, long count) {
+
+	if (count == 0) {
+		return;
+	}
+	if (hashes->nblocks + count > hashes->capacity) {
+		long capacity = hashes->capacity == 0 ? 16 : hashes->capacity * 2;
+		while (capacity < hashes->nblocks + count) {
+			capacity = capacity * 2;
+		}
+		hashes->blocks = tb_realloc(hashes->blocks, sizeof(hashBlock) * capacity);
+		hashes->capacity = capacity;
+	}
+	memmove(&hashes->blocks[at + count], &hashes->blocks[at], sizeof(hashBlock) * (hashes->nblocks - at));
+	for (long i = at; i < at + count; i++) {
+		hashes->blocks[i].first = NULL;
+		hashes->blocks[i].count = 0;
+		hashes->blocks[i].hash = 0;
+		hashes->blocks[i].power = 1;
+		hashes->blocks[i].dirty = TRUE;
+	}
+	hashes->nblocks = hashes->nblocks + count;
+}
+
+/* 
+ * Removes 'count' blocks from block 'at' on
+ */
+static void drop_blocks(hashIndex *hashes, long at, long count) {
+
+	if (count == 0) {
+		return;
+	}
+	memmove(&hashes->blocks[at], &hashes->blocks[at + count], sizeof(hashBlock) * (hashes->nblocks - at - count));
+	hashes->nblocks = hashes->nblocks - count;
+}
+
+/* 
+ * Counts 'count' lines inserted at 'pos' in the hash blocks of 'tb', if it
+ * has them, in the block they were inserted into
+ */
+static void hashes_insert(TB tb, long pos, long count) {
+
+	hashIndex *hashes = tb->hashes;
+	if (hashes == NULL || count == 0) {
+		return;
+	}
+	long block = 0;
+	if (hashes->nblocks == 0) {
+		add_blocks(hashes, 0, 1);
+		hashes->cursor = 0;
+		hashes->cursorLine = 0;
+	} else {
+		block = find_block(hashes, pos, TRUE);
+	}
+	hashes->blocks[block].count = hashes->blocks[block].count + count;
+	hashes->blocks[block].dirty = TRUE;
+	hashes->stale = TRUE;
+}
+
+/* 
+ * Takes the 'count' lines removed from 'pos' out of the hash blocks of 'tb',
+ * if it has them. What is left of the blocks they touched becomes one dirty
+ * block, which is the block before if the first of them lost its first line.
+ */
+static void hashes_remove(TB tb, long pos, long count) {
+
+	hashIndex *hashes = tb->hashes;
+	if (hashes == NULL || count == 0) {
+		return;
+	}
+	long block = find_block(hashes, pos, FALSE);
+	long line = hashes->cursorLine;
+	long last = block;
+	long end = line;
+	long left = -count;
+	while (end < pos + count) {
+		end = end + hashes->blocks[last].count;
+		left = left + hashes->blocks[last].count;
+		last++;
+	}
+	//Only the first block's first node can be found without a pointer, so
+	//the others are never left without theirs
+	long keep = block;
+	if (line == pos && block > 0) {
+		keep = block - 1;
+		line = line - hashes->blocks[keep].count;
+		left = left + hashes->blocks[keep].count;
+	}
+	hashes->blocks[keep].count = left;
+	hashes->blocks[keep].dirty = TRUE;
+	drop_blocks(hashes, keep + 1, last - keep - 1);
+	if (left == 0) {
+		drop_blocks(hashes, keep, 1);
+	}
+	hashes->cursor = keep < hashes->nblocks ? keep : 0;
+	hashes->cursorLine = keep < hashes->nblocks ? line : 0;
+	hashes->stale = TRUE;
+}
+
+/* 
+ * Marks the hash block holding line 'pos' of 'tb' dirty, if it has them,
+ * after the line changed
+ */
+static void hashes_change(TB tb, long pos) {
+
+	hashIndex *hashes = tb->hashes;
+	if (hashes == NULL) {
+		return;
+	}
+	hashes->blocks[find_block(hashes, pos, FALSE)].dirty = TRUE;
+	hashes->stale = TRUE;
+}
+
+static void free_hashes(TB tb) {
+
+	if (tb->hashes != NULL) {
+		tb_free(tb->hashes->blocks);
+		tb_free(tb->hashes);
+		tb->hashes = NULL;
+	}
+}
+
+/* 
+ * Multiplies two hashes modulo HASH_PRIME
+ */
+static unsigned long long mul_mod(unsigned long long a, unsigned long long b) {
+
+	unsigned __int128 product = (unsigned __int128) a * b;
+	unsigned long long sum = ((unsigned long long) product & HASH_PRIME) + (unsigned long long) (product >> 61);
+	return sum >= HASH_PRIME ? sum - HASH_PRIME : sum;
+}
+
+/* 
+ * The hash of a run of lines followed by more, given the hash of the run,
+ * HASH_BASE to the power of the number of lines that follow, and their hash
+ */
+static unsigned long long join_hash(unsigned long long hash, unsigned long long power, unsigned long long next) {
+
+	unsigned long long sum = mul_mod(hash, power) + next;
+	return sum >= HASH_PRIME ? sum - HASH_PRIME : sum;
+}
+
+/* Write 'tb' to a snapshot file at 'path' that loadSnapshotTB() can map.
+ *
+ * - The file is written beside 'path' and renamed over it, so a crash never
+ *   leaves half a snapshot, and buffers loaded from the old file keep it.
+ * - Returns FALSE if the file can't be written.
+ */
+int saveSnapshotTB (TB tb, const char *path) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	read_lock(tb);
+	int saved = save_snapshot(tb, path, 0);
+	unlock_tb(tb);
+	trace_end(&call, TRACE_SAVE, path, saved);
+	return saved;
+}
+
+/* 
+ * Does the work of saveSnapshotTB, with 'tb' already locked. The file is
+ * synced before it replaces 'path', so that the rename can't overtake it.
+ */
+static int save_snapshot(TB tb, const char *path, uint32_t generation) {
+
+	char temp[strlen(path) + 5];
+	sprintf(temp, "%s.tmp", path);
+	FILE *file = fopen(temp, "wb");
+	if (file == NULL) {
+		return FALSE;
+	}
+	int saved = write_snapshot(tb, file, generation);
+	saved = saved && fflush(file) == 0 && fsync(fileno(file)) == 0;
+	saved = fclose(file) == 0 && saved;
+	if (saved) {
+		saved = rename(temp, path) == 0;
+	}
+	if (!saved) {
+		remove(temp);
+	}
+	return saved;
+}
+
+/* 
+ * Writes the header, offsets and payload of 'tb', with 'tb' already locked.
+ * Returns FALSE if a write fails.
+ */
+static int write_snapshot(TB tb, FILE *file, uint32_t generation) {
+
+	snapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.byteOrder = SNAPSHOT_BYTE_ORDER;
+	header.generation = generation;
+	header.nlines = tb->nlines;
+	header.payloadBytes = 0;
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+	//Offsets, counting up the payload as they go, written a run at a time
+	uint64_t offsets[1024];
+	int pending = 0;
+	uint64_t offset = 0;
+	TBNode curr = tb->first;
+	for (long i = 0; i <= tb->nlines && ok; i++) {
+		offsets[pending++] = offset;
+		if (pending == 1024 || i == tb->nlines) {
+			ok = fwrite(offsets, sizeof(uint64_t), pending, file) == (size_t) pending;
+			pending = 0;
+		}
+		if (i == tb->nlines) {
+			break;
+		}
+		int length;
+		if (tb->mapped != NULL) {
+			mapped_line(tb->mapped, i, &length);
+		} else {
+			length = curr->length;
+			curr = curr->next;
+		}
+		offset = offset + length + 1;
+	}
+	header.payloadBytes = offset;
+
+	curr = tb->first;
+	for (long i = 0; i < tb->nlines && ok; i++) {
+		const char *line;
+		int length;
+		if (tb->mapped != NULL) {
+			line = mapped_line(tb->mapped, i, &length);
+		} else {
+			line = node_line(curr);
+			length = curr->length;
+			curr = curr->next;
+		}
+		ok = fwrite(line, 1, length + 1, file) == (size_t) length + 1;
+		COUNT(nodes, 1);
+		COUNT(bytes, length + 1);
+	}
+	//Now the payload's size is known
+	ok = ok && fseek(file, 0, SEEK_SET) == 0;
+	ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+	return ok;
+}
+
+/* Open a snapshot written by saveSnapshotTB() as a new textbuffer.
+ *
+ * - The file is mapped rather than read: loading takes the same time
+ *   however many lines it holds, and linesTB(), lineTB() and dumpTB() read
+ *   the lines from it in place.
+ * - Any other call first turns the lines into nodes, as newTB() would.
+ * - Returns NULL if the file can't be opened or isn't a snapshot.
+ */
+TB loadSnapshotTB (const char *path) {
+
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	TB tb = load_snapshot(path);
+	trace_end(&call, TRACE_LOAD, tb, path);
+	return tb;
+}
+
+/* 
+ * Does the work of loadSnapshotTB
+ */
+static TB load_snapshot(const char *path) {
+
+	TB tb = NULL;
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd != -1 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(snapshotHeader)) {
+		void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		const snapshotHeader *header = base;
+		uint64_t size = st.st_size - sizeof(snapshotHeader);
+		if (base == MAP_FAILED) {
+			base = NULL;
+		} else if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+				|| header->byteOrder != SNAPSHOT_BYTE_ORDER
+				|| header->nlines >= size / sizeof(uint64_t)
+				|| header->payloadBytes != size - (header->nlines + 1) * sizeof(uint64_t)) {
+			munmap(base, st.st_size);
+			base = NULL;
+		}
+		if (base != NULL) {
+			mappedLines *mapped = tb_alloc(sizeof(mappedLines));
+			mapped->base = base;
+			mapped->size = st.st_size;
+			mapped->offsets = (const uint64_t *) (header + 1);
+			mapped->payload = (const char *) (mapped->offsets + header->nlines + 1);
+			mapped->payloadBytes = header->payloadBytes;
+			tb = new_tb("");
+			tb->nlines = header->nlines;
+			tb->mapped = mapped;
+		}
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	return tb;
+}
+
+/* 
+ * Returns line 'pos' of a mapped snapshot. Offsets are only checked as each
+ * line is read, so that opening a file doesn't have to read all of it.
+ */
+static const char *mapped_line(mappedLines *mapped, long pos, int *length) {
+
+	uint64_t start = mapped->offsets[pos];
+	uint64_t end = mapped->offsets[pos + 1];
+	if (start >= end || end > mapped->payloadBytes || mapped->payload[end - 1] != '\0'
+			|| end - start > INT_MAX) {
+		printf("Corrupt snapshot");
+		abort();
+	}
+	*length = end - start - 1;
+	return mapped->payload + start;
+}
+
+/* 
+ * Turns the lines of a buffer loaded by loadSnapshotTB into nodes, so that
+ * it can be changed, and lets go of its file
+ */
+static void load_mapped(TB tb) {
+
+	if (__atomic_load_n(&tb->mapped, __ATOMIC_ACQUIRE) == NULL) {
+		return;
+	}
+	write_lock(tb);
+	mappedLines *mapped = tb->mapped;
+	if (mapped != NULL) {
+		pthread_mutex_lock(&storage_lock);
+		for (long i = 0; i < tb->nlines; i++) {
+			int length;
+			const char *line = mapped_line(mapped, i, &length);
+			append_line(tb, line, length);
+			COUNT(nodes, 1);
+		}
+		pthread_mutex_unlock(&storage_lock);
+		__atomic_store_n(&tb->mapped, NULL, __ATOMIC_RELEASE);
+		unmap_lines(mapped);
+	}
+	unlock_tb(tb);
+}
+
+/* 
+ * Does the work of dumpTB for a mapped buffer, straight from the payload
+ */
+static char *dump_mapped(TB tb, int showLineNumbers) {
+
+	mappedLines *mapped = tb->mapped;
+	if (!showLineNumbers) {
+		char *dump = result_alloc(mapped->payloadBytes + 1);
+		memcpy(dump, mapped->payload, mapped->payloadBytes);
+		COUNT(bytes, mapped->payloadBytes);
+		//Each line's '\0' becomes its newline
+		char *end = dump + mapped->payloadBytes;
+		char *zero = memchr(dump, '\0', end - dump);
+		while (zero != NULL) {
+			*zero = '\n';
+			zero = memchr(zero + 1, '\0', end - zero - 1);
+		}
+		*end = '\0';
+		return dump;
+	}
+	textBuilder dump = {NULL, 0, 0};
+	append_text(&dump, "", 0);
+	for (long i = 0; i < tb->nlines; i++) {
+		char number[24];
+		int length;
+		const char *line = mapped_line(mapped, i, &length);
+		append_text(&dump, number, sprintf(number, "%ld. ", i + 1));
+		append_text(&dump, line, length);
+		append_text(&dump, "\n", 1);
+	}
+	return dump.text;
+}
+
+static void unmap_lines(mappedLines *mapped) {
+
+	munmap(mapped->base, mapped->size);
+	tb_free(mapped);
+}
+
+/* Keep 'tb' persisted at 'path' by appending a record of each edit to a
+ * log, rather than rewriting the whole buffer.
+ *
+ * - 'tb' is first written to 'path' as a snapshot, the base, and the log
+ *   starts at 'path' with ".log" added. Afterwards each call to addPrefixTB,
+ *   pasteTB, mergeTB, cutTB, deleteTB, formRichText and applyBatchTB that
+ *   changes 'tb' appends a record the size of the edit.
+ * - Records are synced to disk in groups: once JOURNAL_GROUP are waiting,
+ *   by syncJournalTB(), when 'tb' is released, and otherwise by a thread
+ *   each journal starts, once the oldest has waited JOURNAL_DELAY_NS, even
+ *   if no edit follows it. An edit isn't durable before that.
+ * - Once the log outgrows both JOURNAL_COMPACT and the base, 'tb' is written
+ *   out as a new base and the log starts again, so recovery time is bounded
+ *   and each edit still costs its own size on average.
+ * - A NULL 'path' stops journaling. Returns FALSE if the files can't be
+ *   written or the thread can't be started, in which case 'tb' isn't
+ *   journaled.
+ */
+int journalTB (TB tb, const char *path) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	write_lock(tb);
+	if (tb->journal != NULL) {
+		close_journal(tb);
+	}
+	int started = TRUE;
+	if (path != NULL) {
+		//A generation newer than the file being replaced, so that no log
+		//left beside it can match the new base
+		uint32_t generation = 1;
+		snapshotHeader header;
+		FILE *file = fopen(path, "rb");
+		if (file != NULL) {
+			if (fread(&header, sizeof(header), 1, file) == 1
+					&& memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0) {
+				generation = header.generation + 1;
+			}
+			fclose(file);
+		}
+		started = save_snapshot(tb, path, generation)
+			&& start_journal(tb, path, generation, -1);
+	}
+	unlock_tb(tb);
+	trace_end(&call, TRACE_JOURNAL, path == NULL ? "" : path, started);
+	return started;
+}
+
+/* Sync every record 'tb' has appended to its journal to disk.
+ *
+ * - Returns FALSE if 'tb' isn't journaled, or a write to the log has failed
+ *   since it was started.
+ */
+int syncJournalTB (TB tb) {
+
+	traceCall call;
+	trace_begin(&call, tb, NULL);
+	write_lock(tb);
+	int synced = FALSE;
+	if (tb->journal != NULL) {
+		pthread_mutex_lock(&tb->journal->lock);
+		synced = sync_journal(tb->journal);
+		pthread_mutex_unlock(&tb->journal->lock);
+	}
+	unlock_tb(tb);
+	trace_end(&call, TRACE_SYNC, synced);
+	return synced;
+}
+
+/* Rebuild the buffer journalTB() was persisting at 'path', and carry on
+ * journaling it there.
+ *
+ * - The base is loaded and every intact record in the log is replayed. A
+ *   record torn or corrupted by a crash ends the log, and is cut off it.
+ * - A log from an older base, left by a crash while the journal was being
+ *   compacted, is already part of the base and is ignored.
+ * - A plain snapshot from saveSnapshotTB() is taken as a base with no log.
+ * - Returns NULL if 'path' isn't a snapshot or the log can't be written.
+ */
+TB recoverTB (const char *path) {
+
+	traceCall call;
+	trace_begin(&call, NULL, NULL);
+	TB tb = load_snapshot(path);
+	if (tb != NULL) {
+		uint32_t generation = ((const snapshotHeader *) tb->mapped->base)->generation;
+		char name[strlen(path) + 5];
+		sprintf(name, "%s.log", path);
+		int fd = open(name, O_RDWR | O_APPEND);
+		struct stat st;
+		void *base = MAP_FAILED;
+		if (fd != -1 && generation != 0 && fstat(fd, &st) == 0
+				&& st.st_size >= (off_t) sizeof(journalHeader)) {
+			base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		const journalHeader *header = base;
+		if (base != MAP_FAILED
+				&& memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) == 0
+				&& header->byteOrder == SNAPSHOT_BYTE_ORDER && header->generation == generation) {
+			//Replay up to the first record that is torn, corrupt or out of range
+			const char *log = base;
+			off_t at = sizeof(journalHeader);
+			uint32_t frame[2];
+			while (st.st_size - at >= (off_t) sizeof(frame)) {
+				memcpy(frame, log + at, sizeof(frame));
+				const char *body = log + at + sizeof(frame);
+				if (frame[0] > st.st_size - at - sizeof(frame)
+						|| journal_checksum(body, frame[0]) != frame[1]
+						|| !replay_record(tb, body, frame[0])) {
+					break;
+				}
+				at = at + sizeof(frame) + frame[0];
+			}
+			if (at != st.st_size && ftruncate(fd, at) != 0) {
+				close(fd);
+				fd = -1;
+			}
+		} else if (fd != -1) {
+			close(fd);
+			fd = -1;
+		}
+		if (base != MAP_FAILED) {
+			munmap(base, st.st_size);
+		}
+		//A plain snapshot is written again as a base, so that no log can
+		//match it later
+		int started;
+		if (generation == 0) {
+			generation = 1;
+			started = save_snapshot(tb, path, generation) && start_journal(tb, path, generation, -1);
+		} else {
+			started = start_journal(tb, path, generation, fd);
+		}
+		if (!started) {
+			release_tb(tb);
+			tb = NULL;
+		}
+	}
+	trace_end(&call, TRACE_RECOVER, tb, path);
+	return tb;
+}
+
+/* 
+ * Attaches a journal to 'tb' whose base at 'path' is already written,
+ * appending to the log open on 'fd', or to a new log if 'fd' is -1, and
+ * starts the thread that syncs it
+ */
+static int start_journal(TB tb, const char *path, uint32_t generation, int fd) {
+
+	journal *log = tb_alloc(sizeof(journal));
+	log->path = tb_alloc(strlen(path) + 1);
+	strcpy(log->path, path);
+	log->fd = fd;
+	log->generation = generation;
+	log->unsynced = 0;
+	log->logBytes = fd == -1 ? 0 : lseek(fd, 0, SEEK_END);
+	log->failed = FALSE;
+	struct stat st;
+	log->baseBytes = stat(path, &st) == 0 ? st.st_size : 0;
+	if (fd == -1 && !start_log(log)) {
+		tb_free(log->path);
+		tb_free(log);
+		return FALSE;
+	}
+	//Deadlines are kept on trace_clock()'s clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&log->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&log->lock, NULL);
+	log->stopping = FALSE;
+	if (pthread_create(&log->flusher, NULL, flush_journal, log) != 0) {
+		pthread_cond_destroy(&log->wake);
+		pthread_mutex_destroy(&log->lock);
+		close(log->fd);
+		tb_free(log->path);
+		tb_free(log);
+		return FALSE;
+	}
+	tb->journal = log;
+	return TRUE;
+}
+
+/* 
+ * Replaces the log with an empty one for the current generation. The new
+ * log is synced before it takes the old one's place.
+ */
+static int start_log(journal *log) {
+
+	char name[strlen(log->path) + 9];
+	sprintf(name, "%s.log.tmp", log->path);
+	int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+	if (fd == -1) {
+		return FALSE;
+	}
+	journalHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+	header.byteOrder = SNAPSHOT_BYTE_ORDER;
+	header.generation = log->generation;
+	int ok = write(fd, &header, sizeof(header)) == sizeof(header) && fdatasync(fd) == 0;
+	//The name without ".tmp"
+	char final[strlen(log->path) + 5];
+	sprintf(final, "%s.log", log->path);
+	ok = ok && rename(name, final) == 0;
+	if (!ok) {
+		close(fd);
+		remove(name);
+		return FALSE;
+	}
+	if (log->fd != -1) {
+		close(log->fd);
+	}
+	log->fd = fd;
+	log->logBytes = sizeof(header);
+	log->unsynced = 0;
+	return TRUE;
+}
+
+/* 
+ * Syncs and closes the journal of 'tb', with 'tb' already locked
+ */
+static void close_journal(TB tb) {
+
+	journal *log = tb->journal;
+	pthread_mutex_lock(&log->lock);
+	log->stopping = TRUE;
+	pthread_cond_signal(&log->wake);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->flusher, NULL);
+	sync_journal(log);
+	close(log->fd);
+	pthread_cond_destroy(&log->wake);
+	pthread_mutex_destroy(&log->lock);
+	tb_free(log->path);
+	tb_free(log);
+	tb->journal = NULL;
+}
+
+/* 
+ * Syncs the records written to the log so far, with its lock held
+ */
+static int sync_journal(journal *log) {
+
+	if (!log->failed && log->unsynced != 0) {
+		log->failed = fdatasync(log->fd) != 0;
+		log->unsynced = 0;
+	}
+	return !log->failed;
+}
+
+/* 
+ * Body of the thread each journal starts, which syncs the log once its
+ * oldest unsynced record has waited JOURNAL_DELAY_NS, and otherwise sleeps
+ * until it is due, or until a record is written to an idle log
+ */
+static void *flush_journal(void *arg) {
+
+	journal *log = arg;
+	pthread_mutex_lock(&log->lock);
+	while (!log->stopping) {
+		long long due = log->unsyncedSince + JOURNAL_DELAY_NS;
+		if (log->unsynced == 0 || log->failed) {
+			pthread_cond_wait(&log->wake, &log->lock);
+		} else if (trace_clock() >= due) {
+			sync_journal(log);
+		} else {
+			struct timespec until = {due / 1000000000LL, due % 1000000000LL};
+			pthread_cond_timedwait(&log->wake, &log->lock, &until);
+		}
+	}
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+
+/* 
+ * Starts a record, leaving room for the length and checksum that
+ * journal_append fills in
+ */
+static void journal_begin(textBuilder *record, int op) {
+
+	char code = op;
+	append_text(record, "\0\0\0\0\0\0\0\0", 2 * sizeof(uint32_t));
+	append_text(record, &code, 1);
+}
+
+/* 
+ * Appends a record of an edit that takes two numbers and a string, with
+ * 'tb' already locked
+ */
+static void journal_edit(TB tb, int op, long a, long b, const char *text) {
+
+	textBuilder record = {NULL, 0, 0};
+	journal_begin(&record, op);
+	journal_number(&record, a);
+	journal_number(&record, b);
+	trace_string(&record, text);
+	journal_append(tb, &record);
+}
+
+/* 
+ * Builds the record of inserting the lines of 'tb2' before line 'pos'. It
+ * is built before the edit, as merging uses up 'tb2'.
+ */
+static void journal_insert(textBuilder *record, long pos, TB tb2) {
+
+	journal_begin(record, JOURNAL_INSERT);
+	journal_number(record, pos);
+	journal_number(record, 0);
+	journal_lines(record, tb2->first, tb2->nlines);
+}
+
+/* 
+ * Builds the record of applying 'batch', before applying it empties it
+ */
+static void journal_batch(textBuilder *record, TBBatch batch) {
+
+	journal_begin(record, JOURNAL_BATCH);
+	journal_number(record, batch->nedits);
+	for (int i = 0; i < batch->nedits; i++) {
+		batchEdit *edit = &batch->edits[i];
+		journal_number(record, edit->kind);
+		journal_number(record, edit->from);
+		journal_number(record, edit->to);
+		if (edit->kind == BATCH_PREFIX) {
+			trace_string(record, edit->prefix);
+		} else if (edit->kind == BATCH_PASTE) {
+			journal_lines(record, edit->first, edit->count);
+		} else {
+			trace_string(record, "");
+		}
+	}
+}
+
+static void journal_number(textBuilder *record, long n) {
+
+	trace_number(record, ((unsigned long) n << 1) ^ (unsigned long) (n >> 63));
+}
+
+/* 
+ * Appends 'count' lines from 'first' as one string, each line followed by
+ * a newline, as newTB takes them
+ */
+static void journal_lines(textBuilder *record, TBNode first, long count) {
+
+	unsigned long long length = 0;
+	TBNode curr = first;
+	for (long i = 0; i < count; i++) {
+		length = length + curr->length + 1;
+		curr = curr->next;
+	}
+	trace_number(record, length);
+	curr = first;
+	for (long i = 0; i < count; i++) {
+		append_text(record, node_line(curr), curr->length);
+		append_text(record, "\n", 1);
+		curr = curr->next;
+	}
+}
+
+/* 
+ * Writes a finished record to the log of 'tb', with 'tb' already locked,
+ * then syncs the log if its group is due and compacts it if it has grown
+ * too big. Frees the record.
+ */
+static void journal_append(TB tb, textBuilder *record) {
+
+	journal *log = tb->journal;
+	uint32_t frame[2];
+	//A record too long to frame can't be logged, so nothing after it can be
+	if (record->length - sizeof(frame) > UINT32_MAX) {
+		log->failed = TRUE;
+	}
+	frame[0] = record->length - sizeof(frame);
+	frame[1] = journal_checksum(record->text + sizeof(frame), frame[0]);
+	memcpy(record->text, frame, sizeof(frame));
+	pthread_mutex_lock(&log->lock);
+	if (!log->failed) {
+		if (write(log->fd, record->text, record->length) != record->length) {
+			log->failed = TRUE;
+		} else {
+			long long now = trace_clock();
+			log->logBytes = log->logBytes + record->length;
+			if (log->unsynced == 0) {
+				log->unsyncedSince = now;
+				//The thread sleeps until the record is due
+				pthread_cond_signal(&log->wake);
+			}
+			log->unsynced++;
+			if (log->unsynced >= JOURNAL_GROUP || now - log->unsyncedSince >= JOURNAL_DELAY_NS) {
+				sync_journal(log);
+			}
+		}
+	}
+	free(record->text);
+
+	//The new base holds every record, so if a crash comes before the new log
+	//replaces the old one, recoverTB ignores the old one
+	if (!log->failed && log->logBytes > JOURNAL_COMPACT && log->logBytes > log->baseBytes) {
+		if (save_snapshot(tb, log->path, log->generation + 1)) {
+			log->generation++;
+			struct stat st;
+			log->baseBytes = stat(log->path, &st) == 0 ? st.st_size : 0;
+			log->failed = !start_log(log);
+		} else {
+			log->failed = TRUE;
+		}
+	}
+	pthread_mutex_unlock(&log->lock);
+}
+
+/* 
+ * FNV-1a, folded to 32 bits, to catch records torn or damaged by a crash
+ */
+static unsigned int journal_checksum(const char *body, uint32_t length) {
+
+	unsigned int hash = 2166136261U;
+	for (uint32_t i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char) body[i]) * 16777619U;
+	}
+	return hash;
+}
+
+/* 
+ * Applies one record of the log to 'tb'. Returns FALSE, changing nothing,
+ * if the record is malformed or doesn't fit 'tb', which would have made the
+ * edit abort() when it was made.
+ */
+static int replay_record(TB tb, const char *body, uint32_t length) {
+
+	const char *at = body + 1;
+	const char *end = body + length;
+	long long a;
+	long long b;
+	if (length == 0 || !read_number(&at, end, &a)) {
+		return FALSE;
+	}
+	load_mapped(tb);
+	int op = body[0];
+	long nlines = tb->nlines;
+
+	//Case 1: A batch, whose edits are all checked before it is applied
+	if (op == JOURNAL_BATCH) {
+		if (a < 0 || a > end - at) {
+			return FALSE;
+		}
+		TBBatch batch = tb_alloc(sizeof(struct textbufferBatch));
+		batch->edits = NULL;
+		batch->nedits = 0;
+		batch->capacity = 0;
+		int ok = TRUE;
+		for (long long i = 0; i < a && ok; i++) {
+			long long kind;
+			long long from;
+			long long to;
+			char *text = NULL;
+			ok = read_number(&at, end, &kind) && read_number(&at, end, &from)
+				&& read_number(&at, end, &to) && (text = read_string(&at, end)) != NULL;
+			long limit = kind == BATCH_PASTE ? nlines : nlines - 1;
+			ok = ok && from >= 0 && from <= to && to <= limit && to <= INT_MAX;
+			//Empty prefixes and pastes are never queued
+			if (ok && kind == BATCH_DELETE) {
+				queue_edit(batch, kind, from, to);
+			} else if (ok && kind == BATCH_PREFIX && text[0] != '\0') {
+				queue_edit(batch, kind, from, to)->prefix = text;
+				text = NULL;
+			} else if (ok && kind == BATCH_PASTE && from == to && text[0] != '\0') {
+				batchEdit *edit = queue_edit(batch, kind, from, to);
+				TB lines = new_tb(text);
+				edit->first = lines->first;
+				edit->last = lines->last;
+				edit->count = lines->nlines;
+				free_tb(lines);
+			} else {
+				ok = FALSE;
+			}
+			tb_free(text);
+		}
+		ok = ok && at == end;
+		if (ok) {
+			apply_batch(tb, batch);
+		}
+		free_batch(batch);
+		return ok;
+	}
+
+	//Case 2: An edit with two numbers and a string
+	char *text = NULL;
+	if (!read_number(&at, end, &b) || (text = read_string(&at, end)) == NULL || at != end) {
+		tb_free(text);
+		return FALSE;
+	}
+	int ok = TRUE;
+	if (op == JOURNAL_PREFIX && a >= 0 && a <= b && b < nlines) {
+		add_prefix(tb, a, b, text);
+	} else if (op == JOURNAL_DELETE && (nlines == 0 || (a >= 0 && a <= b && b < nlines))) {
+		delete_tb(tb, a, b);
+	} else if (op == JOURNAL_RICH) {
+		form_rich_text(tb);
+	} else if (op == JOURNAL_INSERT && a >= 0 && a <= nlines && text[0] != '\0') {
+		TB lines = new_tb(text);
+		merge_tb(tb, a, lines);
+		free_tb(lines);
+	} else {
+		ok = FALSE;
+	}
+	tb_free(text);
+	return ok;
+}
+
+/* 
+ * Reads a varint, without going past 'end'
+ */
+static int read_varint(const char **at, const char *end, unsigned long long *n) {
+
+	*n = 0;
+	for (int shift = 0; shift < 64; shift = shift + 7) {
+		if (*at == end) {
+			return FALSE;
+		}
+		unsigned char byte = **at;
+		(*at)++;
+		*n = *n | (unsigned long long) (byte & 0x7f) << shift;
+		if (byte < 0x80) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* 
+ * Reads a zigzag varint that fits in an int
+ */
+static int read_number(const char **at, const char *end, long long *n) {
+
+	unsigned long long bits;
+	if (!read_varint(at, end, &bits)) {
+		return FALSE;
+	}
+	*n = (long long) (bits >> 1) ^ -(long long) (bits & 1);
+	return TRUE;
+}
+
+/* 
+ * Reads a string, returning a copy the caller frees, or NULL if it runs
+ * past 'end'
+ */
+static char *read_string(const char **at, const char *end) {
+
+	unsigned long long length;
+	if (!read_varint(at, end, &length) || length > (unsigned long long) (end - *at)) {
+		return NULL;
+	}
+	char *text = tb_alloc(length + 1);
+	memcpy(text, *at, length);
+	text[length] = '\0';
+	*at = *at + length;
+	return text;
+}
+
+/* Record every call made to the textbuffer functions, with its arguments and
+ * how long it took, to a binary trace at 'path' that tbreplay can play back.
+ *
+ * - Calls from every thread go to the one trace, in the order they finish.
+ * - A buffer made before the trace started is recorded with its text the
+ *   first time a call uses it.
+ * - Returns FALSE if the file can't be written, or a trace is already on.
+ */
+int startTraceTB (const char *path) {
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace.file != NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		return FALSE;
+	}
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		return FALSE;
+	}
+	fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LENGTH, file);
+	trace.start = trace_clock();
+	trace.generation++;
+	trace.buffers = 0;
+	trace.batches = 0;
+	trace.watches = 0;
+	trace.workspaces = 0;
+	__atomic_store_n(&trace.file, file, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+	return TRUE;
+}
+
+/* Stop recording the trace started by startTraceTB(), and close its file.
+ */
+void stopTraceTB (void) {
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace.file != NULL) {
+		fclose(trace.file);
+		__atomic_store_n(&trace.file, NULL, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static long long trace_clock(void) {
+
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* 
+ * Starts timing a call, if a trace is on, after noting the buffers it was
+ * passed. Costs a single load when tracing is off and TB_STATS isn't set.
+ */
+static void trace_begin(traceCall *call, TB tb1, TB tb2) {
+
+	call->start = 0;
+	if (__atomic_load_n(&trace.file, __ATOMIC_ACQUIRE) != NULL) {
+		call->ids[0] = tb1 == NULL ? 0 : trace_buffer(tb1);
+		call->ids[1] = tb2 == NULL ? 0 : trace_buffer(tb2);
+		call->start = trace_clock();
+	}
+#ifdef TB_STATS
+	call->tb = tb1;
+	call->work = work;
+	call->began = trace_clock();
+#endif
+}
+
+/* 
+ * Writes the record of a call started by trace_begin(). The arguments
+ * follow traceArgs[op], leaving out the buffers passed to trace_begin().
+ */
+static void trace_end(traceCall *call, int op, ...) {
+
+#ifdef TB_STATS
+	count_call(call, op);
+#endif
+	if (call->start == 0) {
+		return;
+	}
+	long long end = trace_clock();
+	textBuilder record = {NULL, 0, 0};
+	va_list args;
+	va_start(args, op);
+	pthread_mutex_lock(&trace_lock);
+	if (trace.file == NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		va_end(args);
+		return;
+	}
+	trace_header(&record, op, call->start, end);
+	int nids = 0;
+	for (const char *arg = traceArgs[op]; *arg != '\0'; arg++) {
+		if (*arg == 'b') {
+			trace_number(&record, call->ids[nids++]);
+		} else if (*arg == 'n') {
+			TB tb = va_arg(args, TB);
+			if (tb != NULL) {
+				tb->traceId = ++trace.buffers;
+				tb->traceGeneration = trace.generation;
+			}
+			trace_number(&record, tb == NULL ? 0 : tb->traceId);
+		} else if (*arg == 'h') {
+			trace_number(&record, trace_batch(va_arg(args, TBBatch), op != TRACE_BATCH_NEW));
+		} else if (*arg == 'w') {
+			trace_number(&record, trace_watch(va_arg(args, TBWatch)));
+		} else if (*arg == 'k') {
+			trace_number(&record, trace_workspace(va_arg(args, TBWorkspace)));
+		} else if (*arg == 's') {
+			trace_string(&record, va_arg(args, char *));
+		} else if (*arg == 't') {
+			long length = va_arg(args, long);
+			trace_number(&record, length);
+			append_text(&record, va_arg(args, char *), length);
+		} else if (*arg == 'z') {
+			trace_number(&record, va_arg(args, size_t));
+		} else {
+			//Zigzag, so that small negative numbers stay short
+			int n = va_arg(args, int);
+			trace_number(&record, ((unsigned int) n << 1) ^ (unsigned int) (n >> 31));
+		}
+	}
+	va_end(args);
+	fwrite(record.text, 1, record.length, trace.file);
+	pthread_mutex_unlock(&trace_lock);
+	free(record.text);
+}
+
+/* 
+ * Returns the trace id of 'tb', first recording its text if the trace
+ * hasn't seen it yet
+ */
+static int trace_buffer(TB tb) {
+
+	pthread_mutex_lock(&trace_lock);
+	int generation = trace.generation;
+	int seen = tb->traceGeneration == generation;
+	int id = tb->traceId;
+	pthread_mutex_unlock(&trace_lock);
+	if (seen) {
+		return id;
+	}
+
+	read_lock(tb);
+	char *text = dump_tb(tb, FALSE);
+	unlock_tb(tb);
+	long long now = trace_clock();
+	textBuilder record = {NULL, 0, 0};
+	pthread_mutex_lock(&trace_lock);
+	if (tb->traceGeneration != generation && trace.file != NULL && trace.generation == generation) {
+		tb->traceId = ++trace.buffers;
+		tb->traceGeneration = generation;
+		trace_header(&record, TRACE_ADOPT, now, now);
+		trace_number(&record, tb->traceId);
+		trace_string(&record, text);
+		fwrite(record.text, 1, record.length, trace.file);
+	}
+	id = tb->traceId;
+	pthread_mutex_unlock(&trace_lock);
+	free(record.text);
+	free(text);
+	return id;
+}
+
+/* 
+ * Returns the trace id of 'batch', with the trace lock held. If 'adopt', a
+ * batch the trace hasn't seen yet is recorded as new first.
+ */
+static int trace_batch(TBBatch batch, int adopt) {
+
+	if (batch->traceGeneration != trace.generation) {
+		batch->traceId = ++trace.batches;
+		batch->traceGeneration = trace.generation;
+		if (adopt) {
+			textBuilder adopt = {NULL, 0, 0};
+			long long now = trace_clock();
+			trace_header(&adopt, TRACE_BATCH_NEW, now, now);
+			trace_number(&adopt, batch->traceId);
+			fwrite(adopt.text, 1, adopt.length, trace.file);
+			free(adopt.text);
+		}
+	}
+	return batch->traceId;
+}
+
+/* 
+ * Returns the trace id of 'watch', with the trace lock held, numbering it
+ * if the trace hasn't seen it yet
  */
-Match searchTB (TB tb, char* search){
+static int trace_watch(TBWatch watch) {
 
-	//Case 1: search for nothing;
-	if (strcmp(search, "") == 0) {
-		return NULL;
+	if (watch->traceGeneration != trace.generation) {
+		watch->traceId = ++trace.watches;
+		watch->traceGeneration = trace.generation;
 	}
+	return watch->traceId;
+}
 
-	//Case 2: search for NULL;
-	if (search == NULL) {
-		printf("Invalid search");
-		abort();
-	}
+/* 
+ * Returns the trace id of 'ws', with the trace lock held, numbering it if
+ * the trace hasn't seen it yet
+ */
+static int trace_workspace(TBWorkspace ws) {
 
-	//Case 3: No lines;
-	if (tb->nlines == 0) {
-		return NULL;
+	if (ws->traceGeneration != trace.generation) {
+		ws->traceId = ++trace.workspaces;
+		ws->traceGeneration = trace.generation;
 	}
+	return ws->traceId;
+}
 
-	//Case 4: Normal search:
-	//First create match
-	Match new_node = malloc(sizeof(matchNode));
-	Match new_match = new_node;
-	new_node->next = NULL;
+static void trace_header(textBuilder *record, int op, long long start, long long end) {
 
-	TBNode curr = tb->first;
-	int line_num = 1;
-	int found = 0;
-	int search_length = strlen(search);
-	while (curr!= NULL) {
-		char *charindex = strstr(curr->line,search);
-		if (found == 0) {
-			//Do first line;
-			if (charindex != NULL) {
-				new_node->lineNumber = line_num;
-				new_node->charIndex = (charindex - curr->line);
-				new_node->next = NULL;
-				found++;
-			}	
-			if (charindex != NULL) {
-				charindex = strstr(curr->line + new_node->charIndex + search_length, search);
-			}
-		}	
+	char code = op;
+	append_text(record, &code, 1);
+	trace_number(record, start - trace.start);
+	trace_number(record, end - start);
+}
 
-		while (charindex != NULL) {
-			new_node->next = malloc(sizeof(matchNode));
-			new_node->next->lineNumber = line_num;
-			new_node->next->charIndex = (charindex - curr->line);
-			new_node = new_node->next;
-			new_node->next = NULL;
-			charindex = strstr(curr->line + new_node->charIndex + search_length, search);
-		}
-		line_num++;
-		curr = curr->next;
-	}
+/* 
+ * Appends 'n' as a varint, seven bits at a time
+ */
+static void trace_number(textBuilder *record, unsigned long long n) {
 
-	if (found == 0) {
-		free(new_match);
-		new_match = NULL;
+	char bytes[10];
+	int length = 0;
+	while (n >= 0x80) {
+		bytes[length++] = (char) (n | 0x80);
+		n = n >> 7;
 	}
-	return new_match;
+	bytes[length++] = (char) n;
+	append_text(record, bytes, length);
 }
 
-/* Remove the lines between and including 'from' and 'to' from the textbuffer
- * 'tb'.
+static void trace_string(textBuilder *record, const char *s) {
+
+	size_t length = strlen(s);
+	trace_number(record, length);
+	append_text(record, s, length);
+}
+
+/* Report how often each function was called on 'tb', how long the calls
+ * took and the work they did.
  *
- * - The program is to abort() with an error message if 'from' or 'to' is out
- *   of range.
+ * - ops[] is indexed by the operation codes of tbtrace.h, and traceNames
+ *   names them. p50Ns and p99Ns are accurate to within an eighth.
+ * - A call is counted on the first buffer it was passed. newTB, releaseTB
+ *   and the batch functions that take no buffer are only counted globally.
+ * - Counting is compiled in by defining TB_STATS; without it every count
+ *   is zero and the functions cost nothing.
  */
-void deleteTB (TB tb, int from, int to){
+void statsTB (TB tb, tbStats *stats) {
+
+	memset(stats, 0, sizeof(tbStats));
+#ifdef TB_STATS
+	statCounters *counters = __atomic_load_n(&tb->stats, __ATOMIC_ACQUIRE);
+	if (counters != NULL) {
+		opCounters sums[TRACE_OPS];
+		memset(sums, 0, sizeof(sums));
+		sum_counts(counters, sums, stats);
+		report_counts(sums, stats);
+	}
+#else
+	(void) tb;
+#endif
+}
 
-	//Case 1: tb is empty
-	if (tb->nlines == 0) {
-		return;
+/* The same as statsTB, for the calls made on every textbuffer and batch
+ * from every thread so far.
+ */
+void globalStatsTB (tbStats *stats) {
+
+	memset(stats, 0, sizeof(tbStats));
+#ifdef TB_STATS
+	opCounters sums[TRACE_OPS];
+	memset(sums, 0, sizeof(sums));
+	statCounters *counters = __atomic_load_n(&thread_stats, __ATOMIC_ACQUIRE);
+	while (counters != NULL) {
+		sum_counts(counters, sums, stats);
+		counters = counters->next;
 	}
+	report_counts(sums, stats);
+#endif
+}
 
-	//Case 2: to is larger than from
-	if (to < from) {
-		printf("Invalid position");
-		abort();
+#ifdef TB_STATS
+/* 
+ * Counts a call that trace_begin() started, against the calling thread and
+ * the first buffer it was passed
+ */
+static void count_call(traceCall *call, int op) {
+
+	long long ns = trace_clock() - call->began;
+	workCounts done = {
+		work.nodes - call->work.nodes,
+		work.bytes - call->work.bytes,
+		work.allocations - call->work.allocations
+	};
+	if (my_stats == NULL) {
+		my_stats = calloc(1, sizeof(statCounters));
+		assert(my_stats != NULL);
+		my_stats->next = __atomic_load_n(&thread_stats, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&thread_stats, &my_stats->next, my_stats,
+				TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 	}
+	add_counts(my_stats, op, ns, &done);
+	//releaseTB has freed its buffer by now
+	if (call->tb != NULL && op != TRACE_RELEASE) {
+		statCounters *counters = stat_counters((void **) &call->tb->stats, sizeof(statCounters));
+		add_counts(counters, op, ns, &done);
+	}
+}
 
-	//Case 3: If to or from is out of range
-	if (from < 0 || to < 0) {
-		printf("Positions out of range");
-		abort();	
+/* 
+ * Returns the counters at '*counters', allocating them if this is the first
+ * call to need them. Readers of a thread safe buffer may race to do so.
+ */
+static void *stat_counters(void **counters, size_t size) {
+
+	void *found = __atomic_load_n(counters, __ATOMIC_ACQUIRE);
+	if (found != NULL) {
+		return found;
 	}
-	if (from > tb->nlines-1 || to > tb->nlines-1) {
-		printf("Positions out of range");
-		abort();	
+	void *fresh = calloc(1, size);
+	assert(fresh != NULL);
+	if (__atomic_compare_exchange_n(counters, &found, fresh, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return fresh;
 	}
+	free(fresh);
+	return found;
+}
 
-	//Case 4: Deleting first node
-	if ((from == 0) && (to != tb->nlines - 1)) {
-		TBNode first = tb->first;
-		TBNode last = tb->first;
-		int line_num = 0; 
-		while (line_num != to) {
-			last = last->next;
-			line_num++;
+static void add_counts(statCounters *counters, int op, long long ns, workCounts *done) {
+
+	opCounters *counts = stat_counters((void **) &counters->ops[op], sizeof(opCounters));
+	__atomic_fetch_add(&counts->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counts->totalNs, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counts->buckets[stat_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counters->work.nodes, done->nodes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counters->work.bytes, done->bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counters->work.allocations, done->allocations, __ATOMIC_RELAXED);
+}
+
+/* 
+ * Adds 'counters' into 'sums' and the work totals of 'stats'
+ */
+static void sum_counts(statCounters *counters, opCounters sums[TRACE_OPS], tbStats *stats) {
+
+	for (int op = 0; op < TRACE_OPS; op++) {
+		opCounters *counts = __atomic_load_n(&counters->ops[op], __ATOMIC_ACQUIRE);
+		if (counts == NULL) {
+			continue;
 		}
-		//adjust tb
-		tb->first = last->next;
-		last->next->prev = NULL;
-		//make tb2
-		last->next = NULL;
-		free_nodes(first);
-		//free from first to last
-		tb->nlines = tb->nlines - (to-from + 1);
-		return;
-	}
- 
-	//Case 5: Deleting last node
-	if ((from != 0) && (to == tb->nlines - 1)) {
-		TBNode first = tb->first;
-		//TBNode last = tb->last;
-		int line_num = 0; 
-		while (line_num != from) {
-			first = first->next;
-			line_num++;
+		sums[op].calls += __atomic_load_n(&counts->calls, __ATOMIC_RELAXED);
+		sums[op].totalNs += __atomic_load_n(&counts->totalNs, __ATOMIC_RELAXED);
+		for (int i = 0; i < STAT_BUCKETS; i++) {
+			sums[op].buckets[i] += __atomic_load_n(&counts->buckets[i], __ATOMIC_RELAXED);
 		}
-		tb->last = first->prev;
-		first->prev->next = NULL;
-		free_nodes(first);
-		tb->nlines = tb->nlines - (to - from + 1);
-		return;
-
 	}
+	stats->nodesTraversed += __atomic_load_n(&counters->work.nodes, __ATOMIC_RELAXED);
+	stats->bytesCopied += __atomic_load_n(&counters->work.bytes, __ATOMIC_RELAXED);
+	stats->allocations += __atomic_load_n(&counters->work.allocations, __ATOMIC_RELAXED);
+}
 
-	//Case 6: moving whole text
-	if ((from == 0) && (to == tb->nlines - 1)) {
-		free_nodes(tb->first);
-		tb->first = NULL;
-		tb->last = NULL;
-		tb->nlines = tb->nlines - (to - from + 1);
-		return;
+static void report_counts(opCounters sums[TRACE_OPS], tbStats *stats) {
+
+	for (int op = 0; op < TRACE_OPS; op++) {
+		stats->ops[op].calls = sums[op].calls;
+		stats->ops[op].totalNs = sums[op].totalNs;
+		stats->ops[op].p50Ns = stat_percentile(&sums[op], 50);
+		stats->ops[op].p99Ns = stat_percentile(&sums[op], 99);
 	}
+}
 
-	//Case 6: Deleting normally
-	TBNode first = tb->first;
-	TBNode last = tb->last;
-	TBNode curr = tb->first;
-	int line_num = 0; 
-	while (curr != NULL) {
-		if (line_num == from) {
-			first = curr;
-		} 
-		if (line_num == to) {
+/* 
+ * Below 4ns each nanosecond has its own bucket. Above, a value's top bit
+ * picks a power of two and the two bits under it one of four buckets.
+ */
+static int stat_bucket(long long ns) {
 
-			last = curr;
-		}
-		line_num++;
-		curr = curr->next;
+	if (ns < 4) {
+		return ns < 0 ? 0 : ns;
 	}
-	first->prev->next = last->next;
-	last->next->prev = first->prev;
-	first->prev = NULL;
-	last->next = NULL;
-	free_nodes(first);
-	tb->nlines = tb->nlines - (to - from + 1);
-	return;
+	int power = 63 - __builtin_clzll(ns);
+	int bucket = (power - 1) * 4 + (int) ((ns >> (power - 2)) & 3);
+	return bucket < STAT_BUCKETS ? bucket : STAT_BUCKETS - 1;
 }
 
 /* 
- * Frees nodes starting from a start up until it reaches NULL
- * Essentially releaseTB if we didn't have the free component
- */ 
-static void free_nodes(TBNode start) {
+ * Returns the middle of the bucket the given percentile of calls falls in
+ */
+static long long stat_percentile(opCounters *counts, int percent) {
 
-	TBNode curr = start;
-	if (curr->next == NULL){
-		free(curr->line);
-		free(curr);
-		return;
+	if (counts->calls == 0) {
+		return 0;
 	}
-	curr = start->next;
-	while (curr->next!= NULL) {
-		free(curr->prev->line);
-		free(curr->prev);
-		curr = curr->next;
+	unsigned long rank = (counts->calls * percent + 99) / 100;
+	unsigned long seen = 0;
+	int bucket = 0;
+	while (bucket < STAT_BUCKETS - 1) {
+		seen = seen + counts->buckets[bucket];
+		if (seen >= rank) {
+			break;
+		}
+		bucket++;
 	}
-	free(curr->prev->line);
-	free(curr->prev);
-	free(curr->line);
-	free(curr);
-
+	if (bucket < 4) {
+		return bucket;
+	}
+	long long width = 1LL << (bucket / 4 - 1);
+	return (4 + bucket % 4) * width + width / 2;
 }
+#endif
 
-/* Search every line of tb for each occurrence of a set of specified subsitituions
- * and alter them accordingly
- *
- * refer to spec for table.
+/* Reads the varint at 'at' in a trace, for the tests below
  */
-void formRichText (TB tb){
+static unsigned long long trace_read(const char *record, int *at) {
 
-	//Case 1: Empty tb
-	if (tb->nlines == 0) {
-		return;
+	unsigned long long n = 0;
+	int shift = 0;
+	while (record[*at] & 0x80) {
+		n = n | (unsigned long long) (record[(*at)++] & 0x7f) << shift;
+		shift = shift + 7;
 	}
+	return n | (unsigned long long) record[(*at)++] << shift;
+}
 
-	//Case 2: normal case;
-	TBNode curr = tb->first;
-	while (curr != NULL) {
-		int index = 0;
-		int length = strlen(curr->line);
-		//Tells you if it is '_' or '*'
-		char type[length];
-		type[0]= '\0';
-		//Tells you where to find these
-		int array[length];
-		int charIndex = 0;
-		char  letter = curr->line[charIndex];
-		while (letter != '\0') {
-			int found = 0;
-			if (letter == '*') {
-				int prev = charIndex;
-				found = search_closer(charIndex, &charIndex, curr->line, 1);
-				if (found == 1) {
-					type[index *2] = '1';
-					type[index *2 +1] = '1';
-					array[index *2] = prev;
-					array[index *2 +1] = charIndex;
-					index++;
-				}
-			} else if (letter == '_') {
-				int prev = charIndex;
-				found = search_closer(charIndex, &charIndex, curr->line, 2);
-				if (found == 1) {
-					type[index *2] = '2';
-					type[index *2 +1] = '2';
-					array[index *2] = prev;
-					array[index *2 +1] = charIndex;
-					index++;
-				}
-			} else if ((letter == '#') && (charIndex == 0) && (length > 1)) {
-				type[index *2] = '3';
-				type[index *2 +1] = '3';
-				array[0] = 0;
-				array[1] = length;
-				index++;
-				charIndex = length-1;
-			}	
-			charIndex++;
-			letter = curr->line[charIndex];
-		}
-		if (index > 0) {
-			curr->line = addrich(length, array, type, curr->line, index * 2);
+/* An allocator that counts its allocations and frees, for the tests below
+ */
+static void *test_allocate(size_t size, void *ctx) {
+
+	((long *) ctx)[0]++;
+	return malloc(size);
+}
+
+static void *test_reallocate(void *ptr, size_t size, void *ctx) {
+
+	(void) ctx;
+	return realloc(ptr, size);
+}
+
+static void test_deallocate(void *ptr, void *ctx) {
+
+	((long *) ctx)[1]++;
+	free(ptr);
+}
+
+/* Applies an edit script produced by diffTB to 'tb', for the tests below
+ */
+static void apply_diff(TB tb, char *diff) {
+
+	char *command = diff;
+	while (*command != '\0') {
+		char *end = strchr(command, '\n');
+		int pos = atoi(command + 2);
+		if (command[0] == '-') {
+			deleteTB(tb, pos, pos);
+		} else {
+			char *text = strchr(command + 2, ',') + 1;
+			char line[end - text + 2];
+			memcpy(line, text, end - text);
+			line[end - text] = '\n';
+			line[end - text + 1] = '\0';
+			mergeTB(tb, pos, newTB(line));
 		}
-		curr = curr->next;
+		command = end + 1;
 	}
 }
 
-/* Searches through a line to find the next valid '*' or '_'
- * If none found, it returns FALSE
- * If found, it returns TRUE and increments charIndex in the caller
+/* Checks lineAtOffsetTB and offsetOfLineTB against the dump of 'tb', at the
+ * first and last byte of every line, for the tests below
  */
-static int search_closer(int charIndex, int *new_start, char *line, int type) {
+static void check_offsets(TB tb) {
+
+	char *dump = dumpTB(tb, FALSE);
+	size_t offset = 0;
+	size_t nlines = linesTB64(tb);
+	for (size_t line = 0; line < nlines; line++) {
+		size_t end = strchr(dump + offset, '\n') - dump;
+		assert(offsetOfLineTB(tb, line) == offset);
+		assert(lineAtOffsetTB(tb, offset) == line);
+		assert(lineAtOffsetTB(tb, end) == line);
+		offset = end + 1;
+	}
+	assert(offsetOfLineTB(tb, nlines) == offset);
+	free(dump);
+}
 
-	charIndex = charIndex + 1;
-	char letter = line[charIndex];
+/* Checks that the chunks under 'chunk' hold the nodes and lengths of the
+ * lines of 'tb' from line 'pos', with the right totals and in heap order,
+ * for the tests below. Returns the number of chunks.
+ */
+static long check_chunks(TB tb, indexChunk *chunk, long pos) {
 
-	if ((type == 1) && (letter == '*')) {
-		return FALSE;
-	} 
-	if ((type == 2) && (letter == '_')) {
-		return FALSE;
-	} 
+	if (chunk == NULL) {
+		return 0;
+	}
+	long nchunks = check_chunks(tb, chunk->left, pos) + 1;
+	long lines = chunk->count;
+	long bytes = 0;
+	if (chunk->left != NULL) {
+		assert(chunk->left->priority <= chunk->priority);
+		pos = pos + chunk->left->lines;
+		lines = lines + chunk->left->lines;
+		bytes = bytes + chunk->left->bytes;
+	}
+	assert(chunk->count > 0 && chunk->count <= 2 * INDEX_CHUNK);
+	long own = 0;
+	TBNode curr = node_at(tb, pos);
+	for (int i = 0; i < chunk->count; i++) {
+		assert(chunk->nodes[i] == curr && chunk->lengths[i] == curr->length + 1);
+		own = own + chunk->lengths[i];
+		curr = curr->next;
+	}
+	assert(chunk->own == own);
+	bytes = bytes + own;
+	if (chunk->right != NULL) {
+		assert(chunk->right->priority <= chunk->priority);
+		nchunks = nchunks + check_chunks(tb, chunk->right, pos + chunk->count);
+		lines = lines + chunk->right->lines;
+		bytes = bytes + chunk->right->bytes;
+	}
+	assert(chunk->lines == lines && chunk->bytes == bytes);
+	return nchunks;
+}
 
-	while (letter != '\0') {
-		if ((letter == '*') && (type == 1)) {
-			*new_start = charIndex;
-			return TRUE;
-		} else if ((letter == '_') && (type == 2)) {
-			*new_start = charIndex;
-			return TRUE;
+/* Checks that the line index of 'tb', once synced, holds every line, in
+ * chunks that stay at least a quarter full on average and are linked in
+ * order, for the tests below
+ */
+static void check_index(TB tb) {
+
+	lineIndex *index = sync_index(tb);
+	assert(index->valid == tb->nlines);
+	assert(check_chunks(tb, index->root, 0) == index->nchunks);
+	assert(index->nchunks <= 2 * tb->nlines / (INDEX_CHUNK + 1) + 1);
+	TBNode curr = tb->first;
+	long nchunks = 0;
+	for (indexChunk *chunk = first_chunk(index->root); chunk != NULL; chunk = chunk->next) {
+		for (int i = 0; i < chunk->count; i++) {
+			assert(chunk->nodes[i] == curr);
+			curr = curr->next;
 		}
-		charIndex++;
-		letter = line[charIndex];
+		nchunks++;
 	}
-	return FALSE;
+	assert(curr == NULL && nchunks == index->nchunks);
 }
-	
-
 
-/* 
- * First go through all of the text and null terminate
- * any '*' and '_' to use strcat. Then puts in the headers and closers
+/* Checks that 'tb1' and 'tb2' dump the same and give the same matches,
+ * for the tests below
  */
-static char *addrich(int length, int array[length], char type[length], char *line, int index) {
+static void check_unrolled(TB tb1, TB tb2) {
+
+	char *dump1 = dumpTB(tb1, TRUE);
+	char *dump2 = dumpTB(tb2, TRUE);
+	assert(strcmp(dump1, dump2) == 0);
+	free(dump1);
+	free(dump2);
+	Match matches1 = searchTB(tb1, "b");
+	Match matches2 = searchTB(tb2, "b");
+	while (matches1 != NULL && matches2 != NULL) {
+		assert(matches1->lineNumber == matches2->lineNumber && matches1->charIndex == matches2->charIndex);
+		Match next1 = matches1->next;
+		Match next2 = matches2->next;
+		free(matches1);
+		free(matches2);
+		matches1 = next1;
+		matches2 = next2;
+	}
+	assert(matches1 == NULL && matches2 == NULL);
+}
 
-	char *new_line = malloc(length * 5 * sizeof(char));
-	new_line[0] = '\0';
+/* Checks that the hash blocks of 'tb', once synced, cover its lines in order
+ * and hold the hash of the lines they start at, for the tests below
+ */
+static void check_hashes(TB tb) {
 
-	int i = 0 ;
-	while(i<index) {
-		line[array[i]] = '\0';
-		i++;
+	hashIndex *hashes = sync_hashes(tb);
+	TBNode curr = tb->first;
+	long total = 0;
+	for (long i = 0; i < hashes->nblocks; i++) {
+		assert(block_first(tb, i) == curr && hashes->blocks[i].dirty == FALSE);
+		assert(hashes->blocks[i].count > 0 && hashes->blocks[i].count <= 2 * HASH_BLOCK);
+		unsigned long long hash = 0;
+		for (long j = 0; j < hashes->blocks[i].count; j++) {
+			hash = join_hash(hash, HASH_BASE, curr->hash % HASH_PRIME);
+			curr = curr->next;
+		}
+		assert(hashes->blocks[i].hash == hash);
+		total = total + hashes->blocks[i].count;
 	}
+	assert(curr == NULL && total == tb->nlines);
+}
 
-	i = 0 ;
-	int check = 0;
-	int first = 0;
-	while(i<index) {
-		if ((type[i] == '1') && (check == 0)) {
-			if (first == 0) {
-				strcat(new_line, line);
-				first = 1;
-			}
-			strcat(new_line, line + array[i]);
-			strcat(new_line,"<b>");
-			strcat(new_line, line + array[i] + 1);
-			check = 1;
-
-		} else if ((type[i] == '1') && (check == 1)) {
-			strcat(new_line, line + array[i]);
-			strcat(new_line,"</b>");
-			strcat(new_line, line + array[i] + 1);
-			check = 0;
-		}else if ((type[i] == '2') && (check == 0)) {
-			if (first == 0) {
-				strcat(new_line, line);
-				first = 1;
+/* Checks searchFlagsTB without case against a plain comparison of each
+ * line of the dump of 'tb', freeing the matches, for the tests below
+ */
+static void check_ignore_case(TB tb, char *search) {
+
+	char *dump = dumpTB(tb, FALSE);
+	Match matches = searchFlagsTB(tb, search, TB_SEARCH_IGNORE_CASE);
+	long length = strlen(search);
+	char *line = dump;
+	for (int number = 1; *line != '\0'; number++) {
+		char *end = strchr(line, '\n');
+		for (char *at = line; at + length <= end; at++) {
+			if (strncasecmp(at, search, length) == 0) {
+				assert(matches != NULL && matches->lineNumber == number);
+				assert(matches->charIndex == at - line);
+				Match next = matches->next;
+				free(matches);
+				matches = next;
+				at = at + length - 1;
 			}
-			strcat(new_line, line + array[i]);
-			strcat(new_line,"<i>");
-			strcat(new_line, line + array[i] + 1);
-			check = 1;
-		}else if ((type[i] == '2') && (check == 1)) {
-			strcat(new_line, line + array[i]);
-			strcat(new_line,"</i>");
-			strcat(new_line, line + array[i] + 1);
-			check = 0;
-		} else if ((type[i] == '3') && (check == 0)) {
-			strcat(new_line,"<h1>");
-			strcat(new_line, line + array[i] + 1);
-			check = 1;
-		}else if ((type[i] == '3') && (check == 1)) {
-			strcat(new_line,"</h1>");
-			check = 0;
 		}
-		i++;
+		line = end + 1;
+	}
+	assert(matches == NULL);
+	free(dump);
+}
+
+/* Checks the matches of 'watch' against searchTB on its buffer, freeing
+ * both, for the tests below
+ */
+static void check_watch(TBWatch watch, char *search) {
+
+	Match watched = watchMatchesTB(watch);
+	Match searched = searchTB(watch->tb, search);
+	while (searched != NULL) {
+		assert(watched != NULL && watched->lineNumber == searched->lineNumber);
+		assert(watched->charIndex == searched->charIndex);
+		Match next = watched->next;
+		free(watched);
+		watched = next;
+		next = searched->next;
+		free(searched);
+		searched = next;
+	}
+	assert(watched == NULL);
+}
+
+/* Checks the matches searchWorkspaceTB finds in 'ws' against searchTB on
+ * each of its buffers, freeing both, for the tests below
+ */
+static void check_workspace(TBWorkspace ws, char *search, int nthreads) {
+
+	WorkspaceMatch found = searchWorkspaceTB(ws, search, nthreads);
+	for (int i = 0; i < ws->nbuffers; i++) {
+		Match searched = searchTB(ws->buffers[i], search);
+		while (searched != NULL) {
+			assert(found != NULL && found->tb == ws->buffers[i]);
+			assert(found->lineNumber == searched->lineNumber && found->charIndex == searched->charIndex);
+			WorkspaceMatch next = found->next;
+			free(found);
+			found = next;
+			Match following = searched->next;
+			free(searched);
+			searched = following;
+		}
 	}
-	free(line);
-	return new_line;
+	assert(found == NULL);
 }
 
-
-
-
 /* Your whitebox tests
  */
 void whiteBoxTests() {
@@ -2124,6 +9514,1418 @@ void whiteBoxTests() {
 	assert(strcmp(testtb->first->line,"<b>_</b><i>*</i><b>_</b><i>*</i><b>_</b>") == 0);
 	releaseTB(testtb);
 
+	//Tests for diffTB
+
+	//Diff of two empty buffers
+	testtb = newTB("");
+	testtb2 = newTB("");
+	char *diff = diffTB(testtb, testtb2);
+	assert(strcmp(diff, "") == 0);
+	free(diff);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Diff of identical buffers
+	testtb = newTB("Line01\nLine02\nLine03\n");
+	testtb2 = newTB("Line01\nLine02\nLine03\n");
+	diff = diffTB(testtb, testtb2);
+	assert(strcmp(diff, "") == 0);
+	free(diff);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Diff from an empty buffer
+	testtb = newTB("");
+	testtb2 = newTB("Line01\nLine02\n");
+	diff = diffTB(testtb, testtb2);
+	assert(strcmp(diff, "+,0,Line01\n+,1,Line02\n") == 0);
+	apply_diff(testtb, diff);
+	free(diff);
+	assert(testtb->nlines == 2);
+	assert(strcmp(testtb->last->line, "Line02") == 0);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Diff to an empty buffer
+	testtb = newTB("Line01\nLine02\n");
+	testtb2 = newTB("");
+	diff = diffTB(testtb, testtb2);
+	assert(strcmp(diff, "-,0\n-,0\n") == 0);
+	free(diff);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Diff with a changed line in the middle
+	testtb = newTB("Line01\nLine02\nLine03\n");
+	testtb2 = newTB("Line01\nLine2,b\nLine03\n");
+	diff = diffTB(testtb, testtb2);
+	assert(strcmp(diff, "-,1\n+,1,Line2,b\n") == 0);
+	apply_diff(testtb, diff);
+	free(diff);
+	assert(strcmp(testtb->first->next->line, "Line2,b") == 0);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Diff with scattered insertions, deletions and duplicate lines
+	testtb = newTB("a\nb\nc\na\nb\nb\na\n");
+	testtb2 = newTB("c\nb\na\nb\na\nc\n");
+	diff = diffTB(testtb, testtb2);
+	char *commands = diff;
+	int ncommands = 0;
+	while ((commands = strchr(commands, '\n')) != NULL) {
+		ncommands++;
+		commands++;
+	}
+	assert(ncommands == 5);
+	apply_diff(testtb, diff);
+	free(diff);
+	char *s1 = dumpTB(testtb, FALSE);
+	char *s2 = dumpTB(testtb2, FALSE);
+	assert(strcmp(s1, s2) == 0);
+	free(s1);
+	free(s2);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Tests for equalTB
+
+	//Empty buffers are equal
+	testtb = newTB("");
+	testtb2 = newTB("");
+	assert(equalTB(testtb, testtb2) == TRUE);
+	assert(equalTB(testtb, testtb) == TRUE);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Buffers with the same lines in a different order are not equal
+	testtb = newTB("Line01\nLine02\n");
+	testtb2 = newTB("Line02\nLine01\n");
+	assert(testtb->digest == testtb2->digest);
+	assert(equalTB(testtb, testtb2) == FALSE);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Digests are kept up to date through edits
+	testtb = newTB("Line01\nLine02\nLine03\nLine04\n");
+	testtb2 = newTB("*Line01*\nLine02\n");
+	pasteTB(testtb, 2, testtb2);
+	assert(testtb->digest == chain_digest(testtb->first));
+	assert(testtb2->digest == chain_digest(testtb2->first));
+	addPrefixTB(testtb, 1, 3, "> ");
+	assert(testtb->digest == chain_digest(testtb->first));
+	formRichText(testtb);
+	assert(testtb->digest == chain_digest(testtb->first));
+	TB testtb3 = cutTB(testtb, 1, 2);
+	assert(testtb->digest == chain_digest(testtb->first));
+	assert(testtb3->digest == chain_digest(testtb3->first));
+	mergeTB(testtb, 4, testtb3);
+	assert(testtb->digest == chain_digest(testtb->first));
+	deleteTB(testtb, 0, 2);
+	assert(testtb->digest == chain_digest(testtb->first));
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Buffers built by different edits compare equal
+	testtb = newTB("Line01\nLine02\nLine03\n");
+	testtb2 = newTB("Line03\n");
+	testtb3 = newTB("Line01\nLine02\n");
+	mergeTB(testtb2, 0, testtb3);
+	assert(equalTB(testtb, testtb2) == TRUE);
+	deleteTB(testtb2, 1, 1);
+	assert(equalTB(testtb, testtb2) == FALSE);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Hash blocks follow edits across block boundaries, and let equalTB and
+	//diffTB pass over the blocks the buffers share
+	s1 = malloc(5000 * 16);
+	s1[0] = '\0';
+	for (int i = 0; i < 5000; i++) {
+		sprintf(s1 + strlen(s1), "Line%04d\n", i);
+	}
+	testtb = newTB(s1);
+	testtb2 = newTB(s1);
+	free(s1);
+	assert(equalTB(testtb, testtb2) == TRUE);
+	check_hashes(testtb);
+	assert(testtb->hashes->nblocks > 1);
+	deleteTB(testtb, HASH_BLOCK - 10, 3 * HASH_BLOCK + 10);
+	testtb3 = newTB("Paste01\nPaste02\n");
+	pasteTB(testtb, HASH_BLOCK, testtb3);
+	mergeTB(testtb, 4 * HASH_BLOCK, testtb3);
+	addPrefixTB(testtb, 0, HASH_BLOCK, "> ");
+	assert(equalTB(testtb, testtb2) == FALSE);
+	check_hashes(testtb);
+	diff = diffTB(testtb2, testtb);
+	assert(strlen(diff) < 20000);
+	apply_diff(testtb2, diff);
+	free(diff);
+	check_hashes(testtb2);
+	assert(equalTB(testtb, testtb2) == TRUE);
+	compactTB(testtb);
+	check_hashes(testtb);
+	assert(equalTB(testtb, testtb2) == TRUE);
+	//Blocks whose hashes collide are still told apart by their lines
+	deleteTB(testtb2, 2 * HASH_BLOCK, 2 * HASH_BLOCK);
+	testtb3 = newTB("Collides\n");
+	mergeTB(testtb2, 2 * HASH_BLOCK, testtb3);
+	assert(equalTB(testtb, testtb2) == FALSE);
+	assert(testtb->hashes->nblocks == testtb2->hashes->nblocks);
+	for (long i = 0; i < testtb->hashes->nblocks; i++) {
+		assert(testtb->hashes->blocks[i].count == testtb2->hashes->blocks[i].count);
+		testtb2->hashes->blocks[i].hash = testtb->hashes->blocks[i].hash;
+	}
+	testtb2->digest = testtb->digest;
+	assert(equalTB(testtb, testtb2) == FALSE);
+	diff = diffTB(testtb, testtb2);
+	apply_diff(testtb, diff);
+	free(diff);
+	s1 = dumpTB(testtb, FALSE);
+	s2 = dumpTB(testtb2, FALSE);
+	assert(strcmp(s1, s2) == 0);
+	free(s1);
+	free(s2);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Tests for checkpointTB and diffSinceTB
+
+	//No edits since the checkpoint
+	testtb = newTB("Line01\nLine02\n");
+	long checkpoint = checkpointTB(testtb);
+	diff = diffSinceTB(testtb, checkpoint);
+	assert(strcmp(diff, "") == 0);
+	free(diff);
+	releaseTB(testtb);
+
+	//Edits are recorded as they are made
+	testtb = newTB("Line01\nLine02\nLine03\n");
+	checkpoint = checkpointTB(testtb);
+	deleteTB(testtb, 1, 1);
+	addPrefixTB(testtb, 0, 0, "> ");
+	diff = diffSinceTB(testtb, checkpoint);
+	assert(strcmp(diff, "-,1\n-,0\n+,0,> Line01\n") == 0);
+	free(diff);
+	releaseTB(testtb);
+
+	//Replaying the edits since a checkpoint reproduces the buffer
+	testtb = newTB("Line01\n*Line02*\nLine03\nLine04\nLine05\n");
+	testtb2 = newTB("Line01\n*Line02*\nLine03\nLine04\nLine05\n");
+	testtb3 = newTB("Paste01\nPaste02\n");
+	checkpoint = checkpointTB(testtb);
+	pasteTB(testtb, 2, testtb3);
+	mergeTB(testtb, 7, testtb3);
+	TB testtb4 = cutTB(testtb, 0, 1);
+	formRichText(testtb);
+	addPrefixTB(testtb, 3, 5, "_");
+	deleteTB(testtb, 4, 4);
+	long later = checkpointTB(testtb);
+	diff = diffSinceTB(testtb, checkpoint);
+	apply_diff(testtb2, diff);
+	free(diff);
+	assert(equalTB(testtb, testtb2) == TRUE);
+	diff = diffSinceTB(testtb, later);
+	assert(strcmp(diff, "") == 0);
+	free(diff);
+	//Releasing the older checkpoint forgets the edits only it needed
+	addPrefixTB(testtb, 0, 0, "# ");
+	releaseCheckpointTB(testtb, checkpoint);
+	assert(testtb->history->base == later);
+	diff = diffSinceTB(testtb, later);
+	assert(strcmp(diff, testtb->history->script.text) == 0);
+	assert(strncmp(diff, "-,0\n+,0,# ", 10) == 0);
+	free(diff);
+	//Once none is held, nothing is recorded
+	releaseCheckpointTB(testtb, later);
+	assert(testtb->history == NULL);
+	addPrefixTB(testtb, 0, 0, "# ");
+	assert(testtb->history == NULL);
+	//A checkpoint held for each edit, released after the next, keeps the
+	//history from growing
+	checkpoint = checkpointTB(testtb);
+	for (int i = 0; i < 10000; i++) {
+		addPrefixTB(testtb, 0, 0, "> ");
+		deleteTB(testtb, 0, 0);
+		TB pasted = newTB("P\n");
+		pasteTB(testtb, 0, pasted);
+		releaseTB(pasted);
+		later = checkpointTB(testtb);
+		releaseCheckpointTB(testtb, checkpoint);
+		checkpoint = later;
+		assert(testtb->history->script.capacity <= 4096);
+	}
+	assert(testtb->history->base == checkpoint && checkpoint > 100000);
+	diff = diffSinceTB(testtb, checkpoint);
+	assert(strcmp(diff, "") == 0);
+	free(diff);
+	releaseCheckpointTB(testtb, checkpoint);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+	releaseTB(testtb4);
+
+	//Tests for setInternTB and internStatsTB
+
+	//Identical lines share one payload
+	internStats stats;
+	internStatsTB(&stats);
+	long saved = stats.bytesSaved;
+	testtb = newTB("----\nrecord\n----\nrecord\n----\n");
+	setInternTB(testtb, TRUE);
+	assert(testtb->first->line == testtb->first->next->next->line);
+	assert(testtb->first->next->line == testtb->last->prev->line);
+	internStatsTB(&stats);
+	assert(stats.bytesSaved == saved + 2 * 5 + 1 * 7);
+
+	//Copies share payloads, and formRichText leaves shared payloads intact
+	testtb2 = newTB("*bold*\n----\n");
+	setInternTB(testtb2, TRUE);
+	pasteTB(testtb, 0, testtb2);
+	assert(testtb->first->line == testtb2->first->line);
+	formRichText(testtb);
+	assert(strcmp(testtb->first->line, "<b>bold</b>") == 0);
+	assert(strcmp(testtb2->first->line, "*bold*") == 0);
+	assert(testtb->first->next->line == testtb->last->line);
+	addPrefixTB(testtb, 0, 0, "> ");
+	assert(strcmp(testtb->first->line, "> <b>bold</b>") == 0);
+	assert(testtb->first->interned == TRUE);
+
+	//Turning interning off gives lines private copies again
+	setInternTB(testtb, FALSE);
+	assert(testtb->first->next->line != testtb->last->line);
+	assert(strcmp(testtb->first->next->line, testtb->last->line) == 0);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+	internStatsTB(&stats);
+	assert(stats.bytesSaved == saved);
+
+	//Tests for inline line storage
+
+	//Short lines live inside their node, long lines on the heap
+	testtb = newTB("short\nThis line is far too long to be kept inside its node\n");
+	assert(testtb->first->line == testtb->first->small);
+	assert(testtb->last->line != testtb->last->small);
+	assert(testtb->last->length == 52);
+
+	//Lines move between inline and heap storage as they grow
+	addPrefixTB(testtb, 0, 0, "no longer a short line: ");
+	assert(testtb->first->line != testtb->first->small);
+	assert(strcmp(testtb->first->line, "no longer a short line: short") == 0);
+	testtb2 = cutTB(testtb, 1, 1);
+	pasteTB(testtb, 0, testtb2);
+	assert(strcmp(testtb2->first->line, testtb->first->line) == 0);
+	assert(testtb2->first->line != testtb->first->line);
+	releaseTB(testtb2);
+	testtb2 = newTB("*a*\n");
+	formRichText(testtb2);
+	assert(testtb2->first->line == testtb2->first->small);
+	assert(strcmp(testtb2->first->line, "<b>a</b>") == 0);
+	mergeTB(testtb, 2, testtb2);
+	char *dump = dumpTB(testtb, TRUE);
+	assert(strcmp(dump, "1. This line is far too long to be kept inside its node\n2. no longer a short line: short\n3. <b>a</b>\n") == 0);
+	free(dump);
+	releaseTB(testtb);
+
+	//Tests for compactTB
+
+	//Compacting keeps the lines and lays the nodes out in order
+	testtb = newTB("Line01\nLine02\nLine03\nLine04\nLine05\nLine06\n");
+	testtb2 = newTB("A line long enough to live on the heap instead\n");
+	pasteTB(testtb, 3, testtb2);
+	deleteTB(testtb, 1, 2);
+	s1 = dumpTB(testtb, FALSE);
+	compactTB(testtb);
+	s2 = dumpTB(testtb, FALSE);
+	assert(strcmp(s1, s2) == 0);
+	free(s1);
+	free(s2);
+	assert(testtb->first->next == testtb->first + 1);
+	assert(testtb->last == testtb->first + 4);
+	assert(testtb->last->prev->prev == testtb->first + 2);
+	assert(testtb->first->line == testtb->first->small);
+	assert(strcmp(testtb->first->next->line, "A line long enough to live on the heap instead") == 0);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Tests for batched edits
+
+	//An empty batch changes nothing
+	testtb = newTB("Line01\nLine02\n");
+	TBBatch testbatch = newBatchTB();
+	applyBatchTB(testtb, testbatch);
+	assert(testtb->nlines == 2);
+	releaseBatchTB(testbatch);
+	releaseTB(testtb);
+
+	//Edits use the original positions and apply together
+	testtb = newTB("L0\nL1\nL2\nL3\nL4\nL5\n");
+	testtb2 = newTB("L0\nL1\nL2\nL3\nL4\nL5\n");
+	checkpoint = checkpointTB(testtb);
+	testbatch = newBatchTB();
+	batchDeleteTB(testbatch, 1, 2);
+	batchPrefixTB(testbatch, 0, 3, "> ");
+	batchPrefixTB(testbatch, 2, 4, "# ");
+	testtb3 = newTB("P\n");
+	batchPasteTB(testbatch, 2, testtb3);
+	releaseTB(testtb3);
+	testtb3 = newTB("E\n");
+	batchPasteTB(testbatch, 6, testtb3);
+	batchDeleteTB(testbatch, 2, 2);
+	applyBatchTB(testtb, testbatch);
+	dump = dumpTB(testtb, FALSE);
+	assert(strcmp(dump, "> L0\nP\n# > L3\n# L4\nL5\nE\n") == 0);
+	free(dump);
+	assert(testtb->nlines == 6);
+	assert(testtb->digest == chain_digest(testtb->first));
+	assert(testtb->first->prev == NULL);
+	assert(testtb->last->next == NULL);
+	assert(strcmp(testtb->last->prev->line, "L5") == 0);
+	diff = diffSinceTB(testtb, checkpoint);
+	apply_diff(testtb2, diff);
+	free(diff);
+	assert(equalTB(testtb, testtb2) == TRUE);
+
+	//The batch is emptied, and can be filled again
+	batchDeleteTB(testbatch, 0, 5);
+	batchPasteTB(testbatch, 0, testtb3);
+	applyBatchTB(testtb, testbatch);
+	assert(testtb->nlines == 1);
+	assert(strcmp(testtb->first->line, "E") == 0);
+	releaseBatchTB(testbatch);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+	releaseTB(testtb3);
+
+	//Tests for setThreadSafeTB
+
+	//Every operation still works with locking on, including on one buffer twice
+	testtb = newTB("Line01\nLine02\nLine03\n");
+	testtb2 = newTB("Line01\n");
+	setThreadSafeTB(testtb, TRUE);
+	setThreadSafeTB(testtb2, TRUE);
+	assert(equalTB(testtb, testtb) == TRUE);
+	pasteTB(testtb, 3, testtb);
+	pasteTB(testtb, 3, testtb2);
+	addPrefixTB(testtb, 0, 0, "> ");
+	testtb3 = cutTB(testtb, 1, 2);
+	assert(testtb3->threadSafe == FALSE);
+	mergeTB(testtb2, 1, testtb3);
+	diff = diffTB(testtb, testtb2);
+	assert(strcmp(diff, "-,0\n+,1,Line02\n+,2,Line03\n") == 0);
+	free(diff);
+	assert(linesTB(testtb) == 2);
+	setThreadSafeTB(testtb, FALSE);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Tests for setSnapshotReadsTB
+
+	//Lines taken out during a read stay readable, and lead back into the
+	//buffer, until the read ends
+	testtb = newTB("Line01\nA line long enough to live on the heap instead\nLine03\nLine04\n");
+	setSnapshotReadsTB(testtb, TRUE);
+	assert(testtb->threadSafe == TRUE);
+	readerSlot *slot = enter_epoch();
+	TBNode reading = first_node(testtb)->next;
+	char *line = node_line(reading);
+	deleteTB(testtb, 1, 2);
+	addPrefixTB(testtb, 0, 0, "> ");
+	assert(snapshots.first != NULL);
+	assert(strcmp(line, "A line long enough to live on the heap instead") == 0);
+	assert(strcmp(node_line(next_node(reading)), "Line03") == 0);
+	assert(next_node(next_node(reading)) == testtb->last);
+	exit_epoch(slot);
+	assert(snapshots.first == NULL);
+	dump = dumpTB(testtb, TRUE);
+	assert(strcmp(dump, "1. > Line01\n2. Line04\n") == 0);
+	free(dump);
+	assert(testtb->first->line != testtb->first->small);
+	assert(linesTB(testtb) == 2);
+
+	//Every edit moves the version on by two, and a read it overlaps is
+	//caught, as is one that starts while it is under way
+	testtb2 = newTB("Line01\nLine02\n");
+	setSnapshotReadsTB(testtb2, TRUE);
+	unsigned long version;
+	slot = enter_epoch();
+	assert(begin_snapshot(testtb2, &version) == TRUE);
+	assert(end_snapshot(testtb2, version) == TRUE);
+	addPrefixTB(testtb2, 1, 1, "> ");
+	assert(end_snapshot(testtb2, version) == FALSE);
+	assert(testtb2->version == version + 2);
+	exit_epoch(slot);
+	write_lock(testtb2);
+	assert(testtb2->version % 2 == 1);
+	assert(try_dump_snapshot(testtb2, FALSE) == NULL);
+	slot = enter_epoch();
+	assert(begin_snapshot(testtb2, &version) == FALSE);
+	exit_epoch(slot);
+	unlock_tb(testtb2);
+	assert(testtb2->version == version + 1);
+	dump = try_dump_snapshot(testtb2, FALSE);
+	assert(strcmp(dump, "Line01\n> Line02\n") == 0);
+	free(dump);
+	releaseTB(testtb2);
+
+	//Cut lines are copies, and edits keep the digest up to date
+	testtb2 = cutTB(testtb, 1, 1);
+	assert(testtb2->snapshot == FALSE);
+	assert(strcmp(testtb2->first->line, "Line04") == 0);
+	pasteTB(testtb, 1, testtb2);
+	pasteTB(testtb, 0, testtb2);
+	mergeTB(testtb, 3, testtb2);
+	setInternTB(testtb, TRUE);
+	setInternTB(testtb, FALSE);
+	compactTB(testtb);
+	dump = dumpTB(testtb, FALSE);
+	assert(strcmp(dump, "Line04\n> Line01\nLine04\nLine04\n") == 0);
+	free(dump);
+	assert(testtb->digest == chain_digest(testtb->first));
+	testmatch = searchTB(testtb, "04");
+	assert(testmatch->lineNumber == 1 && testmatch->next->lineNumber == 3);
+	assert(testmatch->next->next->lineNumber == 4 && testmatch->next->next->next == NULL);
+	while (testmatch != NULL) {
+		Match next = testmatch->next;
+		free(testmatch);
+		testmatch = next;
+	}
+	releaseTB(testtb);
+	assert(snapshots.first == NULL);
+
+	//Tests for startTraceTB
+
+	//A buffer made before the trace is recorded with its text, then calls
+	//are recorded as they finish
+	testtb = newTB("Line01\nLine02\n");
+	assert(startTraceTB("test_trace.bin") == TRUE);
+	assert(startTraceTB("test_trace.bin") == FALSE);
+	deleteTB(testtb, 0, 0);
+	testtb2 = newTB("Line03\n");
+	mergeTB(testtb, 1, testtb2);
+	stopTraceTB();
+	linesTB(testtb);
+	FILE *file = fopen("test_trace.bin", "rb");
+	char record[256];
+	int length = fread(record, 1, sizeof(record), file);
+	fclose(file);
+	remove("test_trace.bin");
+	assert(memcmp(record, TRACE_MAGIC, TRACE_MAGIC_LENGTH) == 0);
+	int at = TRACE_MAGIC_LENGTH;
+	assert(record[at++] == TRACE_ADOPT);
+	trace_read(record, &at);
+	assert(trace_read(record, &at) == 0);
+	assert(trace_read(record, &at) == 1);
+	assert(trace_read(record, &at) == 14);
+	assert(memcmp(record + at, "Line01\nLine02\n", 14) == 0);
+	at = at + 14;
+	assert(record[at++] == TRACE_DELETE);
+	trace_read(record, &at);
+	trace_read(record, &at);
+	assert(trace_read(record, &at) == 1);
+	assert(trace_read(record, &at) == 0 && trace_read(record, &at) == 0);
+	assert(record[at++] == TRACE_NEW);
+	trace_read(record, &at);
+	trace_read(record, &at);
+	assert(trace_read(record, &at) == 2);
+	assert(trace_read(record, &at) == 7);
+	at = at + 7;
+	//Positions are zigzag encoded
+	assert(record[at++] == TRACE_MERGE);
+	trace_read(record, &at);
+	trace_read(record, &at);
+	assert(trace_read(record, &at) == 1);
+	assert(trace_read(record, &at) == 2);
+	assert(trace_read(record, &at) == 2);
+	assert(at == length);
+	releaseTB(testtb);
+
+	//Tests for statsTB
+
+	//Calls are counted against their first buffer, and against every buffer
+	//together
+	tbStats counted;
+	tbStats counted_before;
+	globalStatsTB(&counted_before);
+	testtb = newTB("Line01\nLine02\nLine03\n");
+	statsTB(testtb, &counted);
+	assert(counted.ops[TRACE_NEW].calls == 0 && counted.nodesTraversed == 0);
+	free(dumpTB(testtb, FALSE));
+	free(dumpTB(testtb, TRUE));
+	deleteTB(testtb, 1, 1);
+	statsTB(testtb, &counted);
+#ifdef TB_STATS
+	assert(counted.ops[TRACE_DUMP].calls == 2 && counted.ops[TRACE_DELETE].calls == 1);
+	assert(counted.ops[TRACE_LINES].calls == 0);
+	assert(counted.ops[TRACE_DUMP].totalNs > 0);
+	assert(counted.ops[TRACE_DUMP].p50Ns <= counted.ops[TRACE_DUMP].p99Ns);
+	assert(counted.nodesTraversed >= 12 && counted.bytesCopied >= 42 && counted.allocations >= 2);
+	globalStatsTB(&counted);
+	assert(counted.ops[TRACE_NEW].calls == counted_before.ops[TRACE_NEW].calls + 1);
+	assert(counted.ops[TRACE_DUMP].calls == counted_before.ops[TRACE_DUMP].calls + 2);
+	assert(counted.allocations > counted_before.allocations);
+	//Percentiles fall in the middle of the bucket of their call
+	opCounters counts;
+	memset(&counts, 0, sizeof(counts));
+	for (int i = 0; i < 98; i++) {
+		counts.buckets[stat_bucket(3)]++;
+	}
+	counts.buckets[stat_bucket(1000)]++;
+	counts.buckets[stat_bucket(100000)]++;
+	counts.calls = 100;
+	assert(stat_percentile(&counts, 50) == 3);
+	assert(stat_percentile(&counts, 99) >= 960 && stat_percentile(&counts, 99) < 1024);
+#else
+	assert(counted.ops[TRACE_DUMP].calls == 0 && counted.allocations == 0);
+#endif
+	releaseTB(testtb);
+
+	//Tests for memoryUsageTB
+
+	//A short line lives in its node, a long one outside it
+	testtb = newTB("Line01\nThis line is too long to fit in a node\n");
+	memoryUsage usage;
+	memoryUsageTB(testtb, &usage);
+	assert(usage.nodeBytes == sizeof(textbuffer) + 2 * sizeof(struct textbufferNode));
+	assert(usage.payloadBytes == 39);
+	assert(usage.slackBytes == INLINE_LINE - 7 + INLINE_LINE);
+	//Interned lines are split between the nodes sharing them
+	testtb2 = newTB("This line is too long to fit in a node\n");
+	setInternTB(testtb, TRUE);
+	setInternTB(testtb2, TRUE);
+	memoryUsageTB(testtb2, &usage);
+	assert(usage.payloadBytes == (long) (sizeof(internedLine) + 39) / 2);
+	releaseTB(testtb2);
+	releaseTB(testtb);
+
+	//Tests for setAllocatorTB
+
+	long counted_allocs[2] = {0, 0};
+	assert(setAllocatorTB(test_allocate, NULL, test_deallocate, counted_allocs) == FALSE);
+	assert(setAllocatorTB(test_allocate, test_reallocate, test_deallocate, counted_allocs) == TRUE);
+	testtb = newTB("Line01\nThis line is too long to fit in a node\n");
+	addPrefixTB(testtb, 0, 1, "> ");
+	assert(counted_allocs[0] > 0);
+	//The allocator can't change while memory from it is in use
+	assert(setAllocatorTB(NULL, NULL, NULL, NULL) == FALSE);
+	dump = dumpTB(testtb, FALSE);
+	assert(strcmp(dump, "> Line01\n> This line is too long to fit in a node\n") == 0);
+	free(dump);
+	releaseTB(testtb);
+	assert(setAllocatorTB(NULL, NULL, NULL, NULL) == TRUE);
+	assert(counted_allocs[0] == counted_allocs[1]);
+
+	//Tests for lineTB
+
+	testtb = newTB("Line01\nLine02\nLine03\nLine04\n");
+	dump = lineTB(testtb, 0);
+	assert(strcmp(dump, "Line01") == 0);
+	free(dump);
+	dump = lineTB(testtb, 3);
+	assert(strcmp(dump, "Line04") == 0);
+	free(dump);
+	releaseTB(testtb);
+
+	//Tests for saveSnapshotTB and loadSnapshotTB
+
+	//A loaded buffer is read from its file until it is changed
+	testtb = newTB("Line01\n\nThis line is too long to fit in a node\nLine04\n");
+	assert(saveSnapshotTB(testtb, "test_snapshot.bin") == TRUE);
+	testtb2 = loadSnapshotTB("test_snapshot.bin");
+	assert(testtb2 != NULL && testtb2->mapped != NULL);
+	assert(linesTB(testtb2) == 4);
+	dump = lineTB(testtb2, 2);
+	assert(strcmp(dump, "This line is too long to fit in a node") == 0);
+	free(dump);
+	dump = lineTB(testtb2, 1);
+	assert(strcmp(dump, "") == 0);
+	free(dump);
+	dump = dumpTB(testtb2, FALSE);
+	assert(strcmp(dump, "Line01\n\nThis line is too long to fit in a node\nLine04\n") == 0);
+	free(dump);
+	dump = dumpTB(testtb2, TRUE);
+	assert(strcmp(dump, "1. Line01\n2. \n3. This line is too long to fit in a node\n4. Line04\n") == 0);
+	free(dump);
+	assert(testtb2->mapped != NULL);
+	assert(equalTB(testtb, testtb2) == TRUE);
+	assert(testtb2->mapped == NULL);
+	assert(testtb2->digest == testtb->digest);
+	deleteTB(testtb2, 0, 0);
+	dump = dumpTB(testtb2, FALSE);
+	assert(strcmp(dump, "\nThis line is too long to fit in a node\nLine04\n") == 0);
+	free(dump);
+	releaseTB(testtb2);
+	//A loaded buffer can be released, or saved again, without being changed
+	testtb2 = loadSnapshotTB("test_snapshot.bin");
+	assert(saveSnapshotTB(testtb2, "test_snapshot.bin") == TRUE);
+	releaseTB(testtb2);
+	testtb2 = loadSnapshotTB("test_snapshot.bin");
+	assert(equalTB(testtb, testtb2) == TRUE);
+	releaseTB(testtb2);
+	releaseTB(testtb);
+	//Empty buffers
+	testtb = newTB("");
+	assert(saveSnapshotTB(testtb, "test_snapshot.bin") == TRUE);
+	releaseTB(testtb);
+	testtb = loadSnapshotTB("test_snapshot.bin");
+	assert(linesTB(testtb) == 0);
+	dump = dumpTB(testtb, FALSE);
+	assert(strcmp(dump, "") == 0);
+	free(dump);
+	releaseTB(testtb);
+	//Files that aren't snapshots are refused
+	file = fopen("test_snapshot.bin", "wb");
+	fputs("Line01\nLine02\n", file);
+	fclose(file);
+	assert(loadSnapshotTB("test_snapshot.bin") == NULL);
+	remove("test_snapshot.bin");
+	assert(loadSnapshotTB("test_snapshot.bin") == NULL);
+	testtb = newTB("Line01\n");
+	assert(saveSnapshotTB(testtb, "no_such_dir/test_snapshot.bin") == FALSE);
+	releaseTB(testtb);
+
+	//Tests for newStreamTB, feedTB and finishTB
+
+	//Lines split anywhere between chunks
+	testtb = newStreamTB();
+	feedTB(testtb, "Li", 2);
+	feedTB(testtb, "ne01\nLine", 9);
+	feedTB(testtb, "", 0);
+	feedTB(testtb, "02\n\nLa", 6);
+	assert(linesTB(testtb) == 3);
+	feedTB(testtb, "st line, longer than fits in a node", 35);
+	finishTB(testtb);
+	testtb2 = newTB("Line01\nLine02\n\nLast line, longer than fits in a node");
+	assert(equalTB(testtb, testtb2) == TRUE);
+	assert(testtb->digest == testtb2->digest);
+	releaseTB(testtb2);
+	releaseTB(testtb);
+	//A stream that ends with its newline, or has nothing in it
+	testtb = newStreamTB();
+	feedTB(testtb, "Line01\n", 7);
+	finishTB(testtb);
+	assert(linesTB(testtb) == 1);
+	releaseTB(testtb);
+	testtb = newStreamTB();
+	finishTB(testtb);
+	assert(linesTB(testtb) == 0);
+	releaseTB(testtb);
+	//Text bigger than the stack, fed or not
+	int bigLength = 16 << 20;
+	char *big = malloc(bigLength + 2);
+	memset(big, 'x', bigLength);
+	big[bigLength] = '\n';
+	big[bigLength + 1] = '\0';
+	testtb = newTB(big);
+	testtb2 = newStreamTB();
+	for (int i = 0; i < bigLength + 1; i = i + 65536) {
+		feedTB(testtb2, big + i, bigLength + 1 - i < 65536 ? bigLength + 1 - i : 65536);
+	}
+	finishTB(testtb2);
+	assert(linesTB(testtb) == 1 && equalTB(testtb, testtb2) == TRUE);
+	free(big);
+	releaseTB(testtb2);
+	releaseTB(testtb);
+
+	//Tests for newTBParallel
+
+	//Enough text for several threads, with and without a final newline
+	int parallelLength = 0;
+	char *parallel = malloc(400000 * 11 + 1);
+	for (int i = 0; i < 400000; i++) {
+		parallelLength = parallelLength + sprintf(parallel + parallelLength, "Line%06d\n", i);
+	}
+	testtb = newTB(parallel);
+	testtb2 = newTBParallel(parallel, parallelLength, 4);
+	assert(linesTB(testtb2) == 400000 && equalTB(testtb, testtb2) == TRUE);
+	assert(testtb->digest == testtb2->digest && testtb2->last->next == NULL);
+	releaseTB(testtb2);
+	releaseTB(testtb);
+	parallel[parallelLength - 1] = '\0';
+	testtb = newTB(parallel);
+	testtb2 = newTBParallel(parallel, parallelLength - 1, 0);
+	assert(linesTB(testtb2) == 400000 && equalTB(testtb, testtb2) == TRUE);
+	releaseTB(testtb2);
+	releaseTB(testtb);
+	//A line longer than a thread's share leaves the threads after it nothing
+	memset(parallel, 'x', 3 << 20);
+	testtb = newTB(parallel);
+	testtb2 = newTBParallel(parallel, parallelLength - 1, 4);
+	assert(equalTB(testtb, testtb2) == TRUE);
+	releaseTB(testtb2);
+	releaseTB(testtb);
+	free(parallel);
+	//Only 'length' bytes are read
+	testtb = newTBParallel("Line01\nLine02\nLine03\n", 14, 2);
+	dump = dumpTB(testtb, FALSE);
+	assert(strcmp(dump, "Line01\nLine02\n") == 0);
+	free(dump);
+	releaseTB(testtb);
+	testtb = newTBParallel("", 0, 2);
+	assert(linesTB(testtb) == 0);
+	releaseTB(testtb);
+
+	//Tests for dumpParallelTB
+
+	//Enough text for several threads, with line numbers of every width
+	parallel = malloc(400000 * 11 + 1);
+	parallelLength = 0;
+	for (int i = 0; i < 400000; i++) {
+		parallelLength = parallelLength + sprintf(parallel + parallelLength, "Line%06d\n", i);
+	}
+	testtb = newTB(parallel);
+	free(parallel);
+	for (int numbers = FALSE; numbers <= TRUE; numbers++) {
+		dump = dumpTB(testtb, numbers);
+		char *parallelDump = dumpParallelTB(testtb, numbers, 4);
+		assert(strcmp(dump, parallelDump) == 0);
+		free(parallelDump);
+		parallelDump = dumpParallelTB(testtb, numbers, 0);
+		assert(strcmp(dump, parallelDump) == 0);
+		free(parallelDump);
+		free(dump);
+	}
+	releaseTB(testtb);
+	//Buffers too small to share out
+	testtb = newTB("Line01\n\nThis line is too long to fit in a node\n");
+	dump = dumpParallelTB(testtb, TRUE, 4);
+	assert(strcmp(dump, "1. Line01\n2. \n3. This line is too long to fit in a node\n") == 0);
+	free(dump);
+	releaseTB(testtb);
+	testtb = newTB("");
+	dump = dumpParallelTB(testtb, TRUE, 4);
+	assert(strcmp(dump, "") == 0);
+	free(dump);
+	releaseTB(testtb);
+
+	//Tests for journalTB, syncJournalTB and recoverTB
+
+	//Every kind of edit is replayed
+	testtb = newTB("Line01\nLine02\nLine03\n");
+	assert(journalTB(testtb, "test_journal.bin") == TRUE);
+	addPrefixTB(testtb, 0, 1, "*");
+	testtb2 = newTB("Paste01\nPaste02\n");
+	pasteTB(testtb, 1, testtb2);
+	mergeTB(testtb, 5, testtb2);
+	releaseTB(cutTB(testtb, 0, 0));
+	deleteTB(testtb, 3, 3);
+	addPrefixTB(testtb, 0, 0, "#");
+	formRichText(testtb);
+	TBBatch journalBatch = newBatchTB();
+	batchDeleteTB(journalBatch, 0, 0);
+	batchPrefixTB(journalBatch, 1, 2, "> ");
+	testtb2 = newTB("Batch01\n");
+	batchPasteTB(journalBatch, 4, testtb2);
+	releaseTB(testtb2);
+	applyBatchTB(testtb, journalBatch);
+	releaseBatchTB(journalBatch);
+	assert(syncJournalTB(testtb) == TRUE);
+	testtb2 = recoverTB("test_journal.bin");
+	assert(testtb2 != NULL && equalTB(testtb, testtb2) == TRUE);
+	releaseTB(testtb2);
+	//A lone edit is synced once it is due, with no edit or sync after it
+	addPrefixTB(testtb, 0, 0, "!");
+	struct timespec journalPause = {0, JOURNAL_DELAY_NS};
+	nanosleep(&journalPause, NULL);
+	int journalUnsynced = TRUE;
+	for (int i = 0; i < 1000 && journalUnsynced; i++) {
+		nanosleep(&journalPause, NULL);
+		pthread_mutex_lock(&testtb->journal->lock);
+		journalUnsynced = testtb->journal->unsynced != 0;
+		pthread_mutex_unlock(&testtb->journal->lock);
+	}
+	assert(!journalUnsynced);
+	//A torn record at the end is cut off, and the recovered buffer carries
+	//on journaling after it
+	assert(journalTB(testtb, NULL) == TRUE);
+	struct stat journalStat;
+	stat("test_journal.bin.log", &journalStat);
+	off_t journalBytes = journalStat.st_size;
+	file = fopen("test_journal.bin.log", "ab");
+	fwrite("\x40\0\0\0\1\2\3\4\0\2", 1, 10, file);
+	fclose(file);
+	testtb2 = recoverTB("test_journal.bin");
+	assert(testtb2 != NULL && equalTB(testtb, testtb2) == TRUE);
+	stat("test_journal.bin.log", &journalStat);
+	assert(journalStat.st_size == journalBytes);
+	deleteTB(testtb, 0, 0);
+	deleteTB(testtb2, 0, 0);
+	releaseTB(testtb2);
+	testtb2 = recoverTB("test_journal.bin");
+	assert(testtb2 != NULL && equalTB(testtb, testtb2) == TRUE);
+	//A big log is folded into a new base
+	char journalPrefix[4001];
+	memset(journalPrefix, 'x', 4000);
+	journalPrefix[4000] = '\0';
+	uint32_t journalGeneration = testtb2->journal->generation;
+	for (int i = 0; i < 300; i++) {
+		addPrefixTB(testtb, 0, 0, journalPrefix);
+		addPrefixTB(testtb2, 0, 0, journalPrefix);
+	}
+	stat("test_journal.bin.log", &journalStat);
+	assert(journalStat.st_size < 300 * 4000);
+	assert(testtb2->journal->generation == journalGeneration + 1);
+	releaseTB(testtb2);
+	testtb2 = recoverTB("test_journal.bin");
+	assert(testtb2 != NULL && equalTB(testtb, testtb2) == TRUE);
+	releaseTB(testtb2);
+	//A log older than its base is ignored
+	releaseTB(testtb);
+	testtb = newTB("Line01\n");
+	assert(saveSnapshotTB(testtb, "test_journal.bin") == TRUE);
+	testtb2 = recoverTB("test_journal.bin");
+	assert(testtb2 != NULL && equalTB(testtb, testtb2) == TRUE);
+	assert(testtb2->journal->generation == 1);
+	assert(journalTB(testtb2, NULL) == TRUE);
+	assert(syncJournalTB(testtb2) == FALSE);
+	releaseTB(testtb2);
+	releaseTB(testtb);
+	remove("test_journal.bin");
+	remove("test_journal.bin.log");
+	assert(recoverTB("test_journal.bin") == NULL);
+
+	//Tests for the 64-bit variants
+
+	//They do what the int ones do
+	testtb = newTB("Line01\nLine02\nLine03\nLine04\n");
+	assert(linesTB64(testtb) == 4);
+	addPrefixTB64(testtb, 1, 2, "> ");
+	char *line64 = lineTB64(testtb, 2);
+	assert(strcmp(line64, "> Line03") == 0);
+	free(line64);
+	testtb2 = cutTB64(testtb, 0, 1);
+	pasteTB64(testtb, 2, testtb2);
+	mergeTB64(testtb, 0, testtb2);
+	deleteTB64(testtb, 5, 5);
+	dump = dumpTB(testtb, FALSE);
+	assert(strcmp(dump, "Line01\n> Line02\n> Line03\nLine04\nLine01\n") == 0);
+	free(dump);
+	Match64 matches64 = searchTB64(testtb, "Line0");
+	Match64 match64 = matches64;
+	for (size_t i = 1; i <= 5; i++) {
+		assert(match64 != NULL && match64->lineNumber == i);
+		assert(match64->charIndex == (i == 2 || i == 3 ? 2 : 0));
+		match64 = match64->next;
+		free(matches64);
+		matches64 = match64;
+	}
+	assert(match64 == NULL);
+	assert(searchTB64(testtb, "") == NULL);
+	releaseTB(testtb);
+	//Line numbers past an int are written out in full
+	assert(num_places(999999999) == 9);
+	assert(num_places(9999999999L) == 10);
+	assert(num_places(10000000000L) == 11);
+	assert(num_places(LONG_MAX) == 19);
+
+	//formRichText keeps the markers of a line on the heap, so a line far
+	//bigger than the stack is fine
+	long richLength = 16 << 20;
+	char *rich = malloc(richLength + 2);
+	memset(rich, 'a', richLength);
+	rich[0] = '*';
+	rich[2] = '*';
+	rich[richLength - 3] = '_';
+	rich[richLength - 1] = '_';
+	rich[richLength] = '\n';
+	rich[richLength + 1] = '\0';
+	testtb = newTB(rich);
+	free(rich);
+	formRichText(testtb);
+	dump = lineTB(testtb, 0);
+	assert(strlen(dump) == (size_t) richLength + 10);
+	assert(strncmp(dump, "<b>a</b>aaa", 11) == 0);
+	assert(strcmp(dump + richLength + 10 - 10, "aa<i>a</i>") == 0);
+	free(dump);
+	releaseTB(testtb);
+
+	//A buffer of more than 10 GB, built from one interned line of 1 MB so
+	//that it fits in memory. It takes a while, so it only runs when
+	//TB_BIG_TEST is set.
+	if (getenv("TB_BIG_TEST") != NULL) {
+		long bigLine = 1 << 20;
+		long bigLines = 10240 + 512;
+		char *big = malloc(bigLine + 2);
+		memset(big, 'a', bigLine);
+		big[bigLine] = '\n';
+		big[bigLine + 1] = '\0';
+		testtb2 = newTB(big);
+		free(big);
+		setInternTB(testtb2, TRUE);
+		testtb = newTB("");
+		for (long i = 0; i < bigLines; i++) {
+			pasteTB64(testtb, i, testtb2);
+		}
+		releaseTB(testtb2);
+		testtb2 = newTB("needle\n");
+		pasteTB64(testtb, bigLines, testtb2);
+		releaseTB(testtb2);
+		assert(linesTB64(testtb) == (size_t) bigLines + 1);
+		assert(text_length(testtb) == (bigLine + 1) * bigLines + 7);
+		assert(text_length(testtb) > 10L << 30);
+		//Every byte is scanned
+		matches64 = searchTB64(testtb, "needle");
+		assert(matches64 != NULL && matches64->next == NULL);
+		assert(matches64->lineNumber == (size_t) bigLines + 1 && matches64->charIndex == 0);
+		free(matches64);
+		//A snapshot of it needs offsets past 4 GB
+		assert(saveSnapshotTB(testtb, "test_big.bin") == TRUE);
+		testtb2 = loadSnapshotTB("test_big.bin");
+		assert(linesTB64(testtb2) == (size_t) bigLines + 1);
+		line64 = lineTB64(testtb2, bigLines);
+		assert(strcmp(line64, "needle") == 0);
+		free(line64);
+		releaseTB(testtb2);
+		remove("test_big.bin");
+		//A dump past 2 GB, with line numbers
+		deleteTB64(testtb, 3072, bigLines - 1);
+		dump = dumpTB(testtb, TRUE);
+		size_t dumpLength = strlen(dump);
+		assert(dumpLength == (size_t) (bigLine + 1) * 3072 + 7 + 9 * 3 + 90 * 4 + 900 * 5 + 2074 * 6);
+		assert(strcmp(dump + dumpLength - 15, "a\n3073. needle\n") == 0);
+		free(dump);
+		releaseTB(testtb);
+	}
+
+	//Tests for lineAtOffsetTB and offsetOfLineTB
+
+	//Each line owns its newline
+	testtb = newTB("ab\n\ncde\n");
+	assert(lineAtOffsetTB(testtb, 0) == 0 && lineAtOffsetTB(testtb, 2) == 0);
+	assert(lineAtOffsetTB(testtb, 3) == 1);
+	assert(lineAtOffsetTB(testtb, 4) == 2 && lineAtOffsetTB(testtb, 7) == 2);
+	assert(offsetOfLineTB(testtb, 0) == 0 && offsetOfLineTB(testtb, 1) == 3);
+	assert(offsetOfLineTB(testtb, 2) == 4 && offsetOfLineTB(testtb, 3) == 8);
+	releaseTB(testtb);
+	testtb = newTB("");
+	assert(offsetOfLineTB(testtb, 0) == 0);
+	releaseTB(testtb);
+	//The index follows every kind of edit once built
+	char offsetText[1000 * 12 + 1];
+	int offsetLength = 0;
+	for (int i = 0; i < 1000; i++) {
+		offsetLength = offsetLength + sprintf(offsetText + offsetLength, "%.*s\n", i % 11, "*abcdefghi*");
+	}
+	testtb = newTB(offsetText);
+	check_offsets(testtb);
+	addPrefixTB(testtb, 100, 300, "> ");
+	check_offsets(testtb);
+	formRichText(testtb);
+	check_offsets(testtb);
+	testtb2 = newTB("Pasted\nlines\n");
+	pasteTB(testtb, 500, testtb2);
+	pasteTB(testtb, linesTB(testtb), testtb2);
+	check_offsets(testtb);
+	mergeTB(testtb, 0, testtb2);
+	check_offsets(testtb);
+	releaseTB(cutTB(testtb, 10, 20));
+	check_offsets(testtb);
+	deleteTB(testtb, 900, linesTB(testtb) - 1);
+	check_offsets(testtb);
+	TBBatch offsetBatch = newBatchTB();
+	batchDeleteTB(offsetBatch, 700, 750);
+	batchPrefixTB(offsetBatch, 600, 800, "# ");
+	applyBatchTB(testtb, offsetBatch);
+	releaseBatchTB(offsetBatch);
+	check_offsets(testtb);
+	check_index(testtb);
+	offsetBatch = newBatchTB();
+	testtb2 = newTB("Pasted\nlines\n");
+	batchPasteTB(offsetBatch, 5, testtb2);
+	batchDeleteTB(offsetBatch, 5, 5);
+	batchPasteTB(offsetBatch, 400, testtb2);
+	releaseTB(testtb2);
+	applyBatchTB(testtb, offsetBatch);
+	releaseBatchTB(offsetBatch);
+	check_offsets(testtb);
+	check_index(testtb);
+	//Small edits near the top keep the chunks full and the lookups right
+	for (int i = 0; i < 300; i++) {
+		mergeTB(testtb, 5, newTB("Merged\n"));
+		assert(offsetOfLineTB(testtb, 6) == offsetOfLineTB(testtb, 5) + 7);
+		if (i % 3 == 0) {
+			deleteTB(testtb, 7, 8);
+		}
+	}
+	check_offsets(testtb);
+	check_index(testtb);
+	releaseTB(cutTB(testtb, 0, linesTB(testtb) - 1));
+	check_offsets(testtb);
+	check_index(testtb);
+	//A snapshot is looked up in its file, without loading it
+	assert(saveSnapshotTB(testtb, "test_snapshot.bin") == TRUE);
+	testtb2 = loadSnapshotTB("test_snapshot.bin");
+	check_offsets(testtb2);
+	assert(testtb2->mapped != NULL && testtb2->index == NULL);
+	releaseTB(testtb2);
+	remove("test_snapshot.bin");
+	releaseTB(testtb);
+	//Lines fed in after the index was built join it straight away
+	testtb = newStreamTB();
+	feedTB(testtb, offsetText, 5000);
+	check_offsets(testtb);
+	feedTB(testtb, offsetText + 5000, offsetLength - 5000);
+	assert(testtb->index->valid == linesTB(testtb));
+	mergeTB(testtb, 3, newTB("Merged\n"));
+	check_offsets(testtb);
+	check_index(testtb);
+	releaseTB(testtb);
+
+	//Tests for setUnrolledTB
+
+	//Scans through the chunks find what scans through the nodes do, after
+	//every kind of edit
+	testtb = newTB(offsetText);
+	testtb2 = newTB(offsetText);
+	setUnrolledTB(testtb, TRUE);
+	assert(testtb->index != NULL && testtb2->index == NULL);
+	check_unrolled(testtb, testtb2);
+	for (int i = 0; i < 2; i++) {
+		TB edited = i == 0 ? testtb : testtb2;
+		TB pasted = newTB("Pasted *bold*\nlines\n");
+		pasteTB(edited, 300, pasted);
+		mergeTB(edited, 0, pasted);
+		deleteTB(edited, 500, 700);
+		releaseTB(cutTB(edited, 10, 12));
+		addPrefixTB(edited, 5, 600, "_x_ ");
+		TBBatch unrolledBatch = newBatchTB();
+		batchDeleteTB(unrolledBatch, 20, 40);
+		batchPrefixTB(unrolledBatch, 30, 60, "* ");
+		applyBatchTB(edited, unrolledBatch);
+		releaseBatchTB(unrolledBatch);
+	}
+	check_unrolled(testtb, testtb2);
+	formRichText(testtb);
+	formRichText(testtb2);
+	check_unrolled(testtb, testtb2);
+	check_index(testtb);
+	//Compacting moves the nodes the chunks point at
+	compactTB(testtb);
+	check_index(testtb);
+	check_unrolled(testtb, testtb2);
+	setUnrolledTB(testtb, FALSE);
+	assert(testtb->index == NULL);
+	check_unrolled(testtb, testtb2);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+
+	//Tests for searchFlagsTB and validateUtf8TB
+
+	//Columns count characters rather than bytes
+	testtb = newTB("h\xc3\xa9llo w\xc3\xb6rld w\n\xe2\x82\xac\xf0\x9f\x98\x80 w\n");
+	int wBytes[] = {1, 7, 1, 14, 2, 8};
+	int wColumns[] = {1, 6, 1, 12, 2, 3};
+	for (int flags = 0; flags <= TB_SEARCH_CODEPOINTS; flags++) {
+		testmatch = searchFlagsTB(testtb, "w", flags);
+		for (int i = 0; i < 3; i++) {
+			int *expected = flags ? wColumns : wBytes;
+			assert(testmatch != NULL && testmatch->lineNumber == expected[2 * i]);
+			assert(testmatch->charIndex == expected[2 * i + 1]);
+			Match next = testmatch->next;
+			free(testmatch);
+			testmatch = next;
+		}
+		assert(testmatch == NULL);
+	}
+	assert(validateUtf8TB(testtb, 0) == NULL);
+	releaseTB(testtb);
+	//Past a whole number of vector blocks, on a line with every width
+	char utf8Text[2 * 50 * 10 + 3];
+	int utf8Length = 0;
+	for (int half = 0; half < 2; half++) {
+		for (int i = 0; i < 50; i++) {
+			utf8Length = utf8Length + sprintf(utf8Text + utf8Length, "\xc3\xa9\xe2\x82\xac" "a\xf0\x9f\x98\x80");
+		}
+		utf8Text[utf8Length++] = 'X';
+	}
+	utf8Text[utf8Length] = '\0';
+	testtb = newTB(utf8Text);
+	testmatch = searchFlagsTB(testtb, "X", TB_SEARCH_CODEPOINTS);
+	assert(testmatch != NULL && testmatch->charIndex == 200);
+	assert(testmatch->next != NULL && testmatch->next->charIndex == 401);
+	assert(testmatch->next->next == NULL);
+	free(testmatch->next);
+	free(testmatch);
+	assert(validateUtf8TB(testtb, TB_SEARCH_CODEPOINTS) == NULL);
+	releaseTB(testtb);
+	//Each invalid sequence is reported once, where it starts, whether it is
+	//a stray byte, cut short, overlong, a surrogate or past U+10FFFF
+	testtb = newTB("ok\xff!\n\xe2\x82\n\xc0\xaf\xed\xa0\x80\n"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\xc3\xa9\x80\n\xf0\x9f\x98" "a\xf4\x90\x80\x80\n");
+	int invalidBytes[] = {1, 2, 2, 0, 3, 0, 3, 1, 3, 2, 3, 3, 3, 4, 4, 42, 5, 0, 5, 4, 5, 5, 5, 6, 5, 7};
+	int invalidColumns[] = {1, 2, 2, 0, 3, 0, 3, 1, 3, 1, 3, 2, 3, 2, 4, 41, 5, 0, 5, 2, 5, 3, 5, 3, 5, 3};
+	for (int flags = 0; flags <= TB_SEARCH_CODEPOINTS; flags++) {
+		testmatch = validateUtf8TB(testtb, flags);
+		for (int i = 0; i < 13; i++) {
+			int *expected = flags ? invalidColumns : invalidBytes;
+			assert(testmatch != NULL && testmatch->lineNumber == expected[2 * i]);
+			assert(testmatch->charIndex == expected[2 * i + 1]);
+			Match next = testmatch->next;
+			free(testmatch);
+			testmatch = next;
+		}
+		assert(testmatch == NULL);
+	}
+	releaseTB(testtb);
+	//Surrogates are sound in the first byte after ED, and so on
+	testtb = newTB("\xed\x9f\xbf\xee\x80\x80\xf4\x8f\xbf\xbf\xe0\xa0\x80\xf0\x90\x80\x80\xc2\x80\n");
+	assert(validateUtf8TB(testtb, 0) == NULL);
+	releaseTB(testtb);
+
+	//Tests for searchFlagsTB without case
+
+	testtb = newTB("Hello HELLO hello\nhElLo@[`{hell\n");
+	testmatch = searchFlagsTB(testtb, "heLLo", TB_SEARCH_IGNORE_CASE);
+	int helloMatches[] = {1, 0, 1, 6, 1, 12, 2, 0};
+	for (int i = 0; i < 4; i++) {
+		assert(testmatch != NULL && testmatch->lineNumber == helloMatches[2 * i]);
+		assert(testmatch->charIndex == helloMatches[2 * i + 1]);
+		Match next = testmatch->next;
+		free(testmatch);
+		testmatch = next;
+	}
+	assert(testmatch == NULL);
+	//Only letters fold, not the characters either side of them
+	testmatch = searchFlagsTB(testtb, "{", TB_SEARCH_IGNORE_CASE);
+	assert(testmatch != NULL && testmatch->next == NULL);
+	free(testmatch);
+	testmatch = searchFlagsTB(testtb, "[`{HELL", TB_SEARCH_IGNORE_CASE);
+	assert(testmatch != NULL && testmatch->next == NULL);
+	free(testmatch);
+	assert(searchFlagsTB(testtb, "{@", TB_SEARCH_IGNORE_CASE) == NULL);
+	assert(searchFlagsTB(testtb, "HELLO@{", TB_SEARCH_IGNORE_CASE) == NULL);
+	releaseTB(testtb);
+	//Against a plain comparison, on lines of every length up to past a few
+	//vector blocks, with matches running up to their ends
+	char caseText[80 * 81 + 1];
+	int caseLength = 0;
+	const char caseAlphabet[] = "aAbB@[`{\xc3\xa9";
+	for (int i = 0; i < 80; i++) {
+		for (int j = 0; j < i; j++) {
+			caseText[caseLength++] = caseAlphabet[(i * 7 + j * j) % 10];
+		}
+		caseText[caseLength++] = '\n';
+	}
+	caseText[caseLength] = '\0';
+	testtb = newTB(caseText);
+	char *caseNeedles[] = {"a", "B", "ab", "Ba", "aAa", "b@", "abABab", "bbbbbbbbbbbbbbbbb", "A[", "`A", "\xc3\xa9"};
+	for (int i = 0; i < 11; i++) {
+		check_ignore_case(testtb, caseNeedles[i]);
+	}
+	//Lines outside their node are read no further back than their start
+	setInternTB(testtb, TRUE);
+	setSnapshotReadsTB(testtb, TRUE);
+	for (int i = 0; i < 11; i++) {
+		check_ignore_case(testtb, caseNeedles[i]);
+	}
+	setSnapshotReadsTB(testtb, FALSE);
+	//Columns can be given in code points as well
+	testmatch = searchFlagsTB(testtb, "\xc3\xa9" "B", TB_SEARCH_IGNORE_CASE | TB_SEARCH_CODEPOINTS);
+	Match byteMatch = searchFlagsTB(testtb, "\xc3\xa9" "B", TB_SEARCH_IGNORE_CASE);
+	assert(testmatch != NULL);
+	while (testmatch != NULL) {
+		char *line = lineTB(testtb, testmatch->lineNumber - 1);
+		assert(byteMatch != NULL && byteMatch->lineNumber == testmatch->lineNumber);
+		assert(testmatch->charIndex == count_codepoints(line, byteMatch->charIndex));
+		free(line);
+		Match next = testmatch->next;
+		free(testmatch);
+		testmatch = next;
+		next = byteMatch->next;
+		free(byteMatch);
+		byteMatch = next;
+	}
+	assert(byteMatch == NULL);
+	releaseTB(testtb);
+
+	//Tests for watchSearchTB
+
+	char watchText[1000 * 16 + 1];
+	int watchLength = 0;
+	for (int i = 0; i < 1000; i++) {
+		watchLength = watchLength + sprintf(watchText + watchLength, i % 3 == 0 ? "*ab* ab %d\n" : "line %d\n", i);
+	}
+	testtb = newTB(watchText);
+	TBWatch watch = watchSearchTB(testtb, "ab");
+	TBWatch watch2 = watchSearchTB(testtb, "*");
+	check_watch(watch, "ab");
+	//Each edit on its own, then several between queries
+	addPrefixTB(testtb, 100, 200, "ab ");
+	check_watch(watch, "ab");
+	testtb2 = newTB("ab\nno\n*abab*\n");
+	pasteTB(testtb, 500, testtb2);
+	check_watch(watch, "ab");
+	releaseTB(cutTB(testtb, 10, 20));
+	check_watch(watch, "ab");
+	deleteTB(testtb, 0, 0);
+	check_watch(watch, "ab");
+	formRichText(testtb);
+	check_watch(watch, "ab");
+	check_watch(watch2, "*");
+	pasteTB(testtb, linesTB(testtb), testtb2);
+	addPrefixTB(testtb, 400, 600, "ab");
+	deleteTB(testtb, 450, 550);
+	pasteTB(testtb, 0, testtb2);
+	mergeTB(testtb, 300, testtb2);
+	releaseTB(cutTB(testtb, 299, 301));
+	TBBatch watchBatch = newBatchTB();
+	batchDeleteTB(watchBatch, 700, 710);
+	batchPrefixTB(watchBatch, 600, 800, "*ab");
+	applyBatchTB(testtb, watchBatch);
+	releaseBatchTB(watchBatch);
+	check_watch(watch, "ab");
+	check_watch(watch2, "*");
+	//Enough scattered edits to make the watch catch up on its own
+	for (int i = 0; i < WATCH_PIECES; i++) {
+		addPrefixTB(testtb, i * 2, i * 2, i % 2 ? "ab" : "-");
+		deleteTB(testtb, i * 2 + 1, i * 2 + 1);
+	}
+	assert(watch->npieces <= WATCH_PIECES);
+	check_watch(watch, "ab");
+	//Every line removed, then some back
+	deleteTB(testtb, 0, linesTB(testtb) - 1);
+	check_watch(watch, "ab");
+	testtb2 = newTB("ab ab\nx\n");
+	pasteTB(testtb, 0, testtb2);
+	check_watch(watch, "ab");
+	releaseTB(testtb2);
+	//A watch on a released buffer has no matches
+	releaseWatchTB(watch2);
+	releaseTB(testtb);
+	assert(watchMatchesTB(watch) == NULL);
+	releaseWatchTB(watch);
+	//Nor does a watch for nothing
+	testtb = newTB("abc\n");
+	watch = watchSearchTB(testtb, "");
+	assert(watchMatchesTB(watch) == NULL);
+	releaseWatchTB(watch);
+	releaseTB(testtb);
+	//Lines deleted from the end leave no matches past the last line
+	testtb = newTB("ab\nxx\nab\nxx\n");
+	watch = watchSearchTB(testtb, "ab");
+	deleteTB(testtb, 2, 3);
+	check_watch(watch, "ab");
+	releaseWatchTB(watch);
+	releaseTB(testtb);
+	testtb = newTB("xx\nab\nab\n");
+	watch = watchSearchTB(testtb, "ab");
+	check_watch(watch, "ab");
+	deleteTB(testtb, 2, 2);
+	check_watch(watch, "ab");
+	releaseWatchTB(watch);
+	releaseTB(testtb);
+	//The same through a batch
+	testtb = newTB("xx\nab\nab\nab\nab\nab\nab\nab\nab\nab\n");
+	watch = watchSearchTB(testtb, "ab");
+	watchBatch = newBatchTB();
+	batchPrefixTB(watchBatch, 1, 1, "ab");
+	batchDeleteTB(watchBatch, 1, 8);
+	batchDeleteTB(watchBatch, 2, 9);
+	applyBatchTB(testtb, watchBatch);
+	releaseBatchTB(watchBatch);
+	assert(linesTB(testtb) == 1);
+	check_watch(watch, "ab");
+	releaseWatchTB(watch);
+	releaseTB(testtb);
+
+	//Tests for searchWorkspaceTB
+
+	//Buffers of very different sizes, one far larger than the rest
+	TBWorkspace ws = newWorkspaceTB();
+	assert(searchWorkspaceTB(ws, "ab", 4) == NULL);
+	TB wsBuffers[6];
+	char *wsText = malloc(20000 * 16 + 1);
+	for (int b = 0; b < 6; b++) {
+		int nlines = b == 2 ? 20000 : b * 7;
+		int wsLength = 0;
+		for (int i = 0; i < nlines; i++) {
+			wsLength = wsLength + sprintf(wsText + wsLength, i % 5 == b ? "ab %d abab\n" : "line %d\n", i);
+		}
+		wsText[wsLength] = '\0';
+		wsBuffers[b] = newTB(wsText);
+		addWorkspaceTB(ws, wsBuffers[b]);
+	}
+	free(wsText);
+	addWorkspaceTB(ws, wsBuffers[3]);
+	assert(ws->nbuffers == 6);
+	for (int nthreads = 0; nthreads <= 9; nthreads++) {
+		check_workspace(ws, "ab", nthreads);
+	}
+	check_workspace(ws, "1", 3);
+	check_workspace(ws, "line 1999", 3);
+	check_workspace(ws, "absent", 3);
+	assert(searchWorkspaceTB(ws, "", 3) == NULL);
+	//Edits between searches, and a buffer taken out
+	addPrefixTB(wsBuffers[2], 5000, 15000, "ab");
+	deleteTB(wsBuffers[4], 0, 2);
+	removeWorkspaceTB(ws, wsBuffers[1]);
+	assert(ws->nbuffers == 5 && ws->buffers[1] == wsBuffers[2]);
+	check_workspace(ws, "ab", 4);
+	setThreadSafeTB(wsBuffers[2], TRUE);
+	check_workspace(ws, "ab", 2);
+	releaseWorkspaceTB(ws);
+	for (int b = 0; b < 6; b++) {
+		releaseTB(wsBuffers[b]);
+	}
+
+	//Tests for setDeferredFreesTB
+
+	assert(drainFreesTB() == 0);
+	assert(setDeferredFreesTB(TRUE));
+	char *deferText = malloc(5000 * 48 + 1);
+	int deferLength = 0;
+	for (int i = 0; i < 5000; i++) {
+		deferLength = deferLength + sprintf(deferText + deferLength,
+			i % 2 ? "line %d\n" : "a line %d too long to fit inside its node\n", i);
+	}
+	testtb = newTB(deferText);
+	//Lines dropped by deleteTB in each of its cases, by applyBatchTB, and
+	//by releasing a batch and buffers
+	deleteTB(testtb, 0, 9);
+	deleteTB(testtb, 4980, 4989);
+	deleteTB(testtb, 100, 199);
+	watchBatch = newBatchTB();
+	batchDeleteTB(watchBatch, 200, 299);
+	applyBatchTB(testtb, watchBatch);
+	testtb2 = newTB("x\ny\n");
+	batchPasteTB(watchBatch, 0, testtb2);
+	releaseBatchTB(watchBatch);
+	assert(linesTB(testtb) == 4780);
+	char *deferDump = dumpTB(testtb, FALSE);
+	releaseTB(testtb);
+	releaseTB(testtb2);
+	assert(drainFreesTB() == 10 + 10 + 100 + 100 + 2 + 4780 + 2);
+	assert(drainFreesTB() == 0);
+	//Freed by the background thread, with no drain to wait on
+	testtb = newTB(deferDump);
+	deleteTB(testtb, 0, linesTB(testtb) - 1);
+	releaseTB(testtb);
+	struct timespec pause = {0, 1000000};
+	while (__atomic_load_n(&deferred.freed, __ATOMIC_ACQUIRE) != __atomic_load_n(&deferred.queued, __ATOMIC_ACQUIRE)) {
+		nanosleep(&pause, NULL);
+	}
+	assert(drainFreesTB() == 4780);
+	//Once the thread is too far behind, the call frees its own lines, and
+	//nothing is queued
+	assert(deferred.pending == 0);
+	__atomic_fetch_add(&deferred.pending, DEFERRED_LIMIT + 1, __ATOMIC_RELAXED);
+	unsigned long deferQueued = deferred.queued;
+	testtb = newTB(deferDump);
+	releaseTB(testtb);
+	assert(deferred.queued == deferQueued && deferred.queue == NULL);
+	assert(__atomic_load_n(&deferred.pending, __ATOMIC_RELAXED) == DEFERRED_LIMIT + 1);
+	__atomic_fetch_sub(&deferred.pending, DEFERRED_LIMIT + 1, __ATOMIC_RELAXED);
+	assert(drainFreesTB() == 0);
+	//Turning it off waits for what is queued, and frees in the call again
+	testtb = newTB(deferDump);
+	releaseTB(testtb);
+	assert(setDeferredFreesTB(FALSE));
+	assert(__atomic_load_n(&deferred.queue, __ATOMIC_RELAXED) == NULL && deferred.freed == deferred.queued);
+	assert(drainFreesTB() == 4780);
+	testtb = newTB(deferDump);
+	releaseTB(testtb);
+	assert(drainFreesTB() == 0);
+	free(deferDump);
+	free(deferText);
+
 	printf("success!\n");
 }
 
@@ -1,8 +1,16 @@
 #ifndef TEXTBUFFER_H
 #define TEXTBUFFER_H
 
+#include <stddef.h>
+
 typedef struct textbuffer *TB;
 
+typedef struct textbufferBatch *TBBatch;
+
+typedef struct textbufferWatch *TBWatch;
+
+typedef struct textbufferWorkspace *TBWorkspace;
+
 typedef struct _matchNode {
       int lineNumber;
       int charIndex;
@@ -11,11 +19,85 @@ typedef struct _matchNode {
 
 typedef matchNode *Match;
 
+//A match as searchTB64() returns it, on a line past what an int can number
+typedef struct _matchNode64 {
+      size_t lineNumber;
+      size_t charIndex;
+      struct _matchNode64* next;
+} matchNode64;
+
+typedef matchNode64 *Match64;
+
+//A match as searchWorkspaceTB() returns it, with the buffer it is in
+typedef struct _workspaceMatchNode {
+      TB tb;
+      int lineNumber;
+      int charIndex;
+      struct _workspaceMatchNode* next;
+} workspaceMatchNode;
+
+typedef workspaceMatchNode *WorkspaceMatch;
+
+typedef struct _internStats {
+      long uniqueLines;
+      long references;
+      long bytesStored;
+      long bytesSaved;
+} internStats;
+
+typedef struct _memoryUsage {
+      //The header and nodes, including the room each node has for a short
+      //line, and any edit history or offset index
+      long nodeBytes;
+      //Lines kept outside their node, with interned ones split among users
+      long payloadBytes;
+      //How much of the above holds nothing
+      long slackBytes;
+} memoryUsage;
+
+typedef struct _opStats {
+      long calls;
+      long long totalNs;
+      long long p50Ns;
+      long long p99Ns;
+} opStats;
+
+//Room for every operation code in tbtrace.h
+#define TB_STATS_OPS 64
+
+typedef struct _tbStats {
+      //Indexed by operation code
+      opStats ops[TB_STATS_OPS];
+      long nodesTraversed;
+      long bytesCopied;
+      long allocations;
+} tbStats;
+
 /* Allocate a new textbuffer whose contents is initialised with the text given
  * in the array.
  */
 TB newTB (char text[]);
 
+/* Build the textbuffer newTB() would from the first 'length' bytes of 'text',
+ * splitting the work between 'nthreads' threads, or one per processor if 0.
+ */
+TB newTBParallel (const char *text, long length, int nthreads);
+
+/* Allocate a new, empty textbuffer to be filled a chunk at a time by
+ * feedTB(), then finished by finishTB().
+ */
+TB newStreamTB (void);
+
+/* Append 'length' bytes of text to a textbuffer from newStreamTB(). Lines
+ * may be split between chunks anywhere.
+ */
+void feedTB (TB tb, const char *chunk, int length);
+
+/* End the text of a textbuffer from newStreamTB(), whose last line need not
+ * end in a newline.
+ */
+void finishTB (TB tb);
+
 /* Free the memory occupied by the given textbuffer.  It is an error to access
  * the buffer afterwards.
  */
@@ -26,6 +108,11 @@ void releaseTB (TB tb);
  */
 char *dumpTB (TB tb, int showLineNumbers);
 
+/* Return the same text as dumpTB(), copied by 'nthreads' threads at once,
+ * or one per processor if 0.
+ */
+char *dumpParallelTB (TB tb, int showLineNumbers, int nthreads);
+
 /* Return the number of lines of the given textbuffer.
  */
 int linesTB (TB tb);
@@ -75,6 +162,57 @@ TB cutTB (TB tb, int from, int to);
  */
 Match searchTB (TB tb, char* search);
 
+//Options for searchFlagsTB() and validateUtf8TB(): give charIndex in code
+//points rather than bytes, taking the lines as UTF-8
+#define TB_SEARCH_CODEPOINTS 1
+//For searchFlagsTB() alone: match ASCII letters of either case
+#define TB_SEARCH_IGNORE_CASE 2
+
+/* The same as searchTB(), with the options in 'flags'.
+ */
+Match searchFlagsTB (TB tb, char *search, int flags);
+
+/* Return a list of where each byte sequence in 'tb' that isn't valid UTF-8
+ * starts, or NULL if there are none, with the options in 'flags'.
+ *
+ * - The user is responsible of freeing the returned list
+ */
+Match validateUtf8TB (TB tb, int flags);
+
+/* Start a search for 'search' in 'tb' whose matches are kept up to date by
+ * every edit, which searches only the lines it writes.
+ */
+TBWatch watchSearchTB (TB tb, char *search);
+
+/* Return the current matches of 'watch', as searchTB() would, in time
+ * proportional to their number. The user is responsible of freeing the list.
+ */
+Match watchMatchesTB (TBWatch watch);
+
+/* Stop 'watch' and free it. A watch outlives its buffer, without matches.
+ */
+void releaseWatchTB (TBWatch watch);
+
+/* Allocate a new, empty set of buffers to search together, and free one,
+ * leaving its buffers.
+ */
+TBWorkspace newWorkspaceTB (void);
+
+void releaseWorkspaceTB (TBWorkspace ws);
+
+/* Add a buffer to 'ws', or take one out, as must be done before releasing
+ * it.
+ */
+void addWorkspaceTB (TBWorkspace ws, TB tb);
+
+void removeWorkspaceTB (TBWorkspace ws, TB tb);
+
+/* Return the matches of 'search' in every buffer of 'ws', tagged with their
+ * buffer, found by 'nthreads' threads at once, or one per processor if 0.
+ * The user is responsible of freeing the list.
+ */
+WorkspaceMatch searchWorkspaceTB (TBWorkspace ws, char *search, int nthreads);
+
 /* Remove the lines between and including 'from' and 'to' from the textbuffer
  * 'tb'.
  *
@@ -101,9 +239,181 @@ void whiteBoxTests();
 
 char* diffTB (TB tb1, TB tb2) ;
 
+/* Return TRUE iff 'tb1' and 'tb2' contain exactly the same lines.
+ */
+int equalTB (TB tb1, TB tb2) ;
+
+/* Start recording edits to 'tb' and return a checkpoint of its current state.
+ */
+long checkpointTB (TB tb) ;
+
+/* Return the edit script, in the format of diffTB(), which turns 'tb' as it
+ * was at 'checkpoint' into 'tb' as it is now.
+ */
+char* diffSinceTB (TB tb, long checkpoint) ;
+
+/* Let go of 'checkpoint', so that the edits before the oldest checkpoint
+ * still held are forgotten, and none are recorded once none is held.
+ */
+void releaseCheckpointTB (TB tb, long checkpoint) ;
+
+/* Turn on or off sharing of identical lines of 'tb' through an intern table.
+ */
+void setInternTB (TB tb, int intern) ;
+
+/* Report the number of interned lines and the memory interning has saved.
+ */
+void internStatsTB (internStats *stats) ;
+
+/* Repack the lines of 'tb' contiguously in memory, in order. Lines are
+ * still one node each; this only undoes the scattering edits cause.
+ */
+void compactTB (TB tb) ;
+
+/* Keep the lines of 'tb' in an unrolled list too, in chunks of up to 256
+ * nodes held in arrays, which dumpTB, searchTB and formRichText then walk
+ * instead of one pointer per line. Every edit keeps it up to date.
+ */
+void setUnrolledTB (TB tb, int unrolled) ;
+
+/* Allocate a new, empty batch of edits.
+ */
+TBBatch newBatchTB (void) ;
+
+/* Free the given batch and any edits in it that were never applied.
+ */
+void releaseBatchTB (TBBatch batch) ;
+
+/* Queue deleting, prefixing or pasting lines, by their position in the
+ * textbuffer before the batch is applied.
+ */
+void batchDeleteTB (TBBatch batch, int from, int to) ;
+
+void batchPrefixTB (TBBatch batch, int pos1, int pos2, char* prefix) ;
+
+void batchPasteTB (TBBatch batch, int pos, TB tb2) ;
+
+/* Apply every edit in 'batch' to 'tb' in one pass, then empty the batch.
+ */
+void applyBatchTB (TB tb, TBBatch batch) ;
+
+/* Let 'tb' be used from many threads at once: read-only operations run
+ * concurrently, and operations that change 'tb' run alone.
+ */
+void setThreadSafeTB (TB tb, int threadSafe) ;
+
+/* Let linesTB, dumpTB and searchTB read 'tb' without taking its lock while
+ * no edit is under way; writers free removed lines only once no reader can
+ * still see them. Each read sees 'tb' as it was between two edits. One that
+ * starts during an edit, or that edits keep overtaking, takes the lock
+ * instead, and holds up the edits after it until it is done.
+ */
+void setSnapshotReadsTB (TB tb, int snapshot) ;
+
+/* Record every call to these functions, with its arguments and timing, to
+ * a binary trace at 'path' for tbreplay. Returns FALSE if it can't.
+ */
+int startTraceTB (const char *path) ;
+
+void stopTraceTB (void) ;
+
+/* Report how often each function was called on 'tb', how long the calls
+ * took and the work they did. Counts stay zero unless built with TB_STATS.
+ */
+void statsTB (TB tb, tbStats *stats) ;
+
+/* The same, for the calls made on every textbuffer and batch so far.
+ */
+void globalStatsTB (tbStats *stats) ;
+
+/* Report the memory held by 'tb', broken down into its nodes, its lines and
+ * the part of both that is unused.
+ */
+void memoryUsageTB (TB tb, memoryUsage *usage) ;
+
+/* Take every textbuffer's memory from the given functions, each passed
+ * 'ctx', or from malloc again if they are NULL. Returns FALSE, changing
+ * nothing, while memory from the current allocator is still in use.
+ */
+int setAllocatorTB (void *(*allocate)(size_t size, void *ctx),
+                    void *(*reallocate)(void *ptr, size_t size, void *ctx),
+                    void (*deallocate)(void *ptr, void *ctx), void *ctx) ;
+
+/* Free the lines that releaseTB, deleteTB and the other calls drop on a
+ * background thread, so that those calls return without waiting, or go
+ * back to freeing them in the call. Returns FALSE if the thread can't start.
+ */
+int setDeferredFreesTB (int defer) ;
+
+/* Wait until the lines dropped so far have been freed. Returns how many
+ * lines were freed that way since the last call.
+ */
+size_t drainFreesTB (void) ;
+
+/* Return a copy of line 'pos' of 'tb', without its newline. The user is
+ * responsible for freeing it.
+ */
+char *lineTB (TB tb, int pos) ;
+
+/* Write 'tb' to 'path' in a binary format that loadSnapshotTB() maps and
+ * uses in place. Returns FALSE if it can't.
+ */
+int saveSnapshotTB (TB tb, const char *path) ;
+
+/* Open a snapshot written by saveSnapshotTB(), in time independent of its
+ * size. Returns NULL if 'path' isn't a snapshot.
+ */
+TB loadSnapshotTB (const char *path) ;
+
+/* Persist 'tb' at 'path' by appending each edit to a log beside it, synced
+ * in groups and folded back into 'path' as it grows. A NULL 'path' stops.
+ * Returns FALSE if the files can't be written.
+ */
+int journalTB (TB tb, const char *path) ;
+
+/* Make every edit journaled so far durable. Returns FALSE if 'tb' isn't
+ * journaled or a write has failed.
+ */
+int syncJournalTB (TB tb) ;
+
+/* Rebuild a buffer journaled at 'path' after a crash, replaying its log up
+ * to the first torn record, and keep journaling it. Returns NULL if it can't.
+ */
+TB recoverTB (const char *path) ;
+
 void undoTB (TB tb) ;
 
 void redoTB (TB tb) ;
 
+/* Variants of the functions above for buffers too big for an int, taking
+ * and returning line positions and counts as size_t. newTB(), dumpTB(),
+ * diffTB() and the rest take any size of text already; the lines themselves
+ * must each be shorter than 2 GB.
+ */
+size_t linesTB64 (TB tb) ;
+
+void addPrefixTB64 (TB tb, size_t pos1, size_t pos2, char *prefix) ;
+
+void mergeTB64 (TB tb1, size_t pos, TB tb2) ;
+
+void pasteTB64 (TB tb1, size_t pos, TB tb2) ;
+
+TB cutTB64 (TB tb, size_t from, size_t to) ;
+
+Match64 searchTB64 (TB tb, char *search) ;
+
+void deleteTB64 (TB tb, size_t from, size_t to) ;
+
+char *lineTB64 (TB tb, size_t pos) ;
+
+/* Convert between byte offsets into the text dumpTB() returns without line
+ * numbers and the lines that hold them, in O(log n) through an index kept
+ * up to date by every edit. offsetOfLineTB() also takes the number of lines,
+ * for the end of the text.
+ */
+size_t lineAtOffsetTB (TB tb, size_t offset) ;
+
+size_t offsetOfLineTB (TB tb, size_t pos) ;
+
 #endif
 